@@ -0,0 +1,418 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     Timing the region list and the hex view against a synthetic process
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#include "MemView.h"
+#include "MemInfo.h"
+#include "RegionDiff.h"
+#include "RegionView.h"
+#include "HexFormat.h"
+#include "ByteDiff.h"
+#include <string>
+#include <map>
+#include <cwctype>
+#include <cctype>
+
+const size_t kDefaultRegions = 10000;
+const size_t kHexBufferSize = 1024 * 1024;
+const int kMinRuns = 5;
+const int kMaxRuns = 1000;
+// A benchmark that takes longer than this compared to the baseline fails the run
+const double kMaxRatio = 1.25;
+
+// The target is a copy of ourselves that creates the regions, signals hReady
+// and then stays alive until hParent exits (or it is terminated).
+// One in 16 regions is a view of a file or of the page file, the rest alternates
+// committed and reserved pages of one reservation with rotating protections.
+static int RunTarget(size_t Regions, HANDLE hReady, HANDLE hParent)
+{
+    static const DWORD Protections[] = { PAGE_READWRITE, PAGE_READONLY, PAGE_EXECUTE_READ, PAGE_EXECUTE_READWRITE };
+
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+
+    size_t Views = Regions / 16;
+    if (Views)
+    {
+        WCHAR TempPath[MAX_PATH], TempFile[MAX_PATH];
+        if (!GetTempPathW(_countof(TempPath), TempPath) || !GetTempFileNameW(TempPath, L"mvb", 0, TempFile))
+            return 1;
+        HANDLE hFile = CreateFileW(TempFile, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+            FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+        if (hFile == INVALID_HANDLE_VALUE)
+            return 1;
+        HANDLE hFileMapping = CreateFileMappingW(hFile, NULL, PAGE_READWRITE, 0, si.dwAllocationGranularity, NULL);
+        HANDLE hPageFileMapping = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, si.dwAllocationGranularity, NULL);
+        if (!hFileMapping || !hPageFileMapping)
+            return 1;
+
+        for (size_t n = 0; n < Views; ++n)
+        {
+            HANDLE hMapping = (n & 1) ? hPageFileMapping : hFileMapping;
+            DWORD Access = (n & 2) ? FILE_MAP_WRITE : FILE_MAP_READ;
+            if (!MapViewOfFile(hMapping, Access, 0, 0, 0))
+                return 1;
+        }
+    }
+
+    size_t Pages = Regions - Views;
+    PBYTE Base = static_cast<PBYTE>(VirtualAlloc(NULL, Pages * si.dwPageSize, MEM_RESERVE, PAGE_NOACCESS));
+    if (!Base)
+        return 1;
+    for (size_t n = 0; n < Pages; n += 2)
+    {
+        DWORD Protect = Protections[(n / 2) % _countof(Protections)];
+        if (!VirtualAlloc(Base + n * si.dwPageSize, si.dwPageSize, MEM_COMMIT, Protect))
+            return 1;
+    }
+
+    SetEvent(hReady);
+    WaitForSingleObject(hParent, INFINITE);
+    return 0;
+}
+
+static HANDLE StartTarget(size_t Regions)
+{
+    SECURITY_ATTRIBUTES sa = { sizeof(sa), NULL, TRUE };
+    HANDLE hReady = CreateEventW(&sa, TRUE, FALSE, NULL);
+    HANDLE hParent = NULL;
+    if (!hReady || !DuplicateHandle(GetCurrentProcess(), GetCurrentProcess(), GetCurrentProcess(), &hParent, SYNCHRONIZE, TRUE, 0))
+    {
+        if (hReady)
+            CloseHandle(hReady);
+        return NULL;
+    }
+
+    WCHAR Path[MAX_PATH], CommandLine[MAX_PATH + 100];
+    GetModuleFileNameW(NULL, Path, _countof(Path));
+    StringCchPrintfW(CommandLine, _countof(CommandLine), L"\"%s\" --bench-target %Iu %Iu %Iu",
+        Path, Regions, (ULONG_PTR)hReady, (ULONG_PTR)hParent);
+
+    STARTUPINFOW si = { sizeof(si) };
+    PROCESS_INFORMATION pi = { 0 };
+    HANDLE hProcess = NULL;
+    if (CreateProcessW(NULL, CommandLine, NULL, NULL, TRUE, 0, NULL, NULL, &si, &pi))
+    {
+        CloseHandle(pi.hThread);
+        HANDLE Wait[] = { hReady, pi.hProcess };
+        if (WaitForMultipleObjects(_countof(Wait), Wait, FALSE, INFINITE) == WAIT_OBJECT_0)
+            hProcess = pi.hProcess;
+        else
+            CloseHandle(pi.hProcess);
+    }
+
+    CloseHandle(hParent);
+    CloseHandle(hReady);
+    return hProcess;
+}
+
+// The best time of one call in nanoseconds, Work is repeated for at least half a second
+template<typename Work>
+static double Measure(Work work)
+{
+    LARGE_INTEGER Frequency, Start, End;
+    QueryPerformanceFrequency(&Frequency);
+    LONGLONG Best = MAXLONGLONG, Total = 0;
+    for (int Runs = 0; Runs < kMinRuns || (Total < Frequency.QuadPart / 2 && Runs < kMaxRuns); ++Runs)
+    {
+        QueryPerformanceCounter(&Start);
+        work();
+        QueryPerformanceCounter(&End);
+        LONGLONG Elapsed = End.QuadPart - Start.QuadPart;
+        Total += Elapsed;
+        Best = std::min(Best, Elapsed);
+    }
+    return Best * 1e9 / Frequency.QuadPart;
+}
+
+// The formatter from before it was vectorized, the output has to stay the same
+static void ReferenceHexLine(WCHAR* Buffer, size_t Cch, const BYTE* Data, const DWORD* Valid, size_t StartAt, size_t DataLen, size_t PerLine, const BYTE* Address)
+{
+    static const WCHAR Hex2Str[] = L"0123456789abcdef";
+    StringCchPrintfW(Buffer, Cch, L"%p:  ", Address);
+    WCHAR* p = Buffer + wcslen(Buffer);
+    for (size_t n = 0; n < DataLen; ++n)
+    {
+        BYTE Value = Data[StartAt + n];
+        bool IsValid = TestMaskBit(Valid, StartAt + n);
+        *(p++) = IsValid ? Hex2Str[Value >> 4] : '?';
+        *(p++) = IsValid ? Hex2Str[Value & 0xf] : '?';
+        *(p++) = ' ';
+    }
+    for (size_t n = DataLen; n < PerLine; ++n)
+    {
+        *(p++) = ' ';
+        *(p++) = ' ';
+        *(p++) = ' ';
+    }
+    *(p++) = ' ';
+    *(p++) = ' ';
+    for (size_t n = 0; n < DataLen; ++n)
+    {
+        BYTE Value = Data[StartAt + n];
+        *(p++) = !TestMaskBit(Valid, StartAt + n) ? '?' : isprint(Value) ? (char)Value : '.';
+    }
+    *p = 0;
+}
+
+// Lines of an earlier run, by benchmark and region count
+static std::map<std::string, double> LoadBaseline(const wchar_t* File)
+{
+    std::map<std::string, double> Result;
+    HANDLE hFile = CreateFileW(File, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return Result;
+
+    std::string Text;
+    char buf[4096];
+    DWORD Read;
+    while (ReadFile(hFile, buf, sizeof(buf), &Read, NULL) && Read)
+        Text.append(buf, Read);
+    CloseHandle(hFile);
+
+    size_t Line = 0;
+    while (Line < Text.size())
+    {
+        size_t End = Text.find('\n', Line);
+        if (End == std::string::npos)
+            End = Text.size();
+        // name,regions,value
+        size_t First = Text.find(',', Line);
+        size_t Second = First < End ? Text.find(',', First + 1) : std::string::npos;
+        if (Second < End)
+        {
+            double Time = strtod(Text.c_str() + Second + 1, NULL);
+            if (Time > 0)
+                Result[Text.substr(Line, Second - Line)] = Time;
+        }
+        Line = End + 1;
+    }
+    return Result;
+}
+
+static int Usage()
+{
+    PrintError(L"Usage: MemView --bench [<regions>] [--baseline <file>] [--out <file>]\r\n");
+    return 2;
+}
+
+int RunBenchmark(int argc, wchar_t** argv)
+{
+    if (argc == 4 && !wcscmp(argv[0], L"--bench-target"))
+    {
+        return RunTarget(wcstoul(argv[1], NULL, 10), (HANDLE)(ULONG_PTR)_wcstoui64(argv[2], NULL, 10),
+            (HANDLE)(ULONG_PTR)_wcstoui64(argv[3], NULL, 10));
+    }
+
+    size_t Regions = kDefaultRegions;
+    const wchar_t* Baseline = NULL;
+    const wchar_t* File = NULL;
+    for (int n = 1; n < argc; ++n)
+    {
+        if (iswdigit(argv[n][0]))
+            Regions = wcstoul(argv[n], NULL, 10);
+        else if (!wcscmp(argv[n], L"--baseline") && n + 1 < argc)
+            Baseline = argv[++n];
+        else if (!wcscmp(argv[n], L"--out") && n + 1 < argc)
+            File = argv[++n];
+        else
+            return Usage();
+    }
+    if (!Regions)
+        return Usage();
+
+    std::map<std::string, double> Previous;
+    if (Baseline)
+    {
+        Previous = LoadBaseline(Baseline);
+        if (Previous.empty())
+        {
+            PrintError(L"Unable to read the baseline\r\n");
+            return 1;
+        }
+    }
+
+    HANDLE hProcess = StartTarget(Regions);
+    if (!hProcess)
+    {
+        PrintError(L"Unable to start the target process\r\n");
+        return 1;
+    }
+
+    // Times are in ns, the rows ending in _bytes are sizes
+    std::string Out = Baseline ? "benchmark,regions,value,baseline,ratio\r\n" : "benchmark,regions,value\r\n";
+    bool Slower = false;
+    auto Report = [&](const char* Name, double Time)
+    {
+        char Key[100], buf[200];
+        StringCchPrintfA(Key, _countof(Key), "%s,%Iu", Name, Regions);
+        StringCchPrintfA(buf, _countof(buf), "%s,%.0f", Key, Time);
+        Out += buf;
+        if (Baseline)
+        {
+            auto it = Previous.find(Key);
+            if (it != Previous.end())
+            {
+                double Ratio = Time / it->second;
+                StringCchPrintfA(buf, _countof(buf), ",%.0f,%.2f", it->second, Ratio);
+                Out += buf;
+                Slower = Slower || Ratio > kMaxRatio;
+            }
+            else
+            {
+                Out += ",,";
+            }
+        }
+        Out += "\r\n";
+    };
+
+    MemSnapshot Read, Info, Next;
+    EditScript Script;
+    std::vector<size_t> Origin;
+    std::vector<PBYTE> Toggled;
+    std::vector<ULONG_PTR> WorkingSet;
+    Report("enumerate", Measure([&]() { MemSnapshot::read(hProcess, Read); }));
+    Report("working_set", Measure([&]() { Read.readWorkingSet(hProcess, WorkingSet); }));
+    TerminateProcess(hProcess, 0);
+    CloseHandle(hProcess);
+
+    // The mapped names are interned, compared with a std::wstring of its own for every region
+    const size_t Inline = std::wstring().capacity();
+    size_t Strings = 0;
+    for (size_t n = 0; n < Read.size(); ++n)
+    {
+        size_t Length = wcslen(Read.mapped(n).c_str());
+        Strings += sizeof(std::wstring) + (Length > Inline ? (Length + 1) * sizeof(wchar_t) : 0);
+    }
+    Report("names_interned_bytes", (double)(Read.size() * sizeof(MappedName) + MappedName::poolUsage()));
+    Report("names_strings_bytes", (double)Strings);
+    Report("region_list_bytes", (double)(Read.memoryUsage() + MappedName::poolUsage()));
+
+    // Nothing changed since the last refresh
+    Info.clear();
+    for (size_t n = 0; n < Read.size(); ++n)
+        Info.push_back(Read, n);
+    Report("refresh_unchanged", Measure([&]() { BuildListView(Info, Read, true, Toggled, Script, Next, Origin); }));
+
+    // The list as it is first shown, with every allocation collapsed
+    MemSnapshot Empty;
+    BuildListView(Empty, Read, false, Toggled, Script, Info, Origin);
+    Report("refresh_collapsed", Measure([&]() { BuildListView(Info, Read, false, Toggled, Script, Next, Origin); }));
+
+    // One in 8 regions is new, and one in 8 changed its protection
+    Info.clear();
+    for (size_t n = 0; n < Read.size(); ++n)
+    {
+        if (n % 8 == 0)
+            continue;
+        Info.push_back(Read, n);
+        if (n % 8 == 1)
+        {
+            MEMORY_BASIC_INFORMATION mbi = { 0 };
+            mbi.BaseAddress = Read.start(n);
+            mbi.AllocationBase = Read.allocationStart(n);
+            mbi.AllocationProtect = Read.allocationProtect(n);
+            mbi.RegionSize = Read.regionSize(n);
+            mbi.State = Read.state(n);
+            mbi.Protect = Read.protect(n) == PAGE_NOACCESS ? PAGE_READONLY : PAGE_NOACCESS;
+            mbi.Type = Read.type(n);
+            MemSnapshot Changed;
+            Changed.push_back(mbi, Read.mapped(n));
+            Info.update(Info.size() - 1, Changed, 0);
+        }
+    }
+    Report("refresh_changed", Measure([&]() { BuildListView(Info, Read, true, Toggled, Script, Next, Origin); }));
+
+    volatile WCHAR Sink;
+    WCHAR Text[512];
+    Report("column_text", Measure([&]()
+    {
+        for (size_t n = 0; n < Read.size(); ++n)
+        {
+            for (int Index = 0; Index < 10; ++Index)
+            {
+                Read.columnText(n, Text, _countof(Text), Index);
+                Sink = Text[0];
+            }
+        }
+    }));
+
+    // A buffer of the hex view, with an unreadable page every 64 KB
+    std::vector<BYTE> Data(kHexBufferSize);
+    std::vector<DWORD> Valid(kHexBufferSize / 32, ~0u);
+    DWORD Seed = 0x12345678;
+    for (BYTE& Value : Data)
+    {
+        Seed = Seed * 1103515245 + 12345;
+        Value = (BYTE)(Seed >> 16);
+    }
+    for (size_t Page = 0; Page < kHexBufferSize; Page += 64 * 1024)
+        std::fill_n(Valid.begin() + Page / 32, 4096 / 32, 0u);
+
+    // Every line length, at every alignment of the masks
+    WCHAR Expected[512];
+    for (size_t PerLine = 8; PerLine <= 64; PerLine *= 2)
+    {
+        for (size_t Offset = 64 * 1024 - 200; Offset < 64 * 1024 + 4096 + 200; Offset += 5)
+        {
+            size_t DataLen = Offset % (PerLine + 1);
+            FormatHexLine(Text, _countof(Text), Data.data(), Valid.data(), Offset, DataLen, PerLine, Data.data() + Offset);
+            ReferenceHexLine(Expected, _countof(Expected), Data.data(), Valid.data(), Offset, DataLen, PerLine, Data.data() + Offset);
+            if (wcscmp(Text, Expected))
+            {
+                PrintError(L"The hex formatter output differs from the reference\r\n");
+                return 1;
+            }
+        }
+    }
+
+    for (size_t PerLine : { 16, 32 })
+    {
+        char Name[20];
+        StringCchPrintfA(Name, _countof(Name), "hex_%Iu", PerLine);
+        Report(Name, Measure([&]()
+        {
+            for (size_t Offset = 0; Offset < Data.size(); Offset += PerLine)
+            {
+                FormatHexLine(Text, _countof(Text), Data.data(), Valid.data(), Offset, PerLine, PerLine, Data.data() + Offset);
+                Sink = Text[0];
+            }
+        }));
+    }
+
+    // A maximized window, with one in 16 bytes changed
+    const size_t ScreenLines = 80, ScreenPerLine = 32;
+    std::vector<DWORD> Changed(MaskWords(ScreenLines * ScreenPerLine));
+    for (size_t n = 0; n < ScreenLines * ScreenPerLine; n += 16)
+        SetMaskRange(Changed.data(), n, n + 1, true);
+    HexScreen Screen;
+    Report("hex_screen", Measure([&]()
+    {
+        Screen.clear(ScreenPerLine);
+        for (size_t n = 0; n < ScreenLines; ++n)
+            Screen.addLine(Data.data(), Valid.data(), Changed.data(), n * ScreenPerLine, ScreenPerLine, Data.data() + n * ScreenPerLine);
+        Sink = *Screen.line(0);
+    }));
+
+    HANDLE hFile = File ? CreateFileW(File, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL)
+                        : OutputHandle(STD_OUTPUT_HANDLE);
+    DWORD Written;
+    bool ok = hFile != INVALID_HANDLE_VALUE && WriteFile(hFile, Out.data(), (DWORD)Out.size(), &Written, NULL) && Written == Out.size();
+    if (File && hFile != INVALID_HANDLE_VALUE)
+        CloseHandle(hFile);
+    if (!ok)
+    {
+        PrintError(L"Unable to write the output\r\n");
+        return 1;
+    }
+    if (Slower)
+    {
+        PrintError(L"Slower or larger than the baseline\r\n");
+        return 1;
+    }
+    return 0;
+}
+
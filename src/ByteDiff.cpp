@@ -0,0 +1,144 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     Vectorized byte compare into a packed change mask
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#include "MemView.h"
+#include "ByteDiff.h"
+#include <intrin.h>
+#include <algorithm>
+
+#if defined(_M_IX86) || defined(_M_X64)
+#include <emmintrin.h>
+#include <immintrin.h>
+
+enum SimdLevel
+{
+    SimdUnknown = -1,
+    SimdNone,
+    SimdSse2,
+    SimdAvx2,
+};
+
+static SimdLevel g_SimdLevel = SimdUnknown;
+
+static SimdLevel DetectSimd()
+{
+#ifdef _M_IX86
+    if (!IsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE))
+        return SimdNone;
+#endif
+
+    int regs[4];
+    __cpuid(regs, 0);
+    if (regs[0] < 7)
+        return SimdSse2;
+
+    // AVX has to be supported by the cpu, and the OS has to save the YMM registers
+    __cpuid(regs, 1);
+    const int OSXSAVE = (1 << 27), AVX = (1 << 28);
+    if ((regs[2] & (OSXSAVE | AVX)) != (OSXSAVE | AVX) || (_xgetbv(0) & 6) != 6)
+        return SimdSse2;
+
+    __cpuidex(regs, 7, 0);
+    const int AVX2 = (1 << 5);
+    return (regs[1] & AVX2) ? SimdAvx2 : SimdSse2;
+}
+
+static DWORD DiffSse2(const BYTE* Old, const BYTE* New, size_t Words, DWORD* Mask)
+{
+    DWORD any = 0;
+    for (size_t w = 0; w < Words; ++w)
+    {
+        const __m128i* o = reinterpret_cast<const __m128i*>(Old + w * 32);
+        const __m128i* n = reinterpret_cast<const __m128i*>(New + w * 32);
+        DWORD lo = (DWORD)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(o), _mm_loadu_si128(n)));
+        DWORD hi = (DWORD)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(o + 1), _mm_loadu_si128(n + 1)));
+        DWORD diff = ~(lo | (hi << 16));
+        Mask[w] |= diff;
+        any |= diff;
+    }
+    return any;
+}
+
+static DWORD DiffAvx2(const BYTE* Old, const BYTE* New, size_t Words, DWORD* Mask)
+{
+    DWORD any = 0;
+    for (size_t w = 0; w < Words; ++w)
+    {
+        __m256i o = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(Old + w * 32));
+        __m256i n = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(New + w * 32));
+        DWORD diff = ~(DWORD)_mm256_movemask_epi8(_mm256_cmpeq_epi8(o, n));
+        Mask[w] |= diff;
+        any |= diff;
+    }
+    // Avoid the penalty of switching back to legacy SSE code
+    _mm256_zeroupper();
+    return any;
+}
+#endif
+
+bool DiffBytes(const BYTE* Old, const BYTE* New, size_t Length, DWORD* Mask)
+{
+    size_t Words = Length / 32;
+    DWORD any = 0;
+
+#if defined(_M_IX86) || defined(_M_X64)
+    if (g_SimdLevel == SimdUnknown)
+        g_SimdLevel = DetectSimd();
+
+    if (g_SimdLevel == SimdAvx2)
+        any = DiffAvx2(Old, New, Words, Mask);
+    else if (g_SimdLevel == SimdSse2)
+        any = DiffSse2(Old, New, Words, Mask);
+    else
+#endif
+        Words = 0;
+
+    // Whatever is left (or everything, without SIMD support)
+    for (size_t n = Words * 32; n < Length; ++n)
+    {
+        if (Old[n] != New[n])
+        {
+            DWORD bit = 1u << (n % 32);
+            Mask[n / 32] |= bit;
+            any |= bit;
+        }
+    }
+    return any != 0;
+}
+
+void SetMaskRange(DWORD* Mask, size_t Start, size_t End, bool Value)
+{
+    while (Start < End)
+    {
+        size_t Bit = Start % 32;
+        size_t Count = std::min<size_t>(32 - Bit, End - Start);
+        DWORD bits = (Count == 32 ? ~0u : ((1u << Count) - 1)) << Bit;
+        if (Value)
+            Mask[Start / 32] |= bits;
+        else
+            Mask[Start / 32] &= ~bits;
+        Start += Count;
+    }
+}
+
+size_t FindMaskRunEnd(const DWORD* Mask, size_t Start, size_t End, bool Value)
+{
+    size_t n = Start;
+    while (n < End)
+    {
+        // Set bits are the ones that differ from Value
+        DWORD word = Value ? ~Mask[n / 32] : Mask[n / 32];
+        word &= ~0u << (n % 32);
+
+        unsigned long index;
+        if (_BitScanForward(&index, word))
+            return std::min<size_t>((n & ~size_t(31)) + index, End);
+
+        n = (n & ~size_t(31)) + 32;
+    }
+    return End;
+}
@@ -0,0 +1,29 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     Vectorized byte compare into a packed change mask
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#pragma once
+
+// A change mask holds one bit per byte, packed in 32 bit words
+inline size_t MaskWords(size_t Length)
+{
+    return (Length + 31) / 32;
+}
+
+inline bool TestMaskBit(const DWORD* Mask, size_t n)
+{
+    return ((Mask[n / 32] >> (n % 32)) & 1) != 0;
+}
+
+// Set or clear the bits in [Start, End)
+void SetMaskRange(DWORD* Mask, size_t Start, size_t End, bool Value);
+
+// Set the bit for every byte that differs between Old and New, other bits are left untouched.
+// Returns true when at least one byte differs.
+bool DiffBytes(const BYTE* Old, const BYTE* New, size_t Length, DWORD* Mask);
+
+// Return the first position in [Start, End) where the bit is not equal to Value, or End.
+size_t FindMaskRunEnd(const DWORD* Mask, size_t Start, size_t End, bool Value);
@@ -0,0 +1,304 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     The snapshot diff window
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#include "MemView.h"
+#include <Commctrl.h>
+#include <thread>
+#include "MemInfo.h"
+#include "SnapshotFile.h"
+#include "SnapshotDiff.h"
+
+#define DIFF_CLASS TEXT("MemDiffClass")
+const UINT WM_DIFF_DONE = WM_APP + 1;
+
+static HWND g_DiffWnd;
+static HWND g_DiffList;
+static HWND g_DiffStatic;
+
+static SnapshotDiff g_Diff;
+static std::thread g_DiffThread;
+static bool g_Comparing;
+static bool g_DiffOk;
+static std::shared_ptr<SnapshotFile> g_OldSnapshot;
+static std::shared_ptr<SnapshotFile> g_NewSnapshot;
+static std::wstring g_OldName;
+static std::wstring g_NewName;
+
+static wchar_t* Columns[] =
+{
+    L"Address",
+    L"Size",
+    L"Type",
+    L"Access",
+    L"Initial Access",
+    L"Change",
+    L"Changed bytes",
+    L"Mapped",
+};
+
+static int Sizes[] = {
+#ifdef _WIN64
+    136,
+#else
+    76,
+#endif
+    70,
+    40,
+    110,
+    110,
+    70,
+    90,
+    300,
+};
+
+// The columns that MemSnapshot::columnText fills
+static int ColumnIndex(int SubItem)
+{
+    if (SubItem < 5)
+        return SubItem;
+    return SubItem == _countof(Columns) - 1 ? 5 : -1;
+}
+
+static void UpdateStatus()
+{
+    WCHAR buf[200];
+    if (g_Comparing)
+        StringCchCopyW(buf, _countof(buf), L"Comparing...");
+    else if (!g_DiffOk)
+        StringCchCopyW(buf, _countof(buf), L"The snapshots cannot be compared");
+    else
+        StringCchPrintfW(buf, _countof(buf), L"%Iu regions differ, %I64u bytes changed%s", g_Diff.size(), g_Diff.totalChangedBytes(),
+            g_Diff.truncated() ? L" (not all changed ranges are kept)" : L"");
+    Static_SetText(g_DiffStatic, buf);
+}
+
+static void WaitForDiff()
+{
+    if (g_DiffThread.joinable())
+    {
+        g_Diff.cancel();
+        g_DiffThread.join();
+    }
+}
+
+static void StartDiff()
+{
+    WaitForDiff();
+    ListView_SetItemCountEx(g_DiffList, 0, 0);
+    g_Comparing = true;
+    UpdateStatus();
+
+    HWND Notify = g_DiffWnd;
+    g_DiffThread = std::thread([=]()
+    {
+        g_DiffOk = g_Diff.run(*g_OldSnapshot, *g_NewSnapshot);
+        PostMessageW(Notify, WM_DIFF_DONE, 0, 0);
+    });
+}
+
+static void HandleDiffDone()
+{
+    WaitForDiff();
+    g_Comparing = false;
+    ListView_SetItemCountEx(g_DiffList, g_Diff.size(), 0);
+    UpdateStatus();
+}
+
+static void HandleSize(HWND hwnd)
+{
+    RECT client;
+    GetClientRect(hwnd, &client);
+    LONG w = client.right - client.left;
+    LONG StatusHeight = 16;
+    HDWP wp = BeginDeferWindowPos(2);
+    wp = DeferWindowPos(wp, g_DiffList, 0, client.left, client.top, w, client.bottom - client.top - StatusHeight, 0);
+    wp = DeferWindowPos(wp, g_DiffStatic, 0, client.left, client.bottom - StatusHeight, w, StatusHeight, 0);
+    EndDeferWindowPos(wp);
+    ListView_SetColumnWidth(g_DiffList, _countof(Columns) - 1, LVSCW_AUTOSIZE_USEHEADER);
+}
+
+static LRESULT DiffWM_NOTIFY(HWND hWnd, WPARAM wParam, LPNMHDR lParam)
+{
+    switch (lParam->code)
+    {
+    case LVN_GETDISPINFO:
+    {
+        NMLVDISPINFO* plvdi = (NMLVDISPINFO*)lParam;
+        size_t item = plvdi->item.iItem;
+        if ((plvdi->item.mask & LVIF_TEXT) && !g_Comparing && item < g_Diff.size())
+        {
+            static const wchar_t* Changes[] = { L"Added", L"Removed", L"Modified" };
+            int Index = ColumnIndex(plvdi->item.iSubItem);
+            if (Index >= 0)
+                g_Diff.rows().columnText(item, plvdi->item.pszText, plvdi->item.cchTextMax, Index);
+            else if (plvdi->item.iSubItem == 5)
+                StringCchCopyW(plvdi->item.pszText, plvdi->item.cchTextMax, Changes[g_Diff.change(item)]);
+            else if (g_Diff.changedBytes(item))
+                StringCchPrintfW(plvdi->item.pszText, plvdi->item.cchTextMax, L"%I64u", g_Diff.changedBytes(item));
+            return TRUE;
+        }
+    }
+    break;
+    case NM_DBLCLK:
+    {
+        INT Num = ListView_GetNextItem(g_DiffList, -1, LVNI_SELECTED);
+        if (Num >= 0 && !g_Comparing && (size_t)Num < g_Diff.size())
+        {
+            const MemSnapshot& rows = g_Diff.rows();
+            if (g_Diff.change(Num) == SnapshotDiff::Removed)
+            {
+                ShowSnapshotMemory(hWnd, rows.at(Num), g_OldSnapshot, g_OldName);
+            }
+            else
+            {
+                // Start at the first change
+                SIZE_T Offset = g_Diff.rangeCount(Num) ? g_Diff.range(Num, 0).Start - rows.start(Num) : 0;
+                ShowSnapshotMemory(hWnd, rows.at(Num), g_NewSnapshot, g_NewName, Offset);
+            }
+        }
+    }
+        return TRUE;
+
+    case NM_CUSTOMDRAW:
+    {
+        LPNMLVCUSTOMDRAW lplvcd = reinterpret_cast<LPNMLVCUSTOMDRAW>(lParam);
+
+        switch (lplvcd->nmcd.dwDrawStage)
+        {
+        case CDDS_PREPAINT:
+            return CDRF_NOTIFYITEMDRAW;
+        case CDDS_ITEMPREPAINT:
+            return CDRF_NOTIFYSUBITEMDRAW;
+        case CDDS_SUBITEM | CDDS_ITEMPREPAINT:
+        {
+            size_t item = lplvcd->nmcd.dwItemSpec;
+            if (g_Comparing || item >= g_Diff.size())
+                return CDRF_DODEFAULT;
+
+            const MemSnapshot& rows = g_Diff.rows();
+            if (rows.isImage(item))
+                lplvcd->clrTextBk = RGB(170, 204, 255);
+            else if (rows.isMapped(item))
+                lplvcd->clrTextBk = RGB(255, 170, 0);
+            else if (rows.isPrivate(item))
+                lplvcd->clrTextBk = RGB(255, 255, 170);
+            else
+                lplvcd->clrTextBk = RGB(255, 255, 255);
+
+            int Index = ColumnIndex(lplvcd->iSubItem);
+            bool changed;
+            if (Index >= 0)
+                changed = (rows.changed(item) & MemInfo::Index2Info(Index)) != Info::None;
+            else if (lplvcd->iSubItem == 5)
+                changed = g_Diff.change(item) != SnapshotDiff::Modified;
+            else
+                changed = g_Diff.changedBytes(item) != 0;
+            lplvcd->clrText = changed ? RGB(255, 0, 0) : RGB(0, 0, 0);
+        }
+        return CDRF_NEWFONT;
+        }
+    }
+        return CDRF_DODEFAULT;
+    }
+    return DefWindowProc(hWnd, WM_NOTIFY, wParam, (LPARAM)lParam);
+}
+
+LRESULT CALLBACK DiffWndProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
+{
+    switch (uMsg)
+    {
+    case WM_CREATE:
+    {
+        g_DiffList = CreateWindowW(WC_LISTVIEW, L"", WS_CHILD | LVS_REPORT | WS_VISIBLE | LVS_OWNERDATA | WS_TABSTOP | LVS_SHOWSELALWAYS,
+            0, 0, 0, 0, hwnd, NULL, g_hInst, NULL);
+        g_DiffStatic = CreateWindowW(WC_STATIC, L"", WS_CHILD | WS_VISIBLE | SS_SUNKEN,
+            0, 0, 0, 0, hwnd, NULL, g_hInst, NULL);
+
+        ListView_SetExtendedListViewStyle(g_DiffList, ListView_GetExtendedListViewStyle(g_DiffList) | LVS_EX_FULLROWSELECT | LVS_EX_DOUBLEBUFFER);
+        SetWindowFont(g_DiffList, getFont(), FALSE);
+        SetWindowFont(g_DiffStatic, getFont(), FALSE);
+
+        LVCOLUMN lvc;
+        for (size_t n = 0; n < _countof(Columns); ++n)
+        {
+            lvc.mask = LVCF_FMT | LVCF_WIDTH | LVCF_TEXT | LVCF_SUBITEM;
+            lvc.iSubItem = (int)n;
+            lvc.cx = Sizes[n];
+            lvc.fmt = LVCFMT_LEFT;
+            lvc.pszText = Columns[n];
+            ListView_InsertColumn(g_DiffList, n, &lvc);
+        }
+
+        HandleSize(hwnd);
+    }
+    return 0;
+
+    case WM_SIZE:
+        HandleSize(hwnd);
+        return 0;
+
+    case WM_DIFF_DONE:
+        HandleDiffDone();
+        return 0;
+
+    case WM_NOTIFY:
+        if (((LPNMHDR)lParam)->hwndFrom == g_DiffList)
+            return DiffWM_NOTIFY(hwnd, wParam, (LPNMHDR)lParam);
+        break;
+
+    case WM_DESTROY:
+        WaitForDiff();
+        g_Comparing = false;
+        g_Diff.clear();
+        g_OldSnapshot.reset();
+        g_NewSnapshot.reset();
+        RemoveDialogWindow(hwnd);
+        g_DiffWnd = NULL;
+        break;
+    }
+    return DefWindowProc(hwnd, uMsg, wParam, lParam);
+}
+
+void ShowSnapshotDiff(HWND Parent, const std::shared_ptr<SnapshotFile>& Old, const std::wstring& OldName,
+    const std::shared_ptr<SnapshotFile>& New, const std::wstring& NewName)
+{
+    if (!g_DiffWnd)
+    {
+        WNDCLASSEX wc = { sizeof(wc), 0 };
+        if (!GetClassInfoEx(g_hInst, DIFF_CLASS, &wc))
+        {
+            wc.lpfnWndProc = DiffWndProc;
+            wc.hInstance = g_hInst;
+            wc.hCursor = LoadCursor((HINSTANCE)NULL, IDC_ARROW);
+            wc.hbrBackground = (HBRUSH)(COLOR_BTNFACE + 1);
+            wc.lpszClassName = DIFF_CLASS;
+            setIcons(wc);
+
+            if (!RegisterClassEx(&wc))
+                return;
+        }
+
+        g_DiffWnd = CreateWindowEx(WS_EX_CONTROLPARENT, DIFF_CLASS, L"Snapshot diff", WS_OVERLAPPEDWINDOW,
+            CW_USEDEFAULT, CW_USEDEFAULT, 900, 400, Parent, NULL, g_hInst, NULL);
+        AddDialogWindow(g_DiffWnd);
+        ShowWindow(g_DiffWnd, SW_SHOW);
+        UpdateWindow(g_DiffWnd);
+    }
+    else
+    {
+        SetForegroundWindow(g_DiffWnd);
+    }
+
+    // The previous diff is still using the old files
+    WaitForDiff();
+    g_OldSnapshot = Old;
+    g_NewSnapshot = New;
+    g_OldName = OldName;
+    g_NewName = NewName;
+    StartDiff();
+}
+
@@ -0,0 +1,117 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     Drawing the hex view from pre-rendered glyphs
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#include "MemView.h"
+#include "GlyphAtlas.h"
+#include "HexFormat.h"
+#include <algorithm>
+
+const size_t kGlyphCount = GlyphAtlas::kLast - GlyphAtlas::kFirst + 1;
+const DWORD kChangedCell = 1 << 16;
+const DWORD kUnknownCell = 0xffffffff;
+
+static DWORD Blend(DWORD Background, DWORD Foreground, DWORD Coverage)
+{
+    DWORD Result = 0;
+    for (int Shift = 0; Shift < 24; Shift += 8)
+    {
+        int Bg = (Background >> Shift) & 0xff;
+        int Fg = (Foreground >> Shift) & 0xff;
+        int Alpha = (Coverage >> Shift) & 0xff;
+        Result |= (DWORD)(Bg + ((Fg - Bg) * Alpha + 127) / 255) << Shift;
+    }
+    return Result;
+}
+
+GlyphAtlas::GlyphAtlas()
+    :mCellWidth(0), mCellHeight(0)
+{
+}
+
+void GlyphAtlas::create(int CellWidth, int CellHeight, const DWORD* Coverage, size_t Stride, DWORD Background, DWORD Normal, DWORD Changed)
+{
+    mCellWidth = CellWidth;
+    mCellHeight = CellHeight;
+    size_t CellSize = (size_t)CellWidth * CellHeight;
+    mCells.assign(CellSize * (kGlyphCount + 1) * 2, Background);
+
+    for (int Color = 0; Color < 2; ++Color)
+    {
+        DWORD Foreground = Color ? Changed : Normal;
+        for (size_t Glyph = 0; Glyph < kGlyphCount; ++Glyph)
+        {
+            DWORD* Cell = &mCells[(Color * (kGlyphCount + 1) + Glyph + 1) * CellSize];
+            for (int y = 0; y < CellHeight; ++y)
+            {
+                const DWORD* Source = Coverage + y * Stride + Glyph * CellWidth;
+                for (int x = 0; x < CellWidth; ++x)
+                    Cell[y * CellWidth + x] = Blend(Background, Foreground, Source[x]);
+            }
+        }
+    }
+}
+
+const DWORD* GlyphAtlas::cell(WCHAR Char, bool Changed) const
+{
+    size_t Glyph = (Char >= kFirst && Char <= kLast) ? Char - kFirst + 1 : 0;
+    return &mCells[((Changed ? kGlyphCount + 1 : 0) + Glyph) * mCellWidth * mCellHeight];
+}
+
+HexRenderer::HexRenderer()
+    :mColumns(0), mRows(0)
+{
+}
+
+void HexRenderer::resize(size_t Columns, size_t Rows)
+{
+    mColumns = Columns;
+    mRows = Rows;
+    mNext.resize(Columns * Rows);
+    invalidate();
+}
+
+void HexRenderer::invalidate()
+{
+    mLast.assign(mColumns * mRows, kUnknownCell);
+}
+
+size_t HexRenderer::render(const GlyphAtlas& Atlas, const HexScreen& Screen, DWORD* Pixels, size_t Stride)
+{
+    // The cells of this frame, whatever is not covered by a run is blank
+    std::fill(mNext.begin(), mNext.end(), (DWORD)L' ');
+    for (const HexRun& Run : Screen.runs())
+    {
+        if (Run.Line >= mRows || Run.Column >= mColumns)
+            continue;
+        const WCHAR* Text = Screen.line(Run.Line);
+        DWORD* Row = &mNext[Run.Line * mColumns];
+        size_t End = std::min(Run.Column + Run.Length, mColumns);
+        for (size_t Column = Run.Column; Column < End; ++Column)
+            Row[Column] = Text[Column] | (Run.Changed ? kChangedCell : 0);
+    }
+
+    const int Width = Atlas.cellWidth(), Height = Atlas.cellHeight();
+    size_t Drawn = 0;
+    for (size_t Row = 0; Row < mRows; ++Row)
+    {
+        for (size_t Column = 0; Column < mColumns; ++Column)
+        {
+            size_t n = Row * mColumns + Column;
+            if (mNext[n] == mLast[n])
+                continue;
+
+            const DWORD* Glyph = Atlas.cell((WCHAR)mNext[n], (mNext[n] & kChangedCell) != 0);
+            DWORD* Target = Pixels + Row * Height * Stride + Column * Width;
+            for (int y = 0; y < Height; ++y)
+                memcpy(Target + y * Stride, Glyph + y * Width, Width * sizeof(DWORD));
+            ++Drawn;
+        }
+    }
+    mLast.swap(mNext);
+    return Drawn;
+}
+
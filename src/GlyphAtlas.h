@@ -0,0 +1,70 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     Drawing the hex view from pre-rendered glyphs
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#pragma once
+
+#include <vector>
+
+class HexScreen;
+
+// Pixels are 32 bit 0x00RRGGBB, as in a top-down DIB
+inline DWORD PixelFromColor(COLORREF Color)
+{
+    return (GetRValue(Color) << 16) | (GetGValue(Color) << 8) | GetBValue(Color);
+}
+
+// Every printable character, blended once in the normal and the changed color
+class GlyphAtlas
+{
+public:
+    enum
+    {
+        kFirst = 0x20,
+        kLast = 0x7e,
+    };
+
+    GlyphAtlas();
+
+    // Coverage holds the glyphs kFirst to kLast next to each other, drawn white on black, Stride is in pixels.
+    // The channels are blended on their own, so subpixel rendering keeps its colors.
+    void create(int CellWidth, int CellHeight, const DWORD* Coverage, size_t Stride, DWORD Background, DWORD Normal, DWORD Changed);
+
+    bool empty() const { return mCells.empty(); }
+    int cellWidth() const { return mCellWidth; }
+    int cellHeight() const { return mCellHeight; }
+
+    // CellWidth x CellHeight pixels, characters outside of the atlas are blank
+    const DWORD* cell(WCHAR Char, bool Changed) const;
+
+private:
+    int mCellWidth;
+    int mCellHeight;
+    // A blank cell followed by the glyphs, first in the normal and then in the changed color
+    std::vector<DWORD> mCells;
+};
+
+// Copies the cells of a HexScreen into a framebuffer, skipping the cells that are the same as in the last frame
+class HexRenderer
+{
+public:
+    HexRenderer();
+
+    // Forget the last frame, all cells are drawn again
+    void resize(size_t Columns, size_t Rows);
+    void invalidate();
+
+    // Pixels holds Rows * CellHeight lines of Stride pixels, returns the number of cells that were drawn
+    size_t render(const GlyphAtlas& Atlas, const HexScreen& Screen, DWORD* Pixels, size_t Stride);
+
+private:
+    size_t mColumns;
+    size_t mRows;
+    // One per cell, the character and the changed state in bit 16
+    std::vector<DWORD> mLast;
+    std::vector<DWORD> mNext;
+};
+
@@ -0,0 +1,455 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     Dumping region maps from the command line
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#include "MemView.h"
+#include <Psapi.h>
+#include "mfl/win32/tlhelp32.h"
+#include "MemInfo.h"
+#include "Parallel.h"
+#include <mutex>
+#include <string>
+#include <map>
+#include <algorithm>
+#include <cwctype>
+
+// Binary layout, all values little endian:
+//   DWORD Magic (kDumpMagic), DWORD Version, DWORD PointerSize
+//   Per process:
+//     DWORD Pid, String Name
+//     DWORD RegionCount, DWORD MappedCount, String Mapped[MappedCount]
+//     DumpRegion Regions[RegionCount]
+//   A String is a DWORD length followed by that many UTF-16 characters
+struct DumpRegion
+{
+    UINT64 Base;
+    UINT64 Size;
+    UINT64 AllocationBase;
+    DWORD Protect;
+    DWORD AllocationProtect;
+    DWORD State;
+    DWORD Type;
+    DWORD Mapped;   // Index in the mapped names of the process, or kNoMapped
+    DWORD Reserved;
+};
+
+const DWORD kDumpMagic = 'MRVM';
+const DWORD kDumpVersion = 1;
+const DWORD kNoMapped = 0xffffffff;
+const size_t kWriteBufferSize = 1024 * 1024;
+
+enum class DumpFormat
+{
+    Json,
+    Csv,
+    Binary,
+};
+
+// All output goes through one buffer, processes are formatted on their own and then appended as a whole.
+// Processes are appended in the order of their index, not in the order the workers finish them,
+// so two dumps of the same processes can be compared.
+class OutputWriter
+{
+public:
+    explicit OutputWriter(HANDLE hFile)
+        :mFile(hFile), mFailed(false), mNext(0)
+    {
+        mBuffer.reserve(kWriteBufferSize);
+    }
+
+    void write(const std::string& Data)
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        appendLocked(Data);
+    }
+
+    // Every index has to be written once, a process that is skipped with an empty Data
+    void write(size_t Index, std::string& Data)
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        if (Index != mNext)
+        {
+            mPending[Index].swap(Data);
+            return;
+        }
+        appendLocked(Data);
+        for (auto it = mPending.find(++mNext); it != mPending.end(); it = mPending.find(++mNext))
+        {
+            appendLocked(it->second);
+            mPending.erase(it);
+        }
+    }
+
+    bool flush()
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        flushLocked();
+        return !mFailed;
+    }
+
+private:
+    void appendLocked(const std::string& Data)
+    {
+        if (mBuffer.size() + Data.size() > kWriteBufferSize)
+            flushLocked();
+        if (Data.size() > kWriteBufferSize)
+            writeFile(Data.data(), Data.size());
+        else
+            mBuffer.append(Data);
+    }
+
+    void flushLocked()
+    {
+        writeFile(mBuffer.data(), mBuffer.size());
+        mBuffer.clear();
+    }
+
+    void writeFile(const char* Data, size_t Size)
+    {
+        DWORD Written;
+        if (Size && !mFailed && (!WriteFile(mFile, Data, (DWORD)Size, &Written, NULL) || Written != Size))
+            mFailed = true;
+    }
+
+    std::mutex mLock;
+    HANDLE mFile;
+    std::string mBuffer;
+    bool mFailed;
+    size_t mNext;                               // Index of the next process to append
+    std::map<size_t, std::string> mPending;     // Processes that finished before mNext
+};
+
+static void AppendHex(std::string& Out, UINT64 Value, int Digits)
+{
+    static const char Hex[] = "0123456789abcdef";
+    char buf[16];
+    int n = 0;
+    do
+    {
+        buf[n++] = Hex[Value & 0xf];
+        Value >>= 4;
+    } while (Value || n < Digits);
+    while (n)
+        Out += buf[--n];
+}
+
+static void AppendDecimal(std::string& Out, UINT64 Value)
+{
+    char buf[20];
+    int n = 0;
+    do
+    {
+        buf[n++] = (char)('0' + Value % 10);
+        Value /= 10;
+    } while (Value);
+    while (n)
+        Out += buf[--n];
+}
+
+static void AppendAddress(std::string& Out, const void* Address)
+{
+    AppendHex(Out, (ULONG_PTR)Address, sizeof(void*) * 2);
+}
+
+template<typename T>
+static void AppendRaw(std::string& Out, const T& Value)
+{
+    Out.append(reinterpret_cast<const char*>(&Value), sizeof(Value));
+}
+
+static void AppendRawString(std::string& Out, const wchar_t* Text)
+{
+    DWORD Length = (DWORD)wcslen(Text);
+    AppendRaw(Out, Length);
+    Out.append(reinterpret_cast<const char*>(Text), Length * sizeof(wchar_t));
+}
+
+// Text in UTF-8, quoted and escaped for the format
+static void AppendString(std::string& Out, DumpFormat Format, const wchar_t* Text)
+{
+    char buf[MAX_PATH * 3];
+    int Length = WideCharToMultiByte(CP_UTF8, 0, Text, -1, buf, sizeof(buf), NULL, NULL);
+    Length = Length > 0 ? Length - 1 : 0;
+
+    Out += '"';
+    for (int n = 0; n < Length; ++n)
+    {
+        char c = buf[n];
+        if (Format == DumpFormat::Csv)
+        {
+            if (c == '"')
+                Out += '"';
+            Out += c;
+        }
+        else if (c == '"' || c == '\\')
+        {
+            Out += '\\';
+            Out += c;
+        }
+        else if ((unsigned char)c < 0x20)
+        {
+            Out += "\\u00";
+            AppendHex(Out, (unsigned char)c, 2);
+        }
+        else
+        {
+            Out += c;
+        }
+    }
+    Out += '"';
+}
+
+// Same names as the list columns, without the padding
+static void AppendProtection(std::string& Out, DumpFormat Format, DWORD Protect)
+{
+    std::wstring Text = Prot2Str(Protect);
+    Text.erase(Text.find_last_not_of(L' ') + 1);
+    AppendString(Out, Format, Text.c_str());
+}
+
+static const wchar_t* TypeName(const MemSnapshot& Regions, size_t n)
+{
+    if (Regions.isImage(n))
+        return L"Imag";
+    if (Regions.isMapped(n))
+        return L"Map";
+    if (Regions.isPrivate(n))
+        return L"Priv";
+    return L"Other";
+}
+
+static void FormatText(std::string& Out, DumpFormat Format, DWORD Pid, const wchar_t* Name, const MemSnapshot& Regions)
+{
+    const bool Json = Format == DumpFormat::Json;
+    if (Json)
+    {
+        Out += "{\"pid\":";
+        AppendDecimal(Out, Pid);
+        Out += ",\"name\":";
+        AppendString(Out, Format, Name);
+        Out += ",\"regions\":[";
+    }
+
+    for (size_t n = 0; n < Regions.size(); ++n)
+    {
+        if (Json)
+        {
+            Out += n ? ",{\"address\":\"" : "{\"address\":\"";
+            AppendAddress(Out, Regions.start(n));
+            Out += "\",\"size\":\"";
+            AppendHex(Out, Regions.regionSize(n), 8);
+            Out += "\",\"allocation\":\"";
+            AppendAddress(Out, Regions.allocationStart(n));
+            Out += "\",\"state\":";
+            Out += Regions.state(n) == MEM_COMMIT ? "\"commit\"" : "\"reserve\"";
+            Out += ",\"type\":";
+        }
+        else
+        {
+            AppendDecimal(Out, Pid);
+            Out += ',';
+            AppendString(Out, Format, Name);
+            Out += ',';
+            AppendAddress(Out, Regions.start(n));
+            Out += ',';
+            AppendHex(Out, Regions.regionSize(n), 8);
+            Out += ',';
+            AppendAddress(Out, Regions.allocationStart(n));
+            Out += Regions.state(n) == MEM_COMMIT ? ",commit," : ",reserve,";
+        }
+
+        AppendString(Out, Format, TypeName(Regions, n));
+        Out += Json ? ",\"access\":" : ",";
+        AppendProtection(Out, Format, Regions.state(n) == MEM_COMMIT ? Regions.protect(n) : 0);
+        Out += Json ? ",\"initial\":" : ",";
+        AppendProtection(Out, Format, Regions.allocationProtect(n));
+        Out += Json ? ",\"mapped\":" : ",";
+        AppendString(Out, Format, Regions.mapped(n).c_str());
+        Out += Json ? "}" : "\r\n";
+    }
+
+    if (Json)
+        Out += "]}\r\n";
+}
+
+static void FormatBinary(std::string& Out, DWORD Pid, const wchar_t* Name, const MemSnapshot& Regions)
+{
+    AppendRaw(Out, Pid);
+    AppendRawString(Out, Name);
+
+    // Regions of one mapping are adjacent, so only the last name has to be checked
+    std::vector<DWORD> Index(Regions.size(), kNoMapped);
+    std::vector<const wchar_t*> Names;
+    for (size_t n = 0; n < Regions.size(); ++n)
+    {
+        if (Regions.mapped(n).empty())
+            continue;
+        if (Names.empty() || Names.back() != Regions.mapped(n).c_str())
+            Names.push_back(Regions.mapped(n).c_str());
+        Index[n] = (DWORD)Names.size() - 1;
+    }
+
+    AppendRaw(Out, (DWORD)Regions.size());
+    AppendRaw(Out, (DWORD)Names.size());
+    for (const wchar_t* Mapped : Names)
+        AppendRawString(Out, Mapped);
+
+    for (size_t n = 0; n < Regions.size(); ++n)
+    {
+        DumpRegion Region = { (ULONG_PTR)Regions.start(n), Regions.regionSize(n), (ULONG_PTR)Regions.allocationStart(n),
+            Regions.protect(n), Regions.allocationProtect(n), Regions.state(n), Regions.type(n), Index[n], 0 };
+        AppendRaw(Out, Region);
+    }
+}
+
+// A gui application has no console of its own, borrow the one we were started from
+HANDLE OutputHandle(DWORD StdHandle)
+{
+    HANDLE Handle = GetStdHandle(StdHandle);
+    if (Handle && Handle != INVALID_HANDLE_VALUE)
+        return Handle;
+
+    AttachConsole(ATTACH_PARENT_PROCESS);
+    return CreateFileW(L"CONOUT$", GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+}
+
+void PrintError(const wchar_t* Text)
+{
+    HANDLE Handle = OutputHandle(STD_ERROR_HANDLE);
+    char buf[512];
+    int Length = WideCharToMultiByte(CP_UTF8, 0, Text, -1, buf, sizeof(buf), NULL, NULL);
+    DWORD Written;
+    if (Handle != INVALID_HANDLE_VALUE && Length > 1)
+        WriteFile(Handle, buf, Length - 1, &Written, NULL);
+}
+
+static int Usage()
+{
+    PrintError(L"Usage: MemView --dump <pid>... | --all [--format json|csv|binary] [--out <file>]\r\n"
+               L"       MemView --bench [<regions>] [--baseline <file>] [--out <file>]\r\n");
+    return 2;
+}
+
+int RunHeadless(int argc, wchar_t** argv)
+{
+    std::vector<DWORD> Pids;
+    bool All = false;
+    DumpFormat Format = DumpFormat::Json;
+    const wchar_t* File = NULL;
+
+    if (argc > 0 && (!wcscmp(argv[0], L"--bench") || !wcscmp(argv[0], L"--bench-target")))
+        return RunBenchmark(argc, argv);
+
+    for (int n = 0; n < argc; ++n)
+    {
+        if (!wcscmp(argv[n], L"--all"))
+        {
+            All = true;
+        }
+        else if (!wcscmp(argv[n], L"--dump"))
+        {
+            for (; n + 1 < argc && iswdigit(argv[n + 1][0]); ++n)
+                Pids.push_back(wcstoul(argv[n + 1], NULL, 10));
+        }
+        else if (!wcscmp(argv[n], L"--format") && n + 1 < argc)
+        {
+            const wchar_t* Name = argv[++n];
+            if (!wcscmp(Name, L"json"))
+                Format = DumpFormat::Json;
+            else if (!wcscmp(Name, L"csv"))
+                Format = DumpFormat::Csv;
+            else if (!wcscmp(Name, L"binary"))
+                Format = DumpFormat::Binary;
+            else
+                return Usage();
+        }
+        else if (!wcscmp(argv[n], L"--out") && n + 1 < argc)
+        {
+            File = argv[++n];
+        }
+        else
+        {
+            return Usage();
+        }
+    }
+
+    if (All)
+    {
+        mfl::win32::ProcessIterator pi;
+        while (pi.next())
+        {
+            if (pi->th32ProcessID != 0)
+                Pids.push_back(pi->th32ProcessID);
+        }
+    }
+    if (Pids.empty())
+        return Usage();
+    std::sort(Pids.begin(), Pids.end());
+    Pids.erase(std::unique(Pids.begin(), Pids.end()), Pids.end());
+
+    HANDLE hFile = File ? CreateFileW(File, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL)
+                        : OutputHandle(STD_OUTPUT_HANDLE);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        PrintError(L"Unable to open the output\r\n");
+        return 1;
+    }
+
+    OutputWriter Writer(hFile);
+    std::string Header;
+    if (Format == DumpFormat::Csv)
+    {
+        Header = "pid,process,address,size,allocation,state,type,access,initial,mapped\r\n";
+    }
+    else if (Format == DumpFormat::Binary)
+    {
+        AppendRaw(Header, kDumpMagic);
+        AppendRaw(Header, kDumpVersion);
+        AppendRaw(Header, (DWORD)sizeof(void*));
+    }
+    Writer.write(Header);
+
+    std::atomic<bool> Failed(false);
+    ParallelFor(Pids.size(), [&](size_t index)
+    {
+        DWORD Pid = Pids[index];
+        std::string Out;
+        HANDLE hProcess = OpenProcessHandle(Pid);
+        if (!hProcess)
+        {
+            // Not every process can be opened when dumping all of them
+            if (!All)
+                Failed = true;
+            Writer.write(index, Out);
+            return;
+        }
+
+        WCHAR Name[MAX_PATH] = { 0 };
+        GetProcessImageFileNameW(hProcess, Name, _countof(Name));
+        // The names of the PEB and SharedUserData, without the table of the main window
+        KnownRegions Known;
+        Known.init(hProcess);
+        MemSnapshot Regions;
+        MemSnapshot::read(hProcess, Regions, Known);
+        CloseHandle(hProcess);
+
+        if (Format == DumpFormat::Binary)
+            FormatBinary(Out, Pid, Name, Regions);
+        else
+            FormatText(Out, Format, Pid, Name, Regions);
+        Writer.write(index, Out);
+    });
+
+    bool ok = Writer.flush();
+    if (File)
+        CloseHandle(hFile);
+    if (!ok)
+        PrintError(L"Unable to write the output\r\n");
+    else if (Failed)
+        PrintError(L"Not all processes could be opened\r\n");
+    return ok && !Failed ? 0 : 1;
+}
+
@@ -0,0 +1,167 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     Text of the lines in the hex view
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#include "MemView.h"
+#include "HexFormat.h"
+#include "ByteDiff.h"
+#include <cctype>
+
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HEX_SSE2
+#endif
+
+// Same digits as %p
+static const WCHAR Address2Str[] = L"0123456789ABCDEF";
+
+// The characters of every byte value, built once
+struct HexTables
+{
+    HexTables()
+    {
+        static const WCHAR Hex2Str[] = L"0123456789abcdef";
+        for (int n = 0; n < 256; ++n)
+        {
+            // Both digits as they are stored in memory
+            Pairs[n] = Hex2Str[n >> 4] | ((DWORD)Hex2Str[n & 0xf] << 16);
+            Ascii[n] = isprint(n) ? (WCHAR)n : L'.';
+        }
+    }
+
+    DWORD Pairs[256];
+    WCHAR Ascii[256];
+};
+
+static const HexTables g_Tables;
+static const DWORD kUnknownPair = L'?' | ((DWORD)L'?' << 16);
+
+// 16 bits of Mask starting at bit n, all of them have to be inside the mask
+static DWORD MaskBits16(const DWORD* Mask, size_t n)
+{
+    size_t Shift = n % 32;
+    UINT64 Bits = Mask[n / 32];
+    if (Shift > 16)
+        Bits |= (UINT64)Mask[n / 32 + 1] << 32;
+    return (DWORD)(Bits >> Shift) & 0xffff;
+}
+
+static WCHAR* FormatAscii(WCHAR* p, const BYTE* Data, const DWORD* Valid, size_t StartAt, size_t DataLen)
+{
+    size_t n = 0;
+#ifdef HEX_SSE2
+    const __m128i Zero = _mm_setzero_si128();
+    const __m128i Low = _mm_set1_epi8(0x1f), High = _mm_set1_epi8(0x7f);
+    const __m128i Dot = _mm_set1_epi8('.'), Unknown = _mm_set1_epi8('?');
+    const __m128i Select = _mm_set_epi8((char)0x80, 0x40, 0x20, 0x10, 8, 4, 2, 1, (char)0x80, 0x40, 0x20, 0x10, 8, 4, 2, 1);
+    for (; n + 16 <= DataLen; n += 16, p += 16)
+    {
+        __m128i Bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(Data + StartAt + n));
+        // 0x20 - 0x7e, the bytes from 0x80 are negative so they fail the first compare
+        __m128i Printable = _mm_and_si128(_mm_cmpgt_epi8(Bytes, Low), _mm_cmplt_epi8(Bytes, High));
+        __m128i Chars = _mm_or_si128(_mm_and_si128(Printable, Bytes), _mm_andnot_si128(Printable, Dot));
+
+        // One byte of 0xff for every valid bit
+        DWORD Bits = MaskBits16(Valid, StartAt + n);
+        __m128i Spread = _mm_unpacklo_epi64(_mm_set1_epi8((char)Bits), _mm_set1_epi8((char)(Bits >> 8)));
+        __m128i IsValid = _mm_cmpeq_epi8(_mm_and_si128(Spread, Select), Select);
+        Chars = _mm_or_si128(_mm_and_si128(IsValid, Chars), _mm_andnot_si128(IsValid, Unknown));
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(p), _mm_unpacklo_epi8(Chars, Zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(p + 8), _mm_unpackhi_epi8(Chars, Zero));
+    }
+#endif
+    for (; n < DataLen; ++n)
+        *(p++) = TestMaskBit(Valid, StartAt + n) ? g_Tables.Ascii[Data[StartAt + n]] : L'?';
+    return p;
+}
+
+size_t FormatHexLine(WCHAR* Buffer, size_t Cch, const BYTE* Data, const DWORD* Valid, size_t StartAt, size_t DataLen, size_t PerLine, const BYTE* Address)
+{
+    size_t Length = AsciiColumn(DataLen, PerLine);
+    // The hex digits are written 4 characters at a time, so there has to be room for one more
+    if (Length + 2 > Cch || DataLen > PerLine)
+        return 0;
+
+    WCHAR* p = Buffer;
+    ULONG_PTR Value = (ULONG_PTR)Address;
+    for (int shift = sizeof(void*) * 8 - 4; shift >= 0; shift -= 4)
+        *(p++) = Address2Str[(Value >> shift) & 0xf];
+    *(p++) = ':';
+    *(p++) = ' ';
+    *(p++) = ' ';
+
+    // Both digits and the space in one store, the 4th character is overwritten by the next byte
+    const UINT64 Space = (UINT64)L' ' << 32;
+    const BYTE* Bytes = Data + StartAt;
+    for (size_t n = 0; n < DataLen; ++n, p += 3)
+    {
+        UINT64 Cell = (TestMaskBit(Valid, StartAt + n) ? g_Tables.Pairs[Bytes[n]] : kUnknownPair) | Space;
+        memcpy(p, &Cell, sizeof(Cell));
+    }
+    for (size_t n = DataLen; n < PerLine; ++n)
+    {
+        *(p++) = ' ';
+        *(p++) = ' ';
+        *(p++) = ' ';
+    }
+    *(p++) = ' ';
+    *(p++) = ' ';
+    p = FormatAscii(p, Data, Valid, StartAt, DataLen);
+    *p = 0;
+    return Length;
+}
+
+HexScreen::HexScreen()
+    :mPerLine(0), mStride(0), mLines(0)
+{
+}
+
+void HexScreen::clear(size_t PerLine)
+{
+    mPerLine = PerLine;
+    mStride = AsciiColumn(PerLine, PerLine) + 2;
+    mLines = 0;
+    mRuns.clear();
+}
+
+void HexScreen::addRun(size_t Column, size_t End, bool Changed)
+{
+    if (End <= Column)
+        return;
+
+    HexRun Run = { mLines, Column, End - Column, Changed };
+    mRuns.push_back(Run);
+}
+
+void HexScreen::addLine(const BYTE* Data, const DWORD* Valid, const DWORD* Changed, size_t StartAt, size_t DataLen, const BYTE* Address)
+{
+    if (mText.size() < (mLines + 1) * mStride)
+        mText.resize((mLines + 1) * mStride);
+    size_t Length = FormatHexLine(&mText[mLines * mStride], mStride, Data, Valid, StartAt, DataLen, mPerLine, Address);
+
+    // The runs of the hex digits and then the characters, a run ends where the changed state flips
+    size_t Current = 0;
+    bool CurrentChanged = false;
+    for (int Part = 0; Part < 2; ++Part)
+    {
+        for (size_t n = 0; n < DataLen;)
+        {
+            bool IsChanged = TestMaskBit(Changed, StartAt + n);
+            if (CurrentChanged != IsChanged)
+            {
+                size_t Column = Part ? AsciiColumn(n, mPerLine) : HexColumn(n);
+                addRun(Current, Column, CurrentChanged);
+                Current = Column;
+                CurrentChanged = IsChanged;
+            }
+            n = FindMaskRunEnd(Changed, StartAt + n, StartAt + DataLen, IsChanged) - StartAt;
+        }
+    }
+    addRun(Current, Length, CurrentChanged);
+    ++mLines;
+}
+
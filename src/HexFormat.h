@@ -0,0 +1,64 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     Text of the lines in the hex view
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#pragma once
+
+#include <vector>
+
+// A line is the address, two spaces, PerLine times "xx ", two spaces and PerLine characters.
+// Bytes that could not be read are shown as "??" and "?".
+
+// Position of the hex digits of byte n
+inline size_t HexColumn(size_t n)
+{
+    return sizeof(void*) * 2 + 3 + n * 3;
+}
+
+// Position of the character of byte n
+inline size_t AsciiColumn(size_t n, size_t PerLine)
+{
+    return HexColumn(PerLine) + 2 + n;
+}
+
+// Format the bytes [StartAt, StartAt + DataLen) of Data, Valid holds one bit per byte of Data.
+// Returns the length of the line, or 0 when it does not fit in Buffer.
+size_t FormatHexLine(WCHAR* Buffer, size_t Cch, const BYTE* Data, const DWORD* Valid, size_t StartAt, size_t DataLen, size_t PerLine, const BYTE* Address);
+
+// Part of a line where all bytes have the same changed state
+struct HexRun
+{
+    size_t Line;
+    size_t Column;
+    size_t Length;
+    bool Changed;
+};
+
+// The text of all visible lines, with the runs to draw them in.
+// The font is fixed pitch, so a run starts at Column times the character width.
+class HexScreen
+{
+public:
+    HexScreen();
+
+    void clear(size_t PerLine);
+    // Same arguments as FormatHexLine, Changed holds one bit per byte of Data as well
+    void addLine(const BYTE* Data, const DWORD* Valid, const DWORD* Changed, size_t StartAt, size_t DataLen, const BYTE* Address);
+
+    size_t lines() const { return mLines; }
+    const WCHAR* line(size_t n) const { return &mText[n * mStride]; }
+    const std::vector<HexRun>& runs() const { return mRuns; }
+
+private:
+    void addRun(size_t Column, size_t End, bool Changed);
+
+    size_t mPerLine;
+    size_t mStride;
+    size_t mLines;
+    std::vector<WCHAR> mText;
+    std::vector<HexRun> mRuns;
+};
+
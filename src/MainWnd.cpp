@@ -9,11 +9,139 @@
 #include <Commctrl.h>
 #include <algorithm>
 #include "MemInfo.h"
+#include "RegionDiff.h"
+#include "SnapshotFile.h"
+#include "Timeline.h"
+#include "Scheduler.h"
+#include "RegionStats.h"
+#include "RegionFilter.h"
+#include "RegionSort.h"
+#include "RegionView.h"
+#include <commdlg.h>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+#pragma comment(lib, "Comdlg32.lib")
+
+const UINT WM_REFRESH_DONE = WM_APP + 1;
+const UINT WM_SNAPSHOT_WRITTEN = WM_APP + 2;
 
 static HWND g_CurrentProcessNameStatic;
 static HWND g_AboutStatic;
 static HWND g_Listview;
-static std::vector<std::unique_ptr<MemInfo>> g_Info;
+static HWND g_StatsList;
+static HWND g_FilterEdit;
+
+// One state of the region list. Once it is shown it does not change anymore,
+// so the refresh worker diffs against the list that the listview shows without copying it.
+struct RegionList
+{
+    std::shared_ptr<MemSnapshot> Regions;   // All regions as read, shared by the lists built from the same read
+    // The entries, without the sections of collapsed allocations unless Indexed.
+    // Shared by the lists that only differ in their filter or order.
+    std::shared_ptr<MemSnapshot> Info;
+    // Without a filter and in address order every entry of Info is an item of the listview.
+    // Otherwise Visible holds the entry of every item, in the order of Sort,
+    // and with a filter Matches holds the result for every entry.
+    std::shared_ptr<const RegionFilter> Filter;
+    RegionSort Sort;
+    std::vector<BYTE> Matches;
+    std::vector<size_t> Visible;
+    bool Indexed;
+};
+
+static std::shared_ptr<RegionList> EmptyList()
+{
+    std::shared_ptr<RegionList> List = std::make_shared<RegionList>();
+    List->Regions = std::make_shared<MemSnapshot>();
+    List->Info = std::make_shared<MemSnapshot>();
+    List->Indexed = false;
+    return List;
+}
+
+// The regions or entries of a recycled list can still be used by the list that is shown
+static MemSnapshot& Unshared(std::shared_ptr<MemSnapshot>& Snapshot)
+{
+    if (!Snapshot || Snapshot.use_count() > 1)
+        Snapshot = std::make_shared<MemSnapshot>();
+    return *Snapshot;
+}
+
+// Only replaced by the UI thread
+static std::shared_ptr<const RegionList> g_List = EmptyList();
+// A list that is not shown or used anymore, recycled so that a steady-state refresh does not allocate
+static std::shared_ptr<RegionList> g_SpareList;
+
+// The filter and order that were asked for, the list that is shown can still be built for the previous ones
+static std::shared_ptr<const RegionFilter> g_Filter;
+static RegionSort g_Sort;
+// The text of the filter edit does not compile, the last valid filter is still applied
+static bool g_FilterInvalid;
+
+// The regions are read and diffed on a worker thread, that builds a new list next to the one that is shown.
+// A finished refresh is published through g_Finished and taken over by the UI thread as a whole,
+// the listview only ever sees complete lists and nothing is locked while the regions are read.
+struct RegionRefresh
+{
+    UINT Generation;
+    UINT Source;
+    bool Read;              // Without it the entries of Base are only filtered and sorted again
+    HANDLE Process;         // Closed by the worker
+    std::shared_ptr<SnapshotFile> Snapshot;
+    HWND Notify;
+    std::shared_ptr<const RegionList> Base;     // The list that was shown when the refresh started
+    std::shared_ptr<RegionList> Next;
+    EditScript Script;
+    std::vector<size_t> Origin;         // The index in Base of every entry of Next, or kNewEntry
+    std::shared_ptr<const RegionFilter> Filter;
+    RegionSort Sort;
+    SortScratch SortBuffers;
+    std::vector<PBYTE> Toggled;         // Allocations that were clicked to expand or collapse them
+    std::vector<ULONG_PTR> WorkingSet;
+    StatSummary Stats;
+    bool Changed;
+    DWORD Cost;     // Milliseconds the worker took
+};
+// Owned by the worker while g_Refreshing is set
+static RegionRefresh g_Refresh;
+static std::atomic<RegionRefresh*> g_Finished;
+static bool g_Refreshing;
+// A refresh that reads the regions was skipped while the running one was redone
+static bool g_ReadPending;
+// Allocations clicked since the list that is shown was built, in the order of the clicks
+static std::vector<PBYTE> g_Toggled;
+// One worker thread for all refreshes, woken through g_RefreshQueued
+static std::thread g_RefreshThread;
+static std::mutex g_RefreshLock;
+static std::condition_variable g_RefreshWake;
+static bool g_RefreshQueued;
+static bool g_RefreshStop;
+// Bumped when g_List is replaced outside of a refresh, a refresh of an older generation is not shown
+static UINT g_Generation;
+// Bumped when another process or snapshot is shown
+static UINT g_Source;
+
+// A snapshot is written on a worker, the target is only suspended while its memory is read
+static std::thread g_SnapshotThread;
+static bool g_WritingSnapshot;
+static std::atomic<bool> g_CancelSnapshot;
+
+// Only used by the refresh worker
+static RegionStats g_Stats;
+static UINT g_StatsSource;
+
+// One line of the statistics pane
+struct StatRow
+{
+    std::wstring Label;
+    bool Heading;
+    bool HasGrowth;
+    StatTotals Totals;
+    INT64 Growth;
+};
+static std::vector<StatRow> g_StatRows;
 
 #ifndef GWL_WNDPROC
 #define GWL_WNDPROC         (-4)
@@ -27,9 +155,36 @@ static wchar_t* Columns[] =
     L"Type",
     L"Access",
     L"Initial Acess",
+    L"Resident",
+    L"Private",
+    L"Shared",
+    L"Not resident",
     L"Mapped"
 };
 
+// The index for MemSnapshot::columnText of every column, Mapped stays last so it can take the remaining width
+static int ColumnIndex[] = { -1, 0, 1, 2, 3, 4, 6, 7, 8, 9, 5 };
+
+static wchar_t* StatColumns[] =
+{
+    L"Statistic",
+    L"Regions",
+    L"Committed",
+    L"Reserved",
+    L"Growth",
+};
+
+static int StatSizes[] = {
+    170,
+    55,
+    75,
+    75,
+    65,
+};
+
+const LONG kStatsWidth = 460;
+const LONG kFilterWidth = 360;
+
 static int Sizes[] = {
     16,
 #ifdef _WIN64
@@ -41,112 +196,459 @@ static int Sizes[] = {
     40,
     110,
     110,
+    70,
+    70,
+    70,
+    80,
     600
 };
 
 
-static void UpdateListView()
+static size_t ItemCount()
+{
+    return g_List->Indexed ? g_List->Visible.size() : g_List->Info->size();
+}
+
+// The entry of the list that is shown as item
+static size_t RowOf(size_t item)
+{
+    return g_List->Indexed ? g_List->Visible[item] : item;
+}
+
+// The entries are sorted by address, the items in the order of g_Sort
+static int FindItem(PBYTE Address)
+{
+    if (!Address)
+        return -1;
+
+    const RegionList& List = *g_List;
+    const MemSnapshot& Info = *List.Info;
+    size_t lo = 0, hi = Info.size();
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (Info.start(mid) < Address)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo >= Info.size() || Info.start(lo) != Address)
+        return -1;
+    if (!List.Indexed)
+        return (int)lo;
+    if (!List.Matches.empty() && !List.Matches[lo])
+        return -1;
+
+    size_t row = lo;
+    auto it = std::lower_bound(List.Visible.begin(), List.Visible.end(), row, [&](size_t a, size_t b) { return List.Sort.less(Info, a, b); });
+    return it != List.Visible.end() && *it == row ? (int)(it - List.Visible.begin()) : -1;
+}
+
+// A list to build the next one in
+static std::shared_ptr<RegionList> TakeList()
+{
+    std::shared_ptr<RegionList> List;
+    List.swap(g_SpareList);
+    if (!List)
+        List = EmptyList();
+    return List;
+}
+
+// Show List, the top item and the selection stay on the same regions
+static void ShowListView(const std::shared_ptr<const RegionList>& List)
 {
     int Top = ListView_GetTopIndex(g_Listview);
     PBYTE FirstItem = 0;
-    if (Top >= 0 && Top < (int)g_Info.size())
-        FirstItem = g_Info[Top]->start();
-    Top = -1;
-    int End = -1;
+    if (Top >= 0 && Top < (int)ItemCount())
+        FirstItem = g_List->Info->start(RowOf(Top));
 
     INT Selected = ListView_GetNextItem(g_Listview, -1, LVNI_SELECTED);
     PBYTE SelectedValue = 0;
-    if (Selected >= 0 && Selected < (int)g_Info.size())
-        SelectedValue = g_Info[Selected]->start();
-    Selected = -1;
+    if (Selected >= 0 && Selected < (int)ItemCount())
+        SelectedValue = g_List->Info->start(RowOf(Selected));
+
+    // Recycled when a running refresh does not diff against it
+    std::shared_ptr<const RegionList> Previous = g_List;
+    g_List = List;
+    if (Previous.use_count() == 1)
+        g_SpareList = std::const_pointer_cast<RegionList>(Previous);
+    Top = FindItem(FirstItem);
+    Selected = FindItem(SelectedValue);
 
-    std::vector<std::unique_ptr<MemInfo>> Info;
-    MemInfo::read(g_ProcessHandle, Info);
+    SetWindowRedraw(g_Listview, FALSE);
+    ListView_SetItemCountEx(g_Listview, ItemCount(), LVSICF_NOSCROLL);
 
-    for (size_t n = 0; n < Info.size();)
+    if (Top >= 0)
     {
-        MemInfo* ptr = Info[n].get();
-        if (Top < 0 && ptr->start() == FirstItem)
+        if (ListView_GetTopIndex(g_Listview) != Top)
         {
-            Top = (int)n;
-            End = Top + ListView_GetCountPerPage(g_Listview);
+            int End = Top + ListView_GetCountPerPage(g_Listview);
+            int jump = std::min<int>(End, (int)ItemCount()-1);
+            ListView_EnsureVisible(g_Listview, jump, FALSE); // jump forward
+            ListView_EnsureVisible(g_Listview, Top, TRUE); // step back
         }
+    }
+    INT CurrentSelected = ListView_GetNextItem(g_Listview, -1, LVNI_SELECTED);
+    if (Selected >= 0 && Selected != CurrentSelected)
+    {
+        ListView_SetItemState(g_Listview, CurrentSelected, 0, 0x000F);
+        ListView_SetItemState(g_Listview, Selected, LVIS_FOCUSED | LVIS_SELECTED, 0x000F);
+    }
+
+    SetWindowRedraw(g_Listview, TRUE);
+}
+
+static void AddStatRow(LPCWSTR Label, const StatTotals& Totals, bool Heading = false)
+{
+    StatRow Row;
+    Row.Label = Label;
+    Row.Heading = Heading;
+    Row.HasGrowth = false;
+    Row.Totals = Totals;
+    Row.Growth = 0;
+    g_StatRows.push_back(Row);
+}
+
+static void AddAllocationRows(LPCWSTR Heading, const std::vector<AllocationStats>& Allocations)
+{
+    AddStatRow(Heading, StatTotals(), true);
+    for (const AllocationStats& Allocation : Allocations)
+    {
+        // Modules by their file name, other allocations by their address
+        WCHAR Label[MAX_PATH];
+        const wchar_t* Name = Allocation.Mapped.c_str();
+        const wchar_t* FileName = wcsrchr(Name, L'\\');
+        if (*Name)
+            StringCchCopyW(Label, _countof(Label), FileName ? FileName + 1 : Name);
+        else
+            StringCchPrintfW(Label, _countof(Label), L"%p", Allocation.Base);
+        AddStatRow(Label, Allocation.Totals);
+        g_StatRows.back().HasGrowth = true;
+        g_StatRows.back().Growth = Allocation.growth();
+    }
+}
 
-        if (SelectedValue && SelectedValue == ptr->start())
-            Selected = (int)n;
+static void ShowStats(const StatSummary& Stats)
+{
+    static const wchar_t* Types[StatTypeCount] = { L"Image", L"Mapped", L"Private" };
+    static const wchar_t* Protections[StatProtectionCount] = { L"RWX", L"R X", L"RW", L"R", L"Guard", L"No access" };
+
+    g_StatRows.clear();
+    AddStatRow(L"All regions", Stats.Total, true);
+    for (int n = 0; n < StatTypeCount; ++n)
+        AddStatRow(Types[n], Stats.Types[n]);
+    AddStatRow(L"Committed by access", StatTotals(), true);
+    for (int n = 0; n < StatProtectionCount; ++n)
+        AddStatRow(Protections[n], Stats.Protections[n]);
+    AddAllocationRows(L"Largest modules", Stats.LargestModules);
+    AddAllocationRows(L"Modules grown since attached", Stats.GrowingModules);
+    AddAllocationRows(L"Largest allocations", Stats.Largest);
+    AddAllocationRows(L"Grown since attached", Stats.Growing);
+
+    ListView_SetItemCountEx(g_StatsList, g_StatRows.size(), LVSICF_NOSCROLL);
+    InvalidateRect(g_StatsList, NULL, FALSE);
+}
+
+static void StatText(const StatRow& Row, int Column, __out_ecount(cchDest) STRSAFE_LPWSTR pszDest, __in size_t cchDest)
+{
+    // Headings only have totals when they are the total of all regions
+    bool Totals = !Row.Heading || Row.Totals.Regions;
+    switch (Column)
+    {
+    case 0:
+        StringCchPrintfW(pszDest, cchDest, Row.Heading ? L"%s" : L"  %s", Row.Label.c_str());
+        break;
+    case 1:
+        if (Totals)
+            StringCchPrintfW(pszDest, cchDest, L"%Iu", Row.Totals.Regions);
+        else
+            StringCchCopyW(pszDest, cchDest, L"");
+        break;
+    case 2:
+    case 3:
+        if (Totals)
+            StringCchPrintfW(pszDest, cchDest, L"%Iu K", (Column == 2 ? Row.Totals.Committed : Row.Totals.Reserved) / 1024);
+        else
+            StringCchCopyW(pszDest, cchDest, L"");
+        break;
+    case 4:
+        if (Row.HasGrowth && Row.Growth)
+            StringCchPrintfW(pszDest, cchDest, L"%+I64d K", Row.Growth / 1024);
+        else
+            StringCchCopyW(pszDest, cchDest, L"");
+        break;
+    }
+}
 
-        bool checkExpand = false;
-        if (n < g_Info.size())
+static void RefreshRegions(RegionRefresh* Refresh)
+{
+    LARGE_INTEGER Frequency, Start, End;
+    QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&Start);
+
+    const RegionList& Base = *Refresh->Base;
+    RegionList& Next = *Refresh->Next;
+    Next.Filter = Refresh->Filter;
+    Next.Sort = Refresh->Sort;
+    Next.Indexed = Next.Filter || !Next.Sort.natural();
+
+    if (Refresh->Read)
+    {
+        MemSnapshot& Regions = Unshared(Next.Regions);
+        if (Refresh->Snapshot)
         {
-            int cmp = g_Info[n]->cmp(*ptr);
-            if (!cmp)
-            {
-                g_Info[n]->update(*ptr);
-                checkExpand = true;
-                ++n;
-            }
-            else if (cmp < 0)
-            {
-                g_Info.erase(g_Info.begin() + n);
-            }
-            else
-            {
-                g_Info.insert(g_Info.begin() + n, std::unique_ptr<MemInfo>(Info[n].release()));
-                checkExpand = true;
-                ++n;
-            }
+            Refresh->Snapshot->regions(Regions);
         }
-        else
+        else if (Refresh->Process)
         {
-            g_Info.push_back(std::unique_ptr<MemInfo>(Info[n].release()));
-            checkExpand = true;
-            ++n;
+            MemSnapshot::read(Refresh->Process, Regions);
+            Regions.readWorkingSet(Refresh->Process, Refresh->WorkingSet);
+            g_Timeline.record(GetProcessId(Refresh->Process), Regions);
+            CloseHandle(Refresh->Process);
         }
-        if (checkExpand)
+        else
         {
-            PBYTE allocationStart = g_Info[n-1]->allocationStart();
-            bool isFirstEntryOfMapping = g_Info[n-1]->start() == allocationStart;
-            if (isFirstEntryOfMapping && n < Info.size())
-            {
-                g_Info[n-1]->CanExpand = Info[n]->allocationStart() == allocationStart;
-
-                if (!g_Info[n-1]->CanExpand)
-                    g_Info[n-1]->IsExpanded = false;
-
-                if (!g_Info[n-1]->IsExpanded)
-                {
-                    while (n < Info.size() && Info[n]->allocationStart() == allocationStart)
-                    {
-                        Info.erase(Info.begin() + n);
-                    }
-                }
-            }
+            Regions.clear();
         }
     }
+    else
+    {
+        Next.Regions = Base.Regions;
+    }
 
-    if (g_Info.size() > Info.size())
-        g_Info.resize(Info.size());
+    // A filter shows the sections of collapsed allocations, otherwise only the filter, order or
+    // the expanded allocations changed and the entries of Base are filtered and sorted again as they are
+    if (Refresh->Read || Next.Indexed != Base.Indexed || !Refresh->Toggled.empty())
+    {
+        bool Changed = BuildListView(*Base.Info, *Next.Regions, Next.Indexed, Refresh->Toggled, Refresh->Script, Unshared(Next.Info), Refresh->Origin);
+        // Showing or hiding sections is not a change of the process
+        Refresh->Changed = Changed && Refresh->Read;
+    }
+    else
+    {
+        Refresh->Changed = false;
+        Next.Info = Base.Info;
+        Refresh->Origin.resize(Next.Info->size());
+        for (size_t n = 0; n < Refresh->Origin.size(); ++n)
+            Refresh->Origin[n] = n;
+    }
 
-    SetWindowRedraw(g_Listview, FALSE);
-    ListView_SetItemCountEx(g_Listview, g_Info.size(), LVSICF_NOSCROLL);
+    // The results of Base are only valid for the filter and order it was built with
+    const MemSnapshot& Info = *Next.Info;
+    if (Next.Filter && Next.Filter == Base.Filter)
+        FilterListView(Next.Filter.get(), Info, Refresh->Origin, Base.Matches, Next.Matches);
+    else if (Next.Filter)
+        Next.Filter->scan(Info, Next.Matches);
+    else
+        Next.Matches.clear();
+    if (!Next.Indexed)
+        Next.Visible.clear();
+    else if (Next.Sort == Base.Sort)
+        Next.Sort.update(Base.Visible, Base.Info->size(), Info, Refresh->Origin, Next.Matches, Refresh->SortBuffers, Next.Visible);
+    else
+        Next.Sort.sort(Info, Next.Matches, Next.Visible);
 
-    if (Top >= 0)
+    // The totals follow the changes between the regions of two refreshes, they start over for another process
+    if (Refresh->Read)
     {
-        if (ListView_GetTopIndex(g_Listview) != Top)
+        if (Refresh->Source != g_StatsSource)
         {
-            int jump = std::min<int>(End, (int)g_Info.size()-1);
-            ListView_EnsureVisible(g_Listview, jump, FALSE); // jump forward
-            ListView_EnsureVisible(g_Listview, Top, TRUE); // step back
+            g_Stats.reset();
+            g_StatsSource = Refresh->Source;
         }
+        g_Stats.update(*Next.Regions);
+        g_Stats.summary(Refresh->Stats);
     }
-    INT CurrentSelected = ListView_GetNextItem(g_Listview, -1, LVNI_SELECTED);
-    if (Selected >= 0 && Selected != CurrentSelected)
+
+    QueryPerformanceCounter(&End);
+    Refresh->Cost = (DWORD)((End.QuadPart - Start.QuadPart) * 1000 / Frequency.QuadPart);
+    g_Finished.store(Refresh, std::memory_order_release);
+    PostMessageW(Refresh->Notify, WM_REFRESH_DONE, 0, 0);
+}
+
+static void RefreshWorker()
+{
+    std::unique_lock<std::mutex> lock(g_RefreshLock);
+    for (;;)
     {
-        ListView_SetItemState(g_Listview, CurrentSelected, 0, 0x000F);
-        ListView_SetItemState(g_Listview, Selected, LVIS_FOCUSED | LVIS_SELECTED, 0x000F);
+        g_RefreshWake.wait(lock, [] { return g_RefreshStop || g_RefreshQueued; });
+        if (g_RefreshStop)
+            return;
+        g_RefreshQueued = false;
+
+        lock.unlock();
+        RefreshRegions(&g_Refresh);
+        lock.lock();
     }
+}
 
-    SetWindowRedraw(g_Listview, TRUE);
+// Read the regions on the worker, a refresh that is due while the previous one is still running is skipped.
+// Without Read the list that is shown is only filtered and sorted again.
+static void StartRefresh(HWND hwnd, bool Read = true)
+{
+    if (g_Refreshing)
+    {
+        g_ReadPending = g_ReadPending || Read;
+        return;
+    }
+    if (Read)
+        g_ReadPending = false;
+
+    // The listview keeps showing g_List meanwhile, the worker only reads it
+    RegionRefresh* Refresh = &g_Refresh;
+    Refresh->Read = Read;
+    Refresh->Generation = g_Generation;
+    Refresh->Source = g_Source;
+    Refresh->Base = g_List;
+    Refresh->Next = TakeList();
+    Refresh->Filter = g_Filter;
+    Refresh->Sort = g_Sort;
+    Refresh->Toggled = g_Toggled;
+    Refresh->Snapshot = g_Snapshot;
+    Refresh->Notify = hwnd;
+    Refresh->Process = NULL;
+    if (Read && g_ProcessHandle)
+        DuplicateHandle(GetCurrentProcess(), g_ProcessHandle, GetCurrentProcess(), &Refresh->Process, 0, FALSE, DUPLICATE_SAME_ACCESS);
+
+    g_Refreshing = true;
+    if (!g_RefreshThread.joinable())
+        g_RefreshThread = std::thread(RefreshWorker);
+    {
+        std::lock_guard<std::mutex> lock(g_RefreshLock);
+        g_RefreshQueued = true;
+    }
+    g_RefreshWake.notify_one();
+}
+
+static void StopRefreshWorker()
+{
+    if (!g_RefreshThread.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(g_RefreshLock);
+        g_RefreshStop = true;
+    }
+    g_RefreshWake.notify_one();
+    g_RefreshThread.join();
+}
+
+// The process or the expanded allocations changed, a running refresh is redone when it finishes
+static void RestartRefresh(HWND hwnd)
+{
+    ++g_Generation;
+    StartRefresh(hwnd);
+}
+
+// Another process or snapshot is shown, its regions arrive with the next refresh
+static void ClearListView(HWND hwnd)
+{
+    g_List = EmptyList();
+    g_Toggled.clear();
+    ListView_SetItemCountEx(g_Listview, 0, 0);
+    g_StatRows.clear();
+    ListView_SetItemCountEx(g_StatsList, 0, 0);
+    ++g_Source;
+    RestartRefresh(hwnd);
+}
+
+static void HandleRefreshDone(HWND hwnd)
+{
+    g_Refreshing = false;
+
+    RegionRefresh* Refresh = g_Finished.exchange(nullptr, std::memory_order_acquire);
+    ReportCost(hwnd, Refresh->Cost);
+    Refresh->Base.reset();
+    Refresh->Snapshot.reset();
+    std::shared_ptr<RegionList> Next;
+    Next.swap(Refresh->Next);
+    if (Refresh->Generation != g_Generation)
+    {
+        // Built from entries that are no longer shown, or for another filter or order
+        g_SpareList = Next;
+        StartRefresh(hwnd, Refresh->Read || g_ReadPending);
+        return;
+    }
+
+    ShowListView(Next);
+    g_Toggled.clear();
+    if (Refresh->Read)
+        ShowStats(Refresh->Stats);
+    if (Refresh->Changed)
+        ReportChanges(hwnd);
+}
+
+// Filter and sort the list that is shown again on the worker, for another filter or order.
+// While typing, a filter that is still running is redone when it finishes.
+static void RebuildListView(HWND hwnd)
+{
+    // A running refresh was built for the previous filter and order
+    ++g_Generation;
+    StartRefresh(hwnd, false);
+}
+
+// The filter edit changed, the regions of the last refresh are filtered again without reading them
+static void ApplyFilter(HWND hwnd)
+{
+    WCHAR Text[512];
+    GetWindowTextW(g_FilterEdit, Text, _countof(Text));
+    std::shared_ptr<RegionFilter> Filter = std::make_shared<RegionFilter>();
+    bool Invalid = !Filter->compile(Text);
+    if (Invalid != g_FilterInvalid)
+    {
+        g_FilterInvalid = Invalid;
+        InvalidateRect(g_FilterEdit, NULL, TRUE);
+    }
+    if (Invalid)
+    {
+        Static_SetText(g_CurrentProcessNameStatic, Filter->error().c_str());
+        return;
+    }
+    UpdateStatic(g_CurrentProcessNameStatic);
+
+    g_Filter = Filter->empty() ? nullptr : Filter;
+    RebuildListView(hwnd);
+}
+
+static void ShowSortArrows()
+{
+    HWND header = ListView_GetHeader(g_Listview);
+    for (int n = 1; n < _countof(Columns); ++n)
+    {
+        HDITEMW hdi = {0};
+        hdi.mask = HDI_FORMAT;
+        Header_GetItem(header, n, &hdi);
+        hdi.fmt &= ~(HDF_SORTUP | HDF_SORTDOWN);
+        if (ColumnIndex[n] == g_Sort.column() && !g_Sort.natural())
+            hdi.fmt |= g_Sort.descending() ? HDF_SORTDOWN : HDF_SORTUP;
+        Header_SetItem(header, n, &hdi);
+    }
+}
+
+// Sort by a column of the listview, the same column again reverses the order
+static void SortListView(HWND hwnd, int Column)
+{
+    if (Column <= 0 || Column >= _countof(Columns))
+        return;
+
+    int Index = ColumnIndex[Column];
+    bool Descending;
+    if (Index == g_Sort.column())
+        Descending = !g_Sort.descending();
+    else    // The largest sizes are the interesting ones
+        Descending = (MemInfo::Index2Info(Index) & (Info::Size | Info::Resident | Info::PrivateResident | Info::SharedResident | Info::NotResident)) != Info::None;
+
+    g_Sort = RegionSort(Index, Descending);
+    ShowSortArrows();
+    RebuildListView(hwnd);
+}
+
+void FocusRegionFilter()
+{
+    if (g_FilterEdit)
+    {
+        SetFocus(g_FilterEdit);
+        Edit_SetSel(g_FilterEdit, 0, -1);
+    }
 }
 
 static void HandleSize(HWND hwnd)
@@ -154,12 +656,16 @@ static void HandleSize(HWND hwnd)
     RECT client;
     GetClientRect(hwnd, &client);
     LONG  w = client.right - client.left;
-    HDWP wp = BeginDeferWindowPos(3);
+    HDWP wp = BeginDeferWindowPos(5);
     LONG ItemHeight = 16;
-    wp = DeferWindowPos(wp, g_CurrentProcessNameStatic, 0, client.left, client.top, w - ItemHeight, ItemHeight, 0);
+    LONG FilterWidth = std::min<LONG>(kFilterWidth, w / 3);
+    wp = DeferWindowPos(wp, g_CurrentProcessNameStatic, 0, client.left, client.top, w - ItemHeight - FilterWidth, ItemHeight, 0);
+    wp = DeferWindowPos(wp, g_FilterEdit, 0, client.right - ItemHeight - FilterWidth, client.top, FilterWidth, ItemHeight, 0);
     wp = DeferWindowPos(wp, g_AboutStatic, 0, client.right - ItemHeight, client.top, ItemHeight, ItemHeight, 0);
     client.top += ItemHeight;
-    wp = DeferWindowPos(wp, g_Listview, 0, client.left, client.top, w, client.bottom - client.top, 0);
+    LONG StatsWidth = std::min<LONG>(kStatsWidth, w / 2);
+    wp = DeferWindowPos(wp, g_Listview, 0, client.left, client.top, w - StatsWidth, client.bottom - client.top, 0);
+    wp = DeferWindowPos(wp, g_StatsList, 0, client.right - StatsWidth, client.top, StatsWidth, client.bottom - client.top, 0);
     EndDeferWindowPos(wp);
     ListView_SetColumnWidth(g_Listview, _countof(Columns) - 1, LVSCW_AUTOSIZE_USEHEADER);
 }
@@ -174,16 +680,16 @@ static LRESULT ListviewWM_NOTIFY(HWND hWnd, WPARAM wParam, LPNMHDR lParam)
         NMLVDISPINFO* plvdi = (NMLVDISPINFO*)lParam;
         if (plvdi->item.mask & LVIF_TEXT)
         {
-            const MemInfo& info = *g_Info[plvdi->item.iItem];
+            size_t item = plvdi->item.iItem;
             int column = plvdi->item.iSubItem;
 
-            if (column == 0)
+            if (column == 0 || item >= ItemCount())
             {
                 StringCchCopy(plvdi->item.pszText, plvdi->item.cchTextMax, TEXT(""));
             }
             else
             {
-                info.columnText(plvdi->item.pszText, plvdi->item.cchTextMax, column - 1);
+                g_List->Info->columnText(RowOf(item), plvdi->item.pszText, plvdi->item.cchTextMax, ColumnIndex[column]);
             }
             return TRUE;
         }
@@ -198,17 +704,24 @@ static LRESULT ListviewWM_NOTIFY(HWND hWnd, WPARAM wParam, LPNMHDR lParam)
         // If nothing is found, then set the return value to -1.
     }
         return -1;
+    case LVN_COLUMNCLICK:
+        SortListView(hWnd, ((LPNMLISTVIEW)lParam)->iSubItem);
+        return 0;
     case  NM_CLICK:
     {
         NMITEMACTIVATE* nm = (NMITEMACTIVATE*)lParam;
 
-        if (nm->iSubItem == 0 && nm->iItem >= 0 && (size_t)nm->iItem < g_Info.size())
+        // A filtered or sorted list shows all sections, allocations are not collapsed
+        if (nm->iSubItem == 0 && nm->iItem >= 0 && (size_t)nm->iItem < g_List->Info->size() && !g_List->Indexed)
         {
-            MemInfo& info = *g_Info[nm->iItem];
-            if (info.CanExpand)
+            size_t item = nm->iItem;
+            if (g_List->Info->hasFlag(item, MemSnapshot::CanExpand))
             {
-                info.IsExpanded = !info.IsExpanded;
-                UpdateListView();
+                // The sections are shown or hidden by the worker, without reading the regions again.
+                // A running refresh does not have this click yet, it is redone when it finishes.
+                g_Toggled.push_back(g_List->Info->allocationStart(item));
+                ++g_Generation;
+                StartRefresh(hWnd, false);
             }
         }
     }
@@ -216,8 +729,13 @@ static LRESULT ListviewWM_NOTIFY(HWND hWnd, WPARAM wParam, LPNMHDR lParam)
     case NM_DBLCLK:
     {
         INT Num = ListView_GetNextItem(g_Listview, -1, LVNI_SELECTED);
-        if (Num >= 0 && (size_t)Num < g_Info.size())
-            ShowMemory(hWnd, *g_Info[Num], g_ProcessHandle, g_ProcessName);
+        if (Num >= 0 && (size_t)Num < ItemCount())
+        {
+            if (g_Snapshot)
+                ShowSnapshotMemory(hWnd, g_List->Info->at(RowOf(Num)), g_Snapshot, g_ProcessName);
+            else
+                ShowMemory(hWnd, g_List->Info->at(RowOf(Num)), g_ProcessHandle, g_ProcessName);
+        }
     }
         return TRUE;
 
@@ -233,16 +751,19 @@ static LRESULT ListviewWM_NOTIFY(HWND hWnd, WPARAM wParam, LPNMHDR lParam)
             return CDRF_NOTIFYSUBITEMDRAW;
         case CDDS_SUBITEM | CDDS_ITEMPREPAINT:
         {
-            const MemInfo& info = *g_Info[lplvcd->nmcd.dwItemSpec];
+            if (lplvcd->nmcd.dwItemSpec >= ItemCount())
+                return CDRF_DODEFAULT;
+            size_t item = RowOf(lplvcd->nmcd.dwItemSpec);
+            const MemSnapshot& Info = *g_List->Info;
 
             if (lplvcd->iSubItem == 0)
             {
-                if (info.CanExpand)
+                if (Info.hasFlag(item, MemSnapshot::CanExpand) && !g_List->Indexed)
                 {
                     RECT rc;
                     ListView_GetItemRect(g_Listview, lplvcd->nmcd.dwItemSpec, &rc, LVIR_LABEL);
                     HBRUSH hbrush = (HBRUSH)GetCurrentObject(lplvcd->nmcd.hdc, OBJ_BRUSH);
-                    DrawIconEx(lplvcd->nmcd.hdc, rc.left-3, rc.top, info.IsExpanded ? getCollapseIcon() : getExpandIcon(), 0, 0, 0, hbrush, DI_NORMAL);
+                    DrawIconEx(lplvcd->nmcd.hdc, rc.left-3, rc.top, Info.hasFlag(item, MemSnapshot::IsExpanded) ? getCollapseIcon() : getExpandIcon(), 0, 0, 0, hbrush, DI_NORMAL);
                     return CDRF_SKIPDEFAULT;
                 }
                 else
@@ -251,16 +772,16 @@ static LRESULT ListviewWM_NOTIFY(HWND hWnd, WPARAM wParam, LPNMHDR lParam)
                 }
             }
 
-            if (info.isImage())
+            if (Info.isImage(item))
                 lplvcd->clrTextBk = RGB(170, 204, 255);
-            else if (info.isMapped())
+            else if (Info.isMapped(item))
                 lplvcd->clrTextBk = RGB(255, 170, 0);
-            else if (info.isPrivate())
+            else if (Info.isPrivate(item))
                 lplvcd->clrTextBk = RGB(255, 255, 170);
             else
                 lplvcd->clrTextBk = RGB(255, 255, 255);
 
-            if (lplvcd->iSubItem > 0 && ((info.changed() & MemInfo::Index2Info(lplvcd->iSubItem-1)) != Info::None))
+            if (lplvcd->iSubItem > 0 && ((Info.changed(item) & MemInfo::Index2Info(ColumnIndex[lplvcd->iSubItem])) != Info::None))
             {
                 lplvcd->clrText = RGB(255, 0, 0);
             }
@@ -277,6 +798,96 @@ static LRESULT ListviewWM_NOTIFY(HWND hWnd, WPARAM wParam, LPNMHDR lParam)
     return DefWindowProc(hWnd, WM_NOTIFY, wParam, (LPARAM)lParam);
 }
 
+static bool SnapshotFileDialog(HWND Parent, bool Save, WCHAR* File, DWORD cchFile, LPCWSTR Title = NULL)
+{
+    OPENFILENAMEW ofn = { sizeof(ofn) };
+    ofn.hwndOwner = Parent;
+    ofn.lpstrTitle = Title;
+    ofn.lpstrFilter = L"MemView snapshots (*.mvss)\0*.mvss\0All files (*.*)\0*.*\0";
+    ofn.lpstrFile = File;
+    ofn.nMaxFile = cchFile;
+    ofn.lpstrDefExt = L"mvss";
+    if (Save)
+    {
+        ofn.Flags = OFN_OVERWRITEPROMPT | OFN_PATHMUSTEXIST | OFN_NOCHANGEDIR;
+        return !!GetSaveFileNameW(&ofn);
+    }
+    ofn.Flags = OFN_FILEMUSTEXIST | OFN_PATHMUSTEXIST | OFN_NOCHANGEDIR;
+    return !!GetOpenFileNameW(&ofn);
+}
+
+void SaveSnapshotDialog(HWND Parent)
+{
+    // A snapshot cannot be captured again, and one snapshot is written at a time
+    if (!g_ProcessHandle || g_WritingSnapshot)
+        return;
+
+    WCHAR File[MAX_PATH] = { 0 };
+    if (!SnapshotFileDialog(Parent, true, File, _countof(File)))
+        return;
+
+    // Written on a worker with its own handle, the main window keeps refreshing and can switch to another process
+    HANDLE hProcess = NULL;
+    if (!DuplicateHandle(GetCurrentProcess(), g_ProcessHandle, GetCurrentProcess(), &hProcess, 0, FALSE, DUPLICATE_SAME_ACCESS))
+        return;
+
+    g_WritingSnapshot = true;
+    g_CancelSnapshot = false;
+    Static_SetText(g_CurrentProcessNameStatic, L"Writing the snapshot...");
+    std::wstring Target = File;
+    g_SnapshotThread = std::thread([=]()
+    {
+        bool ok = WriteSnapshot(hProcess, Target.c_str(), g_CancelSnapshot);
+        CloseHandle(hProcess);
+        PostMessageW(Parent, WM_SNAPSHOT_WRITTEN, ok, 0);
+    });
+}
+
+static void HandleSnapshotWritten(HWND hwnd, bool ok)
+{
+    g_SnapshotThread.join();
+    g_WritingSnapshot = false;
+    UpdateStatic(g_CurrentProcessNameStatic);
+    if (!ok)
+        MessageBoxW(hwnd, L"Unable to write the snapshot", L"MemView", MB_OK | MB_ICONERROR);
+}
+
+void OpenSnapshotDialog(HWND Parent)
+{
+    WCHAR File[MAX_PATH] = { 0 };
+    if (!SnapshotFileDialog(Parent, false, File, _countof(File)))
+        return;
+
+    if (!OpenSnapshot(File))
+    {
+        MessageBoxW(Parent, L"Unable to open the snapshot", L"MemView", MB_OK | MB_ICONERROR);
+        return;
+    }
+
+    UpdateStatic(g_CurrentProcessNameStatic);
+    ClearListView(Parent);
+}
+
+void DiffSnapshotsDialog(HWND Parent)
+{
+    WCHAR OldFile[MAX_PATH] = { 0 }, NewFile[MAX_PATH] = { 0 };
+    if (!SnapshotFileDialog(Parent, false, OldFile, _countof(OldFile), L"Open the old snapshot") ||
+        !SnapshotFileDialog(Parent, false, NewFile, _countof(NewFile), L"Open the new snapshot"))
+    {
+        return;
+    }
+
+    std::shared_ptr<SnapshotFile> Old = SnapshotFile::open(OldFile);
+    std::shared_ptr<SnapshotFile> New = SnapshotFile::open(NewFile);
+    if (!Old || !New)
+    {
+        MessageBoxW(Parent, L"Unable to open the snapshot", L"MemView", MB_OK | MB_ICONERROR);
+        return;
+    }
+
+    ShowSnapshotDiff(Parent, Old, OldFile, New, NewFile);
+}
+
 LRESULT CALLBACK MainWndProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 {
     switch (uMsg)
@@ -293,18 +904,28 @@ LRESULT CALLBACK MainWndProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
         g_Listview = CreateWindowW(WC_LISTVIEW, L"", WS_CHILD | LVS_REPORT | WS_VISIBLE | LVS_OWNERDATA | WS_TABSTOP,
             client.left, client.top + 16, w, h, hwnd, NULL, g_hInst, NULL);
 
+        g_StatsList = CreateWindowW(WC_LISTVIEW, L"", WS_CHILD | LVS_REPORT | WS_VISIBLE | LVS_OWNERDATA | WS_TABSTOP | LVS_NOSORTHEADER,
+            client.right - kStatsWidth, client.top + 16, kStatsWidth, h, hwnd, NULL, g_hInst, NULL);
+
         g_CurrentProcessNameStatic = CreateWindowW(WC_STATIC, L"", WS_CHILD | WS_OVERLAPPED | WS_VISIBLE | SS_NOTIFY | SS_SUNKEN,
             client.left, client.top, w - 16, 16, hwnd, NULL, g_hInst, 0);
 
         g_AboutStatic = CreateWindowW(WC_STATIC, L"?", WS_CHILD | WS_OVERLAPPED | WS_VISIBLE | SS_NOTIFY | SS_SUNKEN | SS_CENTER,
             client.right - 16, client.top, 16, 16, hwnd, NULL, g_hInst, 0);
 
+        g_FilterEdit = CreateWindowW(WC_EDIT, L"", WS_CHILD | WS_VISIBLE | WS_TABSTOP | WS_BORDER | ES_AUTOHSCROLL,
+            client.right - 16 - kFilterWidth, client.top, kFilterWidth, 16, hwnd, NULL, g_hInst, 0);
+
 
         ListView_SetExtendedListViewStyle(g_Listview, ListView_GetExtendedListViewStyle(g_Listview) | LVS_EX_FULLROWSELECT | LVS_EX_DOUBLEBUFFER);
 
         SetWindowFont(g_CurrentProcessNameStatic, getFont(), FALSE);
         SetWindowFont(g_AboutStatic, getFont(), FALSE);
+        SetWindowFont(g_FilterEdit, getFont(), FALSE);
+        Edit_SetCueBannerText(g_FilterEdit, L"Filter, for example: type==priv && prot contains W && size>1M");
         SetWindowFont(g_Listview, getFont(), FALSE);
+        SetWindowFont(g_StatsList, getFont(), FALSE);
+        ListView_SetExtendedListViewStyle(g_StatsList, ListView_GetExtendedListViewStyle(g_StatsList) | LVS_EX_FULLROWSELECT | LVS_EX_DOUBLEBUFFER);
 
         UpdateStatic(g_CurrentProcessNameStatic);
 
@@ -330,6 +951,16 @@ LRESULT CALLBACK MainWndProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
         }
         ListView_SetColumnWidth(g_Listview, _countof(Columns) - 1, LVSCW_AUTOSIZE_USEHEADER);
 
+        for (size_t n = 0; n < _countof(StatColumns); ++n)
+        {
+            lvc.mask = LVCF_FMT | LVCF_WIDTH | LVCF_TEXT | LVCF_SUBITEM;
+            lvc.iSubItem = (int)n;
+            lvc.cx = StatSizes[n];
+            lvc.fmt = n == 0 ? LVCFMT_LEFT : LVCFMT_RIGHT;
+            lvc.pszText = StatColumns[n];
+            ListView_InsertColumn(g_StatsList, n, &lvc);
+        }
+
         HWND header = ListView_GetHeader(g_Listview);
         HDITEMW hdi = {0};
         hdi.mask = HDI_FORMAT;
@@ -337,9 +968,10 @@ LRESULT CALLBACK MainWndProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
         hdi.fmt |= HDF_FIXEDWIDTH;
         Header_SetItem(header, 0, &hdi);
 
-        UpdateListView();
+        RestartRefresh(hwnd);
+        PrefetchProcessList();
         SetFocus(g_Listview);
-        SetTimer(hwnd, 0x1337, 1000, NULL);
+        ScheduleRefresh(hwnd, GetProcessId(g_ProcessHandle));
     }
     return 0;
 
@@ -349,13 +981,18 @@ LRESULT CALLBACK MainWndProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
     }
     return 0;
 
-    case WM_TIMER:
-        if (wParam == 0x1337)
-        {
-            UpdateListView();
-            return TRUE;
-        }
-        break;
+    case WM_SCHEDULED_REFRESH:
+        // The process can change between refreshes, a snapshot is not refreshed together with any process
+        ScheduleRefresh(hwnd, g_Snapshot ? 0 : GetProcessId(g_ProcessHandle));
+        StartRefresh(hwnd);
+        PrefetchProcessList();
+        return TRUE;
+    case WM_REFRESH_DONE:
+        HandleRefreshDone(hwnd);
+        return 0;
+    case WM_SNAPSHOT_WRITTEN:
+        HandleSnapshotWritten(hwnd, wParam != 0);
+        return 0;
     case WM_COMMAND:
         if ((HWND)lParam == g_CurrentProcessNameStatic && HIWORD(wParam) == STN_CLICKED)
         {
@@ -369,7 +1006,7 @@ LRESULT CALLBACK MainWndProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
                 UpdateStatic(g_CurrentProcessNameStatic);
 
                 // Immediately update list of modules,
-                UpdateListView();
+                ClearListView(hwnd);
             }
         }
         else if ((HWND)lParam == g_AboutStatic && HIWORD(wParam) == STN_CLICKED)
@@ -377,6 +1014,20 @@ LRESULT CALLBACK MainWndProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
             PostMessageW(hwnd, WM_KEYUP, VK_F1, 0);
             //if (Msg.message == WM_KEYUP && Msg.wParam == VK_F1)
         }
+        else if ((HWND)lParam == g_FilterEdit && HIWORD(wParam) == EN_CHANGE)
+        {
+            ApplyFilter(hwnd);
+        }
+        break;
+
+    case WM_CTLCOLOREDIT:
+        if ((HWND)lParam == g_FilterEdit && g_FilterInvalid)
+        {
+            HDC hdc = (HDC)wParam;
+            SetTextColor(hdc, RGB(255, 0, 0));
+            SetBkColor(hdc, GetSysColor(COLOR_WINDOW));
+            return (LRESULT)GetSysColorBrush(COLOR_WINDOW);
+        }
         break;
 
     case WM_SETCURSOR:
@@ -391,12 +1042,29 @@ LRESULT CALLBACK MainWndProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
     case WM_NOTIFY:
         if (((LPNMHDR)lParam)->hwndFrom == g_Listview)
             return ListviewWM_NOTIFY(hwnd, wParam, (LPNMHDR)lParam);
+        if (((LPNMHDR)lParam)->hwndFrom == g_StatsList && ((LPNMHDR)lParam)->code == LVN_GETDISPINFO)
+        {
+            NMLVDISPINFO* plvdi = (NMLVDISPINFO*)lParam;
+            size_t item = plvdi->item.iItem;
+            if ((plvdi->item.mask & LVIF_TEXT) && item < g_StatRows.size())
+                StatText(g_StatRows[item], plvdi->item.iSubItem, plvdi->item.pszText, plvdi->item.cchTextMax);
+            return TRUE;
+        }
         break;
 
     case WM_DESTROY:
-        KillTimer(hwnd, 0x1337);
+        UnscheduleRefresh(hwnd);
+        StopRefreshWorker();
+        StopProcessList();
+        // Do not wait for the rest of a capture to reach the disk
+        g_CancelSnapshot = true;
+        if (g_SnapshotThread.joinable())
+            g_SnapshotThread.join();
         DestroyWindow(g_Listview);
+        DestroyWindow(g_StatsList);
         DestroyWindow(g_CurrentProcessNameStatic);
+        DestroyWindow(g_FilterEdit);
+        g_FilterEdit = NULL;
         PostQuitMessage(0);
         return 0;
 
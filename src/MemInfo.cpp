@@ -10,26 +10,31 @@
 #include "MemInfo.h"
 #include <winternl.h>
 #include <unordered_map>
+#include <mutex>
+#include <algorithm>
 
 
 static LPSYSTEM_INFO g_Info = nullptr;
 
-// FIXME: See PhpUpdateMemoryRegionTypes
-static std::unordered_map<PVOID, std::wstring> g_KnownRegions;
+// The known regions of the process shown in the main window
+static KnownRegions g_KnownRegions;
+// The region list is read on a worker, while a process switch fills g_KnownRegions again
+static std::mutex g_KnownRegionsLock;
 static decltype(NtQueryInformationProcess)* g_NtQueryInformationProcess;
 
-void MemInfo_InitProcess(HANDLE hProcess)
+// FIXME: See PhpUpdateMemoryRegionTypes
+void KnownRegions::init(HANDLE hProcess)
 {
     PROCESS_BASIC_INFORMATION pbi;
     NTSTATUS Status;
 
-    g_KnownRegions.clear();
+    mNames.clear();
 #if _WIN64
-    g_KnownRegions[(PVOID)0xFFFFF78000000000] = L"SharedUserData [W]";
+    mNames[(PVOID)0xFFFFF78000000000] = MappedName::intern(L"SharedUserData [W]");
 #else
-    g_KnownRegions[(PVOID)0xFFDF0000] = L"SharedUserData [W]";
+    mNames[(PVOID)0xFFDF0000] = MappedName::intern(L"SharedUserData [W]");
 #endif
-    g_KnownRegions[(PVOID)0x7FFE0000] = L"SharedUserData [R]";
+    mNames[(PVOID)0x7FFE0000] = MappedName::intern(L"SharedUserData [R]");
 
     if (g_NtQueryInformationProcess == nullptr)
     {
@@ -39,10 +44,25 @@ void MemInfo_InitProcess(HANDLE hProcess)
     Status = g_NtQueryInformationProcess(hProcess, ProcessBasicInformation, &pbi, sizeof(pbi), NULL);
     if (NT_SUCCESS(Status))
     {
-        g_KnownRegions[pbi.PebBaseAddress] = L"PEB";
+        mNames[pbi.PebBaseAddress] = MappedName::intern(L"PEB");
     }
 }
 
+MappedName KnownRegions::find(PVOID Address) const
+{
+    auto it = mNames.find(Address);
+    return it != mNames.end() ? it->second : MappedName();
+}
+
+void MemInfo_InitProcess(HANDLE hProcess)
+{
+    KnownRegions Known;
+    Known.init(hProcess);
+
+    std::lock_guard<std::mutex> lock(g_KnownRegionsLock);
+    g_KnownRegions = Known;
+}
+
 const wchar_t* Prot2Str(DWORD prot)
 {
     switch (prot & 0x1ff)
@@ -85,14 +105,102 @@ Info operator& (const Info& left, const Info& right)
     return static_cast<Info>(static_cast<int>(left) & static_cast<int>(right));
 }
 
+struct MappedName::Entry
+{
+    const std::wstring* Name;
+    volatile LONG Refs;
+};
+
+// Intentionally never destroyed, names can still be released from other static destructors
+static std::unordered_map<std::wstring, MappedName::Entry>& g_Names = *new std::unordered_map<std::wstring, MappedName::Entry>();
+// Regions are enumerated from several threads, the lock guards g_Names and the last reference of a name
+static std::mutex& g_NamesLock = *new std::mutex();
+
+MappedName::MappedName(const MappedName& other)
+    :mEntry(other.mEntry)
+{
+    // We hold a reference through other, so the entry cannot go away meanwhile
+    if (mEntry)
+        InterlockedIncrement(&mEntry->Refs);
+}
+
+MappedName::~MappedName()
+{
+    if (!mEntry)
+        return;
+
+    // Dropping a reference that is not the last one does not need the lock
+    for (LONG Refs = mEntry->Refs; Refs > 1; Refs = mEntry->Refs)
+    {
+        if (InterlockedCompareExchange(&mEntry->Refs, Refs - 1, Refs) == Refs)
+            return;
+    }
+
+    // intern can hand out the name again until the lock is taken
+    std::lock_guard<std::mutex> lock(g_NamesLock);
+    if (InterlockedDecrement(&mEntry->Refs) == 0)
+    {
+        // The last region using this name is gone
+        g_Names.erase(g_Names.find(*mEntry->Name));
+    }
+}
+
+MappedName& MappedName::operator=(const MappedName& other)
+{
+    if (mEntry != other.mEntry)
+    {
+        MappedName tmp(other);
+        std::swap(mEntry, tmp.mEntry);
+    }
+    return *this;
+}
+
+MappedName MappedName::intern(const wchar_t* name)
+{
+    std::lock_guard<std::mutex> lock(g_NamesLock);
+
+    // Re-use the key buffer, so looking up a known name does not allocate
+    static std::wstring key;
+    key.assign(name);
+
+    auto it = g_Names.find(key);
+    if (it == g_Names.end())
+    {
+        it = g_Names.emplace(key, Entry()).first;
+        it->second.Name = &it->first;
+        it->second.Refs = 0;
+    }
+    InterlockedIncrement(&it->second.Refs);
+    return MappedName(&it->second);
+}
+
+size_t MappedName::poolUsage()
+{
+    std::lock_guard<std::mutex> lock(g_NamesLock);
+    // Every name is a node of the map, with a buffer of its own when it does not fit in the string
+    const size_t Inline = std::wstring().capacity();
+    size_t Bytes = g_Names.bucket_count() * sizeof(void*);
+    for (const auto& it : g_Names)
+    {
+        Bytes += sizeof(it) + sizeof(void*);
+        if (it.first.capacity() > Inline)
+            Bytes += (it.first.capacity() + 1) * sizeof(wchar_t);
+    }
+    return Bytes;
+}
+
+const wchar_t* MappedName::c_str() const
+{
+    return mEntry ? mEntry->Name->c_str() : L"";
+}
+
 MemInfo::MemInfo()
 {
     memset(&mInfo, 0, sizeof(mInfo));
-    mChanged = Info::None;
 }
 
-MemInfo::MemInfo(const MEMORY_BASIC_INFORMATION& info)
-    :mInfo(info), mChanged(Info::Address | Info::Size | Info::Type | Info::Protection | Info::AllocationProtection | Info::Mapped)
+MemInfo::MemInfo(const MEMORY_BASIC_INFORMATION& info, const MappedName& mapped)
+    :mInfo(info), mMapped(mapped)
 {
 }
 
@@ -105,64 +213,248 @@ Info MemInfo::Index2Info(int index)
     return static_cast<Info>(1 << index);
 }
 
-void MemInfo::columnText(__out_ecount(cchDest) STRSAFE_LPWSTR pszDest, __in size_t cchDest, int Index) const
+void MemSnapshot::clear()
+{
+    mBase.clear();
+    mSize.clear();
+    mAllocationBase.clear();
+    mProtect.clear();
+    mAllocationProtect.clear();
+    mState.clear();
+    mType.clear();
+    mMapped.clear();
+    mResident.clear();
+    mPrivateResident.clear();
+    mSharedResident.clear();
+    mChanged.clear();
+    mFlags.clear();
+}
+
+void MemSnapshot::reserve(size_t count)
+{
+    mBase.reserve(count);
+    mSize.reserve(count);
+    mAllocationBase.reserve(count);
+    mProtect.reserve(count);
+    mAllocationProtect.reserve(count);
+    mState.reserve(count);
+    mType.reserve(count);
+    mMapped.reserve(count);
+    mResident.reserve(count);
+    mPrivateResident.reserve(count);
+    mSharedResident.reserve(count);
+    mChanged.reserve(count);
+    mFlags.reserve(count);
+}
+
+size_t MemSnapshot::memoryUsage() const
+{
+    return mBase.capacity() * sizeof(PBYTE) + mSize.capacity() * sizeof(SIZE_T) + mAllocationBase.capacity() * sizeof(PBYTE) +
+        (mProtect.capacity() + mAllocationProtect.capacity() + mState.capacity() + mType.capacity()) * sizeof(DWORD) +
+        mMapped.capacity() * sizeof(MappedName) +
+        (mResident.capacity() + mPrivateResident.capacity() + mSharedResident.capacity()) * sizeof(SIZE_T) +
+        mChanged.capacity() * sizeof(Info) + mFlags.capacity();
+}
+
+void MemSnapshot::swap(MemSnapshot& other)
+{
+    mBase.swap(other.mBase);
+    mSize.swap(other.mSize);
+    mAllocationBase.swap(other.mAllocationBase);
+    mProtect.swap(other.mProtect);
+    mAllocationProtect.swap(other.mAllocationProtect);
+    mState.swap(other.mState);
+    mType.swap(other.mType);
+    mMapped.swap(other.mMapped);
+    mResident.swap(other.mResident);
+    mPrivateResident.swap(other.mPrivateResident);
+    mSharedResident.swap(other.mSharedResident);
+    mChanged.swap(other.mChanged);
+    mFlags.swap(other.mFlags);
+}
+
+void MemSnapshot::push_back(const MEMORY_BASIC_INFORMATION& info, const MappedName& mapped)
+{
+    mBase.push_back(static_cast<PBYTE>(info.BaseAddress));
+    mSize.push_back(info.RegionSize);
+    mAllocationBase.push_back(static_cast<PBYTE>(info.AllocationBase));
+    mProtect.push_back(info.Protect);
+    mAllocationProtect.push_back(info.AllocationProtect);
+    mState.push_back(info.State);
+    mType.push_back(info.Type);
+    mMapped.push_back(mapped);
+    mResident.push_back(0);
+    mPrivateResident.push_back(0);
+    mSharedResident.push_back(0);
+    mChanged.push_back(Info::Address | Info::Size | Info::Type | Info::Protection | Info::AllocationProtection | Info::Mapped);
+    mFlags.push_back(0);
+}
+
+void MemSnapshot::push_back(const MemSnapshot& other, size_t n)
+{
+    mBase.push_back(other.mBase[n]);
+    mSize.push_back(other.mSize[n]);
+    mAllocationBase.push_back(other.mAllocationBase[n]);
+    mProtect.push_back(other.mProtect[n]);
+    mAllocationProtect.push_back(other.mAllocationProtect[n]);
+    mState.push_back(other.mState[n]);
+    mType.push_back(other.mType[n]);
+    mMapped.push_back(other.mMapped[n]);
+    mResident.push_back(other.mResident[n]);
+    mPrivateResident.push_back(other.mPrivateResident[n]);
+    mSharedResident.push_back(other.mSharedResident[n]);
+    mChanged.push_back(other.mChanged[n]);
+    mFlags.push_back(other.mFlags[n]);
+}
+
+MemInfo MemSnapshot::at(size_t n) const
 {
-    Info type = Index2Info(Index);
+    MEMORY_BASIC_INFORMATION mbi;
+    mbi.BaseAddress = mBase[n];
+    mbi.AllocationBase = mAllocationBase[n];
+    mbi.AllocationProtect = mAllocationProtect[n];
+    mbi.RegionSize = mSize[n];
+    mbi.State = mState[n];
+    mbi.Protect = mProtect[n];
+    mbi.Type = mType[n];
+    return MemInfo(mbi, mMapped[n]);
+}
+
+void MemSnapshot::columnText(size_t n, __out_ecount(cchDest) STRSAFE_LPWSTR pszDest, __in size_t cchDest, int Index) const
+{
+    Info type = MemInfo::Index2Info(Index);
     LPCWSTR TypeName;
     switch (type)
     {
     case Info::Address:
         // Indent sections
-        StringCchPrintf(pszDest, cchDest, TEXT("%s%p"), start() == allocationStart() ? TEXT("") : TEXT(" "), mInfo.BaseAddress);
+        StringCchPrintf(pszDest, cchDest, TEXT("%s%p"), start(n) == allocationStart(n) ? TEXT("") : TEXT(" "), start(n));
         break;
     case Info::Size:
-        StringCchPrintf(pszDest, cchDest, TEXT("%08x"), mInfo.RegionSize);
+        StringCchPrintf(pszDest, cchDest, TEXT("%08x"), regionSize(n));
         break;
     case Info::Type:
-        if (isImage())
+        if (isImage(n))
             TypeName = L"Imag";
-        else if (isMapped())
+        else if (isMapped(n))
             TypeName = L"Map";
-        else if (isPrivate())
+        else if (isPrivate(n))
             TypeName = L"Priv";
         else
             TypeName = L"Other";
         StringCchCopy(pszDest, cchDest, TypeName);
         break;
     case Info::Protection:
-        StringCchCopy(pszDest, cchDest, mInfo.State != MEM_RESERVE ? Prot2Str(mInfo.Protect) : L"");
+        StringCchCopy(pszDest, cchDest, mState[n] != MEM_RESERVE ? Prot2Str(mProtect[n]) : L"");
         break;
     case Info::AllocationProtection:
-        StringCchCopy(pszDest, cchDest, Prot2Str(mInfo.AllocationProtect));
+        StringCchCopy(pszDest, cchDest, Prot2Str(mAllocationProtect[n]));
         break;
     case Info::Mapped:
-        StringCchCopy(pszDest, cchDest, mMapped.c_str());
+        StringCchCopy(pszDest, cchDest, mMapped[n].c_str());
+        break;
+    case Info::Resident:
+    case Info::PrivateResident:
+    case Info::SharedResident:
+    case Info::NotResident:
+    {
+        SIZE_T Bytes = type == Info::Resident ? resident(n) : type == Info::PrivateResident ? privateResident(n) :
+            type == Info::SharedResident ? sharedResident(n) : notResident(n);
+        if (Bytes)
+            StringCchPrintf(pszDest, cchDest, TEXT("%Iu K"), Bytes / 1024);
+        else
+            StringCchCopy(pszDest, cchDest, TEXT(""));
+    }
         break;
     }
 }
 
-int MemInfo::cmp(const MemInfo& info) const
+int MemSnapshot::cmp(size_t n, const MemSnapshot& other, size_t o) const
 {
-    return info.mInfo.BaseAddress == mInfo.BaseAddress ? 0 : ((mInfo.BaseAddress < info.mInfo.BaseAddress) ? -1 : 1);
+    return other.mBase[o] == mBase[n] ? 0 : ((mBase[n] < other.mBase[o]) ? -1 : 1);
 }
 
-void MemInfo::update(const MemInfo& info)
+Info MemSnapshot::compare(size_t n, const MemSnapshot& other, size_t o) const
 {
-    mChanged = (mChanged != Info::None && mChanged != Info::Color ) ?  Info::Color : Info::None;
-    if (info.mInfo.BaseAddress != mInfo.BaseAddress) mChanged |= Info::Address;
-    if (info.mInfo.RegionSize != mInfo.RegionSize) mChanged |= Info::Size;
-    if (info.mInfo.Type != mInfo.Type) mChanged |= Info::Type;
-    if (info.mInfo.Protect != mInfo.Protect) mChanged |= Info::Protection;
-    if (info.mInfo.AllocationProtect != mInfo.AllocationProtect) mChanged |= Info::AllocationProtection;
-    if (info.mMapped != mMapped) mChanged |= Info::Mapped;
-    mInfo = info.mInfo;
-    mMapped = info.mMapped;
+    Info changed = Info::None;
+    if (other.mBase[o] != mBase[n]) changed |= Info::Address;
+    if (other.mSize[o] != mSize[n]) changed |= Info::Size;
+    if (other.mType[o] != mType[n]) changed |= Info::Type;
+    if (other.mProtect[o] != mProtect[n]) changed |= Info::Protection;
+    if (other.mAllocationProtect[o] != mAllocationProtect[n]) changed |= Info::AllocationProtection;
+    if (other.mMapped[o] != mMapped[n]) changed |= Info::Mapped;
+    return changed;
 }
 
+void MemSnapshot::update(size_t n, const MemSnapshot& other, size_t o)
+{
+    Info changed = (mChanged[n] != Info::None && mChanged[n] != Info::Color ) ?  Info::Color : Info::None;
+    changed |= compare(n, other, o);
+    mChanged[n] = changed;
+    mBase[n] = other.mBase[o];
+    mSize[n] = other.mSize[o];
+    mAllocationBase[n] = other.mAllocationBase[o];
+    mProtect[n] = other.mProtect[o];
+    mAllocationProtect[n] = other.mAllocationProtect[o];
+    mState[n] = other.mState[o];
+    mType[n] = other.mType[o];
+    mMapped[n] = other.mMapped[o];
+    mResident[n] = other.mResident[o];
+    mPrivateResident[n] = other.mPrivateResident[o];
+    mSharedResident[n] = other.mSharedResident[o];
+}
 
-void MemInfo::read(HANDLE hProcess, std::vector<std::unique_ptr<MemInfo>>& items)
+bool MemSnapshot::readWorkingSet(HANDLE hProcess, std::vector<ULONG_PTR>& Buffer)
 {
-    items.clear();
+    mResident.assign(size(), 0);
+    mPrivateResident.assign(size(), 0);
+    mSharedResident.assign(size(), 0);
+    if (!g_Info)
+        return false;
+
+    // Only the resident pages are returned, the first entry is the number of pages
+    if (Buffer.size() < 2)
+        Buffer.resize(64 * 1024);
+    while (!QueryWorkingSet(hProcess, Buffer.data(), (DWORD)(Buffer.size() * sizeof(ULONG_PTR))))
+    {
+        if (GetLastError() != ERROR_BAD_LENGTH)
+            return false;
+        // The working set can grow before the next call
+        Buffer.resize(Buffer[0] + Buffer[0] / 8 + 1024);
+    }
+
+    // Each entry is the page address with flags in the bits below the page size (PSAPI_WORKING_SET_BLOCK).
+    // Sorted, the pages are matched with the regions in a single pass.
+    ULONG_PTR* Pages = Buffer.data() + 1;
+    ULONG_PTR* PagesEnd = Pages + std::min<size_t>(Buffer[0], Buffer.size() - 1);
+    std::sort(Pages, PagesEnd);
+
+    const SIZE_T PageSize = g_Info->dwPageSize;
+    size_t n = 0;
+    for (ULONG_PTR* Page = Pages; Page != PagesEnd && n < size(); ++Page)
+    {
+        PBYTE Address = (PBYTE)(*Page & ~(ULONG_PTR)(PageSize - 1));
+        while (n < size() && mBase[n] + mSize[n] <= Address)
+            ++n;
+        if (n == size() || Address < mBase[n])
+            continue;
+
+        mResident[n] += PageSize;
+        bool Shared = (*Page & (1 << 8)) != 0;
+        ULONG_PTR ShareCount = (*Page >> 5) & 7;
+        if (!Shared)
+            mPrivateResident[n] += PageSize;
+        else if (ShareCount > 1)
+            mSharedResident[n] += PageSize;
+    }
+    return true;
+}
+
+
+template<typename Lookup>
+static void ReadRegions(HANDLE hProcess, MemSnapshot& snapshot, Lookup FindKnown)
+{
+    snapshot.clear();
 
     if (!g_Info)
     {
@@ -173,6 +465,11 @@ void MemInfo::read(HANDLE hProcess, std::vector<std::unique_ptr<MemInfo>>& items
             delete info;
     }
 
+    // All regions of one allocation are backed by the same file (or by none),
+    // so the mapped name is only queried once for the first region of an allocation.
+    PVOID lastAllocation = nullptr;
+    MappedName lastMapped;
+
     for (PBYTE addr = (PBYTE)g_Info->lpMinimumApplicationAddress; addr < g_Info->lpMaximumApplicationAddress;)
     {
         MEMORY_BASIC_INFORMATION mbi = { 0 };
@@ -181,23 +478,34 @@ void MemInfo::read(HANDLE hProcess, std::vector<std::unique_ptr<MemInfo>>& items
         {
             if (mbi.State != MEM_FREE)
             {
-                items.push_back(std::unique_ptr<MemInfo>(new MemInfo(mbi)));
-                DWORD num = GetMappedFileName(hProcess, mbi.BaseAddress, buf, _countof(buf));
-                if (num != 0)
+                if (lastMapped.empty() || mbi.AllocationBase != lastAllocation)
                 {
-                    items.back()->mMapped = buf;
+                    lastMapped = MappedName();
+                    // Private memory is never backed by a file
+                    DWORD num = mbi.Type != MEM_PRIVATE ? GetMappedFileName(hProcess, mbi.BaseAddress, buf, _countof(buf)) : 0;
+                    if (num != 0)
+                    {
+                        lastMapped = MappedName::intern(buf);
+                        lastAllocation = mbi.AllocationBase;
+                        snapshot.push_back(mbi, lastMapped);
+                    }
+                    else
+                    {
+                        snapshot.push_back(mbi, FindKnown(mbi.BaseAddress));
+                    }
                 }
                 else
                 {
-                    auto it = g_KnownRegions.find(mbi.BaseAddress);
-                    if (it != g_KnownRegions.end())
-                    {
-                        items.back()->mMapped = it->second;
-                    }
+                    snapshot.push_back(mbi, lastMapped);
                 }
             }
             addr = (PBYTE)mbi.BaseAddress + mbi.RegionSize;
         }
+        else if (GetLastError() == ERROR_INVALID_HANDLE)
+        {
+            // Without a process every address fails, do not walk the address space page by page
+            return;
+        }
         else
         {
             addr += g_Info->dwPageSize;
@@ -205,3 +513,17 @@ void MemInfo::read(HANDLE hProcess, std::vector<std::unique_ptr<MemInfo>>& items
     }
 }
 
+void MemSnapshot::read(HANDLE hProcess, MemSnapshot& snapshot)
+{
+    ReadRegions(hProcess, snapshot, [](PVOID Address)
+    {
+        std::lock_guard<std::mutex> lock(g_KnownRegionsLock);
+        return g_KnownRegions.find(Address);
+    });
+}
+
+void MemSnapshot::read(HANDLE hProcess, MemSnapshot& snapshot, const KnownRegions& Known)
+{
+    ReadRegions(hProcess, snapshot, [&Known](PVOID Address) { return Known.find(Address); });
+}
+
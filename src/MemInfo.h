@@ -9,6 +9,7 @@
 
 #include <vector>
 #include <memory>
+#include <unordered_map>
 
 enum class Info
 {
@@ -19,6 +20,11 @@ enum class Info
     Protection = (1 << 3),
     AllocationProtection = (1 << 4),
     Mapped = (1 << 5),
+    // Working set columns, never marked as changed
+    Resident = (1 << 6),
+    PrivateResident = (1 << 7),
+    SharedResident = (1 << 8),
+    NotResident = (1 << 9),
 
     Color = (1<<31),
 };
@@ -27,37 +33,148 @@ Info& operator|= (Info& left, const Info& right);
 Info operator| (const Info& left, const Info& right);
 Info operator& (const Info& left, const Info& right);
 
+const wchar_t* Prot2Str(DWORD prot);
+
+// Mapped file names are interned, so all regions of one mapping share a single string.
+// Names are compared by pointer, and freed when the last region referencing them is gone.
+class MappedName
+{
+public:
+    MappedName() : mEntry(nullptr) {}
+    MappedName(const MappedName& other);
+    ~MappedName();
+    MappedName& operator=(const MappedName& other);
+
+    static MappedName intern(const wchar_t* name);
+    // Bytes taken by all interned names
+    static size_t poolUsage();
+
+    const wchar_t* c_str() const;
+    bool empty() const { return mEntry == nullptr; }
+    bool operator==(const MappedName& other) const { return mEntry == other.mEntry; }
+    bool operator!=(const MappedName& other) const { return mEntry != other.mEntry; }
+
+    struct Entry;
+private:
+    explicit MappedName(Entry* entry) : mEntry(entry) {}
+
+    Entry* mEntry;
+};
+
+// A copy of a single region, used by windows that outlive a refresh of the region list
 class MemInfo
 {
 public:
     MemInfo();
+    MemInfo(const MEMORY_BASIC_INFORMATION& info, const MappedName& mapped);
     ~MemInfo();
 
-    void columnText(__out_ecount(cchDest) STRSAFE_LPWSTR pszDest, __in size_t cchDest, int Index) const;
-    Info changed() const { return mChanged; }
-
-    int cmp(const MemInfo& info) const;
-    void update(const MemInfo& info);
-
     static Info Index2Info(int index);
-    static void read(HANDLE hProcess, std::vector<std::unique_ptr<MemInfo>>& items);
 
     PBYTE start() const { return static_cast<PBYTE>(mInfo.BaseAddress); }
     SIZE_T size() const { return mInfo.RegionSize; }
     PBYTE allocationStart() const { return static_cast<PBYTE>(mInfo.AllocationBase); }
+    const MappedName& mapped() const { return mMapped; }
 
     bool isImage() const { return mInfo.Type == MEM_IMAGE; }
     bool isMapped() const { return mInfo.Type == MEM_MAPPED; }
     bool isPrivate() const { return mInfo.Type == MEM_PRIVATE; }
 
-    bool CanExpand = false;
-    bool IsExpanded = false;
-
 protected:
-    MemInfo(const MEMORY_BASIC_INFORMATION& info);
-
     MEMORY_BASIC_INFORMATION mInfo;
-    std::wstring mMapped;
-    Info mChanged;
+    MappedName mMapped;
+};
+
+// Names of regions that are not backed by a file, like the PEB of one process
+class KnownRegions
+{
+public:
+    void init(HANDLE hProcess);
+    MappedName find(PVOID Address) const;
+
+private:
+    std::unordered_map<PVOID, MappedName> mNames;
+};
+
+// All regions of a process, stored column-wise and sorted by address.
+// Clearing a snapshot keeps the storage of all columns, so snapshots that are
+// recycled between refreshes stop allocating once they have grown large enough.
+class MemSnapshot
+{
+public:
+    enum Flags : BYTE
+    {
+        CanExpand = (1 << 0),
+        IsExpanded = (1 << 1),
+    };
+
+    size_t size() const { return mBase.size(); }
+    bool empty() const { return mBase.empty(); }
+    void clear();
+    void reserve(size_t count);
+    void swap(MemSnapshot& other);
+    // Bytes allocated for all columns
+    size_t memoryUsage() const;
+
+    // Add a newly discovered region, all fields are marked as changed
+    void push_back(const MEMORY_BASIC_INFORMATION& info, const MappedName& mapped);
+    // Copy row n of another snapshot, including the changed and expand state
+    void push_back(const MemSnapshot& other, size_t n);
+
+    void columnText(size_t n, __out_ecount(cchDest) STRSAFE_LPWSTR pszDest, __in size_t cchDest, int Index) const;
+    Info changed(size_t n) const { return mChanged[n]; }
+    void setChanged(size_t n, Info changed) { mChanged[n] = changed; }
+
+    int cmp(size_t n, const MemSnapshot& other, size_t o) const;
+    // The fields of row n that differ from row o of other
+    Info compare(size_t n, const MemSnapshot& other, size_t o) const;
+    void update(size_t n, const MemSnapshot& other, size_t o);
+
+    // Regions without a file are named from the known regions of the process opened by MemInfo_InitProcess
+    static void read(HANDLE hProcess, MemSnapshot& snapshot);
+    static void read(HANDLE hProcess, MemSnapshot& snapshot, const KnownRegions& Known);
+    // Fill the working set columns from one query of the working set of hProcess,
+    // Buffer is scratch space that can be reused between calls
+    bool readWorkingSet(HANDLE hProcess, std::vector<ULONG_PTR>& Buffer);
+
+    MemInfo at(size_t n) const;
+
+    PBYTE start(size_t n) const { return mBase[n]; }
+    SIZE_T regionSize(size_t n) const { return mSize[n]; }
+    PBYTE allocationStart(size_t n) const { return mAllocationBase[n]; }
+    DWORD protect(size_t n) const { return mProtect[n]; }
+    DWORD allocationProtect(size_t n) const { return mAllocationProtect[n]; }
+    DWORD state(size_t n) const { return mState[n]; }
+    DWORD type(size_t n) const { return mType[n]; }
+    const MappedName& mapped(size_t n) const { return mMapped[n]; }
+    // Bytes in the working set, and the part of it that is private or shared with another process.
+    // Pages of a mapping that no other process uses are neither.
+    SIZE_T resident(size_t n) const { return mResident[n]; }
+    SIZE_T privateResident(size_t n) const { return mPrivateResident[n]; }
+    SIZE_T sharedResident(size_t n) const { return mSharedResident[n]; }
+    // Committed, but paged out or never touched
+    SIZE_T notResident(size_t n) const { return mState[n] == MEM_COMMIT ? mSize[n] - mResident[n] : 0; }
+
+    bool isImage(size_t n) const { return mType[n] == MEM_IMAGE; }
+    bool isMapped(size_t n) const { return mType[n] == MEM_MAPPED; }
+    bool isPrivate(size_t n) const { return mType[n] == MEM_PRIVATE; }
+
+    bool hasFlag(size_t n, Flags flag) const { return (mFlags[n] & flag) != 0; }
+    void setFlag(size_t n, Flags flag, bool set) { mFlags[n] = (BYTE)(set ? (mFlags[n] | flag) : (mFlags[n] & ~flag)); }
+
+protected:
+    std::vector<PBYTE> mBase;
+    std::vector<SIZE_T> mSize;
+    std::vector<PBYTE> mAllocationBase;
+    std::vector<DWORD> mProtect;
+    std::vector<DWORD> mAllocationProtect;
+    std::vector<DWORD> mState;
+    std::vector<DWORD> mType;
+    std::vector<MappedName> mMapped;
+    std::vector<SIZE_T> mResident;
+    std::vector<SIZE_T> mPrivateResident;
+    std::vector<SIZE_T> mSharedResident;
+    std::vector<Info> mChanged;
+    std::vector<BYTE> mFlags;
 };
 
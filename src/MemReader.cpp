@@ -0,0 +1,68 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     Fault tolerant reading of another process's memory
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#include "MemView.h"
+#include "MemReader.h"
+#include "ByteDiff.h"
+
+static SIZE_T g_PageSize;
+
+SIZE_T PageSize()
+{
+    if (!g_PageSize)
+    {
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        g_PageSize = si.dwPageSize;
+    }
+    return g_PageSize;
+}
+
+static SIZE_T ReadRange(HANDLE hProcess, const BYTE* Address, BYTE* Buffer, SIZE_T Offset, SIZE_T Length, DWORD* Valid)
+{
+    SIZE_T Read = 0;
+    if (ReadProcessMemory(hProcess, Address + Offset, Buffer + Offset, Length, &Read) && Read == Length)
+    {
+        SetMaskRange(Valid, Offset, Offset + Length, true);
+        return Length;
+    }
+
+    // A partial copy stops at the first page that could not be read
+    if (Read > Length)
+        Read = 0;
+    SetMaskRange(Valid, Offset, Offset + Read, true);
+    Offset += Read;
+    Length -= Read;
+
+    const SIZE_T Page = PageSize();
+    ULONG_PTR First = (ULONG_PTR)(Address + Offset);
+    ULONG_PTR FirstPageEnd = (First | (Page - 1)) + 1;
+    if (First + Length <= FirstPageEnd)
+    {
+        // Nothing left to split, this page is not readable
+        SetMaskRange(Valid, Offset, Offset + Length, false);
+        return Read;
+    }
+
+    // Split on the page boundary closest to the middle, and retry both halves
+    ULONG_PTR Middle = (First + Length / 2) & ~(ULONG_PTR)(Page - 1);
+    if (Middle <= First)
+        Middle = FirstPageEnd;
+    SIZE_T Left = Middle - First;
+
+    Read += ReadRange(hProcess, Address, Buffer, Offset, Left, Valid);
+    Read += ReadRange(hProcess, Address, Buffer, Offset + Left, Length - Left, Valid);
+    return Read;
+}
+
+SIZE_T ReadMemoryPages(HANDLE hProcess, const BYTE* Address, BYTE* Buffer, SIZE_T Length, DWORD* Valid)
+{
+    if (!Length)
+        return 0;
+
+    return ReadRange(hProcess, Address, Buffer, 0, Length, Valid);
+}
@@ -0,0 +1,18 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     Fault tolerant reading of another process's memory
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#pragma once
+
+SIZE_T PageSize();
+
+// Read Length bytes at Address from hProcess into Buffer.
+// When the range cannot be read at once (guard pages, PAGE_NOACCESS, decommitted pages),
+// it is split on page boundaries and only the failing parts are retried.
+// The bit of every byte that was read is set in Valid (one bit per byte, see ByteDiff.h),
+// the bit of every byte that could not be read is cleared and its contents are left untouched.
+// Returns the number of bytes that were read.
+SIZE_T ReadMemoryPages(HANDLE hProcess, const BYTE* Address, BYTE* Buffer, SIZE_T Length, DWORD* Valid);
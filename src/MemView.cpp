@@ -7,22 +7,29 @@
 
 #include "MemView.h"
 #include "MemInfo.h"
+#include "ByteDiff.h"
+#include "PageCache.h"
+#include "SnapshotFile.h"
+#include "HexFormat.h"
+#include "GlyphAtlas.h"
+#include "Scheduler.h"
 #include <algorithm>
 
 extern HINSTANCE g_hInst;
-const UINT_PTR kUpdateTimerId = 0x1ea4;
+const UINT WM_PAGES_READ = WM_APP + 1;
 
 // http://www.catch22.net/tuts/scrollbars-scrolling
 
 struct MemView
 {
-    MemView(const std::wstring& Name, DWORD pid, const MemInfo& info)
+    MemView(const std::wstring& Name, DWORD pid, const MemInfo& info, SIZE_T Offset)
         :ProcessName(Name), ProcessPid(pid), Info(info)
-        , ProcessHandle(NULL), DisplayLines(0), PerLine(16)
+        , ProcessHandle(NULL), StartOffset(Offset), DisplayLines(0), PerLine(16)
         , ScrollMax(0), ScrollPos(0)
-        , vMax(0), vPos(0), vInc(0)
+        , vMax(0), vPos(0), vInc(0), LastPos(0)
         , Dirty(true), Resizing(true), Scrolling(false)
         , FontX(0), FontY(0)
+        , FrameDC(NULL), Frame(NULL), OldFrame(NULL), FramePixels(NULL), FrameWidth(0), FrameHeight(0)
     {
         updateTotal();
         SystemParametersInfo(SPI_GETWHEELSCROLLLINES, 0, &WheelLines, 0);
@@ -38,7 +45,10 @@ struct MemView
     std::wstring ProcessName;
     DWORD ProcessPid;
     HANDLE ProcessHandle;
+    std::shared_ptr<SnapshotFile> Snapshot;     // Read from instead of ProcessHandle when set
+    std::unique_ptr<PageCache> Cache;           // Reads ProcessHandle
     MemInfo Info;
+    SIZE_T StartOffset;     // Scrolled into view on the first WM_SIZE
 
     size_t TotalLines;
     size_t DisplayLines;
@@ -48,142 +58,204 @@ struct MemView
     long vMax;
     long vPos;
     int vInc;
+    long LastPos;           // vPos of the last read, to know the scroll direction
     int WheelLines;
 
     bool Dirty;
     bool Resizing;
     bool Scrolling;
     std::vector<unsigned char> Buffer;
-    std::vector<bool> Changed;
+    std::vector<unsigned char> Previous;
+    std::vector<DWORD> Changed;
+    std::vector<DWORD> Valid;
+    std::vector<DWORD> PreviousValid;
+    HexScreen Screen;
 
     int FontX;
     int FontY;
+
+    // The screen is drawn from the glyph atlas into this DIB, and copied to the window in one go
+    HexRenderer Renderer;
+    HDC FrameDC;
+    HBITMAP Frame;
+    HGDIOBJ OldFrame;
+    DWORD* FramePixels;
+    int FrameWidth;
+    int FrameHeight;
 };
 
-static WCHAR Hex2Str[] = L"0123456789abcdef";
+// Shared by all hex windows, they use the same font
+static GlyphAtlas g_Atlas;
 
-static void DrawLine(HDC hdc, int x, int y, WCHAR* Buffer, size_t Cch, const std::vector<unsigned char>& DataBuffer, const std::vector<bool>& Changed, SIZE_T StartAt, SIZE_T DataLen, SIZE_T PerLine, PBYTE Address)
+static HBITMAP CreateFrameBitmap(HDC hdc, int Width, int Height, void** Bits)
 {
-    StringCchPrintfW(Buffer, Cch, L"%p:  ", Address);
-    WCHAR* p = Buffer + wcslen(Buffer);
-    WCHAR* Current = Buffer;
-    bool CurrentChanged = false;
-    const unsigned char* Data = DataBuffer.data() + StartAt;
+    BITMAPINFO bmi = { 0 };
+    bmi.bmiHeader.biSize = sizeof(bmi.bmiHeader);
+    bmi.bmiHeader.biWidth = Width;
+    bmi.bmiHeader.biHeight = -Height;   // Top-down
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = 32;
+    bmi.bmiHeader.biCompression = BI_RGB;
+    return CreateDIBSection(hdc, &bmi, DIB_RGB_COLORS, Bits, NULL, 0);
+}
 
-    for(size_t n = 0; n < PerLine; ++n)
+// Rasterize every glyph once, white on black so that the pixels are the coverage
+static void CreateAtlas(HDC hdc, int CellWidth, int CellHeight)
+{
+    const int Count = GlyphAtlas::kLast - GlyphAtlas::kFirst + 1;
+    void* Bits = NULL;
+    HBITMAP Bitmap = CreateFrameBitmap(hdc, CellWidth * Count, CellHeight, &Bits);
+    if (!Bitmap)
+        return;
+
+    HDC MemDC = CreateCompatibleDC(hdc);
+    HGDIOBJ OldBitmap = SelectObject(MemDC, Bitmap);
+    HGDIOBJ OldFont = SelectObject(MemDC, getFont());
+    SetTextColor(MemDC, RGB(255, 255, 255));
+    SetBkColor(MemDC, RGB(0, 0, 0));
+    for (int n = 0; n < Count; ++n)
     {
-        if (n < DataLen)
-        {
-            // Check of we crossed the boundary from changed to unchanged
-            if (CurrentChanged != Changed[StartAt + n])
-            {
-                // Do we have new text?
-                if (Current != p)
-                {
-                    // Draw it out first
-                    TextOutW(hdc, x, y, Current, (int)(p - Current));
-                    // Calculate the width
-                    RECT r = {0};
-                    DrawTextW(hdc, Current, (int)(p - Current), &r, DT_CALCRECT);
-                    x += r.right;
-                    // Save the new starting position
-                    Current = p;
-                }
-                CurrentChanged = Changed[StartAt + n];
-                COLORREF col = GetTextColor(hdc);
-                SetTextColor(hdc, CurrentChanged ? RGB(255, 0, 0) : RGB(0,0,0));
-            }
+        WCHAR Char = (WCHAR)(GlyphAtlas::kFirst + n);
+        RECT Cell = { n * CellWidth, 0, (n + 1) * CellWidth, CellHeight };
+        ExtTextOutW(MemDC, Cell.left, 0, ETO_CLIPPED | ETO_OPAQUE, &Cell, &Char, 1, NULL);
+    }
+    GdiFlush();
 
-            *(p++) = Hex2Str[Data[n] >> 4];
-            *(p++) = Hex2Str[Data[n] & 0xf];
-            *(p++) = ' ';
-        }
-        else
-        {
-            *(p++) = ' ';
-            *(p++) = ' ';
-            *(p++) = ' ';
-        }
+    // The same colors as DrawScreen uses
+    g_Atlas.create(CellWidth, CellHeight, static_cast<const DWORD*>(Bits), CellWidth * Count,
+        PixelFromColor(GetBkColor(hdc)), PixelFromColor(RGB(0,0,0)), PixelFromColor(RGB(255, 0, 0)));
+
+    SelectObject(MemDC, OldFont);
+    SelectObject(MemDC, OldBitmap);
+    DeleteDC(MemDC);
+    DeleteObject(Bitmap);
+}
+
+static void DestroyFrame(MemView* mv)
+{
+    if (mv->FrameDC)
+    {
+        SelectObject(mv->FrameDC, mv->OldFrame);
+        DeleteDC(mv->FrameDC);
+        DeleteObject(mv->Frame);
+    }
+    mv->FrameDC = NULL;
+    mv->Frame = NULL;
+    mv->OldFrame = NULL;
+    mv->FramePixels = NULL;
+}
+
+// Without a frame, the screen is drawn with DrawScreen
+static void CreateFrame(HWND hwnd, MemView* mv)
+{
+    DestroyFrame(mv);
+    if (g_Atlas.empty())
+        return;
+
+    size_t Columns = AsciiColumn(mv->PerLine, mv->PerLine);
+    mv->FrameWidth = (int)Columns * g_Atlas.cellWidth();
+    mv->FrameHeight = (int)mv->DisplayLines * g_Atlas.cellHeight();
+
+    HDC hdc = GetDC(hwnd);
+    void* Bits = NULL;
+    mv->Frame = CreateFrameBitmap(hdc, mv->FrameWidth, mv->FrameHeight, &Bits);
+    if (mv->Frame)
+    {
+        mv->FrameDC = CreateCompatibleDC(hdc);
+        mv->OldFrame = SelectObject(mv->FrameDC, mv->Frame);
+        mv->FramePixels = static_cast<DWORD*>(Bits);
+        mv->Renderer.resize(Columns, mv->DisplayLines);
     }
-    *(p++) = ' ';
-    *(p++) = ' ';
-    for(size_t n = 0; n < PerLine; ++n)
+    ReleaseDC(hwnd, hdc);
+}
+
+// One TextOutW per run, the font is fixed pitch so no text has to be measured
+static void DrawScreen(HDC hdc, int x, int y, const HexScreen& Screen, int FontX, int FontY)
+{
+    bool Changed = false;
+    for (const HexRun& Run : Screen.runs())
     {
-        if (n < DataLen)
+        if (Run.Changed != Changed)
         {
-            // Check of we crossed the boundary from changed to unchanged
-            if (CurrentChanged != Changed[StartAt + n])
-            {
-                if (Current != p)
-                {
-                    TextOutW(hdc, x, y, Current, (int)(p - Current));
-                    RECT r = {0};
-                    DrawTextW(hdc, Current, (int)(p - Current), &r, DT_CALCRECT);
-                    x += r.right;
-                    Current = p;
-                }
-                CurrentChanged = Changed[StartAt + n];
-                COLORREF col = GetTextColor(hdc);
-                SetTextColor(hdc, CurrentChanged ? RGB(255, 0, 0) : RGB(0,0,0));
-            }
-
-            if (isprint(Data[n]))
-                *(p++) = (char)Data[n];
-            else
-                *(p++) = '.';
+            Changed = Run.Changed;
+            SetTextColor(hdc, Changed ? RGB(255, 0, 0) : RGB(0,0,0));
         }
+        TextOutW(hdc, x + FontX * (int)Run.Column, y + FontY * (int)Run.Line, Screen.line(Run.Line) + Run.Column, (int)Run.Length);
     }
-    *p = 0;
-
-    // Do we have any text left over?
-    if (Current != p)
-        TextOutW(hdc, x, y, Current, (int)(p - Current));
 
     SetTextColor(hdc, RGB(0,0,0));
 }
 
-static void ReadMemory(HWND hwnd, MemView* mv, bool IsWmPaint)
+// The part of the region that is visible
+static SIZE_T VisibleRange(MemView* mv, PBYTE& start)
 {
     SIZE_T Requested = mv->Buffer.size();
-    SIZE_T Read = 0;
 
     MemInfo& info = mv->Info;
 
-    PBYTE start = info.start() + (mv->vPos*mv->PerLine);
+    start = info.start() + (mv->vPos*mv->PerLine);
     PBYTE end = info.start() + info.size();
     if ((Requested + start) > end)
         Requested -= ((Requested + start)-end);
+    return Requested;
+}
+
+static void ReadMemory(HWND hwnd, MemView* mv, bool IsWmPaint)
+{
+    PBYTE start;
+    SIZE_T Requested = VisibleRange(mv, start);
+    int Direction = mv->vPos > mv->LastPos ? 1 : (mv->vPos < mv->LastPos ? -1 : 0);
+    mv->LastPos = mv->vPos;
+
+    // Keep the previous contents to compare against, without copying them
+    mv->Previous.swap(mv->Buffer);
+    mv->Buffer.resize(mv->Previous.size());
+    mv->PreviousValid.swap(mv->Valid);
+    mv->PreviousValid.resize(MaskWords(mv->Buffer.size()));
+    mv->Valid.resize(MaskWords(mv->Buffer.size()));
+    if (mv->Snapshot)
+        mv->Snapshot->read(start, mv->Buffer.data(), Requested, mv->Valid.data());
+    else
+        mv->Cache->read(start, mv->Buffer.data(), Requested, mv->Valid.data(), Direction);
+    SetMaskRange(mv->Valid.data(), Requested, mv->Buffer.size(), false);
 
-    std::vector<unsigned char> buf = mv->Buffer;
-    std::vector<bool> changed = mv->Changed;
-    ReadProcessMemory(mv->ProcessHandle, start, mv->Buffer.data(), Requested, &Read);
+    // Bytes that could not be read keep their previous contents
+    size_t Size = mv->Buffer.size();
+    for (size_t n = FindMaskRunEnd(mv->Valid.data(), 0, Size, true); n < Size;)
+    {
+        size_t RunEnd = FindMaskRunEnd(mv->Valid.data(), n, Size, false);
+        std::copy(mv->Previous.begin() + n, mv->Previous.begin() + RunEnd, mv->Buffer.begin() + n);
+        n = FindMaskRunEnd(mv->Valid.data(), RunEnd, Size, true);
+    }
     mv->Dirty = false;
-    mv->Changed.resize(mv->Buffer.size());
-    if (buf != mv->Buffer)
+
+    bool HadChanges = std::find_if(mv->Changed.begin(), mv->Changed.end(), [](DWORD w) { return w != 0; }) != mv->Changed.end();
+    mv->Changed.resize(MaskWords(mv->Buffer.size()));
+    if (DiffBytes(mv->Previous.data(), mv->Buffer.data(), mv->Buffer.size(), mv->Changed.data()))
     {
-        // Some data changed, see which bytes are different
-        for (size_t n = 0; n < mv->Buffer.size(); ++n)
+        // Bytes that just arrived in the cache were not changed
+        bool AnyChanged = false;
+        for (size_t w = 0; w < mv->Changed.size(); ++w)
         {
-            if (buf[n] != mv->Buffer[n])
-                mv->Changed[n] = true;
+            mv->Changed[w] &= mv->PreviousValid[w];
+            AnyChanged = AnyChanged || mv->Changed[w] != 0;
         }
+
+        // Refresh more often while the bytes keep changing
+        if (AnyChanged && !mv->Scrolling && !mv->Resizing)
+            ReportChanges(hwnd);
+
         // Force a redraw if we are not inside WM_PAINT
         if (!IsWmPaint)
             InvalidateRect(hwnd, NULL, FALSE);
     }
     else
     {
-        mv->Changed.assign(mv->Changed.size(), false);
+        std::fill(mv->Changed.begin(), mv->Changed.end(), 0);
         // If the 'changed' state changed, we also need to redraw
-        if (changed != mv->Changed && !IsWmPaint)
+        if (HadChanges && !IsWmPaint)
             InvalidateRect(hwnd, NULL, FALSE);
     }
-    if (Requested != Read)
-    {
-        if (Read != 0)
-            __debugbreak();
-        OutputDebugString(TEXT("FAIL\n"));
-    }
 }
 
 LRESULT HandleWM_PAINT(HWND hwnd, MemView* mv)
@@ -197,18 +269,34 @@ LRESULT HandleWM_PAINT(HWND hwnd, MemView* mv)
     if (mv->Resizing || mv->Scrolling)
     {
         // Don't show changing bytes when scrolling / resizing
-        mv->Changed.assign(mv->Changed.size(), false);
+        std::fill(mv->Changed.begin(), mv->Changed.end(), 0);
         mv->Resizing = mv->Scrolling = false;
     }
 
-    WCHAR Buffer[512];
     SelectObject(hdc, getFont());
     size_t PerLine = mv->PerLine;
+    mv->Screen.clear(PerLine);
     for(size_t n = 0; n < mv->DisplayLines; ++n)
     {
         size_t offset = (mv->vPos*PerLine) + (n*PerLine);
         size_t Left = std::min<size_t>(PerLine, mv->Info.size() - offset);
-        DrawLine(hdc, 2, mv->FontY * (int)n, Buffer, _countof(Buffer), mv->Buffer, mv->Changed, (n*PerLine), Left, PerLine, mv->Info.start() + offset);
+        mv->Screen.addLine(mv->Buffer.data(), mv->Valid.data(), mv->Changed.data(), (n*PerLine), Left, mv->Info.start() + offset);
+    }
+
+    if (mv->FramePixels)
+    {
+        // Only the cells that differ from the last frame are drawn, but all of the invalid area is copied
+        mv->Renderer.render(g_Atlas, mv->Screen, mv->FramePixels, mv->FrameWidth);
+        RECT Paint = ps.rcPaint;
+        Paint.left = std::max<LONG>(Paint.left, 2);
+        Paint.right = std::min<LONG>(Paint.right, 2 + mv->FrameWidth);
+        Paint.bottom = std::min<LONG>(Paint.bottom, mv->FrameHeight);
+        if (Paint.left < Paint.right && Paint.top < Paint.bottom)
+            BitBlt(hdc, Paint.left, Paint.top, Paint.right - Paint.left, Paint.bottom - Paint.top, mv->FrameDC, Paint.left - 2, Paint.top, SRCCOPY);
+    }
+    else
+    {
+        DrawScreen(hdc, 2, 0, mv->Screen, mv->FontX, mv->FontY);
     }
 
     EndPaint(hwnd, &ps);
@@ -231,6 +319,7 @@ void HandleWM_SIZE(HWND hwnd, MemView* mv, LPARAM lParam)
 
     mv->DisplayLines = ClientHeight / mv->FontY + 1;
     mv->Buffer.resize(mv->DisplayLines * mv->PerLine);
+    CreateFrame(hwnd, mv);
 
     mv->vMax = mv->TotalLines - mv->DisplayLines;
     mv->vInc = 1;
@@ -240,6 +329,11 @@ void HandleWM_SIZE(HWND hwnd, MemView* mv, LPARAM lParam)
         mv->vInc = (mv->vMax / INT_MAX) + 1;
         mv->ScrollMax = INT_MAX;
     }
+    if (mv->StartOffset)
+    {
+        mv->ScrollPos = (int)std::min((long)(mv->StartOffset / mv->PerLine) / mv->vInc, (long)mv->ScrollMax);
+        mv->StartOffset = 0;
+    }
     mv->ScrollPos = std::min(mv->ScrollPos, mv->ScrollMax);
     mv->vPos = std::min((long)mv->ScrollPos * mv->vInc, mv->vMax);
     mv->Resizing = true;
@@ -311,6 +405,8 @@ static void CreateFont(HWND hwnd, MemView* mv)
     GetTextMetrics(hdc, &tm);
     mv->FontX = tm.tmAveCharWidth;
     mv->FontY = tm.tmHeight + tm.tmExternalLeading;
+    if (g_Atlas.empty())
+        CreateAtlas(hdc, mv->FontX, mv->FontY);
     ReleaseDC(hwnd, hdc);
 }
 
@@ -340,15 +436,21 @@ LRESULT CALLBACK MemWndProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
             mv->ProcessName.c_str(), mv->ProcessPid, mv->Info.start(), mv->Info.start() + mv->Info.size());
         SetWindowTextW(hwnd, Buffer);
         CreateFont(hwnd, mv);
+        if (mv->ProcessHandle)
+            mv->Cache.reset(new PageCache(mv->ProcessHandle, mv->Info.start(), mv->Info.size(), hwnd, WM_PAGES_READ));
         //ReadMemory(hwnd, mv);
-        SetTimer(hwnd, kUpdateTimerId, 1000, NULL);
+        ScheduleRefresh(hwnd, mv->ProcessPid);
     }
         break;
     case WM_DESTROY:
-        KillTimer(hwnd, kUpdateTimerId);
+        UnscheduleRefresh(hwnd);
         mv = GetPtr(hwnd);
         SetPtr(hwnd, NULL);
-        CloseHandle(mv->ProcessHandle);
+        // Stop reading before the handle is closed
+        mv->Cache.reset();
+        if (mv->ProcessHandle)
+            CloseHandle(mv->ProcessHandle);
+        DestroyFrame(mv);
         delete mv;
         SetFocus(GetParent(hwnd));
         break;
@@ -376,10 +478,36 @@ LRESULT CALLBACK MemWndProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
         HandleWM_SIZE(hwnd, GetPtr(hwnd), lParam);
         break;
 
-    case WM_TIMER:
-        if (wParam == kUpdateTimerId)
+    case WM_SCHEDULED_REFRESH:
+        mv = GetPtr(hwnd);
+        if (mv->Cache)
+        {
+            // The pages that changed are posted back with WM_PAGES_READ
+            PBYTE start;
+            SIZE_T Length = VisibleRange(mv, start);
+            mv->Cache->refresh(start, Length);
+            // The reads of the worker since the previous refresh
+            ReportCost(hwnd, mv->Cache->takeCost());
+
+            // The changes of the last read are only shown until the next refresh
+            if (std::find_if(mv->Changed.begin(), mv->Changed.end(), [](DWORD w) { return w != 0; }) != mv->Changed.end())
+            {
+                mv->Dirty = true;
+                InvalidateRect(hwnd, NULL, FALSE);
+            }
+        }
+        else
+        {
+            ReadMemory(hwnd, mv, false);
+        }
+        break;
+
+    case WM_PAGES_READ:
+        mv = GetPtr(hwnd);
+        if (mv)
         {
-            ReadMemory(hwnd, GetPtr(hwnd), false);
+            mv->Dirty = true;
+            InvalidateRect(hwnd, NULL, FALSE);
         }
         break;
     }
@@ -388,7 +516,14 @@ LRESULT CALLBACK MemWndProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 
 #define MEMVIEW_CLASS TEXT("MemViewClass")
 
-void ShowMemory(HWND Parent, const MemInfo& info, HANDLE Handle, const std::wstring& Title)
+static std::wstring BaseName(const std::wstring& Title)
+{
+    std::wstring::size_type off = Title.find_last_of(L"\\/");
+    off = (off == std::wstring::npos) ? 0 : (off+1);
+    return Title.substr(off);
+}
+
+static void CreateMemView(HWND Parent, MemView* mi)
 {
     WNDCLASSEX wc = { sizeof(wc), 0 };
     if (!GetClassInfoEx(g_hInst, MEMVIEW_CLASS, &wc))
@@ -404,17 +539,30 @@ void ShowMemory(HWND Parent, const MemInfo& info, HANDLE Handle, const std::wstr
         setIcons(wc);
 
         if (!RegisterClassEx(&wc))
+        {
+            if (mi->ProcessHandle)
+                CloseHandle(mi->ProcessHandle);
+            delete mi;
             return;
+        }
     }
 
-    std::wstring::size_type off = Title.find_last_of(L"\\/");
-    off = (off == std::wstring::npos) ? 0 : (off+1);
-
-    MemView* mi = new MemView(Title.substr(off), GetProcessId(Handle), info);
-    DuplicateHandle(GetCurrentProcess(), Handle, GetCurrentProcess(), &mi->ProcessHandle, 0, FALSE, DUPLICATE_SAME_ACCESS);
-
     HWND Window = CreateWindow(TEXT("MemViewClass"), TEXT("Mem"), WS_OVERLAPPEDWINDOW | WS_VSCROLL,
             CW_USEDEFAULT, CW_USEDEFAULT, 580, 400, Parent, NULL, g_hInst, mi);
     ShowWindow(Window, SW_SHOW);
     UpdateWindow(Window);
 }
+
+void ShowMemory(HWND Parent, const MemInfo& info, HANDLE Handle, const std::wstring& Title, SIZE_T Offset)
+{
+    MemView* mi = new MemView(BaseName(Title), GetProcessId(Handle), info, Offset);
+    DuplicateHandle(GetCurrentProcess(), Handle, GetCurrentProcess(), &mi->ProcessHandle, 0, FALSE, DUPLICATE_SAME_ACCESS);
+    CreateMemView(Parent, mi);
+}
+
+void ShowSnapshotMemory(HWND Parent, const MemInfo& info, const std::shared_ptr<SnapshotFile>& Snapshot, const std::wstring& Title, SIZE_T Offset)
+{
+    MemView* mi = new MemView(BaseName(Title), 0, info, Offset);
+    mi->Snapshot = Snapshot;
+    CreateMemView(Parent, mi);
+}
@@ -17,11 +17,14 @@
 #include <windowsx.h>
 #include <strsafe.h>
 #include <string>
+#include <memory>
 
 
 extern HINSTANCE g_hInst;
 extern HANDLE g_ProcessHandle;
 extern std::wstring g_ProcessName;
+// Set when a snapshot is browsed instead of a live process
+extern std::shared_ptr<class SnapshotFile> g_Snapshot;
 
 // Common resources
 HFONT getFont();
@@ -35,7 +38,36 @@ void MemInfo_InitProcess(HANDLE hProcess);
 
 void UpdateStatic(HWND Static);
 bool UpdateProcessList(HWND Parent, UINT Height, int x, int y);
-void ShowMemory(HWND Parent, const class MemInfo& info, HANDLE Handle, const std::wstring& Title);
+// Keep the process list of UpdateProcessList up to date in the background
+void PrefetchProcessList();
+// Stop the background refresh of the process list, before the main window is gone
+void StopProcessList();
+void ShowMemory(HWND Parent, const class MemInfo& info, HANDLE Handle, const std::wstring& Title, SIZE_T Offset = 0);
+void ShowSnapshotMemory(HWND Parent, const class MemInfo& info, const std::shared_ptr<class SnapshotFile>& Snapshot, const std::wstring& Title, SIZE_T Offset = 0);
+void ShowSnapshotDiff(HWND Parent, const std::shared_ptr<class SnapshotFile>& Old, const std::wstring& OldName,
+    const std::shared_ptr<class SnapshotFile>& New, const std::wstring& NewName);
+void ShowSearch(HWND Parent);
+void ShowValueScan(HWND Parent);
+void ShowTimeline(HWND Parent);
+void ShowMonitor(HWND Parent);
+// Move the keyboard focus to the filter of the region list
+void FocusRegionFilter();
+
+// Windows that need keyboard navigation from the message loop
+void AddDialogWindow(HWND hwnd);
+void RemoveDialogWindow(HWND hwnd);
 
 LRESULT CALLBACK MainWndProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam);
 bool OpenProcess(DWORD pid);
+// A new handle with the access that is needed to view the memory of pid
+HANDLE OpenProcessHandle(DWORD pid);
+bool OpenSnapshot(const wchar_t* File);
+void SaveSnapshotDialog(HWND Parent);
+void OpenSnapshotDialog(HWND Parent);
+void DiffSnapshotsDialog(HWND Parent);
+
+// Command line mode, returns the exit code
+int RunHeadless(int argc, wchar_t** argv);
+int RunBenchmark(int argc, wchar_t** argv);
+HANDLE OutputHandle(DWORD StdHandle);
+void PrintError(const wchar_t* Text);
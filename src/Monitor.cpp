@@ -0,0 +1,171 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     Watching the regions of several processes at once
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#include "MemView.h"
+#include "Monitor.h"
+
+ProcessMonitor::Target::~Target()
+{
+    CloseHandle(Process);
+}
+
+ProcessMonitor::ProcessMonitor(HWND Notify, UINT Message)
+    :mNotify(Notify)
+    ,mMessage(Message)
+    ,mNotified(false)
+    ,mChanged(false)
+    ,mCost(0)
+{
+}
+
+bool ProcessMonitor::add(DWORD Pid, const std::wstring& Name)
+{
+    for (const std::shared_ptr<Target>& target : mTargets)
+    {
+        if (target->Pid == Pid)
+            return false;
+    }
+
+    HANDLE Process = OpenProcessHandle(Pid);
+    if (!Process)
+        return false;
+
+    std::shared_ptr<Target> target = std::make_shared<Target>();
+    target->Pid = Pid;
+    target->Name = Name;
+    target->Process = Process;
+    target->Busy = false;
+    // The names of the regions that are not backed by a file are per process
+    target->Known.init(Process);
+    target->Valid = false;
+    target->Exited = false;
+    target->Totals = ProcessTotals();
+    mTargets.push_back(target);
+    return true;
+}
+
+void ProcessMonitor::remove(size_t n)
+{
+    // A running refresh keeps its own reference
+    if (n < mTargets.size())
+        mTargets.erase(mTargets.begin() + n);
+}
+
+void ProcessMonitor::refresh()
+{
+    for (const std::shared_ptr<Target>& target : mTargets)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            if (target->Exited)
+                continue;
+        }
+
+        // Still busy with the previous refresh
+        if (target->Busy.exchange(true))
+            continue;
+
+        std::shared_ptr<Target> keep = target;
+        mPool.submit([this, keep]() { refresh(keep); });
+    }
+}
+
+void ProcessMonitor::refresh(const std::shared_ptr<Target>& target)
+{
+    DWORD Start = GetTickCount();
+
+    // The regions of a process that is gone cannot be queried
+    DWORD ExitCode = STILL_ACTIVE;
+    bool Exited = GetExitCodeProcess(target->Process, &ExitCode) && ExitCode != STILL_ACTIVE;
+    if (Exited)
+        target->Read.clear();
+    else
+        MemSnapshot::read(target->Process, target->Read, target->Known);
+
+    const MemSnapshot& Old = target->Regions;
+    const MemSnapshot& New = target->Read;
+    ProcessTotals Totals = ProcessTotals();
+    Totals.Regions = New.size();
+    for (size_t n = 0; n < New.size(); ++n)
+    {
+        SIZE_T Size = New.regionSize(n);
+        if (New.state(n) == MEM_COMMIT)
+        {
+            Totals.Committed += Size;
+            if (New.isPrivate(n))
+                Totals.Private += Size;
+        }
+        else if (New.state(n) == MEM_RESERVE)
+        {
+            Totals.Reserved += Size;
+        }
+
+        if (New.isImage(n))
+            Totals.Image += Size;
+        else if (New.isMapped(n))
+            Totals.Mapped += Size;
+    }
+
+    MergeDiff(Old.size(), New.size(), [&](size_t o, size_t n) { return Old.cmp(o, New, n); }, target->Script);
+    for (const EditOp& op : target->Script)
+    {
+        if (op.Type != EditOp::Update)
+        {
+            Totals.Changes += op.Count;
+            continue;
+        }
+        for (size_t k = 0; k < op.Count; ++k)
+        {
+            if (Old.compare(op.OldIndex + k, New, op.NewIndex + k) != Info::None)
+                ++Totals.Changes;
+        }
+    }
+    target->Regions.swap(target->Read);
+    Totals.Duration = GetTickCount() - Start;
+
+    bool Notify;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        target->Totals = Totals;
+        target->Valid = true;
+        target->Exited = Exited;
+        mChanged = mChanged || Totals.Changes != 0;
+        mCost += Totals.Duration;
+        Notify = !mNotified;
+        mNotified = true;
+    }
+    target->Busy = false;
+    if (Notify)
+        PostMessageW(mNotify, mMessage, 0, 0);
+}
+
+void ProcessMonitor::summary(std::vector<Summary>& Summaries)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    mNotified = false;
+    Summaries.resize(mTargets.size());
+    for (size_t n = 0; n < mTargets.size(); ++n)
+    {
+        const Target& target = *mTargets[n];
+        Summary& summary = Summaries[n];
+        summary.Pid = target.Pid;
+        summary.Name = target.Name;
+        summary.Valid = target.Valid;
+        summary.Exited = target.Exited;
+        summary.Totals = target.Totals;
+    }
+}
+
+bool ProcessMonitor::takeChanges(DWORD& Cost)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    bool Changed = mChanged;
+    Cost = mCost;
+    mChanged = false;
+    mCost = 0;
+    return Changed;
+}
@@ -0,0 +1,93 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     Watching the regions of several processes at once
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include "MemInfo.h"
+#include "RegionDiff.h"
+#include "WorkPool.h"
+
+struct ProcessTotals
+{
+    size_t Regions;
+    SIZE_T Committed;
+    SIZE_T Private;     // Committed only, Image and Mapped also count reserved memory
+    SIZE_T Image;
+    SIZE_T Mapped;
+    SIZE_T Reserved;
+    size_t Changes;     // Regions added, removed or changed by the last refresh
+    DWORD Duration;     // Of the last refresh, in milliseconds
+};
+
+// Every monitored process has its own region list, that is refreshed on a shared pool.
+// A process that is still busy with the previous refresh is skipped, so one large
+// process does not hold up the others, and the others do not queue up behind it.
+class ProcessMonitor
+{
+public:
+    // Message is posted to Notify when refreshes finished since the last call to summary
+    ProcessMonitor(HWND Notify, UINT Message);
+
+    // False when Pid is already monitored or cannot be opened
+    bool add(DWORD Pid, const std::wstring& Name);
+    void remove(size_t n);
+    size_t size() const { return mTargets.size(); }
+    size_t threads() const { return mPool.threads(); }
+
+    void refresh();
+
+    struct Summary
+    {
+        DWORD Pid;
+        std::wstring Name;
+        bool Valid;         // At least one refresh finished
+        bool Exited;
+        ProcessTotals Totals;
+    };
+    void summary(std::vector<Summary>& Summaries);
+    // Whether the refreshes that finished since the last call found changes,
+    // Cost is the milliseconds they took together
+    bool takeChanges(DWORD& Cost);
+
+private:
+    struct Target
+    {
+        ~Target();
+
+        DWORD Pid;
+        std::wstring Name;
+        HANDLE Process;
+        std::atomic<bool> Busy;
+        KnownRegions Known;
+
+        // Only used by the refresh
+        MemSnapshot Regions;
+        MemSnapshot Read;
+        EditScript Script;
+
+        // Guarded by the lock of the monitor
+        bool Valid;
+        bool Exited;
+        ProcessTotals Totals;
+    };
+
+    void refresh(const std::shared_ptr<Target>& target);
+
+    HWND mNotify;
+    UINT mMessage;
+    std::vector<std::shared_ptr<Target>> mTargets;
+    std::mutex mLock;
+    bool mNotified;
+    bool mChanged;
+    DWORD mCost;
+    // Destroyed first, the running refreshes still use the monitor
+    WorkPool mPool;
+};
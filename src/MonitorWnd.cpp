@@ -0,0 +1,323 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     The window that monitors several processes
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#include "MemView.h"
+#include <Commctrl.h>
+#include "mfl/win32/tlhelp32.h"
+#include "Monitor.h"
+#include "Scheduler.h"
+
+#define MONITOR_CLASS TEXT("MemMonitorClass")
+const UINT WM_MONITOR_REFRESHED = WM_APP + 1;
+
+static HWND g_MonitorWnd;
+static HWND g_ProcessEdit;
+static HWND g_AddButton;
+static HWND g_MonitorList;
+static HWND g_StatusStatic;
+
+static std::unique_ptr<ProcessMonitor> g_Monitor;
+static std::vector<ProcessMonitor::Summary> g_Summaries;
+
+static wchar_t* Columns[] =
+{
+    L"Process",
+    L"PID",
+    L"Regions",
+    L"Committed",
+    L"Private",
+    L"Image",
+    L"Mapped",
+    L"Reserved",
+    L"Changes",
+    L"Refresh",
+};
+
+static int Sizes[] = {
+    160,
+    50,
+    60,
+    90,
+    90,
+    90,
+    90,
+    90,
+    60,
+    60,
+};
+
+static void UpdateStatus(LPCWSTR Text = NULL)
+{
+    WCHAR buf[200];
+    if (!Text && g_Summaries.empty())
+    {
+        Text = L"Add processes by executable name or pid";
+    }
+    else if (!Text)
+    {
+        SIZE_T Committed = 0, Private = 0;
+        size_t Regions = 0;
+        for (const ProcessMonitor::Summary& summary : g_Summaries)
+        {
+            Regions += summary.Totals.Regions;
+            Committed += summary.Totals.Committed;
+            Private += summary.Totals.Private;
+        }
+        StringCchPrintfW(buf, _countof(buf), L"%Iu processes on %Iu threads: %Iu regions, %Iu KB committed, %Iu KB private",
+            g_Summaries.size(), g_Monitor->threads(), Regions, Committed / 1024, Private / 1024);
+        Text = buf;
+    }
+    Static_SetText(g_StatusStatic, Text);
+}
+
+static void UpdateList()
+{
+    g_Monitor->summary(g_Summaries);
+    ListView_SetItemCountEx(g_MonitorList, g_Summaries.size(), LVSICF_NOSCROLL);
+    InvalidateRect(g_MonitorList, NULL, FALSE);
+    UpdateStatus();
+}
+
+// Add the process with the pid in Text, or all processes with that executable name
+static void AddProcesses()
+{
+    WCHAR Text[MAX_PATH];
+    Edit_GetText(g_ProcessEdit, Text, _countof(Text));
+    if (!Text[0])
+        return;
+
+    WCHAR* End;
+    DWORD Pid = wcstoul(Text, &End, 0);
+    bool ByPid = *End == L'\0';
+
+    size_t Added = 0;
+    mfl::win32::ProcessIterator pi;
+    while (pi.next())
+    {
+        if (ByPid ? pi->th32ProcessID == Pid : _wcsicmp(pi->szExeFile, Text) == 0)
+        {
+            if (g_Monitor->add(pi->th32ProcessID, pi->szExeFile))
+                ++Added;
+        }
+    }
+
+    if (!Added)
+    {
+        UpdateStatus(L"No process added, it is not found, cannot be opened or is already monitored");
+        return;
+    }
+    Edit_SetText(g_ProcessEdit, L"");
+    g_Monitor->refresh();
+    UpdateList();
+}
+
+static void RemoveSelected()
+{
+    // From the end, so the indexes of the items that are still to be removed stay the same
+    for (INT Num = ListView_GetItemCount(g_MonitorList) - 1; Num >= 0; --Num)
+    {
+        if (ListView_GetItemState(g_MonitorList, Num, LVIS_SELECTED))
+            g_Monitor->remove(Num);
+    }
+    ListView_SetItemState(g_MonitorList, -1, 0, LVIS_SELECTED);
+    UpdateList();
+}
+
+static void SummaryText(const ProcessMonitor::Summary& summary, int Column, __out_ecount(cchDest) STRSAFE_LPWSTR pszDest, __in size_t cchDest)
+{
+    const ProcessTotals& Totals = summary.Totals;
+    if (Column > 1 && !summary.Valid)
+    {
+        StringCchCopyW(pszDest, cchDest, L"");
+        return;
+    }
+
+    switch (Column)
+    {
+    case 0:
+        if (summary.Exited)
+            StringCchPrintfW(pszDest, cchDest, L"%s (exited)", summary.Name.c_str());
+        else
+            StringCchCopyW(pszDest, cchDest, summary.Name.c_str());
+        break;
+    case 1:
+        StringCchPrintfW(pszDest, cchDest, L"%u", summary.Pid);
+        break;
+    case 2:
+        StringCchPrintfW(pszDest, cchDest, L"%Iu", Totals.Regions);
+        break;
+    case 3:
+        StringCchPrintfW(pszDest, cchDest, L"%Iu KB", Totals.Committed / 1024);
+        break;
+    case 4:
+        StringCchPrintfW(pszDest, cchDest, L"%Iu KB", Totals.Private / 1024);
+        break;
+    case 5:
+        StringCchPrintfW(pszDest, cchDest, L"%Iu KB", Totals.Image / 1024);
+        break;
+    case 6:
+        StringCchPrintfW(pszDest, cchDest, L"%Iu KB", Totals.Mapped / 1024);
+        break;
+    case 7:
+        StringCchPrintfW(pszDest, cchDest, L"%Iu KB", Totals.Reserved / 1024);
+        break;
+    case 8:
+        StringCchPrintfW(pszDest, cchDest, L"%Iu", Totals.Changes);
+        break;
+    case 9:
+        StringCchPrintfW(pszDest, cchDest, L"%u ms", Totals.Duration);
+        break;
+    }
+}
+
+static void HandleSize(HWND hwnd)
+{
+    RECT client;
+    GetClientRect(hwnd, &client);
+    LONG w = client.right - client.left;
+    LONG ItemHeight = 22, StatusHeight = 16, ButtonWidth = 80;
+    HDWP wp = BeginDeferWindowPos(4);
+    wp = DeferWindowPos(wp, g_ProcessEdit, 0, client.left, client.top, w - ButtonWidth, ItemHeight, 0);
+    wp = DeferWindowPos(wp, g_AddButton, 0, client.right - ButtonWidth, client.top, ButtonWidth, ItemHeight, 0);
+    wp = DeferWindowPos(wp, g_StatusStatic, 0, client.left, client.bottom - StatusHeight, w, StatusHeight, 0);
+    client.top += ItemHeight;
+    client.bottom -= StatusHeight;
+    wp = DeferWindowPos(wp, g_MonitorList, 0, client.left, client.top, w, client.bottom - client.top, 0);
+    EndDeferWindowPos(wp);
+}
+
+LRESULT CALLBACK MonitorWndProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
+{
+    switch (uMsg)
+    {
+    case WM_CREATE:
+    {
+        g_ProcessEdit = CreateWindowExW(WS_EX_CLIENTEDGE, WC_EDIT, L"", WS_CHILD | WS_VISIBLE | WS_TABSTOP | ES_AUTOHSCROLL,
+            0, 0, 0, 0, hwnd, NULL, g_hInst, NULL);
+        g_AddButton = CreateWindowW(WC_BUTTON, L"Add", WS_CHILD | WS_VISIBLE | WS_TABSTOP | BS_DEFPUSHBUTTON,
+            0, 0, 0, 0, hwnd, (HMENU)IDOK, g_hInst, NULL);
+        g_MonitorList = CreateWindowW(WC_LISTVIEW, L"", WS_CHILD | LVS_REPORT | WS_VISIBLE | LVS_OWNERDATA | WS_TABSTOP | LVS_SHOWSELALWAYS,
+            0, 0, 0, 0, hwnd, NULL, g_hInst, NULL);
+        g_StatusStatic = CreateWindowW(WC_STATIC, L"", WS_CHILD | WS_VISIBLE | SS_SUNKEN,
+            0, 0, 0, 0, hwnd, NULL, g_hInst, NULL);
+
+        ListView_SetExtendedListViewStyle(g_MonitorList, ListView_GetExtendedListViewStyle(g_MonitorList) | LVS_EX_FULLROWSELECT | LVS_EX_DOUBLEBUFFER);
+
+        HWND Controls[] = { g_ProcessEdit, g_AddButton, g_MonitorList, g_StatusStatic };
+        for (HWND control : Controls)
+            SetWindowFont(control, getFont(), FALSE);
+
+        LVCOLUMN lvc;
+        for (size_t n = 0; n < _countof(Columns); ++n)
+        {
+            lvc.mask = LVCF_FMT | LVCF_WIDTH | LVCF_TEXT | LVCF_SUBITEM;
+            lvc.iSubItem = (int)n;
+            lvc.cx = Sizes[n];
+            lvc.fmt = n == 0 ? LVCFMT_LEFT : LVCFMT_RIGHT;
+            lvc.pszText = Columns[n];
+            ListView_InsertColumn(g_MonitorList, n, &lvc);
+        }
+
+        g_Monitor.reset(new ProcessMonitor(hwnd, WM_MONITOR_REFRESHED));
+        HandleSize(hwnd);
+        UpdateList();
+        SetFocus(g_ProcessEdit);
+        // The targets are several processes, so the refresh is not grouped with the views of one
+        ScheduleRefresh(hwnd, 0);
+    }
+    return 0;
+
+    case WM_SIZE:
+        HandleSize(hwnd);
+        return 0;
+
+    case WM_SCHEDULED_REFRESH:
+        g_Monitor->refresh();
+        return 0;
+
+    case WM_MONITOR_REFRESHED:
+    {
+        // The refreshes run on the pool, their time counts towards the budget of the scheduler
+        DWORD Cost;
+        bool Changed = g_Monitor->takeChanges(Cost);
+        ReportCost(hwnd, Cost);
+        if (Changed)
+            ReportChanges(hwnd);
+        UpdateList();
+    }
+    return 0;
+
+    case WM_COMMAND:
+        if (LOWORD(wParam) == IDOK)
+        {
+            AddProcesses();
+            return 0;
+        }
+        break;
+
+    case WM_NOTIFY:
+        if (((LPNMHDR)lParam)->hwndFrom == g_MonitorList)
+        {
+            switch (((LPNMHDR)lParam)->code)
+            {
+            case LVN_GETDISPINFO:
+            {
+                NMLVDISPINFO* plvdi = (NMLVDISPINFO*)lParam;
+                size_t item = plvdi->item.iItem;
+                if ((plvdi->item.mask & LVIF_TEXT) && item < g_Summaries.size())
+                    SummaryText(g_Summaries[item], plvdi->item.iSubItem, plvdi->item.pszText, plvdi->item.cchTextMax);
+                return TRUE;
+            }
+            case LVN_KEYDOWN:
+                if (((LPNMLVKEYDOWN)lParam)->wVKey == VK_DELETE)
+                    RemoveSelected();
+                return 0;
+            }
+        }
+        break;
+
+    case WM_DESTROY:
+        UnscheduleRefresh(hwnd);
+        // Waits for the refreshes that are running
+        g_Monitor.reset();
+        g_Summaries.clear();
+        RemoveDialogWindow(hwnd);
+        g_MonitorWnd = NULL;
+        break;
+    }
+    return DefWindowProc(hwnd, uMsg, wParam, lParam);
+}
+
+void ShowMonitor(HWND Parent)
+{
+    if (g_MonitorWnd)
+    {
+        SetForegroundWindow(g_MonitorWnd);
+        SetFocus(g_ProcessEdit);
+        return;
+    }
+
+    WNDCLASSEX wc = { sizeof(wc), 0 };
+    if (!GetClassInfoEx(g_hInst, MONITOR_CLASS, &wc))
+    {
+        wc.lpfnWndProc = MonitorWndProc;
+        wc.hInstance = g_hInst;
+        wc.hCursor = LoadCursor((HINSTANCE)NULL, IDC_ARROW);
+        wc.hbrBackground = (HBRUSH)(COLOR_BTNFACE + 1);
+        wc.lpszClassName = MONITOR_CLASS;
+        setIcons(wc);
+
+        if (!RegisterClassEx(&wc))
+            return;
+    }
+
+    g_MonitorWnd = CreateWindowEx(WS_EX_CONTROLPARENT, MONITOR_CLASS, L"Processes", WS_OVERLAPPEDWINDOW,
+        CW_USEDEFAULT, CW_USEDEFAULT, 900, 400, Parent, NULL, g_hInst, NULL);
+    AddDialogWindow(g_MonitorWnd);
+    ShowWindow(g_MonitorWnd, SW_SHOW);
+    UpdateWindow(g_MonitorWnd);
+}
@@ -0,0 +1,225 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     Pages of another process, read ahead on a worker thread
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#include "MemView.h"
+#include "PageCache.h"
+#include "MemReader.h"
+#include "ByteDiff.h"
+#include <algorithm>
+
+const size_t kMaxPages = 4096;
+// Pages read with a single call
+const size_t kMaxBatch = 16;
+// How far to read ahead, in multiples of the visible range
+const SIZE_T kReadAheadScreens = 4;
+// Visible pages that are older than this are read again
+const DWORD kMaxAge = 1000;
+
+PageCache::PageCache(HANDLE hProcess, const BYTE* Start, SIZE_T Size, HWND Notify, UINT Message)
+    :mProcess(hProcess), mStart((ULONG_PTR)Start), mEnd((ULONG_PTR)Start + Size), mPageSize(PageSize())
+    , mNotify(Notify), mMessage(Message), mStop(false), mNotified(false), mReadTime(0)
+{
+    mThread = std::thread(&PageCache::worker, this);
+}
+
+PageCache::~PageCache()
+{
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mStop = true;
+    }
+    mWake.notify_one();
+    mThread.join();
+}
+
+void PageCache::read(const BYTE* Address, BYTE* Buffer, SIZE_T Length, DWORD* Valid, int Direction)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    mNotified = false;
+    // What was read ahead for an earlier position is not needed anymore, refreshes are kept
+    mQueue.erase(std::remove_if(mQueue.begin(), mQueue.end(), [](const Request& Wanted) { return !Wanted.Force; }), mQueue.end());
+
+    DWORD Now = GetTickCount();
+    ULONG_PTR First = (ULONG_PTR)Address, End = First + Length;
+    for (ULONG_PTR PageAddress = First & ~(ULONG_PTR)(mPageSize - 1); PageAddress < End; PageAddress += mPageSize)
+    {
+        ULONG_PTR From = std::max(PageAddress, First), To = std::min(PageAddress + mPageSize, End);
+        auto it = mPages.find(PageAddress);
+        if (it == mPages.end())
+        {
+            SetMaskRange(Valid, From - First, To - First, false);
+            Request Wanted = { PageAddress, false };
+            mQueue.push_back(Wanted);
+            continue;
+        }
+
+        Page& Cached = it->second;
+        mLru.splice(mLru.begin(), mLru, Cached.Lru);
+        if (Cached.Readable)
+            memcpy(Buffer + (From - First), &Cached.Data[From - PageAddress], To - From);
+        SetMaskRange(Valid, From - First, To - First, Cached.Readable);
+
+        if (Now - Cached.Time > kMaxAge)
+            forceLocked(PageAddress);
+    }
+
+    SIZE_T Ahead = Length * kReadAheadScreens;
+    if (!Direction)
+        Ahead /= 2;
+    if (Direction >= 0 && End < mEnd)
+        queueMissingLocked(End, std::min(mEnd, End + std::min(Ahead, mEnd - End)), false);
+    if (Direction <= 0 && First > mStart)
+        queueMissingLocked(std::max(mStart, First - std::min(Ahead, First - mStart)), First, true);
+
+    if (!mQueue.empty())
+        mWake.notify_one();
+}
+
+void PageCache::refresh(const BYTE* Address, SIZE_T Length)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    ULONG_PTR First = (ULONG_PTR)Address, End = First + Length;
+    for (ULONG_PTR PageAddress = First & ~(ULONG_PTR)(mPageSize - 1); PageAddress < End; PageAddress += mPageSize)
+        forceLocked(PageAddress);
+    if (!mQueue.empty())
+        mWake.notify_one();
+}
+
+// A page is queued once for a forced read, while the process is slow to read the queue does not keep growing
+void PageCache::forceLocked(ULONG_PTR Address)
+{
+    if (!mForced.insert(Address).second)
+        return;
+    Request Wanted = { Address, true };
+    mQueue.push_back(Wanted);
+}
+
+PageCache::Request PageCache::popLocked()
+{
+    Request Wanted = mQueue.front();
+    mQueue.pop_front();
+    if (Wanted.Force)
+        mForced.erase(Wanted.Address);
+    return Wanted;
+}
+
+DWORD PageCache::takeCost()
+{
+    LARGE_INTEGER Frequency;
+    QueryPerformanceFrequency(&Frequency);
+    std::lock_guard<std::mutex> lock(mLock);
+    DWORD Cost = (DWORD)(mReadTime * 1000 / Frequency.QuadPart);
+    mReadTime = 0;
+    return Cost;
+}
+
+// Queue the pages of [First, End) that are not cached, the ones closest to the visible range first
+void PageCache::queueMissingLocked(ULONG_PTR First, ULONG_PTR End, bool Descending)
+{
+    First &= ~(ULONG_PTR)(mPageSize - 1);
+    size_t Count = (End - First + mPageSize - 1) / mPageSize;
+    for (size_t n = 0; n < Count; ++n)
+    {
+        ULONG_PTR Address = First + (Descending ? Count - 1 - n : n) * mPageSize;
+        if (mPages.find(Address) == mPages.end())
+        {
+            Request Wanted = { Address, false };
+            mQueue.push_back(Wanted);
+        }
+    }
+}
+
+bool PageCache::wantedLocked(const Request& Wanted, DWORD Now) const
+{
+    if (Wanted.Force)
+        return true;
+    auto it = mPages.find(Wanted.Address);
+    return it == mPages.end() || Now - it->second.Time > kMaxAge;
+}
+
+// Returns true when the page is new, or differs from the cached one
+bool PageCache::storeLocked(ULONG_PTR Address, const BYTE* Data, bool Readable, DWORD Now)
+{
+    auto it = mPages.find(Address);
+    bool Changed = it == mPages.end();
+    if (Changed)
+    {
+        mLru.push_front(Address);
+        it = mPages.insert(std::make_pair(Address, Page())).first;
+        it->second.Data.resize(mPageSize);
+        it->second.Lru = mLru.begin();
+    }
+    Page& Cached = it->second;
+    if (Cached.Readable != Readable || (Readable && memcmp(Cached.Data.data(), Data, mPageSize)))
+        Changed = true;
+    if (Readable)
+        memcpy(Cached.Data.data(), Data, mPageSize);
+    Cached.Readable = Readable;
+    Cached.Time = Now;
+
+    while (mPages.size() > kMaxPages)
+    {
+        mPages.erase(mLru.back());
+        mLru.pop_back();
+    }
+    return Changed;
+}
+
+void PageCache::worker()
+{
+    std::vector<BYTE> Buffer(kMaxBatch * mPageSize);
+    std::vector<DWORD> Valid(MaskWords(Buffer.size()));
+
+    std::unique_lock<std::mutex> lock(mLock);
+    for (;;)
+    {
+        mWake.wait(lock, [this] { return mStop || !mQueue.empty(); });
+        if (mStop)
+            return;
+
+        DWORD Now = GetTickCount();
+        Request Wanted = popLocked();
+        if (!wantedLocked(Wanted, Now))
+            continue;
+
+        // Take the neighbours that are wanted as well, so that they are read with one call
+        ULONG_PTR First = Wanted.Address;
+        size_t Count = 1;
+        while (!mQueue.empty() && Count < kMaxBatch && wantedLocked(mQueue.front(), Now))
+        {
+            ULONG_PTR Next = mQueue.front().Address;
+            if (Next == First - mPageSize)
+                First = Next;
+            else if (Next != First + Count * mPageSize)
+                break;
+            popLocked();
+            ++Count;
+        }
+
+        lock.unlock();
+        SIZE_T Length = Count * mPageSize;
+        LARGE_INTEGER Start, End;
+        QueryPerformanceCounter(&Start);
+        ReadMemoryPages(mProcess, (const BYTE*)First, Buffer.data(), Length, Valid.data());
+        QueryPerformanceCounter(&End);
+        lock.lock();
+        mReadTime += End.QuadPart - Start.QuadPart;
+
+        // A read is split on page boundaries, so a page is either read completely or not at all
+        bool Changed = false;
+        Now = GetTickCount();
+        for (size_t n = 0; n < Count; ++n)
+            Changed = storeLocked(First + n * mPageSize, &Buffer[n * mPageSize], TestMaskBit(Valid.data(), n * mPageSize), Now) || Changed;
+
+        if (Changed && !mNotified)
+        {
+            mNotified = true;
+            PostMessage(mNotify, mMessage, 0, 0);
+        }
+    }
+}
+
@@ -0,0 +1,77 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     Pages of another process, read ahead on a worker thread
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+// The pages of one region of another process, as last read by a worker thread.
+// The hex view only copies what is cached and never waits for the process,
+// missing pages are queued together with the pages ahead in the scroll direction.
+class PageCache
+{
+public:
+    // Message is posted to Notify when pages arrived that differ from what was cached
+    PageCache(HANDLE hProcess, const BYTE* Start, SIZE_T Size, HWND Notify, UINT Message);
+    ~PageCache();
+
+    // Same contract as ReadMemoryPages, bytes of pages that are not cached yet are not valid.
+    // Direction is the last scroll direction (<0 up, >0 down), the pages on that side of the range are read ahead.
+    void read(const BYTE* Address, BYTE* Buffer, SIZE_T Length, DWORD* Valid, int Direction);
+    // Read the pages of the range again, even when they are cached
+    void refresh(const BYTE* Address, SIZE_T Length);
+    // Milliseconds the worker spent reading since the last call
+    DWORD takeCost();
+
+private:
+    struct Page
+    {
+        std::vector<BYTE> Data;
+        bool Readable;
+        DWORD Time;     // GetTickCount of the read
+        std::list<ULONG_PTR>::iterator Lru;
+    };
+
+    struct Request
+    {
+        ULONG_PTR Address;
+        bool Force;     // Read even when the page is cached and recent
+    };
+
+    void worker();
+    void queueMissingLocked(ULONG_PTR First, ULONG_PTR End, bool Descending);
+    void forceLocked(ULONG_PTR Address);
+    Request popLocked();
+    bool wantedLocked(const Request& Wanted, DWORD Now) const;
+    bool storeLocked(ULONG_PTR Address, const BYTE* Data, bool Readable, DWORD Now);
+
+    HANDLE mProcess;
+    ULONG_PTR mStart;
+    ULONG_PTR mEnd;
+    SIZE_T mPageSize;
+    HWND mNotify;
+    UINT mMessage;
+
+    std::mutex mLock;
+    std::condition_variable mWake;
+    bool mStop;
+    bool mNotified;     // A message is posted, and the view did not read since
+    LONGLONG mReadTime; // Performance counter ticks spent reading, since takeCost
+    std::deque<Request> mQueue;     // The most wanted pages first
+    std::unordered_set<ULONG_PTR> mForced;  // Pages with a Force request in mQueue
+    std::unordered_map<ULONG_PTR, Page> mPages;
+    std::list<ULONG_PTR> mLru;      // Most recently used first
+    std::thread mThread;
+};
+
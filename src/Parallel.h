@@ -0,0 +1,34 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     Spreading work over all cpus
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+
+// Call Work(n) for every n in [0, Count), spread over all cpus
+template<typename Callback>
+static void ParallelFor(size_t Count, Callback Work)
+{
+    std::atomic<size_t> next(0);
+    auto worker = [&]()
+    {
+        for (size_t n; (n = next++) < Count;)
+            Work(n);
+    };
+
+    size_t workers = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), Count);
+    std::vector<std::thread> threads;
+    for (size_t n = 1; n < workers; ++n)
+        threads.push_back(std::thread(worker));
+    worker();
+    for (std::thread& thread : threads)
+        thread.join();
+}
+
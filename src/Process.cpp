@@ -6,30 +6,37 @@
  */
 
 #include "MemView.h"
-#include "mfl/win32/tlhelp32.h"
 #include <Psapi.h>
-#include <map>
+#include <winternl.h>
+#include "SnapshotFile.h"
+#include "Parallel.h"
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 
 static BOOL g_IsRunningOnWow = -1;
 
 static DWORD g_ProcessId;
 HANDLE g_ProcessHandle;
 std::wstring g_ProcessName;
+std::shared_ptr<SnapshotFile> g_Snapshot;
 static bool g_ProcessIsx86;
 
-std::map<DWORD, HWND> g_Windows;
-
 void UpdateStatic(HWND Static)
 {
     if (Static)
     {
         WCHAR buf[MAX_PATH + 20];
-        StringCchPrintfW(buf, _countof(buf), L"%s (%u%s)", g_ProcessName.c_str(), g_ProcessId, g_ProcessIsx86 ? L", x86" : L"");
+        if (g_Snapshot)
+            StringCchPrintfW(buf, _countof(buf), L"%s (snapshot)", g_ProcessName.c_str());
+        else
+            StringCchPrintfW(buf, _countof(buf), L"%s (%u%s)", g_ProcessName.c_str(), g_ProcessId, g_ProcessIsx86 ? L", x86" : L"");
         Static_SetText(Static, buf);
     }
 }
 
-static HANDLE InternalOpen(DWORD pid)
+HANDLE OpenProcessHandle(DWORD pid)
 {
     return OpenProcess(PROCESS_VM_READ | PROCESS_VM_OPERATION | PROCESS_QUERY_INFORMATION, FALSE, pid);
 }
@@ -38,8 +45,9 @@ bool OpenProcess(DWORD pid)
 {
     if (pid == g_ProcessId) return true;
     if (g_ProcessHandle) CloseHandle(g_ProcessHandle);
+    g_Snapshot.reset();
     g_ProcessId = pid;
-    g_ProcessHandle = InternalOpen(pid);
+    g_ProcessHandle = OpenProcessHandle(pid);
     if (g_ProcessHandle)
     {
         WCHAR buf[512];
@@ -59,16 +67,27 @@ bool OpenProcess(DWORD pid)
     return g_ProcessHandle != NULL;
 }
 
+bool OpenSnapshot(const wchar_t* File)
+{
+    std::shared_ptr<SnapshotFile> snapshot = SnapshotFile::open(File);
+    if (!snapshot)
+        return false;
+
+    if (g_ProcessHandle) CloseHandle(g_ProcessHandle);
+    g_ProcessHandle = NULL;
+    g_ProcessId = 0;
+    g_ProcessIsx86 = false;
+    g_ProcessName = File;
+    g_Snapshot = snapshot;
+    return true;
+}
+
 static bool CanOpen(DWORD pid, bool& x86)
 {
-    HANDLE proc = InternalOpen(pid);
+    HANDLE proc = OpenProcessHandle(pid);
     if (proc)
     {
         bool canOpen = true;
-        if (g_IsRunningOnWow == -1)
-        {
-            IsWow64Process(GetCurrentProcess(), &g_IsRunningOnWow);
-        }
         BOOL fIsWowProcess;
         if (IsWow64Process(proc, &fIsWowProcess))
         {
@@ -85,19 +104,199 @@ static bool CanOpen(DWORD pid, bool& x86)
     return false;
 }
 
+// The documented start of SYSTEM_PROCESS_INFORMATION, including the fields that winternl.h hides
+struct SystemProcessInformation
+{
+    ULONG NextEntryOffset;
+    ULONG NumberOfThreads;
+    LARGE_INTEGER Reserved[3];
+    LARGE_INTEGER CreateTime;
+    LARGE_INTEGER UserTime;
+    LARGE_INTEGER KernelTime;
+    UNICODE_STRING ImageName;
+    LONG BasePriority;
+    HANDLE UniqueProcessId;
+    HANDLE InheritedFromUniqueProcessId;
+};
+
+typedef NTSTATUS (NTAPI *NtQuerySystemInformationProc)(ULONG SystemInformationClass, PVOID SystemInformation, ULONG SystemInformationLength, PULONG ReturnLength);
+const ULONG SystemProcessInformationClass = 5;
+const NTSTATUS StatusInfoLengthMismatch = (NTSTATUS)0xC0000004L;
+
+// A pid can be reused once the process exited, together with the start time it identifies one process
+struct ProcessEntry
+{
+    DWORD Pid;
+    UINT64 CreateTime;
+    std::wstring Name;
+    HWND Window;    // Provides the icon in the menu
+    bool Checked;   // CanOpen ran for this process
+    bool CanOpen;
+    bool x86;
+};
+
+// The processes of the menu, refreshed in the background so the menu does not wait for the access checks.
+// An access check is only done once for every process.
+static std::mutex g_RefreshLock;
+static std::mutex g_ProcessesLock;
+static std::vector<ProcessEntry> g_Processes;
+// One worker for all background refreshes, woken through g_PrefetchQueued
+static std::thread g_PrefetchThread;
+static std::mutex g_PrefetchLock;
+static std::condition_variable g_PrefetchWake;
+static bool g_PrefetchQueued;   // Stays set while the refresh runs
+static bool g_PrefetchStop;
+static DWORD g_LastPrefetch;
+const DWORD kPrefetchInterval = 2000;
+
 static BOOL __stdcall enumProc2(HWND hwnd, LPARAM lParam)
 {
     if (IsWindowVisible(hwnd) && GetWindow(hwnd, GW_OWNER) == NULL)
     {
         DWORD pID = 0;
         GetWindowThreadProcessId(hwnd, &pID);
-        g_Windows[pID] = hwnd;
+        (*(std::unordered_map<DWORD, HWND>*)lParam)[pID] = hwnd;
     }
 
     return TRUE;
 }
 
-static void AddMenu(HMENU Menu, int Index, UINT AddType, DWORD pid, WCHAR* buffer)
+// One call for all processes, where the toolhelp snapshot has no start times
+static bool QueryProcesses(std::vector<BYTE>& Buffer)
+{
+    static NtQuerySystemInformationProc NtQuerySystemInformation =
+        (NtQuerySystemInformationProc)GetProcAddress(GetModuleHandleW(L"ntdll.dll"), "NtQuerySystemInformation");
+    if (!NtQuerySystemInformation)
+        return false;
+
+    if (Buffer.empty())
+        Buffer.resize(256 * 1024);
+
+    for (;;)
+    {
+        ULONG Needed = 0;
+        NTSTATUS Status = NtQuerySystemInformation(SystemProcessInformationClass, Buffer.data(), (ULONG)Buffer.size(), &Needed);
+        if (Status != StatusInfoLengthMismatch)
+            return NT_SUCCESS(Status);
+        // Processes can start before the next call
+        Buffer.resize(std::max<size_t>(Buffer.size() * 2, Needed + 64 * 1024));
+    }
+}
+
+static void RefreshProcesses()
+{
+    std::lock_guard<std::mutex> refresh(g_RefreshLock);
+
+    static std::vector<BYTE> Buffer;
+    if (!QueryProcesses(Buffer))
+        return;
+
+    std::unordered_map<DWORD, HWND> Windows;
+    EnumWindows(enumProc2, (LPARAM)&Windows);
+
+    // Only this function changes g_Processes, so it is read without the lock
+    std::unordered_map<DWORD, const ProcessEntry*> Known;
+    for (const ProcessEntry& Entry : g_Processes)
+        Known[Entry.Pid] = &Entry;
+
+    std::vector<ProcessEntry> Entries;
+    for (size_t Offset = 0;;)
+    {
+        const SystemProcessInformation* Info = (const SystemProcessInformation*)(Buffer.data() + Offset);
+        ProcessEntry Entry;
+        Entry.Pid = (DWORD)(ULONG_PTR)Info->UniqueProcessId;
+        Entry.CreateTime = Info->CreateTime.QuadPart;
+        Entry.Name.assign(Info->ImageName.Buffer ? Info->ImageName.Buffer : L"", Info->ImageName.Length / sizeof(WCHAR));
+        auto window = Windows.find(Entry.Pid);
+        Entry.Window = window != Windows.end() ? window->second : NULL;
+        Entry.Checked = Entry.CanOpen = Entry.x86 = false;
+
+        auto known = Known.find(Entry.Pid);
+        if (known != Known.end() && known->second->CreateTime == Entry.CreateTime)
+        {
+            Entry.Checked = true;
+            Entry.CanOpen = known->second->CanOpen;
+            Entry.x86 = known->second->x86;
+        }
+        Entries.push_back(std::move(Entry));
+
+        if (!Info->NextEntryOffset)
+            break;
+        Offset += Info->NextEntryOffset;
+    }
+
+    std::vector<ProcessEntry*> Unchecked;
+    for (ProcessEntry& Entry : Entries)
+    {
+        if (!Entry.Checked)
+            Unchecked.push_back(&Entry);
+    }
+
+    if (g_IsRunningOnWow == -1)
+        IsWow64Process(GetCurrentProcess(), &g_IsRunningOnWow);
+    ParallelFor(Unchecked.size(), [&](size_t n)
+    {
+        ProcessEntry& Entry = *Unchecked[n];
+        Entry.CanOpen = CanOpen(Entry.Pid, Entry.x86);
+        Entry.Checked = true;
+    });
+
+    std::lock_guard<std::mutex> lock(g_ProcessesLock);
+    g_Processes.swap(Entries);
+}
+
+static void PrefetchWorker()
+{
+    std::unique_lock<std::mutex> lock(g_PrefetchLock);
+    for (;;)
+    {
+        g_PrefetchWake.wait(lock, [] { return g_PrefetchStop || g_PrefetchQueued; });
+        if (g_PrefetchStop)
+            return;
+
+        lock.unlock();
+        RefreshProcesses();
+        lock.lock();
+        g_PrefetchQueued = false;
+    }
+}
+
+// Skipped when the previous refresh is still running
+static void StartRefresh()
+{
+    {
+        std::lock_guard<std::mutex> lock(g_PrefetchLock);
+        if (g_PrefetchQueued)
+            return;
+        g_PrefetchQueued = true;
+    }
+    g_LastPrefetch = GetTickCount();
+
+    if (!g_PrefetchThread.joinable())
+        g_PrefetchThread = std::thread(PrefetchWorker);
+    g_PrefetchWake.notify_one();
+}
+
+void StopProcessList()
+{
+    if (!g_PrefetchThread.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(g_PrefetchLock);
+        g_PrefetchStop = true;
+    }
+    g_PrefetchWake.notify_one();
+    g_PrefetchThread.join();
+}
+
+void PrefetchProcessList()
+{
+    if (g_LastPrefetch && GetTickCount() - g_LastPrefetch < kPrefetchInterval)
+        return;
+    StartRefresh();
+}
+
+static void AddMenu(HMENU Menu, int Index, UINT AddType, DWORD pid, HWND Window, WCHAR* buffer)
 {
     MENUITEMINFOW mii = { sizeof(mii) };
     mii.fMask = MIIM_ID | MIIM_STRING | MIIM_DATA | MIIM_BITMAP | MIIM_FTYPE;
@@ -105,16 +304,22 @@ static void AddMenu(HMENU Menu, int Index, UINT AddType, DWORD pid, WCHAR* buffe
     mii.wID = pid;
     mii.dwTypeData = buffer;
     mii.hbmpItem = HBMMENU_SYSTEM;  /* Use the icon from the window specified in dwItemData */
-    ULONG_PTR wnd = (ULONG_PTR)g_Windows[pid];
-    mii.dwItemData = wnd;
+    mii.dwItemData = (ULONG_PTR)Window;
     InsertMenuItemW(Menu, Index, TRUE, &mii);
 }
 
 static HMENU CreateProcessMenu(UINT Height)
 {
     HMENU Menu = NULL;
-    g_Windows.clear();
-    EnumWindows(enumProc2, NULL);
+
+    // The menu shows the processes of the last refresh, only when there was none yet it waits for one
+    bool Empty;
+    {
+        std::lock_guard<std::mutex> lock(g_ProcessesLock);
+        Empty = g_Processes.empty();
+    }
+    if (Empty)
+        RefreshProcesses();
 
     Menu = CreatePopupMenu();
 
@@ -128,20 +333,21 @@ static HMENU CreateProcessMenu(UINT Height)
     UINT ItemHeight, Current = 0;
     ItemHeight = GetSystemMetrics(SM_CYMENUSIZE);
     int Num = 0;
-    mfl::win32::ProcessIterator pi;
-    while(pi.next())
+    std::lock_guard<std::mutex> lock(g_ProcessesLock);
+    for (const ProcessEntry& Entry : g_Processes)
     {
-        bool x86 = false;
-        if (CanOpen(pi->th32ProcessID, x86))
+        if (Entry.CanOpen)
         {
-            UINT flags = MF_STRING | MF_ENABLED;
-            StringCchPrintfW(buffer, _countof(buffer), L"%s (%u%s)", pi->szExeFile, pi->th32ProcessID, x86 ? L", x86" : L"");
+            StringCchPrintfW(buffer, _countof(buffer), L"%s (%u%s)", Entry.Name.c_str(), Entry.Pid, Entry.x86 ? L", x86" : L"");
             Current += ItemHeight;
-            AddMenu(Menu, Num++, (Current > Height) ? MF_MENUBARBREAK : 0, pi->th32ProcessID, buffer);
+            AddMenu(Menu, Num++, (Current > Height) ? MF_MENUBARBREAK : 0, Entry.Pid, Entry.Window, buffer);
             if (Current > Height)
                 Current = ItemHeight;
         }
     }
+
+    // Processes that started meanwhile show up the next time
+    StartRefresh();
     return Menu;
 }
 
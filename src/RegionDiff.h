@@ -0,0 +1,79 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     Linear merge of two sorted region lists into an edit script
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+struct EditOp
+{
+    enum Kind
+    {
+        Update, // Present in both lists
+        Insert, // Only present in the new list
+        Remove, // Only present in the old list
+    };
+
+    Kind Type;
+    size_t OldIndex;    // First index in the old list (for Insert: the position it is inserted before)
+    size_t NewIndex;    // First index in the new list (for Remove: the position it was removed before)
+    size_t Count;
+};
+
+typedef std::vector<EditOp> EditScript;
+
+// Walk two lists that are sorted on the same key exactly once, and describe
+// how to turn the old list into the new one as a list of coalesced ranges.
+// Compare(o, n) returns <0 when old[o] sorts before new[n], 0 when both
+// have the same key, and >0 when old[o] sorts after new[n].
+// The operations are emitted in list order, so replaying them while
+// appending to an output list yields the new list in order.
+template<typename Compare>
+void MergeDiff(size_t OldCount, size_t NewCount, Compare cmp, EditScript& Script)
+{
+    Script.clear();
+
+    auto emit = [&Script](EditOp::Kind Type, size_t OldIndex, size_t NewIndex)
+    {
+        if (!Script.empty())
+        {
+            EditOp& last = Script.back();
+            if (last.Type == Type &&
+                last.OldIndex + (Type != EditOp::Insert ? last.Count : 0) == OldIndex &&
+                last.NewIndex + (Type != EditOp::Remove ? last.Count : 0) == NewIndex)
+            {
+                ++last.Count;
+                return;
+            }
+        }
+        EditOp op = { Type, OldIndex, NewIndex, 1 };
+        Script.push_back(op);
+    };
+
+    size_t o = 0, n = 0;
+    while (o < OldCount && n < NewCount)
+    {
+        int result = cmp(o, n);
+        if (result == 0)
+        {
+            emit(EditOp::Update, o++, n++);
+        }
+        else if (result < 0)
+        {
+            emit(EditOp::Remove, o++, n);
+        }
+        else
+        {
+            emit(EditOp::Insert, o, n++);
+        }
+    }
+    while (o < OldCount)
+        emit(EditOp::Remove, o++, n);
+    while (n < NewCount)
+        emit(EditOp::Insert, o, n++);
+}
@@ -0,0 +1,643 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     Filter expressions over the region list
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#include "MemView.h"
+#include "RegionFilter.h"
+#include <unordered_map>
+
+typedef RegionFilter::Field Field;
+typedef RegionFilter::Op Op;
+
+enum AccessLetters
+{
+    AccessRead = (1 << 0),
+    AccessWrite = (1 << 1),
+    AccessExecute = (1 << 2),
+    AccessCopy = (1 << 3),
+    AccessGuard = (1 << 4),
+};
+
+static BYTE AccessLetters(DWORD Access)
+{
+    switch (Access)
+    {
+    case PAGE_READONLY:             return AccessRead;
+    case PAGE_READWRITE:            return AccessRead | AccessWrite;
+    case PAGE_WRITECOPY:            return AccessRead | AccessWrite | AccessCopy;
+    case PAGE_EXECUTE:              return AccessExecute;
+    case PAGE_EXECUTE_READ:         return AccessRead | AccessExecute;
+    case PAGE_EXECUTE_READWRITE:    return AccessRead | AccessWrite | AccessExecute;
+    case PAGE_EXECUTE_WRITECOPY:    return AccessRead | AccessWrite | AccessExecute | AccessCopy;
+    default:                        return 0;
+    }
+}
+
+// A table lookup instead of a switch, this runs for every row of a scan
+static struct LetterTable
+{
+    LetterTable()
+    {
+        for (DWORD n = 0; n < _countof(Letters); ++n)
+            Letters[n] = AccessLetters(n);
+    }
+    BYTE Letters[0x100];
+} g_Letters;
+
+static DWORD ProtectionLetters(DWORD Protect)
+{
+    return g_Letters.Letters[Protect & 0xff] | ((Protect & PAGE_GUARD) ? AccessGuard : 0);
+}
+
+static std::wstring Lower(const wchar_t* Text)
+{
+    std::wstring Result(Text);
+    for (wchar_t& ch : Result)
+        ch = towlower(ch);
+    return Result;
+}
+
+class RegionFilter::Parser
+{
+public:
+    Parser(const wchar_t* Text, std::vector<Node>& Nodes)
+        :mText(Text), mPos(Text), mNodes(Nodes)
+    {
+        next();
+    }
+
+    bool parse(size_t& Root)
+    {
+        if (!parseOr(Root))
+            return false;
+        if (mToken != Token::End)
+            return fail(L"Unexpected '%s'");
+        return true;
+    }
+
+    std::wstring Error;
+    Info Fields = Info::None;
+    bool Volatile = false;
+
+private:
+    enum class Token { End, Word, String, Symbol };
+
+    bool fail(const wchar_t* Format)
+    {
+        WCHAR buf[200];
+        StringCchPrintfW(buf, _countof(buf), Format, mValue.c_str());
+        Error = buf;
+        return false;
+    }
+
+    static bool isWordChar(wchar_t ch)
+    {
+        return iswalnum(ch) || ch == L'_' || ch == L'.' || ch == L'-';
+    }
+
+    void next()
+    {
+        while (iswspace(*mPos))
+            ++mPos;
+
+        mValue.clear();
+        if (!*mPos)
+        {
+            mToken = Token::End;
+        }
+        else if (*mPos == L'"')
+        {
+            // Only \" is an escape, so regular expressions keep their backslashes
+            mToken = Token::String;
+            for (++mPos; *mPos && *mPos != L'"'; ++mPos)
+            {
+                if (mPos[0] == L'\\' && mPos[1] == L'"')
+                    ++mPos;
+                mValue += *mPos;
+            }
+            if (*mPos)
+                ++mPos;
+        }
+        else if (isWordChar(*mPos))
+        {
+            mToken = Token::Word;
+            while (isWordChar(*mPos))
+                mValue += *mPos++;
+        }
+        else
+        {
+            static const wchar_t* Symbols[] = { L"&&", L"||", L"==", L"!=", L"<=", L">=", L"!", L"(", L")", L"=", L"<", L">", L"~", L"&", L"|" };
+            mToken = Token::Symbol;
+            mValue = *mPos;
+            for (const wchar_t* Symbol : Symbols)
+            {
+                size_t Length = wcslen(Symbol);
+                if (!wcsncmp(mPos, Symbol, Length))
+                {
+                    mValue = Symbol;
+                    break;
+                }
+            }
+            mPos += mValue.size();
+        }
+    }
+
+    bool isWord(const wchar_t* Word) const
+    {
+        return mToken == Token::Word && !_wcsicmp(mValue.c_str(), Word);
+    }
+
+    bool isSymbol(const wchar_t* Symbol) const
+    {
+        return mToken == Token::Symbol && mValue == Symbol;
+    }
+
+    size_t add(Node::Kind Type, size_t Left, size_t Right)
+    {
+        Node node = Node();
+        node.Type = Type;
+        node.Left = Left;
+        node.Right = Right;
+        mNodes.push_back(node);
+        return mNodes.size() - 1;
+    }
+
+    bool parseOr(size_t& Result)
+    {
+        if (!parseAnd(Result))
+            return false;
+        while (isSymbol(L"||") || isSymbol(L"|") || isWord(L"or"))
+        {
+            next();
+            size_t Right;
+            if (!parseAnd(Right))
+                return false;
+            Result = add(Node::Or, Result, Right);
+        }
+        return true;
+    }
+
+    bool parseAnd(size_t& Result)
+    {
+        if (!parseUnary(Result))
+            return false;
+        while (isSymbol(L"&&") || isSymbol(L"&") || isWord(L"and"))
+        {
+            next();
+            size_t Right;
+            if (!parseUnary(Right))
+                return false;
+            Result = add(Node::And, Result, Right);
+        }
+        return true;
+    }
+
+    bool parseUnary(size_t& Result)
+    {
+        if (isSymbol(L"!") || isWord(L"not"))
+        {
+            next();
+            if (!parseUnary(Result))
+                return false;
+            Result = add(Node::Not, Result, 0);
+            return true;
+        }
+        if (isSymbol(L"("))
+        {
+            next();
+            if (!parseOr(Result))
+                return false;
+            if (!isSymbol(L")"))
+                return fail(L"Expected ')' instead of '%s'");
+            next();
+            return true;
+        }
+        return parseTerm(Result);
+    }
+
+    bool parseField(Field& Column)
+    {
+        static const struct { const wchar_t* Name; Field Column; } Fields[] =
+        {
+            { L"type", Field::Type },
+            { L"state", Field::State },
+            { L"prot", Field::Protect },
+            { L"access", Field::Protect },
+            { L"initial", Field::InitialProtect },
+            { L"addr", Field::Address },
+            { L"address", Field::Address },
+            { L"base", Field::Base },
+            { L"size", Field::Size },
+            { L"resident", Field::Resident },
+            { L"notresident", Field::NotResident },
+            { L"name", Field::Name },
+            { L"mapped", Field::Name },
+        };
+        for (const auto& field : Fields)
+        {
+            if (isWord(field.Name))
+            {
+                Column = field.Column;
+                return true;
+            }
+        }
+        return fail(mToken == Token::End ? L"Expected a field" : L"Unknown field '%s'");
+    }
+
+    bool parseOp(Op& Compare)
+    {
+        static const struct { const wchar_t* Symbol; Op Compare; } Ops[] =
+        {
+            { L"==", Op::Equal },
+            { L"=", Op::Equal },
+            { L"!=", Op::NotEqual },
+            { L"<", Op::Less },
+            { L"<=", Op::LessEqual },
+            { L">", Op::Greater },
+            { L">=", Op::GreaterEqual },
+            { L"~", Op::Regex },
+        };
+        if (isWord(L"contains"))
+        {
+            Compare = Op::Contains;
+            return true;
+        }
+        for (const auto& op : Ops)
+        {
+            if (isSymbol(op.Symbol))
+            {
+                Compare = op.Compare;
+                return true;
+            }
+        }
+        return fail(L"Expected a comparison instead of '%s'");
+    }
+
+    bool parseNumber(UINT64& Number)
+    {
+        const wchar_t* Text = mValue.c_str();
+        wchar_t* End;
+        Number = _wcstoui64(Text, &End, 0);
+        if (End == Text)
+            return fail(L"Expected a number instead of '%s'");
+
+        switch (towupper(*End))
+        {
+        case L'K': Number <<= 10; ++End; break;
+        case L'M': Number <<= 20; ++End; break;
+        case L'G': Number <<= 30; ++End; break;
+        case L'T': Number <<= 40; ++End; break;
+        }
+        if (*End)
+            return fail(L"Expected a number instead of '%s'");
+        return true;
+    }
+
+    bool parseLetters(UINT64& Letters)
+    {
+        Letters = 0;
+        for (wchar_t ch : mValue)
+        {
+            switch (towupper(ch))
+            {
+            case L'R': Letters |= AccessRead; break;
+            case L'W': Letters |= AccessWrite; break;
+            case L'E':
+            case L'X': Letters |= AccessExecute; break;
+            case L'C': Letters |= AccessCopy; break;
+            case L'G': Letters |= AccessGuard; break;
+            default:
+                return fail(L"Access can only hold the letters R W X C G, not '%s'");
+            }
+        }
+        return true;
+    }
+
+    bool parseEnum(Field Column, UINT64& Value)
+    {
+        static const struct { Field Column; const wchar_t* Name; DWORD Value; } Names[] =
+        {
+            { Field::Type, L"image", MEM_IMAGE },
+            { Field::Type, L"img", MEM_IMAGE },
+            { Field::Type, L"imag", MEM_IMAGE },
+            { Field::Type, L"mapped", MEM_MAPPED },
+            { Field::Type, L"map", MEM_MAPPED },
+            { Field::Type, L"private", MEM_PRIVATE },
+            { Field::Type, L"priv", MEM_PRIVATE },
+            { Field::State, L"commit", MEM_COMMIT },
+            { Field::State, L"committed", MEM_COMMIT },
+            { Field::State, L"reserve", MEM_RESERVE },
+            { Field::State, L"reserved", MEM_RESERVE },
+        };
+        for (const auto& name : Names)
+        {
+            if (name.Column == Column && !_wcsicmp(mValue.c_str(), name.Name))
+            {
+                Value = name.Value;
+                return true;
+            }
+        }
+        return fail(Column == Field::Type ? L"The type is image, mapped or private, not '%s'" : L"The state is commit or reserve, not '%s'");
+    }
+
+    bool parseTerm(size_t& Result)
+    {
+        Node node = Node();
+        node.Type = Node::Term;
+        if (!parseField(node.Column))
+            return false;
+        next();
+        if (!parseOp(node.Compare))
+            return false;
+        next();
+        if (mToken != Token::Word && mToken != Token::String)
+            return fail(L"Expected a value instead of '%s'");
+
+        bool Ordered = node.Compare != Op::Contains && node.Compare != Op::Regex;
+        bool Equality = node.Compare == Op::Equal || node.Compare == Op::NotEqual;
+        switch (node.Column)
+        {
+        case Field::Type:
+        case Field::State:
+            if (!Equality)
+                return fail(L"Type and state can only be compared with == and !=");
+            if (!parseEnum(node.Column, node.Number))
+                return false;
+            break;
+        case Field::Protect:
+        case Field::InitialProtect:
+            if (!Equality && node.Compare != Op::Contains)
+                return fail(L"Access can only be compared with ==, != and contains");
+            if (!parseLetters(node.Number))
+                return false;
+            break;
+        case Field::Name:
+            if (node.Compare != Op::Contains && node.Compare != Op::Regex && !Equality)
+                return fail(L"Names can only be compared with ==, !=, contains and ~");
+            node.Text = Lower(mValue.c_str());
+            if (node.Compare == Op::Regex)
+            {
+                try
+                {
+                    node.Pattern = std::make_shared<std::wregex>(mValue, std::regex_constants::ECMAScript | std::regex_constants::icase);
+                }
+                catch (const std::regex_error&)
+                {
+                    return fail(L"Invalid regular expression '%s'");
+                }
+            }
+            break;
+        default:
+            if (!Ordered)
+                return fail(L"Numbers can only be compared with == != < <= > >=");
+            if (!parseNumber(node.Number))
+                return false;
+            break;
+        }
+
+        switch (node.Column)
+        {
+        case Field::Type: Fields |= Info::Type; break;
+        case Field::Protect: Fields |= Info::Protection; break;
+        case Field::InitialProtect: Fields |= Info::AllocationProtection; break;
+        case Field::Address: Fields |= Info::Address; break;
+        case Field::Size: Fields |= Info::Size; break;
+        case Field::Name: Fields |= Info::Mapped; break;
+        default: Volatile = true; break;
+        }
+
+        next();
+        mNodes.push_back(node);
+        Result = mNodes.size() - 1;
+        return true;
+    }
+
+    const wchar_t* mText;
+    const wchar_t* mPos;
+    Token mToken;
+    std::wstring mValue;
+    std::vector<Node>& mNodes;
+};
+
+RegionFilter::RegionFilter()
+    :mRoot(0)
+    ,mFields(Info::None)
+    ,mVolatile(false)
+{
+}
+
+bool RegionFilter::compile(const wchar_t* Text)
+{
+    mNodes.clear();
+    mError.clear();
+    mFields = Info::None;
+    mVolatile = false;
+
+    const wchar_t* p = Text;
+    while (iswspace(*p))
+        ++p;
+    // No filter shows everything
+    if (!*p)
+        return true;
+
+    Parser parser(Text, mNodes);
+    if (!parser.parse(mRoot))
+    {
+        mNodes.clear();
+        mError = parser.Error;
+        return false;
+    }
+    mFields = parser.Fields;
+    mVolatile = parser.Volatile;
+    return true;
+}
+
+// The switch is outside of the loops, so every loop is a plain pass over one column
+template<typename Get>
+static void ScanNumber(Op Compare, UINT64 Value, size_t Count, BYTE* Out, Get get)
+{
+    switch (Compare)
+    {
+    case Op::Equal:         for (size_t n = 0; n < Count; ++n) Out[n] = get(n) == Value; break;
+    case Op::NotEqual:      for (size_t n = 0; n < Count; ++n) Out[n] = get(n) != Value; break;
+    case Op::Less:          for (size_t n = 0; n < Count; ++n) Out[n] = get(n) < Value; break;
+    case Op::LessEqual:     for (size_t n = 0; n < Count; ++n) Out[n] = get(n) <= Value; break;
+    case Op::Greater:       for (size_t n = 0; n < Count; ++n) Out[n] = get(n) > Value; break;
+    case Op::GreaterEqual:  for (size_t n = 0; n < Count; ++n) Out[n] = get(n) >= Value; break;
+    case Op::Contains:      for (size_t n = 0; n < Count; ++n) Out[n] = (get(n) & Value) == Value; break;
+    default:                memset(Out, 0, Count); break;
+    }
+}
+
+static bool CompareNumber(Op Compare, UINT64 Left, UINT64 Value)
+{
+    switch (Compare)
+    {
+    case Op::Equal:         return Left == Value;
+    case Op::NotEqual:      return Left != Value;
+    case Op::Less:          return Left < Value;
+    case Op::LessEqual:     return Left <= Value;
+    case Op::Greater:       return Left > Value;
+    case Op::GreaterEqual:  return Left >= Value;
+    case Op::Contains:      return (Left & Value) == Value;
+    default:                return false;
+    }
+}
+
+bool RegionFilter::matchName(const Node& Term, const wchar_t* Name) const
+{
+    if (Term.Compare == Op::Regex)
+        return std::regex_search(Name, *Term.Pattern);
+
+    std::wstring Text = Lower(Name);
+    switch (Term.Compare)
+    {
+    case Op::Equal:     return Text == Term.Text;
+    case Op::NotEqual:  return Text != Term.Text;
+    case Op::Contains:  return Text.find(Term.Text) != std::wstring::npos;
+    default:            return false;
+    }
+}
+
+void RegionFilter::scanTerm(const Node& Term, const MemSnapshot& Rows, BYTE* Out) const
+{
+    size_t Count = Rows.size();
+    switch (Term.Column)
+    {
+    case Field::Type:
+        ScanNumber(Term.Compare, Term.Number, Count, Out, [&](size_t n) { return (UINT64)Rows.type(n); });
+        break;
+    case Field::State:
+        ScanNumber(Term.Compare, Term.Number, Count, Out, [&](size_t n) { return (UINT64)Rows.state(n); });
+        break;
+    case Field::Protect:
+        ScanNumber(Term.Compare, Term.Number, Count, Out, [&](size_t n) { return (UINT64)ProtectionLetters(Rows.protect(n)); });
+        break;
+    case Field::InitialProtect:
+        ScanNumber(Term.Compare, Term.Number, Count, Out, [&](size_t n) { return (UINT64)ProtectionLetters(Rows.allocationProtect(n)); });
+        break;
+    case Field::Address:
+        ScanNumber(Term.Compare, Term.Number, Count, Out, [&](size_t n) { return (UINT64)(ULONG_PTR)Rows.start(n); });
+        break;
+    case Field::Base:
+        ScanNumber(Term.Compare, Term.Number, Count, Out, [&](size_t n) { return (UINT64)(ULONG_PTR)Rows.allocationStart(n); });
+        break;
+    case Field::Size:
+        ScanNumber(Term.Compare, Term.Number, Count, Out, [&](size_t n) { return (UINT64)Rows.regionSize(n); });
+        break;
+    case Field::Resident:
+        ScanNumber(Term.Compare, Term.Number, Count, Out, [&](size_t n) { return (UINT64)Rows.resident(n); });
+        break;
+    case Field::NotResident:
+        ScanNumber(Term.Compare, Term.Number, Count, Out, [&](size_t n) { return (UINT64)Rows.notResident(n); });
+        break;
+    case Field::Name:
+    {
+        // Names are interned, every distinct name is only compared once.
+        // The sections of one mapping follow each other, so the last name is checked first.
+        std::unordered_map<const wchar_t*, BYTE> Seen;
+        const wchar_t* Last = nullptr;
+        BYTE LastMatch = 0;
+        for (size_t n = 0; n < Count; ++n)
+        {
+            const wchar_t* Name = Rows.mapped(n).c_str();
+            if (Name != Last)
+            {
+                auto it = Seen.find(Name);
+                if (it == Seen.end())
+                    it = Seen.emplace(Name, matchName(Term, Name) ? 1 : 0).first;
+                Last = Name;
+                LastMatch = it->second;
+            }
+            Out[n] = LastMatch;
+        }
+    }
+        break;
+    }
+}
+
+void RegionFilter::scan(size_t Index, const MemSnapshot& Rows, BYTE* Out) const
+{
+    const Node& node = mNodes[Index];
+    size_t Count = Rows.size();
+    switch (node.Type)
+    {
+    case Node::Term:
+        scanTerm(node, Rows, Out);
+        break;
+    case Node::Not:
+        scan(node.Left, Rows, Out);
+        for (size_t n = 0; n < Count; ++n)
+            Out[n] ^= 1;
+        break;
+    case Node::And:
+    case Node::Or:
+    {
+        std::vector<BYTE> Right(Count);
+        scan(node.Left, Rows, Out);
+        scan(node.Right, Rows, Right.data());
+        if (node.Type == Node::And)
+        {
+            for (size_t n = 0; n < Count; ++n)
+                Out[n] &= Right[n];
+        }
+        else
+        {
+            for (size_t n = 0; n < Count; ++n)
+                Out[n] |= Right[n];
+        }
+    }
+        break;
+    }
+}
+
+void RegionFilter::scan(const MemSnapshot& Rows, std::vector<BYTE>& Matches) const
+{
+    Matches.resize(Rows.size());
+    if (empty())
+    {
+        memset(Matches.data(), 1, Matches.size());
+        return;
+    }
+    if (!Matches.empty())
+        scan(mRoot, Rows, Matches.data());
+}
+
+bool RegionFilter::match(size_t Index, const MemSnapshot& Rows, size_t n) const
+{
+    const Node& node = mNodes[Index];
+    switch (node.Type)
+    {
+    case Node::Not:
+        return !match(node.Left, Rows, n);
+    case Node::And:
+        return match(node.Left, Rows, n) && match(node.Right, Rows, n);
+    case Node::Or:
+        return match(node.Left, Rows, n) || match(node.Right, Rows, n);
+    default:
+        break;
+    }
+
+    switch (node.Column)
+    {
+    case Field::Type:           return CompareNumber(node.Compare, Rows.type(n), node.Number);
+    case Field::State:          return CompareNumber(node.Compare, Rows.state(n), node.Number);
+    case Field::Protect:        return CompareNumber(node.Compare, ProtectionLetters(Rows.protect(n)), node.Number);
+    case Field::InitialProtect: return CompareNumber(node.Compare, ProtectionLetters(Rows.allocationProtect(n)), node.Number);
+    case Field::Address:        return CompareNumber(node.Compare, (ULONG_PTR)Rows.start(n), node.Number);
+    case Field::Base:           return CompareNumber(node.Compare, (ULONG_PTR)Rows.allocationStart(n), node.Number);
+    case Field::Size:           return CompareNumber(node.Compare, Rows.regionSize(n), node.Number);
+    case Field::Resident:       return CompareNumber(node.Compare, Rows.resident(n), node.Number);
+    case Field::NotResident:    return CompareNumber(node.Compare, Rows.notResident(n), node.Number);
+    case Field::Name:           return matchName(node, Rows.mapped(n).c_str());
+    }
+    return false;
+}
+
+bool RegionFilter::match(const MemSnapshot& Rows, size_t n) const
+{
+    return empty() || match(mRoot, Rows, n);
+}
@@ -0,0 +1,71 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     Filter expressions over the region list
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <regex>
+#include "MemInfo.h"
+
+// A filter is a set of comparisons of region fields, combined with && || ! and parentheses:
+//   type==priv && prot contains W && size>1M && name~"\.dll$"
+// Fields:
+//   type        image (img), mapped (map) or private (priv)
+//   state       commit or reserve
+//   prot        the access letters R W X C (copy on write) G (guard), initial is the initial access
+//   addr, base  the region and allocation address
+//   size, resident, notresident
+//   name        the mapped file
+// Operators are == != < <= > >= for numbers, == != and contains for access letters,
+// and == != contains and ~ (regular expression) for names. Text is compared without case.
+// Numbers can be hex (0x) and have a K M G or T suffix.
+class RegionFilter
+{
+public:
+    RegionFilter();
+
+    // False when Text is not a valid filter, see error
+    bool compile(const wchar_t* Text);
+    const std::wstring& error() const { return mError; }
+    bool empty() const { return mNodes.empty(); }
+
+    // Evaluate every row, one field at a time. Matches holds 1 for the rows that pass.
+    void scan(const MemSnapshot& Rows, std::vector<BYTE>& Matches) const;
+    bool match(const MemSnapshot& Rows, size_t n) const;
+    // A row where only these fields changed still has the result of the previous evaluation
+    bool unaffected(Info Changed) const { return !mVolatile && (Changed & mFields) == Info::None; }
+
+    enum class Field { Type, State, Protect, InitialProtect, Address, Base, Size, Resident, NotResident, Name };
+    enum class Op { Equal, NotEqual, Less, LessEqual, Greater, GreaterEqual, Contains, Regex };
+
+    struct Node
+    {
+        enum Kind { And, Or, Not, Term } Type;
+        size_t Left, Right;     // Operands of And, Or and Not
+        Field Column;
+        Op Compare;
+        UINT64 Number;          // Numbers, the type or state, or the access letters
+        std::wstring Text;      // Lower case
+        std::shared_ptr<std::wregex> Pattern;
+    };
+
+private:
+    class Parser;
+
+    void scan(size_t Node, const MemSnapshot& Rows, BYTE* Out) const;
+    void scanTerm(const Node& Term, const MemSnapshot& Rows, BYTE* Out) const;
+    bool match(size_t Node, const MemSnapshot& Rows, size_t n) const;
+    bool matchName(const Node& Term, const wchar_t* Name) const;
+
+    std::vector<Node> mNodes;
+    size_t mRoot;
+    Info mFields;       // The fields that MemSnapshot::compare tracks
+    bool mVolatile;     // Fields are used that change without being marked
+    std::wstring mError;
+};
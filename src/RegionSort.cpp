@@ -0,0 +1,113 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     Sort order of the region list
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#include "MemView.h"
+#include "RegionSort.h"
+#include <algorithm>
+
+template<typename T>
+static int Compare(T a, T b)
+{
+    return a < b ? -1 : (b < a ? 1 : 0);
+}
+
+RegionSort::RegionSort(int Column, bool Descending)
+    :mColumn(Column)
+    ,mDescending(Descending)
+{
+}
+
+int RegionSort::compare(const MemSnapshot& Rows, size_t a, size_t b) const
+{
+    switch (MemInfo::Index2Info(mColumn))
+    {
+    case Info::Address:                 return Compare(Rows.start(a), Rows.start(b));
+    case Info::Size:                    return Compare(Rows.regionSize(a), Rows.regionSize(b));
+    case Info::Type:                    return Compare(Rows.type(a), Rows.type(b));
+    case Info::Protection:              return Compare(Rows.protect(a), Rows.protect(b));
+    case Info::AllocationProtection:    return Compare(Rows.allocationProtect(a), Rows.allocationProtect(b));
+    case Info::Mapped:
+        // Names are interned, the same name is the same string
+        if (Rows.mapped(a) == Rows.mapped(b))
+            return 0;
+        return _wcsicmp(Rows.mapped(a).c_str(), Rows.mapped(b).c_str());
+    case Info::Resident:                return Compare(Rows.resident(a), Rows.resident(b));
+    case Info::PrivateResident:         return Compare(Rows.privateResident(a), Rows.privateResident(b));
+    case Info::SharedResident:          return Compare(Rows.sharedResident(a), Rows.sharedResident(b));
+    case Info::NotResident:             return Compare(Rows.notResident(a), Rows.notResident(b));
+    default:                            return 0;
+    }
+}
+
+bool RegionSort::less(const MemSnapshot& Rows, size_t a, size_t b) const
+{
+    int order = compare(Rows, a, b);
+    if (order == 0)
+        order = Compare(a, b);
+    return mDescending ? order > 0 : order < 0;
+}
+
+void RegionSort::sort(const MemSnapshot& Rows, const std::vector<BYTE>& Matches, std::vector<size_t>& Order) const
+{
+    Order.clear();
+    for (size_t n = 0; n < Rows.size(); ++n)
+    {
+        if (Matches.empty() || Matches[n])
+            Order.push_back(n);
+    }
+    if (!natural())
+        std::sort(Order.begin(), Order.end(), [&](size_t a, size_t b) { return less(Rows, a, b); });
+}
+
+void RegionSort::update(const std::vector<size_t>& Previous, size_t PreviousCount, const MemSnapshot& Rows,
+    const std::vector<size_t>& Origin, const std::vector<BYTE>& Matches, SortScratch& Scratch, std::vector<size_t>& Order) const
+{
+    // The working set is not compared between refreshes, these columns are sorted again completely
+    Info Key = MemInfo::Index2Info(mColumn);
+    if ((Key & (Info::Resident | Info::PrivateResident | Info::SharedResident | Info::NotResident)) != Info::None)
+    {
+        sort(Rows, Matches, Order);
+        return;
+    }
+
+    const size_t kRemoved = (size_t)-1;
+    std::vector<size_t>& Moved = Scratch.Moved;
+    Moved.assign(PreviousCount, kRemoved);
+    for (size_t n = 0; n < Rows.size(); ++n)
+    {
+        if (Origin[n] < PreviousCount)
+            Moved[Origin[n]] = n;
+    }
+
+    // The rows that were in Previous and kept their value are still sorted,
+    // Origin only grows, so rows with the same value keep their address order as well
+    std::vector<BYTE>& Placed = Scratch.Placed;
+    std::vector<size_t>& Kept = Scratch.Kept;
+    Placed.assign(Rows.size(), 0);
+    Kept.clear();
+    for (size_t o : Previous)
+    {
+        size_t n = o < PreviousCount ? Moved[o] : kRemoved;
+        if (n == kRemoved || (!Matches.empty() && !Matches[n]) || (Rows.changed(n) & Key) != Info::None)
+            continue;
+        Kept.push_back(n);
+        Placed[n] = 1;
+    }
+
+    std::vector<size_t>& Fresh = Scratch.Fresh;
+    Fresh.clear();
+    for (size_t n = 0; n < Rows.size(); ++n)
+    {
+        if (!Placed[n] && (Matches.empty() || Matches[n]))
+            Fresh.push_back(n);
+    }
+
+    auto Less = [&](size_t a, size_t b) { return less(Rows, a, b); };
+    std::sort(Fresh.begin(), Fresh.end(), Less);
+    Order.resize(Kept.size() + Fresh.size());
+    std::merge(Kept.begin(), Kept.end(), Fresh.begin(), Fresh.end(), Order.begin(), Less);
+}
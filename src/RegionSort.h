@@ -0,0 +1,52 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     Sort order of the region list
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#pragma once
+
+#include <vector>
+#include "MemInfo.h"
+
+// The buffers of RegionSort::update, kept by the caller so that a refresh reuses them
+struct SortScratch
+{
+    std::vector<size_t> Moved;
+    std::vector<BYTE> Placed;
+    std::vector<size_t> Kept;
+    std::vector<size_t> Fresh;
+};
+
+// The order of the region list, by one column.
+// Rows with the same value are kept in address order, so every row has a single place.
+class RegionSort
+{
+public:
+    // Column is the index of MemSnapshot::columnText, the address ascending is the order of the regions
+    explicit RegionSort(int Column = 0, bool Descending = false);
+
+    int column() const { return mColumn; }
+    bool descending() const { return mDescending; }
+    bool natural() const { return mColumn == 0 && !mDescending; }
+    bool operator==(const RegionSort& other) const { return mColumn == other.mColumn && mDescending == other.mDescending; }
+
+    // Row a comes before row b
+    bool less(const MemSnapshot& Rows, size_t a, size_t b) const;
+
+    // Sort the rows that are set in Matches, or all rows when Matches is empty
+    void sort(const MemSnapshot& Rows, const std::vector<BYTE>& Matches, std::vector<size_t>& Order) const;
+
+    // Patch Previous, the order of the previous PreviousCount rows, into the order of Rows.
+    // Origin holds the previous index of every row, or an index past PreviousCount for new rows.
+    // Rows that keep their value stay in place, only new and changed rows are sorted and merged in.
+    void update(const std::vector<size_t>& Previous, size_t PreviousCount, const MemSnapshot& Rows,
+        const std::vector<size_t>& Origin, const std::vector<BYTE>& Matches, SortScratch& Scratch, std::vector<size_t>& Order) const;
+
+private:
+    int compare(const MemSnapshot& Rows, size_t a, size_t b) const;
+
+    int mColumn;
+    bool mDescending;
+};
@@ -0,0 +1,198 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     Totals of the region list, kept up to date from the changes between refreshes
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#include "MemView.h"
+#include "RegionStats.h"
+
+static int TypeOf(DWORD Type)
+{
+    switch (Type)
+    {
+    case MEM_IMAGE: return StatImage;
+    case MEM_MAPPED: return StatMapped;
+    case MEM_PRIVATE: return StatPrivate;
+    default: return -1;
+    }
+}
+
+static int ProtectionOf(DWORD Protect)
+{
+    if (Protect & PAGE_GUARD)
+        return StatGuard;
+
+    switch (Protect & 0xff)
+    {
+    case PAGE_EXECUTE_READWRITE:
+    case PAGE_EXECUTE_WRITECOPY:
+        return StatReadWriteExecute;
+    case PAGE_EXECUTE:
+    case PAGE_EXECUTE_READ:
+        return StatReadExecute;
+    case PAGE_READWRITE:
+    case PAGE_WRITECOPY:
+        return StatReadWrite;
+    case PAGE_READONLY:
+        return StatReadOnly;
+    default:
+        return StatNoAccess;
+    }
+}
+
+// Sizes are unsigned, a region that is removed again undoes exactly what adding it did
+static void Apply(StatTotals& Totals, DWORD State, SIZE_T Size, bool Add)
+{
+    SIZE_T Sign = Add ? 1 : (SIZE_T)-1;
+    Totals.Regions += Sign;
+    if (State == MEM_COMMIT)
+        Totals.Committed += Sign * Size;
+    else if (State == MEM_RESERVE)
+        Totals.Reserved += Sign * Size;
+}
+
+RegionStats::RegionStats()
+{
+    reset();
+}
+
+void RegionStats::reset()
+{
+    mAttached = false;
+    mLast.clear();
+    mTotal = StatTotals();
+    for (StatTotals& Totals : mTypes)
+        Totals = StatTotals();
+    for (StatTotals& Totals : mProtections)
+        Totals = StatTotals();
+    mAllocations.clear();
+    mBySize.clear();
+    mByGrowth.clear();
+    mModulesBySize.clear();
+    mModulesByGrowth.clear();
+}
+
+void RegionStats::apply(const MemSnapshot& Regions, size_t n, bool Add)
+{
+    DWORD State = Regions.state(n);
+    SIZE_T Size = Regions.regionSize(n);
+    Apply(mTotal, State, Size, Add);
+
+    int Type = TypeOf(Regions.type(n));
+    if (Type >= 0)
+        Apply(mTypes[Type], State, Size, Add);
+    if (State == MEM_COMMIT)
+        Apply(mProtections[ProtectionOf(Regions.protect(n))], State, Size, Add);
+
+    PBYTE Base = Regions.allocationStart(n);
+    auto it = mAllocations.find(Base);
+    if (it == mAllocations.end())
+    {
+        AllocationStats Allocation = AllocationStats();
+        Allocation.Base = Base;
+        it = mAllocations.emplace(Base, Allocation).first;
+    }
+    else
+    {
+        mBySize.erase(std::make_pair(it->second.Totals.Committed, Base));
+        mByGrowth.erase(std::make_pair(it->second.growth(), Base));
+        mModulesBySize.erase(std::make_pair(it->second.Totals.Committed, Base));
+        mModulesByGrowth.erase(std::make_pair(it->second.growth(), Base));
+    }
+
+    AllocationStats& Allocation = it->second;
+    Apply(Allocation.Totals, State, Size, Add);
+    if (Allocation.Totals.Regions == 0)
+    {
+        mAllocations.erase(it);
+        return;
+    }
+    // The name and type of the first region of the allocation
+    if (Add && Regions.start(n) == Base)
+    {
+        Allocation.Type = Regions.type(n);
+        Allocation.Mapped = Regions.mapped(n);
+    }
+    mBySize.insert(std::make_pair(Allocation.Totals.Committed, Base));
+    mByGrowth.insert(std::make_pair(Allocation.growth(), Base));
+    if (Allocation.Type == MEM_IMAGE)
+    {
+        mModulesBySize.insert(std::make_pair(Allocation.Totals.Committed, Base));
+        mModulesByGrowth.insert(std::make_pair(Allocation.growth(), Base));
+    }
+}
+
+void RegionStats::update(const MemSnapshot& Regions)
+{
+    MergeDiff(mLast.size(), Regions.size(), [&](size_t o, size_t n) { return mLast.cmp(o, Regions, n); }, mScript);
+    for (const EditOp& op : mScript)
+    {
+        for (size_t k = 0; k < op.Count; ++k)
+        {
+            size_t o = op.OldIndex + k, n = op.NewIndex + k;
+            switch (op.Type)
+            {
+            case EditOp::Remove:
+                apply(mLast, o, false);
+                break;
+            case EditOp::Insert:
+                apply(Regions, n, true);
+                break;
+            case EditOp::Update:
+                // compare does not look at the state, a commit can keep the protection
+                if (mLast.compare(o, Regions, n) != Info::None || mLast.state(o) != Regions.state(n) ||
+                    mLast.allocationStart(o) != Regions.allocationStart(n))
+                {
+                    // Added first, so an allocation of a single region is not dropped and its growth forgotten
+                    apply(Regions, n, true);
+                    apply(mLast, o, false);
+                }
+                break;
+            }
+        }
+    }
+
+    if (!mAttached)
+    {
+        // Growth is counted from what the process had when it was attached
+        mByGrowth.clear();
+        mModulesByGrowth.clear();
+        for (auto& it : mAllocations)
+        {
+            it.second.Initial = it.second.Totals.Committed;
+            mByGrowth.insert(std::make_pair(it.second.growth(), it.first));
+            if (it.second.Type == MEM_IMAGE)
+                mModulesByGrowth.insert(std::make_pair(it.second.growth(), it.first));
+        }
+        mAttached = true;
+    }
+
+    mLast.clear();
+    mLast.reserve(Regions.size());
+    for (size_t n = 0; n < Regions.size(); ++n)
+        mLast.push_back(Regions, n);
+}
+
+void RegionStats::summary(StatSummary& Summary) const
+{
+    Summary.Total = mTotal;
+    std::copy(std::begin(mTypes), std::end(mTypes), Summary.Types);
+    std::copy(std::begin(mProtections), std::end(mProtections), Summary.Protections);
+    Summary.Allocations = mAllocations.size();
+
+    top(mBySize, false, Summary.Largest);
+    top(mByGrowth, true, Summary.Growing);
+    top(mModulesBySize, false, Summary.LargestModules);
+    top(mModulesByGrowth, true, Summary.GrowingModules);
+}
+
+// The last kTop entries of Order, only those that grew when Grown is set
+template<typename Key>
+void RegionStats::top(const std::set<std::pair<Key, PBYTE>>& Order, bool Grown, std::vector<AllocationStats>& Top) const
+{
+    Top.clear();
+    for (auto it = Order.rbegin(); it != Order.rend() && Top.size() < kTop && (!Grown || it->first > 0); ++it)
+        Top.push_back(mAllocations.at(it->second));
+}
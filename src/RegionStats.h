@@ -0,0 +1,99 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     Totals of the region list, kept up to date from the changes between refreshes
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#pragma once
+
+#include <vector>
+#include <set>
+#include <unordered_map>
+#include "MemInfo.h"
+#include "RegionDiff.h"
+
+struct StatTotals
+{
+    size_t Regions;
+    SIZE_T Committed;
+    SIZE_T Reserved;
+};
+
+// All regions that share an allocationStart, for an image that is the whole module
+struct AllocationStats
+{
+    PBYTE Base;
+    DWORD Type;
+    MappedName Mapped;
+    StatTotals Totals;
+    SIZE_T Initial;     // Committed when the process was attached, 0 for later allocations
+
+    INT64 growth() const { return (INT64)Totals.Committed - (INT64)Initial; }
+};
+
+enum StatType
+{
+    StatImage,
+    StatMapped,
+    StatPrivate,
+    StatTypeCount
+};
+
+// Of committed memory only
+enum StatProtection
+{
+    StatReadWriteExecute,
+    StatReadExecute,
+    StatReadWrite,
+    StatReadOnly,
+    StatGuard,
+    StatNoAccess,
+    StatProtectionCount
+};
+
+struct StatSummary
+{
+    StatTotals Total;
+    StatTotals Types[StatTypeCount];
+    StatTotals Protections[StatProtectionCount];
+    size_t Allocations;
+    std::vector<AllocationStats> Largest;   // By committed size
+    std::vector<AllocationStats> Growing;   // By growth of the committed size
+    std::vector<AllocationStats> LargestModules;
+    std::vector<AllocationStats> GrowingModules;
+};
+
+// Every refresh only applies the regions that were added, removed or changed since the previous one,
+// the allocations stay ordered by size and by growth so the top lists are not sorted again either.
+// Image allocations are ordered a second time on their own, those are the modules.
+class RegionStats
+{
+public:
+    static const size_t kTop = 20;
+
+    RegionStats();
+
+    // Forget the previous process, the next update is the attach
+    void reset();
+    void update(const MemSnapshot& Regions);
+    void summary(StatSummary& Summary) const;
+
+private:
+    void apply(const MemSnapshot& Regions, size_t n, bool Add);
+    template<typename Key>
+    void top(const std::set<std::pair<Key, PBYTE>>& Order, bool Grown, std::vector<AllocationStats>& Top) const;
+
+    bool mAttached;
+    MemSnapshot mLast;
+    EditScript mScript;
+
+    StatTotals mTotal;
+    StatTotals mTypes[StatTypeCount];
+    StatTotals mProtections[StatProtectionCount];
+    std::unordered_map<PBYTE, AllocationStats> mAllocations;
+    std::set<std::pair<SIZE_T, PBYTE>> mBySize;
+    std::set<std::pair<INT64, PBYTE>> mByGrowth;
+    std::set<std::pair<SIZE_T, PBYTE>> mModulesBySize;
+    std::set<std::pair<INT64, PBYTE>> mModulesByGrowth;
+};
@@ -0,0 +1,96 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     Building the entries of the region list from a refresh
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#include "MemView.h"
+#include "RegionView.h"
+#include "RegionFilter.h"
+#include <algorithm>
+
+bool BuildListView(const MemSnapshot& Base, const MemSnapshot& Regions, bool ShowAll, const std::vector<PBYTE>& Toggled,
+    EditScript& Script, MemSnapshot& Next, std::vector<size_t>& Origin)
+{
+    MergeDiff(Base.size(), Regions.size(), [&](size_t o, size_t n) { return Base.cmp(o, Regions, n); }, Script);
+
+    // Replay the script to build the list of visible entries in one pass
+    Next.clear();
+    Next.reserve(Regions.size());
+    Origin.clear();
+    PBYTE collapsedAllocation = nullptr;
+    bool Changed = false;
+    for (const EditOp& op : Script)
+    {
+        if (op.Type == EditOp::Remove)
+        {
+            Changed = true;
+            continue;
+        }
+
+        for (size_t k = 0; k < op.Count; ++k)
+        {
+            size_t n = op.NewIndex + k;
+            PBYTE allocationStart = Regions.allocationStart(n);
+            bool isFirstEntryOfMapping = Regions.start(n) == allocationStart;
+
+            // Hide the sections of a collapsed allocation
+            if (!isFirstEntryOfMapping && allocationStart == collapsedAllocation && !ShowAll)
+                continue;
+
+            size_t item = Next.size();
+            if (op.Type == EditOp::Update)
+            {
+                Next.push_back(Base, op.OldIndex + k);
+                Next.update(item, Regions, n);
+                Info changed = Next.changed(item);
+                if (changed != Info::None && changed != Info::Color)
+                    Changed = true;
+                Origin.push_back(op.OldIndex + k);
+            }
+            else
+            {
+                // The sections of collapsed allocations are inserted on every refresh, they are skipped above
+                Next.push_back(Regions, n);
+                Changed = true;
+                Origin.push_back(kNewEntry);
+            }
+
+            if (isFirstEntryOfMapping)
+            {
+                if (std::count(Toggled.begin(), Toggled.end(), allocationStart) & 1)
+                    Next.setFlag(item, MemSnapshot::IsExpanded, !Next.hasFlag(item, MemSnapshot::IsExpanded));
+
+                bool canExpand = n + 1 < Regions.size() && Regions.allocationStart(n + 1) == allocationStart;
+                Next.setFlag(item, MemSnapshot::CanExpand, canExpand);
+
+                if (!canExpand)
+                    Next.setFlag(item, MemSnapshot::IsExpanded, false);
+
+                collapsedAllocation = Next.hasFlag(item, MemSnapshot::IsExpanded) ? nullptr : allocationStart;
+            }
+        }
+    }
+    return Changed;
+}
+
+void FilterListView(const RegionFilter* Filter, const MemSnapshot& Next, const std::vector<size_t>& Origin,
+    const std::vector<BYTE>& BaseMatches, std::vector<BYTE>& Matches)
+{
+    if (!Filter)
+    {
+        Matches.clear();
+        return;
+    }
+
+    Matches.resize(Next.size());
+    for (size_t n = 0; n < Next.size(); ++n)
+    {
+        size_t o = Origin[n];
+        if (o < BaseMatches.size() && Filter->unaffected(Next.changed(n)))
+            Matches[n] = BaseMatches[o];
+        else
+            Matches[n] = Filter->match(Next, n) ? 1 : 0;
+    }
+}
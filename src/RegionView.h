@@ -0,0 +1,30 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     Building the entries of the region list from a refresh
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#pragma once
+
+#include <vector>
+#include "MemInfo.h"
+#include "RegionDiff.h"
+
+class RegionFilter;
+
+// Origin of an entry that was not in the previous list
+const size_t kNewEntry = (size_t)-1;
+
+// Diff Regions against the visible entries in Base, and build the new visible entries in Next.
+// Origin receives the index in Base of every entry in Next.
+// Collapsed allocations are shown completely when ShowAll is set, so that a filter sees all regions.
+// Every time an allocation is in Toggled, it is expanded or collapsed once more than it is in Base.
+// Returns true when regions were added, removed or changed
+bool BuildListView(const MemSnapshot& Base, const MemSnapshot& Regions, bool ShowAll, const std::vector<PBYTE>& Toggled,
+    EditScript& Script, MemSnapshot& Next, std::vector<size_t>& Origin);
+
+// Filter the entries of Next. An entry that was in Base keeps its result,
+// unless one of the fields that the filter looks at changed.
+void FilterListView(const RegionFilter* Filter, const MemSnapshot& Next, const std::vector<size_t>& Origin,
+    const std::vector<BYTE>& BaseMatches, std::vector<BYTE>& Matches);
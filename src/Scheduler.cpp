@@ -0,0 +1,189 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     One timer that refreshes all views at their own pace
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#include "MemView.h"
+#include "Scheduler.h"
+#include <algorithm>
+
+const DWORD kMinInterval = 50;
+const DWORD kDefaultInterval = 1000;
+const DWORD kMaxInterval = 5000;
+// Minimized and hidden windows
+const DWORD kHiddenInterval = 10000;
+// A refresh may take at most 1/kBudget of the interval
+const DWORD kBudget = 20;
+
+struct ScheduledView
+{
+    HWND Window;
+    DWORD Pid;
+    DWORD Interval;
+    DWORD Due;          // GetTickCount
+    DWORD Started;      // GetTickCount of the last refresh
+    DWORD Cost;         // Milliseconds the last refresh took, including the work reported by workers
+    bool Changed;       // Reported since the last refresh
+};
+
+static std::vector<ScheduledView> g_Views;
+static UINT_PTR g_TimerId;
+
+static void CALLBACK SchedulerTimerProc(HWND, UINT, UINT_PTR, DWORD);
+
+static ScheduledView* FindView(HWND hwnd)
+{
+    for (ScheduledView& View : g_Views)
+    {
+        if (View.Window == hwnd)
+            return &View;
+    }
+    return nullptr;
+}
+
+static DWORD EffectiveInterval(const ScheduledView& View)
+{
+    DWORD Interval = std::max(View.Interval, View.Cost * kBudget);
+    if (IsIconic(View.Window) || !IsWindowVisible(View.Window))
+        Interval = std::max(Interval, kHiddenInterval);
+    return Interval;
+}
+
+static bool IsDue(const ScheduledView& View, DWORD Now, DWORD Slack)
+{
+    return (INT)(View.Due - Now) <= (INT)Slack;
+}
+
+// Wake up when the first view is due
+static void ArmTimer()
+{
+    if (g_Views.empty())
+    {
+        if (g_TimerId)
+            KillTimer(NULL, g_TimerId);
+        g_TimerId = 0;
+        return;
+    }
+
+    DWORD Now = GetTickCount();
+    INT Delay = INT_MAX;
+    for (const ScheduledView& View : g_Views)
+        Delay = std::min(Delay, (INT)(View.Due - Now));
+    g_TimerId = SetTimer(NULL, g_TimerId, (UINT)std::max<INT>(Delay, USER_TIMER_MINIMUM), SchedulerTimerProc);
+}
+
+static void Refresh(HWND hwnd)
+{
+    ScheduledView* View = FindView(hwnd);
+    if (!View)
+        return;
+
+    // Nothing changed since the last refresh, back off
+    if (!View->Changed)
+        View->Interval = std::min(kMaxInterval, View->Interval * 3 / 2);
+    View->Changed = false;
+
+    View->Started = GetTickCount();
+    View->Cost = 0;
+
+    LARGE_INTEGER Frequency, Start, End;
+    QueryPerformanceFrequency(&Frequency);
+    QueryPerformanceCounter(&Start);
+    SendMessageW(hwnd, WM_SCHEDULED_REFRESH, 0, 0);
+    QueryPerformanceCounter(&End);
+
+    // The window may have been destroyed by the refresh
+    View = FindView(hwnd);
+    if (!View)
+        return;
+
+    View->Cost += (DWORD)((End.QuadPart - Start.QuadPart) * 1000 / Frequency.QuadPart);
+    View->Due = GetTickCount() + EffectiveInterval(*View);
+}
+
+static void CALLBACK SchedulerTimerProc(HWND, UINT, UINT_PTR, DWORD)
+{
+    DWORD Now = GetTickCount();
+
+    // Collect the windows first, a refresh can add or remove views
+    std::vector<HWND> Due;
+    for (const ScheduledView& View : g_Views)
+    {
+        if (IsDue(View, Now, 0))
+            Due.push_back(View.Window);
+    }
+    // Views of the same process that would be due within half their interval come along
+    for (size_t n = 0, Count = Due.size(); n < Count; ++n)
+    {
+        DWORD Pid = FindView(Due[n])->Pid;
+        for (const ScheduledView& View : g_Views)
+        {
+            if (Pid && View.Pid == Pid && IsDue(View, Now, View.Interval / 2) &&
+                std::find(Due.begin(), Due.end(), View.Window) == Due.end())
+            {
+                Due.push_back(View.Window);
+            }
+        }
+    }
+
+    for (HWND hwnd : Due)
+        Refresh(hwnd);
+    ArmTimer();
+}
+
+void ScheduleRefresh(HWND hwnd, DWORD Pid)
+{
+    ScheduledView* View = FindView(hwnd);
+    if (View)
+    {
+        View->Pid = Pid;
+        return;
+    }
+
+    DWORD Now = GetTickCount();
+    ScheduledView NewView = { hwnd, Pid, kDefaultInterval, Now + kDefaultInterval, Now, 0, false };
+    g_Views.push_back(NewView);
+    ArmTimer();
+}
+
+void UnscheduleRefresh(HWND hwnd)
+{
+    g_Views.erase(std::remove_if(g_Views.begin(), g_Views.end(), [hwnd](const ScheduledView& View) { return View.Window == hwnd; }), g_Views.end());
+    ArmTimer();
+}
+
+void ReportChanges(HWND hwnd)
+{
+    ScheduledView* View = FindView(hwnd);
+    if (!View || View->Changed)
+        return;
+
+    View->Changed = true;
+    View->Interval = std::max(kMinInterval, View->Interval / 2);
+    // Do not wait for the rest of a long interval
+    DWORD Due = GetTickCount() + EffectiveInterval(*View);
+    if ((INT)(Due - View->Due) < 0)
+    {
+        View->Due = Due;
+        ArmTimer();
+    }
+}
+
+
+void ReportCost(HWND hwnd, DWORD Milliseconds)
+{
+    ScheduledView* View = FindView(hwnd);
+    if (!View)
+        return;
+
+    View->Cost += Milliseconds;
+    // The work of a worker finishes after the refresh was scheduled again, keep it within the budget
+    DWORD Due = View->Started + EffectiveInterval(*View);
+    if ((INT)(Due - View->Due) > 0)
+    {
+        View->Due = Due;
+        ArmTimer();
+    }
+}
@@ -0,0 +1,23 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     One timer that refreshes all views at their own pace
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#pragma once
+
+// Sent to a scheduled window when it should refresh itself
+const UINT WM_SCHEDULED_REFRESH = WM_APP + 0x100;
+
+// Add a window, or update the process it shows (0 when it does not show a live process).
+// Views of the same process that are nearly due are refreshed together.
+void ScheduleRefresh(HWND hwnd, DWORD Pid);
+void UnscheduleRefresh(HWND hwnd);
+// The last refresh of hwnd found changes, so it is refreshed more often.
+// Views that do not report changes, or that are not visible, are refreshed less often.
+void ReportChanges(HWND hwnd);
+// Time spent on a refresh of hwnd outside of WM_SCHEDULED_REFRESH, by a worker thread.
+// It counts towards the cost of the last refresh, which limits how often it is refreshed.
+void ReportCost(HWND hwnd, DWORD Milliseconds);
+
@@ -0,0 +1,401 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     Multithreaded pattern search over all readable regions
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#include "MemView.h"
+#include "MemInfo.h"
+#include "Search.h"
+#include "ByteDiff.h"
+#include "MemReader.h"
+#include <intrin.h>
+#include <algorithm>
+#include <cwctype>
+
+#if defined(_M_IX86) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+// Regions are split in chunks, so that big regions are spread over all workers
+const SIZE_T kChunkSize = 1024 * 1024;
+
+static int HexValue(wchar_t ch)
+{
+    if (ch >= '0' && ch <= '9')
+        return ch - '0';
+    if (ch >= 'a' && ch <= 'f')
+        return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F')
+        return ch - 'A' + 10;
+    return -1;
+}
+
+// Bytes that are very common in code and data make a poor anchor
+static int AnchorCost(BYTE Value)
+{
+    switch (Value)
+    {
+    case 0x00: case 0xff: case 0xcc: case 0x90:
+        return 3;
+    case 0x0f: case 0x48: case 0x4c: case 0x89: case 0x8b: case 0xe8:
+        return 2;
+    }
+    return 1;
+}
+
+static bool ChooseAnchors(SearchPattern& Pattern)
+{
+    const size_t Length = Pattern.size();
+    auto known = [&](size_t n) { return Pattern.Mask.empty() || Pattern.Mask[n] == 0xff; };
+    auto cost = [&](size_t n) { return AnchorCost(Pattern.Value[n]); };
+
+    size_t First = Length;
+    for (size_t n = 0; n < Length; ++n)
+    {
+        if (known(n) && (First == Length || cost(n) < cost(First)))
+            First = n;
+    }
+    if (First == Length)
+        return false;
+
+    // The second anchor is as cheap as possible, and as far away from the first as possible
+    size_t Last = First;
+    size_t distance = 0;
+    for (size_t n = 0; n < Length; ++n)
+    {
+        if (n == First || !known(n))
+            continue;
+        size_t d = n > First ? n - First : First - n;
+        if (Last == First || cost(n) < cost(Last) || (cost(n) == cost(Last) && d > distance))
+        {
+            Last = n;
+            distance = d;
+        }
+    }
+
+    Pattern.First = First;
+    Pattern.Last = Last;
+    return true;
+}
+
+static bool ParseSignature(const wchar_t* Text, SearchPattern& Pattern)
+{
+    for (const wchar_t* p = Text; *p;)
+    {
+        if (iswspace(*p))
+        {
+            ++p;
+            continue;
+        }
+        const wchar_t* end = p;
+        while (*end && !iswspace(*end))
+            ++end;
+
+        if (end - p == 1 && *p == '?')
+        {
+            Pattern.Value.push_back(0);
+            Pattern.Mask.push_back(0);
+        }
+        else if ((end - p) % 2)
+        {
+            return false;
+        }
+        else
+        {
+            for (; p < end; p += 2)
+            {
+                BYTE value = 0, mask = 0;
+                for (int n = 0; n < 2; ++n)
+                {
+                    value <<= 4;
+                    mask <<= 4;
+                    if (p[n] == '?')
+                        continue;
+                    int nibble = HexValue(p[n]);
+                    if (nibble < 0)
+                        return false;
+                    value |= nibble;
+                    mask |= 0xf;
+                }
+                Pattern.Value.push_back(value);
+                Pattern.Mask.push_back(mask);
+            }
+        }
+        p = end;
+    }
+
+    // Without wildcards this is a plain compare
+    if (std::all_of(Pattern.Mask.begin(), Pattern.Mask.end(), [](BYTE mask) { return mask == 0xff; }))
+        Pattern.Mask.clear();
+    return true;
+}
+
+bool ParseSearchPattern(const wchar_t* Text, SearchKind Kind, SearchPattern& Search)
+{
+    Search.Value.clear();
+    Search.Mask.clear();
+    std::vector<BYTE>& Pattern = Search.Value;
+    switch (Kind)
+    {
+    case SearchKind::Hex:
+    {
+        int high = -1;
+        for (const wchar_t* p = Text; *p; ++p)
+        {
+            if (iswspace(*p) || *p == ',')
+                continue;
+            int value = HexValue(*p);
+            if (value < 0)
+                return false;
+            if (high < 0)
+            {
+                high = value;
+            }
+            else
+            {
+                Pattern.push_back((BYTE)((high << 4) | value));
+                high = -1;
+            }
+        }
+        // Only whole bytes
+        if (high >= 0)
+            return false;
+        break;
+    }
+    case SearchKind::Ascii:
+        for (const wchar_t* p = Text; *p; ++p)
+        {
+            if (*p > 0xff)
+                return false;
+            Pattern.push_back((BYTE)*p);
+        }
+        break;
+    case SearchKind::Utf16:
+        for (const wchar_t* p = Text; *p; ++p)
+        {
+            Pattern.push_back((BYTE)(*p & 0xff));
+            Pattern.push_back((BYTE)(*p >> 8));
+        }
+        break;
+    case SearchKind::Signature:
+        if (!ParseSignature(Text, Search))
+            return false;
+        break;
+    }
+    return !Pattern.empty() && ChooseAnchors(Search);
+}
+
+static bool IsReadable(const MemSnapshot& Regions, size_t n)
+{
+    DWORD protect = Regions.protect(n);
+    return Regions.state(n) == MEM_COMMIT && protect != 0 && (protect & (PAGE_NOACCESS | PAGE_GUARD)) == 0;
+}
+
+static bool IsExecutable(const MemSnapshot& Regions, size_t n)
+{
+    return (Regions.protect(n) & (PAGE_EXECUTE | PAGE_EXECUTE_READ | PAGE_EXECUTE_READWRITE | PAGE_EXECUTE_WRITECOPY)) != 0;
+}
+
+static bool MatchAt(const BYTE* Data, const SearchPattern& Pattern)
+{
+    const size_t Length = Pattern.size();
+    const BYTE* Value = Pattern.Value.data();
+    if (Pattern.Mask.empty())
+        return !memcmp(Data, Value, Length);
+
+    const BYTE* Mask = Pattern.Mask.data();
+    size_t n = 0;
+#if defined(_M_IX86) || defined(_M_X64)
+    for (; n + 16 <= Length; n += 16)
+    {
+        __m128i data = _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(Data + n)),
+                                     _mm_loadu_si128(reinterpret_cast<const __m128i*>(Mask + n)));
+        __m128i equal = _mm_cmpeq_epi8(data, _mm_loadu_si128(reinterpret_cast<const __m128i*>(Value + n)));
+        if (_mm_movemask_epi8(equal) != 0xffff)
+            return false;
+    }
+#endif
+    for (; n < Length; ++n)
+    {
+        if ((Data[n] & Mask[n]) != Value[n])
+            return false;
+    }
+    return true;
+}
+
+// Report the offset of every match that starts in the first Limit bytes of Data
+template<typename Callback>
+static void ScanBuffer(const BYTE* Data, size_t Length, const SearchPattern& Pattern, size_t Limit, Callback report)
+{
+    const size_t PatternLen = Pattern.size();
+    if (Length < PatternLen)
+        return;
+
+    size_t Positions = std::min(Length - PatternLen + 1, Limit);
+    size_t n = 0;
+    const size_t A = Pattern.First, B = Pattern.Last;
+
+#if defined(_M_IX86) || defined(_M_X64)
+    // Only compare the whole pattern where both anchor bytes match
+    const __m128i First = _mm_set1_epi8((char)Pattern.Value[A]);
+    const __m128i Last = _mm_set1_epi8((char)Pattern.Value[B]);
+    for (; n + 16 <= Positions; n += 16)
+    {
+        __m128i first = _mm_cmpeq_epi8(First, _mm_loadu_si128(reinterpret_cast<const __m128i*>(Data + n + A)));
+        __m128i last = _mm_cmpeq_epi8(Last, _mm_loadu_si128(reinterpret_cast<const __m128i*>(Data + n + B)));
+        unsigned long mask = (unsigned long)_mm_movemask_epi8(_mm_and_si128(first, last));
+        unsigned long index;
+        while (_BitScanForward(&index, mask))
+        {
+            mask &= mask - 1;
+            if (MatchAt(Data + n + index, Pattern))
+                report(n + index);
+        }
+    }
+#endif
+
+    for (; n < Positions; ++n)
+    {
+        if (Data[n + A] == Pattern.Value[A] && MatchAt(Data + n, Pattern))
+            report(n);
+    }
+}
+
+MemSearch::MemSearch()
+    :mProcess(NULL), mNotify(NULL), mMessage(0)
+    , mNext(0), mActive(0), mCancel(false), mTruncated(false)
+    , mTotal(0)
+{
+}
+
+MemSearch::~MemSearch()
+{
+    cancel();
+}
+
+void MemSearch::start(HANDLE hProcess, const MemSnapshot& Regions, const SearchPattern& Pattern, bool ExecutableOnly, HWND Notify, UINT Message)
+{
+    cancel();
+
+    mProcess = hProcess;
+    mNotify = Notify;
+    mMessage = Message;
+    mPattern = Pattern;
+    mPending.clear();
+    mTotal = 0;
+    mTruncated = false;
+    mCancel = false;
+    mNext = 0;
+
+    mChunks.clear();
+    for (size_t n = 0; n < Regions.size(); ++n)
+    {
+        if (!IsReadable(Regions, n) || (ExecutableOnly && !IsExecutable(Regions, n)))
+            continue;
+
+        PBYTE start = Regions.start(n);
+        SIZE_T size = Regions.regionSize(n);
+        for (SIZE_T offset = 0; offset < size; offset += kChunkSize)
+        {
+            Chunk chunk;
+            chunk.Start = start + offset;
+            chunk.Size = std::min(kChunkSize, size - offset);
+            // Overlap with the next chunk, so matches crossing the boundary are found
+            chunk.ReadSize = std::min(chunk.Size + mPattern.size() - 1, size - offset);
+            chunk.Region = n;
+            mChunks.push_back(chunk);
+        }
+    }
+
+    size_t workers = std::max(1u, std::thread::hardware_concurrency());
+    workers = std::min(workers, std::max<size_t>(1, mChunks.size()));
+    mActive = workers;
+    for (size_t n = 0; n < workers; ++n)
+        mThreads.push_back(std::thread(&MemSearch::worker, this));
+}
+
+void MemSearch::cancel()
+{
+    mCancel = true;
+    for (std::thread& thread : mThreads)
+        thread.join();
+    mThreads.clear();
+}
+
+void MemSearch::takeHits(std::vector<SearchHit>& Hits)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    Hits.insert(Hits.end(), mPending.begin(), mPending.end());
+    mPending.clear();
+}
+
+void MemSearch::publish(std::vector<SearchHit>& Hits)
+{
+    bool notify;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        size_t room = kMaxHits - mTotal;
+        if (Hits.size() >= room)
+        {
+            Hits.resize(room);
+            mTruncated = true;
+            mCancel = true;
+        }
+        // Only notify once until the ui has picked up the hits
+        notify = mPending.empty() && !Hits.empty();
+        mPending.insert(mPending.end(), Hits.begin(), Hits.end());
+        mTotal += Hits.size();
+    }
+    Hits.clear();
+    if (notify)
+        PostMessageW(mNotify, mMessage, 0, 0);
+}
+
+void MemSearch::worker()
+{
+    std::vector<BYTE> buffer(kChunkSize + mPattern.size());
+    std::vector<DWORD> valid;
+    std::vector<SearchHit> hits;
+
+    while (!mCancel)
+    {
+        size_t index = mNext++;
+        if (index >= mChunks.size())
+            break;
+
+        const Chunk& chunk = mChunks[index];
+        auto report = [&](PBYTE Address)
+        {
+            SearchHit hit = { Address, chunk.Region };
+            hits.push_back(hit);
+        };
+
+        SIZE_T Read = 0;
+        if (ReadProcessMemory(mProcess, chunk.Start, buffer.data(), chunk.ReadSize, &Read) && Read == chunk.ReadSize)
+        {
+            ScanBuffer(buffer.data(), chunk.ReadSize, mPattern, chunk.Size,
+                [&](size_t offset) { report(chunk.Start + offset); });
+        }
+        else
+        {
+            // Only scan the parts that could be read
+            valid.resize(MaskWords(chunk.ReadSize));
+            ReadMemoryPages(mProcess, chunk.Start, buffer.data(), chunk.ReadSize, valid.data());
+            for (size_t start = FindMaskRunEnd(valid.data(), 0, chunk.ReadSize, false); start < chunk.Size;)
+            {
+                size_t end = FindMaskRunEnd(valid.data(), start, chunk.ReadSize, true);
+                ScanBuffer(buffer.data() + start, end - start, mPattern, chunk.Size - start,
+                    [&](size_t offset) { report(chunk.Start + start + offset); });
+                start = FindMaskRunEnd(valid.data(), end, chunk.ReadSize, false);
+            }
+        }
+
+        if (!hits.empty())
+            publish(hits);
+    }
+
+    if (--mActive == 0)
+        PostMessageW(mNotify, mMessage, 0, 0);
+}
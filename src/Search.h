@@ -0,0 +1,94 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     Multithreaded pattern search over all readable regions
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+
+class MemSnapshot;
+
+enum class SearchKind
+{
+    Hex,
+    Ascii,
+    Utf16,
+    Signature,  // Hex bytes where '?' matches any nibble, "48 8B ? ?? 05"
+};
+
+struct SearchPattern
+{
+    std::vector<BYTE> Value;    // Already masked
+    std::vector<BYTE> Mask;     // Empty when every bit has to match
+    // Two fully known bytes that are compared before the full pattern,
+    // picked so that they rarely match by accident
+    size_t First;
+    size_t Last;
+
+    size_t size() const { return Value.size(); }
+};
+
+// Convert the text entered by the user to the pattern to search for
+bool ParseSearchPattern(const wchar_t* Text, SearchKind Kind, SearchPattern& Pattern);
+
+struct SearchHit
+{
+    PBYTE Address;
+    size_t Region;  // Index in the snapshot that was searched
+};
+
+class MemSearch
+{
+public:
+    MemSearch();
+    ~MemSearch();
+
+    // Search all readable regions of Regions (only the executable ones when ExecutableOnly is set),
+    // using one worker per cpu.
+    // Notify receives Message when new hits are available, and when the search is done.
+    void start(HANDLE hProcess, const MemSnapshot& Regions, const SearchPattern& Pattern, bool ExecutableOnly, HWND Notify, UINT Message);
+    // Stop searching, and wait for the workers to exit
+    void cancel();
+
+    bool done() const { return mActive == 0; }
+    bool truncated() const { return mTruncated; }
+
+    // Move the hits found since the last call to Hits
+    void takeHits(std::vector<SearchHit>& Hits);
+
+    static const size_t kMaxHits = 1 << 20;
+
+private:
+    struct Chunk
+    {
+        PBYTE Start;
+        SIZE_T Size;        // Matches have to start in the first Size bytes
+        SIZE_T ReadSize;    // Size plus the overlap with the next chunk
+        size_t Region;
+    };
+
+    void worker();
+    void publish(std::vector<SearchHit>& Hits);
+
+    HANDLE mProcess;
+    HWND mNotify;
+    UINT mMessage;
+    SearchPattern mPattern;
+    std::vector<Chunk> mChunks;
+    std::vector<std::thread> mThreads;
+
+    std::atomic<size_t> mNext;
+    std::atomic<size_t> mActive;
+    std::atomic<bool> mCancel;
+    std::atomic<bool> mTruncated;
+
+    std::mutex mLock;
+    std::vector<SearchHit> mPending;
+    size_t mTotal;
+};
@@ -0,0 +1,295 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     The search window
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#include "MemView.h"
+#include <Commctrl.h>
+#include <algorithm>
+#include "MemInfo.h"
+#include "Search.h"
+
+#define SEARCH_CLASS TEXT("MemSearchClass")
+const UINT WM_SEARCH_PROGRESS = WM_APP + 1;
+
+static HWND g_SearchWnd;
+static HWND g_PatternEdit;
+static HWND g_KindCombo;
+static HWND g_ExecutableCheck;
+static HWND g_SearchButton;
+static HWND g_ResultList;
+static HWND g_StatusStatic;
+
+static MemSearch g_Search;
+static MemSnapshot g_SearchRegions;
+static std::vector<SearchHit> g_Hits;
+static HANDLE g_SearchProcess;
+static std::wstring g_SearchProcessName;
+
+static wchar_t* Columns[] =
+{
+    L"Address",
+    L"Offset",
+    L"Mapped",
+};
+
+static int Sizes[] = {
+#ifdef _WIN64
+    136,
+#else
+    76,
+#endif
+    70,
+    400,
+};
+
+static void UpdateStatus()
+{
+    WCHAR buf[100];
+    LPCWSTR state = L"";
+    if (!g_Search.done())
+        state = L", searching...";
+    else if (g_Search.truncated())
+        state = L", stopped at the maximum number of hits";
+    StringCchPrintfW(buf, _countof(buf), L"%Iu hits%s", g_Hits.size(), state);
+    Static_SetText(g_StatusStatic, buf);
+    Button_SetText(g_SearchButton, g_Search.done() ? L"Search" : L"Cancel");
+}
+
+static void StartSearch()
+{
+    if (!g_Search.done())
+    {
+        g_Search.cancel();
+        UpdateStatus();
+        return;
+    }
+
+    // A snapshot has no process to search
+    if (g_Snapshot || !g_ProcessHandle)
+    {
+        Static_SetText(g_StatusStatic, L"Searching needs a running process");
+        return;
+    }
+
+    WCHAR Text[512];
+    Edit_GetText(g_PatternEdit, Text, _countof(Text));
+    SearchKind Kind = static_cast<SearchKind>(ComboBox_GetCurSel(g_KindCombo));
+    SearchPattern Pattern;
+    if (!ParseSearchPattern(Text, Kind, Pattern))
+    {
+        Static_SetText(g_StatusStatic, L"Invalid search pattern");
+        return;
+    }
+
+    // Keep our own handle, the main window can switch to another process while searching
+    if (g_SearchProcess)
+        CloseHandle(g_SearchProcess);
+    g_SearchProcess = NULL;
+    DuplicateHandle(GetCurrentProcess(), g_ProcessHandle, GetCurrentProcess(), &g_SearchProcess, 0, FALSE, DUPLICATE_SAME_ACCESS);
+    g_SearchProcessName = g_ProcessName;
+
+    g_Hits.clear();
+    ListView_SetItemCountEx(g_ResultList, 0, 0);
+    MemSnapshot::read(g_SearchProcess, g_SearchRegions);
+    bool ExecutableOnly = Button_GetCheck(g_ExecutableCheck) == BST_CHECKED;
+    g_Search.start(g_SearchProcess, g_SearchRegions, Pattern, ExecutableOnly, g_SearchWnd, WM_SEARCH_PROGRESS);
+    UpdateStatus();
+}
+
+static void HandleProgress()
+{
+    g_Search.takeHits(g_Hits);
+    if (g_Search.done())
+    {
+        // Hits arrive in the order the workers find them
+        std::sort(g_Hits.begin(), g_Hits.end(), [](const SearchHit& left, const SearchHit& right) { return left.Address < right.Address; });
+        InvalidateRect(g_ResultList, NULL, FALSE);
+    }
+    ListView_SetItemCountEx(g_ResultList, g_Hits.size(), LVSICF_NOSCROLL);
+    UpdateStatus();
+}
+
+static void HandleSize(HWND hwnd)
+{
+    RECT client;
+    GetClientRect(hwnd, &client);
+    LONG w = client.right - client.left;
+    LONG ItemHeight = 22, StatusHeight = 16;
+    LONG ButtonWidth = 80, ComboWidth = 90, CheckWidth = 110;
+    HDWP wp = BeginDeferWindowPos(6);
+    wp = DeferWindowPos(wp, g_PatternEdit, 0, client.left, client.top, w - ButtonWidth - ComboWidth - CheckWidth, ItemHeight, 0);
+    wp = DeferWindowPos(wp, g_KindCombo, 0, client.right - ButtonWidth - ComboWidth - CheckWidth, client.top, ComboWidth, 200, 0);
+    wp = DeferWindowPos(wp, g_ExecutableCheck, 0, client.right - ButtonWidth - CheckWidth + 4, client.top, CheckWidth - 4, ItemHeight, 0);
+    wp = DeferWindowPos(wp, g_SearchButton, 0, client.right - ButtonWidth, client.top, ButtonWidth, ItemHeight, 0);
+    wp = DeferWindowPos(wp, g_ResultList, 0, client.left, client.top + ItemHeight, w, client.bottom - client.top - ItemHeight - StatusHeight, 0);
+    wp = DeferWindowPos(wp, g_StatusStatic, 0, client.left, client.bottom - StatusHeight, w, StatusHeight, 0);
+    EndDeferWindowPos(wp);
+    ListView_SetColumnWidth(g_ResultList, _countof(Columns) - 1, LVSCW_AUTOSIZE_USEHEADER);
+}
+
+static LRESULT ResultsWM_NOTIFY(HWND hWnd, WPARAM wParam, LPNMHDR lParam)
+{
+    switch (lParam->code)
+    {
+    case LVN_GETDISPINFO:
+    {
+        NMLVDISPINFO* plvdi = (NMLVDISPINFO*)lParam;
+        if (plvdi->item.mask & LVIF_TEXT)
+        {
+            const SearchHit& hit = g_Hits[plvdi->item.iItem];
+            switch (plvdi->item.iSubItem)
+            {
+            case 0:
+                StringCchPrintfW(plvdi->item.pszText, plvdi->item.cchTextMax, L"%p", hit.Address);
+                break;
+            case 1:
+                // Hits in a module are relative to the module base
+                if (g_SearchRegions.isImage(hit.Region))
+                    StringCchPrintfW(plvdi->item.pszText, plvdi->item.cchTextMax, L"+%Ix", hit.Address - g_SearchRegions.allocationStart(hit.Region));
+                else
+                    StringCchPrintfW(plvdi->item.pszText, plvdi->item.cchTextMax, L"+%Ix", hit.Address - g_SearchRegions.start(hit.Region));
+                break;
+            case 2:
+                StringCchCopyW(plvdi->item.pszText, plvdi->item.cchTextMax, g_SearchRegions.mapped(hit.Region).c_str());
+                break;
+            }
+            return TRUE;
+        }
+    }
+    break;
+    case NM_DBLCLK:
+    {
+        INT Num = ListView_GetNextItem(g_ResultList, -1, LVNI_SELECTED);
+        if (Num >= 0 && (size_t)Num < g_Hits.size())
+        {
+            const SearchHit& hit = g_Hits[Num];
+            ShowMemory(hWnd, g_SearchRegions.at(hit.Region), g_SearchProcess, g_SearchProcessName, hit.Address - g_SearchRegions.start(hit.Region));
+        }
+    }
+        return TRUE;
+    }
+    return DefWindowProc(hWnd, WM_NOTIFY, wParam, (LPARAM)lParam);
+}
+
+LRESULT CALLBACK SearchWndProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
+{
+    switch (uMsg)
+    {
+    case WM_CREATE:
+    {
+        g_PatternEdit = CreateWindowExW(WS_EX_CLIENTEDGE, WC_EDIT, L"", WS_CHILD | WS_VISIBLE | WS_TABSTOP | ES_AUTOHSCROLL,
+            0, 0, 0, 0, hwnd, NULL, g_hInst, NULL);
+        g_KindCombo = CreateWindowW(WC_COMBOBOX, L"", WS_CHILD | WS_VISIBLE | WS_TABSTOP | CBS_DROPDOWNLIST,
+            0, 0, 0, 0, hwnd, NULL, g_hInst, NULL);
+        g_ExecutableCheck = CreateWindowW(WC_BUTTON, L"Executable only", WS_CHILD | WS_VISIBLE | WS_TABSTOP | BS_AUTOCHECKBOX,
+            0, 0, 0, 0, hwnd, NULL, g_hInst, NULL);
+        g_SearchButton = CreateWindowW(WC_BUTTON, L"Search", WS_CHILD | WS_VISIBLE | WS_TABSTOP | BS_DEFPUSHBUTTON,
+            0, 0, 0, 0, hwnd, (HMENU)IDOK, g_hInst, NULL);
+        g_ResultList = CreateWindowW(WC_LISTVIEW, L"", WS_CHILD | LVS_REPORT | WS_VISIBLE | LVS_OWNERDATA | WS_TABSTOP | LVS_SHOWSELALWAYS,
+            0, 0, 0, 0, hwnd, NULL, g_hInst, NULL);
+        g_StatusStatic = CreateWindowW(WC_STATIC, L"", WS_CHILD | WS_VISIBLE | SS_SUNKEN,
+            0, 0, 0, 0, hwnd, NULL, g_hInst, NULL);
+
+        ListView_SetExtendedListViewStyle(g_ResultList, ListView_GetExtendedListViewStyle(g_ResultList) | LVS_EX_FULLROWSELECT | LVS_EX_DOUBLEBUFFER);
+
+        HWND Controls[] = { g_PatternEdit, g_KindCombo, g_ExecutableCheck, g_SearchButton, g_ResultList, g_StatusStatic };
+        for (HWND control : Controls)
+            SetWindowFont(control, getFont(), FALSE);
+
+        ComboBox_AddString(g_KindCombo, L"Hex");
+        ComboBox_AddString(g_KindCombo, L"ASCII");
+        ComboBox_AddString(g_KindCombo, L"UTF-16");
+        ComboBox_AddString(g_KindCombo, L"Signature");
+        ComboBox_SetCurSel(g_KindCombo, 0);
+
+        LVCOLUMN lvc;
+        for (size_t n = 0; n < _countof(Columns); ++n)
+        {
+            lvc.mask = LVCF_FMT | LVCF_WIDTH | LVCF_TEXT | LVCF_SUBITEM;
+            lvc.iSubItem = (int)n;
+            lvc.cx = Sizes[n];
+            lvc.fmt = LVCFMT_LEFT;
+            lvc.pszText = Columns[n];
+            ListView_InsertColumn(g_ResultList, n, &lvc);
+        }
+
+        HandleSize(hwnd);
+        UpdateStatus();
+        SetFocus(g_PatternEdit);
+    }
+    return 0;
+
+    case WM_SIZE:
+        HandleSize(hwnd);
+        return 0;
+
+    case WM_COMMAND:
+        if (LOWORD(wParam) == IDOK)
+        {
+            StartSearch();
+            return 0;
+        }
+        if ((HWND)lParam == g_KindCombo && HIWORD(wParam) == CBN_SELCHANGE)
+        {
+            // Signatures are looked for in code by default
+            bool Signature = static_cast<SearchKind>(ComboBox_GetCurSel(g_KindCombo)) == SearchKind::Signature;
+            Button_SetCheck(g_ExecutableCheck, Signature ? BST_CHECKED : BST_UNCHECKED);
+            return 0;
+        }
+        break;
+
+    case WM_SEARCH_PROGRESS:
+        HandleProgress();
+        return 0;
+
+    case WM_NOTIFY:
+        if (((LPNMHDR)lParam)->hwndFrom == g_ResultList)
+            return ResultsWM_NOTIFY(hwnd, wParam, (LPNMHDR)lParam);
+        break;
+
+    case WM_DESTROY:
+        g_Search.cancel();
+        g_Hits.clear();
+        g_SearchRegions.clear();
+        if (g_SearchProcess)
+            CloseHandle(g_SearchProcess);
+        g_SearchProcess = NULL;
+        RemoveDialogWindow(hwnd);
+        g_SearchWnd = NULL;
+        break;
+    }
+    return DefWindowProc(hwnd, uMsg, wParam, lParam);
+}
+
+void ShowSearch(HWND Parent)
+{
+    if (g_SearchWnd)
+    {
+        SetForegroundWindow(g_SearchWnd);
+        SetFocus(g_PatternEdit);
+        return;
+    }
+
+    WNDCLASSEX wc = { sizeof(wc), 0 };
+    if (!GetClassInfoEx(g_hInst, SEARCH_CLASS, &wc))
+    {
+        wc.lpfnWndProc = SearchWndProc;
+        wc.hInstance = g_hInst;
+        wc.hCursor = LoadCursor((HINSTANCE)NULL, IDC_ARROW);
+        wc.hbrBackground = (HBRUSH)(COLOR_BTNFACE + 1);
+        wc.lpszClassName = SEARCH_CLASS;
+        setIcons(wc);
+
+        if (!RegisterClassEx(&wc))
+            return;
+    }
+
+    g_SearchWnd = CreateWindowEx(WS_EX_CONTROLPARENT, SEARCH_CLASS, L"Search", WS_OVERLAPPEDWINDOW,
+        CW_USEDEFAULT, CW_USEDEFAULT, 640, 400, Parent, NULL, g_hInst, NULL);
+    AddDialogWindow(g_SearchWnd);
+    ShowWindow(g_SearchWnd, SW_SHOW);
+    UpdateWindow(g_SearchWnd);
+}
@@ -0,0 +1,214 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     Comparing two process snapshots
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#include "MemView.h"
+#include "MemInfo.h"
+#include "SnapshotDiff.h"
+#include "SnapshotFile.h"
+#include "RegionDiff.h"
+#include "ByteDiff.h"
+#include "Parallel.h"
+#include <algorithm>
+
+// Pages are handed out to the workers in blocks, so that the results can be joined in order
+const size_t kBlockPages = 256;
+// Blocks are compared in batches, so the ranges waiting to be joined stay bounded
+const size_t kBatchBlocks = 64;
+// A block that changed everywhere stops collecting ranges
+const size_t kMaxBlockRanges = 4096;
+
+struct SnapshotDiff::Block
+{
+    Block() : ChangedBytes(0), Truncated(false) {}
+
+    std::vector<DiffRange> Ranges;
+    UINT64 ChangedBytes;
+    bool Truncated;
+};
+
+static bool IsPayload(DWORD Entry)
+{
+    return Entry != kZeroPage && Entry != kUnreadablePage;
+}
+
+static void AddRange(SnapshotDiff::Block& Out, PBYTE Start, SIZE_T Size)
+{
+    Out.ChangedBytes += Size;
+    if (!Out.Ranges.empty() && Out.Ranges.back().Start + Out.Ranges.back().Size == Start)
+    {
+        Out.Ranges.back().Size += Size;
+    }
+    else if (Out.Ranges.size() < kMaxBlockRanges)
+    {
+        DiffRange range = { Start, Size };
+        Out.Ranges.push_back(range);
+    }
+    else
+    {
+        Out.Truncated = true;
+    }
+}
+
+static void CompareBlock(const SnapshotFile& Old, const SnapshotFile& New, PBYTE Start, SIZE_T Size, const std::atomic<bool>& Cancel, SnapshotDiff::Block& Out)
+{
+    const SIZE_T PageSize = New.pageSize();
+    std::vector<BYTE> OldPage, NewPage;
+    std::vector<DWORD> Valid, Mask;
+
+    for (SIZE_T offset = 0; offset < Size && !Cancel; offset += PageSize)
+    {
+        PBYTE Address = Start + offset;
+        DWORD OldEntry = Old.pageEntry(Address);
+        DWORD NewEntry = New.pageEntry(Address);
+
+        // Most pages are decided without touching the payload
+        if (OldEntry == NewEntry && !IsPayload(OldEntry))
+            continue;
+        if (IsPayload(OldEntry) && IsPayload(NewEntry) && Old.pageHash(OldEntry) == New.pageHash(NewEntry))
+            continue;
+        if (OldEntry == kUnreadablePage || NewEntry == kUnreadablePage)
+        {
+            // The page became readable or unreadable
+            AddRange(Out, Address, PageSize);
+            continue;
+        }
+
+        if (OldPage.empty())
+        {
+            OldPage.resize(PageSize);
+            NewPage.resize(PageSize);
+            Valid.resize(MaskWords(PageSize));
+            Mask.resize(MaskWords(PageSize));
+        }
+        if (Old.read(Address, OldPage.data(), PageSize, Valid.data()) != PageSize ||
+            New.read(Address, NewPage.data(), PageSize, Valid.data()) != PageSize)
+        {
+            continue;
+        }
+
+        std::fill(Mask.begin(), Mask.end(), 0);
+        if (!DiffBytes(OldPage.data(), NewPage.data(), PageSize, Mask.data()))
+            continue;
+
+        for (size_t pos = FindMaskRunEnd(Mask.data(), 0, PageSize, false); pos < PageSize;)
+        {
+            size_t end = FindMaskRunEnd(Mask.data(), pos, PageSize, true);
+            AddRange(Out, Address + pos, end - pos);
+            pos = FindMaskRunEnd(Mask.data(), end, PageSize, false);
+        }
+    }
+}
+
+SnapshotDiff::SnapshotDiff()
+    :mTotalBytes(0), mTruncated(false), mCancel(false)
+{
+}
+
+void SnapshotDiff::clear()
+{
+    mRows.clear();
+    mInfo.clear();
+    mRanges.clear();
+    mTotalBytes = 0;
+    mTruncated = false;
+}
+
+void SnapshotDiff::comparePages(const SnapshotFile& Old, const SnapshotFile& New, PBYTE Start, PBYTE End, Row& Result)
+{
+    const SIZE_T BlockSize = kBlockPages * New.pageSize();
+    std::vector<Block> Blocks;
+    for (PBYTE batch = Start; batch < End && !mCancel;)
+    {
+        size_t count = (size_t)std::min<SIZE_T>(kBatchBlocks, (End - batch + BlockSize - 1) / BlockSize);
+        Blocks.assign(count, Block());
+        ParallelFor(count, [&](size_t index)
+        {
+            PBYTE first = batch + index * BlockSize;
+            CompareBlock(Old, New, first, std::min<SIZE_T>(BlockSize, End - first), mCancel, Blocks[index]);
+        });
+
+        for (const Block& block : Blocks)
+        {
+            Result.ChangedBytes += block.ChangedBytes;
+            mTruncated = mTruncated || block.Truncated;
+            for (const DiffRange& range : block.Ranges)
+            {
+                // Join ranges that continue in the next block
+                if (Result.RangeCount && mRanges.back().Start + mRanges.back().Size == range.Start)
+                {
+                    mRanges.back().Size += range.Size;
+                }
+                else if (mRanges.size() < kMaxRanges)
+                {
+                    mRanges.push_back(range);
+                    ++Result.RangeCount;
+                }
+                else
+                {
+                    mTruncated = true;
+                }
+            }
+        }
+        batch += std::min<SIZE_T>(count * BlockSize, End - batch);
+    }
+}
+
+bool SnapshotDiff::run(const SnapshotFile& Old, const SnapshotFile& New)
+{
+    clear();
+    mCancel = false;
+    if (Old.pageSize() != New.pageSize())
+        return false;
+
+    MemSnapshot OldRegions, NewRegions;
+    Old.regions(OldRegions);
+    New.regions(NewRegions);
+
+    EditScript Script;
+    MergeDiff(OldRegions.size(), NewRegions.size(), [&](size_t o, size_t n) { return OldRegions.cmp(o, NewRegions, n); }, Script);
+
+    for (const EditOp& op : Script)
+    {
+        for (size_t k = 0; k < op.Count && !mCancel; ++k)
+        {
+            size_t o = op.OldIndex + k, n = op.NewIndex + k;
+            Row Result = { Modified, 0, mRanges.size(), 0 };
+            if (op.Type == EditOp::Update)
+            {
+                Info fields = OldRegions.compare(o, NewRegions, n);
+                // Reserved regions have no access to show
+                if (OldRegions.state(o) != NewRegions.state(n))
+                    fields |= Info::Protection;
+
+                if (OldRegions.state(o) == MEM_COMMIT && NewRegions.state(n) == MEM_COMMIT)
+                {
+                    PBYTE Start = NewRegions.start(n);
+                    comparePages(Old, New, Start, Start + std::min(OldRegions.regionSize(o), NewRegions.regionSize(n)), Result);
+                }
+
+                if (fields == Info::None && Result.ChangedBytes == 0)
+                    continue;
+                mRows.push_back(NewRegions, n);
+                mRows.setChanged(mRows.size() - 1, fields);
+            }
+            else if (op.Type == EditOp::Insert)
+            {
+                Result.Kind = Added;
+                mRows.push_back(NewRegions, n);
+            }
+            else
+            {
+                Result.Kind = Removed;
+                mRows.push_back(OldRegions, o);
+            }
+            mTotalBytes += Result.ChangedBytes;
+            mInfo.push_back(Result);
+        }
+    }
+    return !mCancel;
+}
+
@@ -0,0 +1,74 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     Comparing two process snapshots
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include "MemInfo.h"
+
+class SnapshotFile;
+
+struct DiffRange
+{
+    PBYTE Start;
+    SIZE_T Size;
+};
+
+// The regions that differ between two snapshots, in address order.
+// The fields that differ are marked as changed in rows(), like the main window does between refreshes.
+// Pages are compared by the hash stored in the snapshot first, so only pages that changed are read.
+class SnapshotDiff
+{
+public:
+    enum Change : BYTE
+    {
+        Added,
+        Removed,
+        Modified,
+    };
+
+    // At most this many changed byte ranges are kept, the changed byte counts stay exact
+    static const size_t kMaxRanges = 1024 * 1024;
+
+    SnapshotDiff();
+
+    bool run(const SnapshotFile& Old, const SnapshotFile& New);
+    void cancel() { mCancel = true; }
+    void clear();
+
+    const MemSnapshot& rows() const { return mRows; }
+    size_t size() const { return mInfo.size(); }
+    Change change(size_t n) const { return mInfo[n].Kind; }
+    UINT64 changedBytes(size_t n) const { return mInfo[n].ChangedBytes; }
+    UINT64 totalChangedBytes() const { return mTotalBytes; }
+    // The changed byte ranges of row n, only for Modified rows
+    size_t rangeCount(size_t n) const { return mInfo[n].RangeCount; }
+    const DiffRange& range(size_t n, size_t r) const { return mRanges[mInfo[n].FirstRange + r]; }
+    bool truncated() const { return mTruncated; }
+
+    struct Block;
+
+private:
+    struct Row
+    {
+        Change Kind;
+        UINT64 ChangedBytes;
+        size_t FirstRange;
+        size_t RangeCount;
+    };
+
+    void comparePages(const SnapshotFile& Old, const SnapshotFile& New, PBYTE Start, PBYTE End, Row& Result);
+
+    MemSnapshot mRows;
+    std::vector<Row> mInfo;
+    std::vector<DiffRange> mRanges;
+    UINT64 mTotalBytes;
+    bool mTruncated;
+    std::atomic<bool> mCancel;
+};
+
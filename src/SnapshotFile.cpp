@@ -0,0 +1,529 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     Process snapshots on disk
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#include "MemView.h"
+#include "MemInfo.h"
+#include "SnapshotFile.h"
+#include "ByteDiff.h"
+#include "MemReader.h"
+#include <winternl.h>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <unordered_map>
+
+// Memory is captured in chunks, that are queued for the writer
+const SIZE_T kChunkSize = 1024 * 1024;
+// Let the reader get this far ahead of the disk, so that the process is resumed sooner.
+// When the disk falls further behind the process is resumed, it does not wait for the disk.
+const size_t kMaxQueued = 128;
+
+typedef NTSTATUS (NTAPI* SuspendResumeProcess)(HANDLE ProcessHandle);
+static SuspendResumeProcess g_NtSuspendProcess;
+static SuspendResumeProcess g_NtResumeProcess;
+
+enum PageKind : BYTE
+{
+    DataPage,
+    ZeroPage,
+    UnreadablePage,
+};
+
+struct CaptureChunk
+{
+    std::vector<BYTE> Data;     // Only the data pages, packed
+    std::vector<BYTE> Kinds;    // One PageKind per page
+};
+
+class CaptureQueue
+{
+public:
+    CaptureQueue()
+        :mDone(false), mFailed(false)
+    {
+    }
+
+    // Returns false when the writer gave up
+    bool push(CaptureChunk& Chunk)
+    {
+        std::unique_lock<std::mutex> lock(mLock);
+        mSpace.wait(lock, [this]() { return mQueue.size() < kMaxQueued || mFailed; });
+        if (mFailed)
+            return false;
+        mQueue.push_back(std::move(Chunk));
+        mReady.notify_one();
+        return true;
+    }
+
+    bool full()
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        return mQueue.size() >= kMaxQueued;
+    }
+
+    void finish()
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mDone = true;
+        mReady.notify_one();
+    }
+
+    // Returns false when everything was written
+    bool pop(CaptureChunk& Chunk)
+    {
+        std::unique_lock<std::mutex> lock(mLock);
+        mReady.wait(lock, [this]() { return !mQueue.empty() || mDone; });
+        if (mQueue.empty())
+            return false;
+        Chunk = std::move(mQueue.front());
+        mQueue.pop_front();
+        mSpace.notify_one();
+        return true;
+    }
+
+    void fail()
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mFailed = true;
+        mSpace.notify_one();
+    }
+
+private:
+    std::mutex mLock;
+    std::condition_variable mReady;
+    std::condition_variable mSpace;
+    std::deque<CaptureChunk> mQueue;
+    bool mDone;
+    bool mFailed;
+};
+
+static bool IsZeroPage(const BYTE* Data, SIZE_T Size)
+{
+    const UINT64* p = reinterpret_cast<const UINT64*>(Data);
+    UINT64 any = 0;
+    for (SIZE_T n = 0; n < Size / sizeof(UINT64); ++n)
+        any |= p[n];
+    return any == 0;
+}
+
+static UINT64 Rotate(UINT64 Value, int Bits)
+{
+    return (Value << Bits) | (Value >> (64 - Bits));
+}
+
+// Not cryptographic, only fast: four independent lanes keep the multiplier busy
+static UINT64 HashPage(const BYTE* Data, SIZE_T Size)
+{
+    const UINT64 kPrime1 = 0x9e3779b185ebca87ull;
+    const UINT64 kPrime2 = 0xc2b2ae3d27d4eb4full;
+    const UINT64* p = reinterpret_cast<const UINT64*>(Data);
+    UINT64 lanes[4] = { kPrime1, kPrime2, ~kPrime1, ~kPrime2 };
+    for (SIZE_T n = 0; n + 4 <= Size / sizeof(UINT64); n += 4)
+    {
+        for (int lane = 0; lane < 4; ++lane)
+            lanes[lane] = Rotate(lanes[lane] + p[n + lane] * kPrime2, 31) * kPrime1;
+    }
+
+    UINT64 hash = Rotate(lanes[0], 1) + Rotate(lanes[1], 7) + Rotate(lanes[2], 12) + Rotate(lanes[3], 18);
+    hash ^= hash >> 33;
+    hash *= kPrime2;
+    hash ^= hash >> 29;
+    return hash;
+}
+
+static bool IsReadable(const MemSnapshot& Regions, size_t n)
+{
+    DWORD protect = Regions.protect(n);
+    return protect != 0 && (protect & (PAGE_NOACCESS | PAGE_GUARD)) == 0;
+}
+
+static void ResumeProcess(HANDLE& hSuspend);
+
+static void CaptureRegions(HANDLE hProcess, HANDLE& hSuspend, const MemSnapshot& Regions, SIZE_T PageSize, CaptureQueue& Queue)
+{
+    std::vector<BYTE> buffer(kChunkSize);
+    std::vector<DWORD> valid(MaskWords(kChunkSize));
+
+    for (size_t n = 0; n < Regions.size(); ++n)
+    {
+        if (Regions.state(n) != MEM_COMMIT)
+            continue;
+
+        const bool readable = IsReadable(Regions, n);
+        const SIZE_T Size = Regions.regionSize(n);
+        for (SIZE_T offset = 0; offset < Size; offset += kChunkSize)
+        {
+            SIZE_T Length = std::min(kChunkSize, Size - offset);
+            PBYTE Start = Regions.start(n) + offset;
+            CaptureChunk chunk;
+            chunk.Kinds.resize(Length / PageSize, UnreadablePage);
+
+            if (readable)
+            {
+                SIZE_T Read = 0;
+                if (ReadProcessMemory(hProcess, Start, buffer.data(), Length, &Read) && Read == Length)
+                    SetMaskRange(valid.data(), 0, Length, true);
+                else
+                    ReadMemoryPages(hProcess, Start, buffer.data(), Length, valid.data());
+
+                chunk.Data.reserve(Length);
+                for (size_t page = 0; page < chunk.Kinds.size(); ++page)
+                {
+                    const BYTE* data = buffer.data() + page * PageSize;
+                    if (!TestMaskBit(valid.data(), page * PageSize))
+                        continue;
+                    if (IsZeroPage(data, PageSize))
+                    {
+                        chunk.Kinds[page] = ZeroPage;
+                    }
+                    else
+                    {
+                        chunk.Kinds[page] = DataPage;
+                        chunk.Data.insert(chunk.Data.end(), data, data + PageSize);
+                    }
+                }
+            }
+
+            // The rest is captured while the process runs, rather than keeping it suspended until the disk caught up
+            if (hSuspend && Queue.full())
+                ResumeProcess(hSuspend);
+            if (!Queue.push(chunk))
+                return;
+        }
+    }
+}
+
+static bool WriteAll(HANDLE hFile, const void* Data, SIZE_T Size)
+{
+    DWORD Written;
+    return WriteFile(hFile, Data, (DWORD)Size, &Written, NULL) && Written == Size;
+}
+
+static bool ReadAt(HANDLE hFile, UINT64 Offset, void* Data, SIZE_T Size)
+{
+    OVERLAPPED ov = { 0 };
+    ov.Offset = (DWORD)Offset;
+    ov.OffsetHigh = (DWORD)(Offset >> 32);
+    DWORD Read;
+    return ReadFile(hFile, Data, (DWORD)Size, &Read, &ov) && Read == Size;
+}
+
+static HANDLE SuspendProcess(HANDLE hProcess)
+{
+    // Suspending ourselves would never finish
+    DWORD pid = GetProcessId(hProcess);
+    if (pid == GetCurrentProcessId())
+        return NULL;
+
+    if (g_NtSuspendProcess == nullptr)
+    {
+        HMODULE ntdll = GetModuleHandleW(L"ntdll.dll");
+        g_NtSuspendProcess = (SuspendResumeProcess)GetProcAddress(ntdll, "NtSuspendProcess");
+        g_NtResumeProcess = (SuspendResumeProcess)GetProcAddress(ntdll, "NtResumeProcess");
+    }
+
+    // The handle we browse with cannot suspend
+    HANDLE hSuspend = OpenProcess(PROCESS_SUSPEND_RESUME, FALSE, pid);
+    if (hSuspend && g_NtSuspendProcess && g_NtResumeProcess && NT_SUCCESS(g_NtSuspendProcess(hSuspend)))
+        return hSuspend;
+
+    if (hSuspend)
+        CloseHandle(hSuspend);
+    return NULL;
+}
+
+static void ResumeProcess(HANDLE& hSuspend)
+{
+    if (hSuspend)
+    {
+        g_NtResumeProcess(hSuspend);
+        CloseHandle(hSuspend);
+        hSuspend = NULL;
+    }
+}
+
+bool WriteSnapshot(HANDLE hProcess, const wchar_t* File, const std::atomic<bool>& Cancel)
+{
+    HANDLE hFile = CreateFileW(File, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    // Suspend before listing the regions, so that they match the captured memory
+    HANDLE hSuspend = SuspendProcess(hProcess);
+    // Named from hProcess, the main window can switch to another process while this runs
+    KnownRegions Known;
+    Known.init(hProcess);
+    MemSnapshot Regions;
+    MemSnapshot::read(hProcess, Regions, Known);
+
+    const SIZE_T PageSize = ::PageSize();
+    CaptureQueue Queue;
+    std::thread reader([&]()
+    {
+        CaptureRegions(hProcess, hSuspend, Regions, PageSize, Queue);
+        // Everything is in memory now, the process does not have to wait for the disk
+        ResumeProcess(hSuspend);
+        Queue.finish();
+    });
+
+    // The header is written last, when all offsets are known
+    std::vector<BYTE> zero(PageSize);
+    bool ok = WriteAll(hFile, zero.data(), zero.size());
+
+    std::vector<DWORD> PageMap;
+    std::vector<UINT64> Hashes;
+    DWORD DataPages = 0;
+    CaptureChunk chunk;
+    while (Queue.pop(chunk))
+    {
+        for (BYTE kind : chunk.Kinds)
+            PageMap.push_back(kind == DataPage ? DataPages++ : (kind == ZeroPage ? kZeroPage : kUnreadablePage));
+        // Hashed here and not by the reader, the process is not waiting for us
+        for (SIZE_T offset = 0; offset < chunk.Data.size(); offset += PageSize)
+            Hashes.push_back(HashPage(chunk.Data.data() + offset, PageSize));
+
+        if (ok && (Cancel || (!chunk.Data.empty() && !WriteAll(hFile, chunk.Data.data(), chunk.Data.size()))))
+        {
+            ok = false;
+            Queue.fail();
+        }
+    }
+    reader.join();
+
+    SnapshotHeader Header = { 0 };
+    Header.Magic = kSnapshotMagic;
+    Header.Version = kSnapshotVersion;
+    Header.PageSize = (DWORD)PageSize;
+    Header.PointerSize = sizeof(void*);
+    Header.RegionCount = (DWORD)Regions.size();
+    Header.PageCount = PageMap.size();
+    Header.DataOffset = PageSize;
+    Header.RegionOffset = Header.DataOffset + (UINT64)DataPages * PageSize;
+    Header.PageMapOffset = Header.RegionOffset + Regions.size() * sizeof(SnapshotRegion);
+    Header.HashOffset = Header.PageMapOffset + PageMap.size() * sizeof(DWORD);
+    Header.NamesOffset = Header.HashOffset + Hashes.size() * sizeof(UINT64);
+
+    std::vector<SnapshotRegion> Table(Regions.size());
+    std::unordered_map<const wchar_t*, DWORD> NameIndex;
+    std::vector<BYTE> Names;
+    UINT64 FirstPage = 0;
+    for (size_t n = 0; n < Regions.size(); ++n)
+    {
+        SnapshotRegion& region = Table[n];
+        region.Base = (ULONG_PTR)Regions.start(n);
+        region.Size = Regions.regionSize(n);
+        region.AllocationBase = (ULONG_PTR)Regions.allocationStart(n);
+        region.Protect = Regions.protect(n);
+        region.AllocationProtect = Regions.allocationProtect(n);
+        region.State = Regions.state(n);
+        region.Type = Regions.type(n);
+        region.Name = kNoName;
+        region.FirstPage = FirstPage;
+        if (region.State == MEM_COMMIT)
+            FirstPage += region.Size / PageSize;
+
+        const MappedName& mapped = Regions.mapped(n);
+        if (!mapped.empty())
+        {
+            // Names are interned, so the pointer identifies the name
+            auto it = NameIndex.find(mapped.c_str());
+            if (it == NameIndex.end())
+            {
+                it = NameIndex.insert(std::make_pair(mapped.c_str(), Header.NameCount++)).first;
+                DWORD Length = (DWORD)wcslen(mapped.c_str());
+                const BYTE* p = reinterpret_cast<const BYTE*>(&Length);
+                Names.insert(Names.end(), p, p + sizeof(Length));
+                p = reinterpret_cast<const BYTE*>(mapped.c_str());
+                Names.insert(Names.end(), p, p + Length * sizeof(wchar_t));
+            }
+            region.Name = it->second;
+        }
+    }
+
+    ok = ok && WriteAll(hFile, Table.data(), Table.size() * sizeof(SnapshotRegion));
+    ok = ok && WriteAll(hFile, PageMap.data(), PageMap.size() * sizeof(DWORD));
+    ok = ok && WriteAll(hFile, Hashes.data(), Hashes.size() * sizeof(UINT64));
+    ok = ok && WriteAll(hFile, Names.data(), Names.size());
+    LARGE_INTEGER Start = { 0 };
+    ok = ok && SetFilePointerEx(hFile, Start, NULL, FILE_BEGIN);
+    ok = ok && WriteAll(hFile, &Header, sizeof(Header));
+
+    CloseHandle(hFile);
+    if (!ok)
+        DeleteFileW(File);
+    return ok;
+}
+
+SnapshotFile::SnapshotFile()
+    :mFile(INVALID_HANDLE_VALUE), mMapping(NULL), mView(NULL), mGranularity(0), mDataPages(0)
+{
+}
+
+SnapshotFile::~SnapshotFile()
+{
+    if (mView)
+        UnmapViewOfFile(mView);
+    if (mMapping)
+        CloseHandle(mMapping);
+    if (mFile != INVALID_HANDLE_VALUE)
+        CloseHandle(mFile);
+}
+
+std::shared_ptr<SnapshotFile> SnapshotFile::open(const wchar_t* File)
+{
+    std::shared_ptr<SnapshotFile> snapshot(new SnapshotFile());
+    snapshot->mFile = CreateFileW(File, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (snapshot->mFile == INVALID_HANDLE_VALUE)
+        return nullptr;
+
+    LARGE_INTEGER FileSize;
+    SnapshotHeader& Header = snapshot->mHeader;
+    if (!GetFileSizeEx(snapshot->mFile, &FileSize) || !ReadAt(snapshot->mFile, 0, &Header, sizeof(Header)))
+        return nullptr;
+
+    // Addresses of a 64 bit process do not fit in a 32 bit build
+    if (Header.Magic != kSnapshotMagic || Header.Version != kSnapshotVersion || Header.PointerSize != sizeof(void*) ||
+        Header.PageSize == 0 || (Header.PageSize & (Header.PageSize - 1)) != 0 ||
+        Header.DataOffset > Header.RegionOffset || Header.RegionOffset > Header.PageMapOffset ||
+        Header.PageMapOffset > Header.HashOffset || Header.HashOffset > Header.NamesOffset ||
+        Header.NamesOffset > (UINT64)FileSize.QuadPart ||
+        Header.PageMapOffset - Header.RegionOffset != (UINT64)Header.RegionCount * sizeof(SnapshotRegion) ||
+        Header.HashOffset - Header.PageMapOffset != Header.PageCount * sizeof(DWORD) ||
+        Header.NamesOffset - Header.HashOffset != (Header.RegionOffset - Header.DataOffset) / Header.PageSize * sizeof(UINT64))
+    {
+        return nullptr;
+    }
+
+    snapshot->mDataPages = (Header.RegionOffset - Header.DataOffset) / Header.PageSize;
+    snapshot->mRegions.resize(Header.RegionCount);
+    snapshot->mPageMap.resize((size_t)Header.PageCount);
+    snapshot->mHashes.resize((size_t)snapshot->mDataPages);
+    std::vector<BYTE> Names((size_t)(FileSize.QuadPart - Header.NamesOffset));
+    if (!ReadAt(snapshot->mFile, Header.RegionOffset, snapshot->mRegions.data(), snapshot->mRegions.size() * sizeof(SnapshotRegion)) ||
+        !ReadAt(snapshot->mFile, Header.PageMapOffset, snapshot->mPageMap.data(), snapshot->mPageMap.size() * sizeof(DWORD)) ||
+        !ReadAt(snapshot->mFile, Header.HashOffset, snapshot->mHashes.data(), snapshot->mHashes.size() * sizeof(UINT64)) ||
+        !ReadAt(snapshot->mFile, Header.NamesOffset, Names.data(), Names.size()))
+    {
+        return nullptr;
+    }
+
+    // Every entry is used as an index in the payload and the hashes, a damaged file is not opened
+    for (DWORD entry : snapshot->mPageMap)
+    {
+        if (entry != kZeroPage && entry != kUnreadablePage && entry >= snapshot->mDataPages)
+            return nullptr;
+    }
+
+    std::wstring Name;
+    for (size_t offset = 0, n = 0; n < Header.NameCount; ++n)
+    {
+        DWORD Length;
+        if (offset + sizeof(Length) > Names.size())
+            return nullptr;
+        memcpy(&Length, Names.data() + offset, sizeof(Length));
+        offset += sizeof(Length);
+        if (Length > (Names.size() - offset) / sizeof(wchar_t))
+            return nullptr;
+        Name.assign(reinterpret_cast<const wchar_t*>(Names.data() + offset), Length);
+        offset += Length * sizeof(wchar_t);
+        snapshot->mNames.push_back(MappedName::intern(Name.c_str()));
+    }
+
+    snapshot->mMapping = CreateFileMappingW(snapshot->mFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!snapshot->mMapping)
+        return nullptr;
+    // Multi-GB snapshots might not fit in a 32 bit process, those map the pages when they are read
+    snapshot->mView = static_cast<const BYTE*>(MapViewOfFile(snapshot->mMapping, FILE_MAP_READ, 0, 0, 0));
+
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    snapshot->mGranularity = si.dwAllocationGranularity;
+    return snapshot;
+}
+
+void SnapshotFile::regions(MemSnapshot& Snapshot) const
+{
+    Snapshot.clear();
+    Snapshot.reserve(mRegions.size());
+    for (const SnapshotRegion& region : mRegions)
+    {
+        MEMORY_BASIC_INFORMATION mbi = { 0 };
+        mbi.BaseAddress = (PVOID)(ULONG_PTR)region.Base;
+        mbi.AllocationBase = (PVOID)(ULONG_PTR)region.AllocationBase;
+        mbi.AllocationProtect = region.AllocationProtect;
+        mbi.RegionSize = (SIZE_T)region.Size;
+        mbi.State = region.State;
+        mbi.Protect = region.Protect;
+        mbi.Type = region.Type;
+        Snapshot.push_back(mbi, region.Name < mNames.size() ? mNames[region.Name] : MappedName());
+    }
+}
+
+const BYTE* SnapshotFile::mapPage(UINT64 Offset, void*& View) const
+{
+    View = NULL;
+    if (mView)
+        return mView + Offset;
+
+    UINT64 Aligned = Offset & ~(UINT64)(mGranularity - 1);
+    View = MapViewOfFile(mMapping, FILE_MAP_READ, (DWORD)(Aligned >> 32), (DWORD)Aligned, (SIZE_T)(Offset - Aligned) + mHeader.PageSize);
+    return View ? static_cast<const BYTE*>(View) + (Offset - Aligned) : NULL;
+}
+
+DWORD SnapshotFile::pageEntry(const BYTE* Address) const
+{
+    auto it = std::upper_bound(mRegions.begin(), mRegions.end(), (UINT64)(ULONG_PTR)Address,
+        [](UINT64 address, const SnapshotRegion& region) { return address < region.Base; });
+    if (it == mRegions.begin())
+        return kUnreadablePage;
+
+    const SnapshotRegion& region = *(it - 1);
+    if (region.State != MEM_COMMIT || (ULONG_PTR)Address >= region.Base + region.Size)
+        return kUnreadablePage;
+
+    UINT64 page = region.FirstPage + ((ULONG_PTR)Address - region.Base) / mHeader.PageSize;
+    return page < mPageMap.size() ? mPageMap[(size_t)page] : kUnreadablePage;
+}
+
+SIZE_T SnapshotFile::read(const BYTE* Address, BYTE* Buffer, SIZE_T Length, DWORD* Valid) const
+{
+    SetMaskRange(Valid, 0, Length, false);
+
+    const SIZE_T PageSize = mHeader.PageSize;
+    SIZE_T Total = 0;
+    for (SIZE_T offset = 0; offset < Length;)
+    {
+        ULONG_PTR address = (ULONG_PTR)Address + offset;
+        ULONG_PTR pageStart = address & ~(ULONG_PTR)(PageSize - 1);
+        SIZE_T count = std::min<SIZE_T>(pageStart + PageSize - address, Length - offset);
+
+        DWORD entry = pageEntry((const BYTE*)address);
+        if (entry == kZeroPage)
+        {
+            memset(Buffer + offset, 0, count);
+            SetMaskRange(Valid, offset, offset + count, true);
+            Total += count;
+        }
+        else if (entry < mDataPages)
+        {
+            void* View;
+            const BYTE* data = mapPage(mHeader.DataOffset + (UINT64)entry * PageSize, View);
+            if (data)
+            {
+                memcpy(Buffer + offset, data + (address - pageStart), count);
+                SetMaskRange(Valid, offset, offset + count, true);
+                Total += count;
+            }
+            if (View)
+                UnmapViewOfFile(View);
+        }
+        offset += count;
+    }
+    return Total;
+}
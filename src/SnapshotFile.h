@@ -0,0 +1,100 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     Process snapshots on disk
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include "MemInfo.h"
+
+// File layout, all offsets are from the start of the file:
+//   SnapshotHeader, padded to a page
+//   Page payloads, one page each
+//   SnapshotRegion[RegionCount]
+//   DWORD PageMap[PageCount], one entry per page of every committed region
+//   UINT64 Hashes[], one per page payload, so that a diff can skip identical pages
+//   Names, NameCount times a DWORD length followed by the characters
+struct SnapshotHeader
+{
+    DWORD Magic;
+    DWORD Version;
+    DWORD PageSize;
+    DWORD PointerSize;
+    DWORD RegionCount;
+    DWORD NameCount;
+    UINT64 PageCount;
+    UINT64 DataOffset;
+    UINT64 RegionOffset;
+    UINT64 PageMapOffset;
+    UINT64 HashOffset;
+    UINT64 NamesOffset;
+};
+
+struct SnapshotRegion
+{
+    UINT64 Base;
+    UINT64 Size;
+    UINT64 AllocationBase;
+    DWORD Protect;
+    DWORD AllocationProtect;
+    DWORD State;
+    DWORD Type;
+    DWORD Name;         // Index in the name table, or kNoName
+    DWORD Reserved;
+    UINT64 FirstPage;   // Index in the page map
+};
+
+const DWORD kSnapshotMagic = 'SSVM';
+const DWORD kSnapshotVersion = 2;
+const DWORD kNoName = 0xffffffff;
+// Page map entries are the index of the payload page, or one of these
+const DWORD kZeroPage = 0xffffffff;
+const DWORD kUnreadablePage = 0xfffffffe;
+
+// Capture all committed memory of hProcess to File.
+// The process is suspended while it is read (when the handle allows it),
+// while the pages are written to disk from a separate thread.
+// When the disk falls behind, the process is resumed and the rest is read while it runs.
+// Setting Cancel stops the capture, the process is resumed and the partial file deleted.
+bool WriteSnapshot(HANDLE hProcess, const wchar_t* File, const std::atomic<bool>& Cancel);
+
+// A snapshot opened for browsing, the payload is mapped and not read into memory
+class SnapshotFile
+{
+public:
+    ~SnapshotFile();
+
+    static std::shared_ptr<SnapshotFile> open(const wchar_t* File);
+
+    // Same contents as MemSnapshot::read would give for the captured process
+    void regions(MemSnapshot& Snapshot) const;
+    // Same contract as ReadMemoryPages
+    SIZE_T read(const BYTE* Address, BYTE* Buffer, SIZE_T Length, DWORD* Valid) const;
+
+    DWORD pageSize() const { return mHeader.PageSize; }
+    // The page map entry of the page holding Address, kUnreadablePage when it was not committed
+    DWORD pageEntry(const BYTE* Address) const;
+    // The hash of a page payload, Entry must be a payload index from pageEntry
+    UINT64 pageHash(DWORD Entry) const { return mHashes[Entry]; }
+
+private:
+    SnapshotFile();
+
+    const BYTE* mapPage(UINT64 Offset, void*& View) const;
+
+    HANDLE mFile;
+    HANDLE mMapping;
+    const BYTE* mView;      // The whole file, when it fits in the address space
+    DWORD mGranularity;
+    UINT64 mDataPages;
+    SnapshotHeader mHeader;
+    std::vector<SnapshotRegion> mRegions;
+    std::vector<DWORD> mPageMap;
+    std::vector<UINT64> mHashes;
+    std::vector<MappedName> mNames;
+};
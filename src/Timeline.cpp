@@ -0,0 +1,405 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     History of the region map of a process
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#include "MemView.h"
+#include "MemInfo.h"
+#include "Timeline.h"
+#include "RegionDiff.h"
+#include "MemReader.h"
+#include <algorithm>
+#include <map>
+
+RegionTimeline g_Timeline;
+
+// MEM_* states and types have the low 12 bits clear, so they are stored shifted
+const int kFlagShift = 12;
+
+static void PutVarint(std::vector<BYTE>& Bytes, UINT64 Value)
+{
+    while (Value >= 0x80)
+    {
+        Bytes.push_back((BYTE)(Value | 0x80));
+        Value >>= 7;
+    }
+    Bytes.push_back((BYTE)Value);
+}
+
+// Reads from a position in the byte ring, wrapping around at its end
+class RingReader
+{
+public:
+    RingReader(const std::vector<BYTE>& Ring, size_t Pos)
+        :mRing(Ring), mPos(Pos)
+    {
+    }
+
+    BYTE byte()
+    {
+        BYTE b = mRing[mPos];
+        if (++mPos == mRing.size())
+            mPos = 0;
+        return b;
+    }
+
+    UINT64 varint()
+    {
+        UINT64 Value = 0;
+        for (int shift = 0;; shift += 7)
+        {
+            BYTE b = byte();
+            Value |= (UINT64)(b & 0x7f) << shift;
+            if (!(b & 0x80))
+                return Value;
+        }
+    }
+
+private:
+    const std::vector<BYTE>& mRing;
+    size_t mPos;
+};
+
+static TimelineRegion MakeRegion(const MemSnapshot& Regions, size_t n)
+{
+    TimelineRegion Region = { Regions.start(n), Regions.regionSize(n), Regions.protect(n), Regions.state(n), Regions.type(n), Regions.mapped(n) };
+    return Region;
+}
+
+static bool SameAllocation(const MemSnapshot& Old, size_t o, const MemSnapshot& New, size_t n)
+{
+    return Old.allocationStart(o) == New.allocationStart(n) && Old.type(o) == New.type(n) && Old.mapped(o) == New.mapped(n);
+}
+
+RegionTimeline::RegionTimeline()
+    :mPageSize(0)
+{
+    clear();
+}
+
+void RegionTimeline::reset()
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    clear();
+}
+
+void RegionTimeline::clear()
+{
+    mPid = 0;
+    mStart = mEnd = 0;
+    mEventCount = 0;
+    mLast.clear();
+    mHead = mUsed = 0;
+    mDropped = 0;
+    mPending.clear();
+    mKeyframes = mKeyframeBytes = mSinceKeyframe = 0;
+    mTicks.clear();
+    mNames.clear();
+    mNameIndex.clear();
+    // Index 0 is the empty name
+    mNames.push_back(MappedName());
+}
+
+UINT64 RegionTimeline::CurrentTime()
+{
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    return ((UINT64)ft.dwHighDateTime << 32 | ft.dwLowDateTime) / 10000;
+}
+
+size_t RegionTimeline::memoryUsage() const
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    return bytesUsed(mBytes.size());
+}
+
+// Everything the timeline holds, with RingBytes for the ring
+size_t RegionTimeline::bytesUsed(size_t RingBytes) const
+{
+    return RingBytes + mPending.capacity() + mTicks.size() * sizeof(Tick) + mLast.memoryUsage() +
+        mNames.capacity() * sizeof(MappedName) + mNameIndex.size() * (sizeof(std::pair<const wchar_t*, DWORD>) + 2 * sizeof(void*));
+}
+
+DWORD RegionTimeline::nameIndex(const MappedName& Name)
+{
+    if (Name.empty())
+        return 0;
+
+    // Names are interned, so the pointer identifies the name
+    auto it = mNameIndex.find(Name.c_str());
+    if (it == mNameIndex.end())
+    {
+        it = mNameIndex.insert(std::make_pair(Name.c_str(), (DWORD)mNames.size())).first;
+        mNames.push_back(Name);
+    }
+    return it->second;
+}
+
+// Events of one refresh are in address order, so the address is stored as the distance to the previous one
+void RegionTimeline::add(const TimelineEvent& Event, PBYTE& Previous)
+{
+    const TimelineRegion& Region = Event.Region;
+    mPending.push_back(Event.Kind);
+    PutVarint(mPending, Region.Base - Previous);
+    PutVarint(mPending, Region.Size / mPageSize);
+    PutVarint(mPending, Region.Protect);
+    PutVarint(mPending, Region.State >> kFlagShift);
+    PutVarint(mPending, Region.Type >> kFlagShift);
+    PutVarint(mPending, nameIndex(Region.Mapped));
+    if (Event.Kind & TimelineEvent::Resize)
+        PutVarint(mPending, Event.OldSize / mPageSize);
+    if (Event.Kind & TimelineEvent::Protect)
+    {
+        PutVarint(mPending, Event.OldProtect);
+        PutVarint(mPending, Event.OldState >> kFlagShift);
+    }
+    Previous = Region.Base;
+}
+
+// Copy the ring in order into a larger one
+void RegionTimeline::grow(size_t Needed)
+{
+    // The ring gets what the rest leaves of kMaxBytes
+    size_t Fixed = bytesUsed(0);
+    size_t Limit = Fixed < kMaxBytes ? kMaxBytes - Fixed : 0;
+    size_t Size = std::max(Needed, std::min(std::max<size_t>(mBytes.size() * 2, 64 * 1024), Limit));
+    std::vector<BYTE> Bytes(Size);
+    size_t First = std::min(mUsed, mBytes.size() - mHead);
+    if (First)
+        memcpy(Bytes.data(), mBytes.data() + mHead, First);
+    if (mUsed > First)
+        memcpy(Bytes.data() + First, mBytes.data(), mUsed - First);
+    mBytes.swap(Bytes);
+    mHead = 0;
+}
+
+// Drop the oldest keyframe with the changes after it, the history then starts at the next keyframe
+void RegionTimeline::dropOldest()
+{
+    size_t Count = 1;
+    while (!mTicks[Count].Keyframe)
+        mEventCount -= mTicks[Count++].Count;
+    --mKeyframes;
+
+    size_t Size = (size_t)(mTicks[Count].Offset - mTicks[0].Offset);
+    mTicks.erase(mTicks.begin(), mTicks.begin() + Count);
+    if (Size)
+        mHead = (mHead + Size) % mBytes.size();
+    mUsed -= Size;
+    mDropped += Size;
+    mStart = mTicks[0].Time;
+}
+
+// Move mPending into the ring as tick
+void RegionTimeline::append(Tick tick)
+{
+    size_t Length = mPending.size();
+    while (mKeyframes > 1 && bytesUsed(mUsed + Length) > kMaxBytes)
+        dropOldest();
+    if (mBytes.size() - mUsed < Length)
+        grow(mUsed + Length);
+
+    tick.Offset = mDropped + mUsed;
+    if (Length)
+    {
+        size_t Pos = (mHead + mUsed) % mBytes.size();
+        size_t First = std::min(Length, mBytes.size() - Pos);
+        memcpy(mBytes.data() + Pos, mPending.data(), First);
+        memcpy(mBytes.data(), mPending.data() + First, Length - First);
+        mUsed += Length;
+    }
+    mPending.clear();
+
+    mTicks.push_back(tick);
+    if (tick.Keyframe)
+    {
+        ++mKeyframes;
+        mKeyframeBytes = Length;
+        mSinceKeyframe = 0;
+    }
+    else
+    {
+        mEventCount += tick.Count;
+        mSinceKeyframe += Length;
+    }
+}
+
+void RegionTimeline::addKeyframe(UINT64 Time)
+{
+    TimelineEvent Event = {};
+    Event.Kind = TimelineEvent::Alloc;
+    PBYTE Previous = nullptr;
+    for (size_t n = 0; n < mLast.size(); ++n)
+    {
+        Event.Region = MakeRegion(mLast, n);
+        add(Event, Previous);
+    }
+    Tick tick = { Time, 0, (UINT)mLast.size(), true };
+    append(tick);
+}
+
+void RegionTimeline::decode(const Tick& tick, std::vector<TimelineEvent>& Events) const
+{
+    RingReader Reader(mBytes, mBytes.empty() ? 0 : (mHead + (size_t)(tick.Offset - mDropped)) % mBytes.size());
+    PBYTE Previous = nullptr;
+    for (UINT n = 0; n < tick.Count; ++n)
+    {
+        TimelineEvent Event = {};
+        TimelineRegion& Region = Event.Region;
+        Event.Time = tick.Time;
+        Event.Kind = Reader.byte();
+        Region.Base = Previous + Reader.varint();
+        Region.Size = (SIZE_T)Reader.varint() * mPageSize;
+        Region.Protect = (DWORD)Reader.varint();
+        Region.State = (DWORD)Reader.varint() << kFlagShift;
+        Region.Type = (DWORD)Reader.varint() << kFlagShift;
+        Region.Mapped = mNames[(size_t)Reader.varint()];
+        if (Event.Kind & TimelineEvent::Resize)
+            Event.OldSize = (SIZE_T)Reader.varint() * mPageSize;
+        if (Event.Kind & TimelineEvent::Protect)
+        {
+            Event.OldProtect = (DWORD)Reader.varint();
+            Event.OldState = (DWORD)Reader.varint() << kFlagShift;
+        }
+        Previous = Region.Base;
+        Events.push_back(Event);
+    }
+}
+
+void RegionTimeline::record(DWORD Pid, const MemSnapshot& Regions)
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    if (Pid != mPid)
+    {
+        clear();
+        mPid = Pid;
+        mPageSize = PageSize();
+    }
+
+    UINT64 Now = CurrentTime();
+    if (mStart != 0)
+    {
+        EditScript Script;
+        MergeDiff(mLast.size(), Regions.size(), [&](size_t o, size_t n) { return mLast.cmp(o, Regions, n); }, Script);
+
+        Tick tick = { Now, 0, 0, false };
+        PBYTE Previous = nullptr;
+        for (const EditOp& op : Script)
+        {
+            for (size_t k = 0; k < op.Count; ++k)
+            {
+                size_t o = op.OldIndex + k, n = op.NewIndex + k;
+                TimelineEvent Event = {};
+                if (op.Type == EditOp::Update && SameAllocation(mLast, o, Regions, n))
+                {
+                    if (mLast.regionSize(o) != Regions.regionSize(n))
+                        Event.Kind |= TimelineEvent::Resize;
+                    if (mLast.protect(o) != Regions.protect(n) || mLast.state(o) != Regions.state(n))
+                        Event.Kind |= TimelineEvent::Protect;
+                    if (!Event.Kind)
+                        continue;
+
+                    Event.Region = MakeRegion(Regions, n);
+                    Event.OldSize = mLast.regionSize(o);
+                    Event.OldProtect = mLast.protect(o);
+                    Event.OldState = mLast.state(o);
+                    add(Event, Previous);
+                    ++tick.Count;
+                    continue;
+                }
+
+                // A region that now belongs to another allocation was freed and allocated again
+                if (op.Type != EditOp::Insert)
+                {
+                    Event.Kind = TimelineEvent::Free;
+                    Event.Region = MakeRegion(mLast, o);
+                    add(Event, Previous);
+                    ++tick.Count;
+                }
+                if (op.Type != EditOp::Remove)
+                {
+                    Event.Kind = TimelineEvent::Alloc;
+                    Event.Region = MakeRegion(Regions, n);
+                    add(Event, Previous);
+                    ++tick.Count;
+                }
+            }
+        }
+
+        if (tick.Count)
+            append(tick);
+    }
+    else
+    {
+        mStart = Now;
+    }
+    mEnd = Now;
+
+    mLast.clear();
+    mLast.reserve(Regions.size());
+    for (size_t n = 0; n < Regions.size(); ++n)
+        mLast.push_back(Regions, n);
+
+    // The first map is a keyframe, the history always starts at one
+    if (mKeyframes == 0 || (mSinceKeyframe > 0 && mSinceKeyframe >= mKeyframeBytes))
+        addKeyframe(Now);
+}
+
+void RegionTimeline::events(UINT64 From, UINT64 To, std::vector<TimelineEvent>& Events) const
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    Events.clear();
+    auto it = std::upper_bound(mTicks.begin(), mTicks.end(), From, [](UINT64 Time, const Tick& tick) { return Time < tick.Time; });
+    for (; it != mTicks.end() && it->Time <= To; ++it)
+    {
+        if (!it->Keyframe)
+            decode(*it, Events);
+    }
+}
+
+void RegionTimeline::regionsAt(UINT64 Time, std::vector<TimelineRegion>& Regions) const
+{
+    std::lock_guard<std::mutex> lock(mLock);
+    Regions.clear();
+    if (Time >= mEnd || mTicks.empty())
+    {
+        Regions.reserve(mLast.size());
+        for (size_t n = 0; n < mLast.size(); ++n)
+            Regions.push_back(MakeRegion(mLast, n));
+        return;
+    }
+
+    // Start at the last keyframe at or before Time, the oldest history starts with a keyframe
+    auto it = std::upper_bound(mTicks.begin(), mTicks.end(), Time, [](UINT64 Time, const Tick& tick) { return Time < tick.Time; });
+    auto Key = it;
+    while (Key != mTicks.begin() && !(Key != mTicks.end() && Key->Keyframe && Key->Time <= Time))
+        --Key;
+
+    std::vector<TimelineEvent> Events;
+    decode(*Key, Events);
+    std::map<PBYTE, TimelineRegion> Map;
+    for (const TimelineEvent& Event : Events)
+        Map.emplace_hint(Map.end(), Event.Region.Base, Event.Region);
+
+    // Every event holds the new region, or the freed one
+    for (++Key; Key != it; ++Key)
+    {
+        if (Key->Keyframe)
+            continue;
+        Events.clear();
+        decode(*Key, Events);
+        for (const TimelineEvent& Event : Events)
+        {
+            if (Event.Kind & TimelineEvent::Free)
+                Map.erase(Event.Region.Base);
+            else
+                Map[Event.Region.Base] = Event.Region;
+        }
+    }
+
+    Regions.reserve(Map.size());
+    for (const auto& Entry : Map)
+        Regions.push_back(Entry.second);
+}
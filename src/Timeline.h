@@ -0,0 +1,117 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     History of the region map of a process
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <mutex>
+#include "MemInfo.h"
+
+struct TimelineRegion
+{
+    PBYTE Base;
+    SIZE_T Size;
+    DWORD Protect;
+    DWORD State;
+    DWORD Type;
+    MappedName Mapped;
+};
+
+struct TimelineEvent
+{
+    enum Flags : BYTE
+    {
+        Alloc = (1 << 0),
+        Free = (1 << 1),
+        Resize = (1 << 2),
+        Protect = (1 << 3),
+    };
+
+    UINT64 Time;
+    BYTE Kind;
+    TimelineRegion Region;  // The new region, or the freed one
+    SIZE_T OldSize;         // Resize only
+    DWORD OldProtect;       // Protect only
+    DWORD OldState;         // Protect only
+};
+
+// Every refresh adds the changes to the region map since the previous refresh.
+// The changes are packed as variable length deltas in a contiguous byte ring.
+// Once the changes since the last keyframe take as much space as a keyframe,
+// the complete region map is added as the next keyframe, so keyframes at most double the size.
+// An earlier region map is rebuilt from the nearest keyframe before it, replaying the changes after it.
+// When everything the timeline holds exceeds kMaxBytes, the oldest keyframe and its changes are dropped.
+// Refreshes are recorded from the region list worker, while the timeline window reads.
+class RegionTimeline
+{
+public:
+    static const size_t kMaxBytes = 16 * 1024 * 1024;
+
+    RegionTimeline();
+
+    void reset();
+    // Add the region map of process Pid, another process starts a new history
+    void record(DWORD Pid, const MemSnapshot& Regions);
+
+    bool empty() const { std::lock_guard<std::mutex> lock(mLock); return mStart == 0; }
+    // Times are in milliseconds, see CurrentTime
+    UINT64 startTime() const { std::lock_guard<std::mutex> lock(mLock); return mStart; }
+    UINT64 endTime() const { std::lock_guard<std::mutex> lock(mLock); return mEnd; }
+    size_t eventCount() const { std::lock_guard<std::mutex> lock(mLock); return mEventCount; }
+    size_t memoryUsage() const;
+
+    // All events in (From, To]
+    void events(UINT64 From, UINT64 To, std::vector<TimelineEvent>& Events) const;
+    // The region map as it was at Time
+    void regionsAt(UINT64 Time, std::vector<TimelineRegion>& Regions) const;
+
+    static UINT64 CurrentTime();
+
+private:
+    struct Tick
+    {
+        UINT64 Time;
+        UINT64 Offset;  // Position of the first event in the byte ring, counted from the first byte ever added
+        UINT Count;
+        bool Keyframe;  // Every region of the map as an Alloc event
+    };
+
+    void clear();
+    size_t bytesUsed(size_t RingBytes) const;
+    DWORD nameIndex(const MappedName& Name);
+    void add(const TimelineEvent& Event, PBYTE& Previous);
+    void append(Tick tick);
+    void addKeyframe(UINT64 Time);
+    void grow(size_t Needed);
+    void dropOldest();
+    void decode(const Tick& tick, std::vector<TimelineEvent>& Events) const;
+
+    DWORD mPid;
+    UINT64 mStart;
+    UINT64 mEnd;
+    size_t mEventCount;
+    SIZE_T mPageSize;
+
+    MemSnapshot mLast;
+    std::vector<BYTE> mBytes;   // The ring
+    size_t mHead;               // Position of the oldest byte in mBytes
+    size_t mUsed;
+    UINT64 mDropped;            // Bytes dropped from the ring since the first byte
+    std::vector<BYTE> mPending; // The events of one refresh, before they are added to the ring
+    size_t mKeyframes;
+    size_t mKeyframeBytes;      // Size of the last keyframe
+    size_t mSinceKeyframe;      // Bytes of changes after it
+    std::deque<Tick> mTicks;
+    std::vector<MappedName> mNames;
+    std::unordered_map<const wchar_t*, DWORD> mNameIndex;
+    mutable std::mutex mLock;
+};
+
+extern RegionTimeline g_Timeline;
+
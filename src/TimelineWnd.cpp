@@ -0,0 +1,394 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     The region map timeline window
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#include "MemView.h"
+#include <Commctrl.h>
+#include "MemInfo.h"
+#include "Timeline.h"
+
+#define TIMELINE_CLASS TEXT("MemTimelineClass")
+const UINT_PTR kRefreshTimerId = 0x71e1;
+
+static HWND g_TimelineWnd;
+static HWND g_Slider;
+static HWND g_ViewCombo;
+static HWND g_TimeStatic;
+static HWND g_TimelineList;
+
+static std::vector<TimelineRegion> g_Regions;
+static std::vector<TimelineEvent> g_Events;
+static bool g_ShowRegions;
+
+// Same order as the view combo, the span of events shown before the selected moment
+static const UINT64 Spans[] =
+{
+    0,
+    10 * 1000,
+    60 * 1000,
+    10 * 60 * 1000,
+    60 * 60 * 1000,
+    ~0ull,
+};
+
+static wchar_t* RegionColumns[] =
+{
+    L"Address",
+    L"Size",
+    L"Type",
+    L"Access",
+    L"Mapped",
+};
+
+static int RegionSizes[] = {
+#ifdef _WIN64
+    136,
+#else
+    76,
+#endif
+    70,
+    40,
+    110,
+    300,
+};
+
+static wchar_t* EventColumns[] =
+{
+    L"Time",
+    L"Event",
+    L"Address",
+    L"Size",
+    L"Access",
+    L"Mapped",
+};
+
+static int EventSizes[] = {
+    70,
+    120,
+#ifdef _WIN64
+    136,
+#else
+    76,
+#endif
+    140,
+    160,
+    300,
+};
+
+static void FormatTime(UINT64 Time, __out_ecount(cchDest) STRSAFE_LPWSTR pszDest, __in size_t cchDest)
+{
+    ULARGE_INTEGER value;
+    value.QuadPart = Time * 10000;
+    FILETIME ft = { value.LowPart, value.HighPart }, local;
+    SYSTEMTIME st;
+    FileTimeToLocalFileTime(&ft, &local);
+    FileTimeToSystemTime(&local, &st);
+    StringCchPrintfW(pszDest, cchDest, L"%02u:%02u:%02u", st.wHour, st.wMinute, st.wSecond);
+}
+
+static LPCWSTR TypeName(DWORD Type)
+{
+    switch (Type)
+    {
+    case MEM_IMAGE: return L"Imag";
+    case MEM_MAPPED: return L"Map";
+    case MEM_PRIVATE: return L"Priv";
+    default: return L"";
+    }
+}
+
+static LPCWSTR AccessName(DWORD Protect, DWORD State)
+{
+    return State == MEM_COMMIT ? Prot2Str(Protect) : L"";
+}
+
+static void SetColumns(bool Regions)
+{
+    while (ListView_DeleteColumn(g_TimelineList, 0))
+        ;
+
+    wchar_t** Columns = Regions ? RegionColumns : EventColumns;
+    int* Sizes = Regions ? RegionSizes : EventSizes;
+    size_t Count = Regions ? _countof(RegionColumns) : _countof(EventColumns);
+    LVCOLUMN lvc;
+    for (size_t n = 0; n < Count; ++n)
+    {
+        lvc.mask = LVCF_FMT | LVCF_WIDTH | LVCF_TEXT | LVCF_SUBITEM;
+        lvc.iSubItem = (int)n;
+        lvc.cx = Sizes[n];
+        lvc.fmt = LVCFMT_LEFT;
+        lvc.pszText = Columns[n];
+        ListView_InsertColumn(g_TimelineList, n, &lvc);
+    }
+    ListView_SetColumnWidth(g_TimelineList, Count - 1, LVSCW_AUTOSIZE_USEHEADER);
+}
+
+static UINT64 SelectedTime()
+{
+    LRESULT Pos = SendMessageW(g_Slider, TBM_GETPOS, 0, 0);
+    LRESULT Max = SendMessageW(g_Slider, TBM_GETRANGEMAX, 0, 0);
+    if (Pos >= Max)
+        return g_Timeline.endTime();
+    return g_Timeline.startTime() + (UINT64)Pos * 1000;
+}
+
+static void UpdateList()
+{
+    UINT64 Time = SelectedTime();
+    int View = ComboBox_GetCurSel(g_ViewCombo);
+    bool ShowRegions = View <= 0;
+    if (ShowRegions != g_ShowRegions)
+    {
+        g_ShowRegions = ShowRegions;
+        SetColumns(ShowRegions);
+    }
+
+    WCHAR When[20], buf[200];
+    FormatTime(Time, When, _countof(When));
+    if (g_Timeline.empty())
+    {
+        StringCchCopyW(buf, _countof(buf), L"Nothing recorded yet");
+        g_Regions.clear();
+        g_Events.clear();
+    }
+    else if (ShowRegions)
+    {
+        g_Timeline.regionsAt(Time, g_Regions);
+        SIZE_T Committed = 0;
+        for (const TimelineRegion& Region : g_Regions)
+        {
+            if (Region.State == MEM_COMMIT)
+                Committed += Region.Size;
+        }
+        StringCchPrintfW(buf, _countof(buf), L"%s: %Iu regions, %Iu KB committed", When, g_Regions.size(), Committed / 1024);
+    }
+    else
+    {
+        UINT64 Span = Spans[View];
+        g_Timeline.events(Time > Span ? Time - Span : 0, Time, g_Events);
+        StringCchPrintfW(buf, _countof(buf), L"%s: %Iu events shown, %Iu recorded in %Iu KB", When, g_Events.size(),
+            g_Timeline.eventCount(), g_Timeline.memoryUsage() / 1024);
+    }
+    Static_SetText(g_TimeStatic, buf);
+    ListView_SetItemCountEx(g_TimelineList, ShowRegions ? g_Regions.size() : g_Events.size(), 0);
+    InvalidateRect(g_TimelineList, NULL, FALSE);
+}
+
+// Extend the slider to the latest refresh, and keep following it when it was at the end
+static void UpdateSlider()
+{
+    LRESULT Pos = SendMessageW(g_Slider, TBM_GETPOS, 0, 0);
+    LRESULT Max = SendMessageW(g_Slider, TBM_GETRANGEMAX, 0, 0);
+    LRESULT NewMax = (LRESULT)((g_Timeline.endTime() - g_Timeline.startTime() + 999) / 1000);
+    SendMessageW(g_Slider, TBM_SETRANGEMAX, TRUE, NewMax);
+    if (Pos >= Max)
+        SendMessageW(g_Slider, TBM_SETPOS, TRUE, NewMax);
+}
+
+static void EventText(const TimelineEvent& Event, int Column, __out_ecount(cchDest) STRSAFE_LPWSTR pszDest, __in size_t cchDest)
+{
+    const TimelineRegion& Region = Event.Region;
+    switch (Column)
+    {
+    case 0:
+        FormatTime(Event.Time, pszDest, cchDest);
+        break;
+    case 1:
+        if (Event.Kind & TimelineEvent::Alloc)
+            StringCchCopyW(pszDest, cchDest, L"Allocated");
+        else if (Event.Kind & TimelineEvent::Free)
+            StringCchCopyW(pszDest, cchDest, L"Freed");
+        else if (Event.Kind == (TimelineEvent::Resize | TimelineEvent::Protect))
+            StringCchCopyW(pszDest, cchDest, L"Resized, protected");
+        else if (Event.Kind & TimelineEvent::Resize)
+            StringCchCopyW(pszDest, cchDest, L"Resized");
+        else
+            StringCchCopyW(pszDest, cchDest, L"Protected");
+        break;
+    case 2:
+        StringCchPrintfW(pszDest, cchDest, L"%p", Region.Base);
+        break;
+    case 3:
+        if (Event.Kind & TimelineEvent::Resize)
+            StringCchPrintfW(pszDest, cchDest, L"%08Ix -> %08Ix", Event.OldSize, Region.Size);
+        else
+            StringCchPrintfW(pszDest, cchDest, L"%08Ix", Region.Size);
+        break;
+    case 4:
+        if (Event.Kind & TimelineEvent::Protect)
+            StringCchPrintfW(pszDest, cchDest, L"%s -> %s", AccessName(Event.OldProtect, Event.OldState), AccessName(Region.Protect, Region.State));
+        else
+            StringCchCopyW(pszDest, cchDest, AccessName(Region.Protect, Region.State));
+        break;
+    case 5:
+        StringCchCopyW(pszDest, cchDest, Region.Mapped.c_str());
+        break;
+    }
+}
+
+static void RegionText(const TimelineRegion& Region, int Column, __out_ecount(cchDest) STRSAFE_LPWSTR pszDest, __in size_t cchDest)
+{
+    switch (Column)
+    {
+    case 0:
+        StringCchPrintfW(pszDest, cchDest, L"%p", Region.Base);
+        break;
+    case 1:
+        StringCchPrintfW(pszDest, cchDest, L"%08Ix", Region.Size);
+        break;
+    case 2:
+        StringCchCopyW(pszDest, cchDest, TypeName(Region.Type));
+        break;
+    case 3:
+        StringCchCopyW(pszDest, cchDest, AccessName(Region.Protect, Region.State));
+        break;
+    case 4:
+        StringCchCopyW(pszDest, cchDest, Region.Mapped.c_str());
+        break;
+    }
+}
+
+static void HandleSize(HWND hwnd)
+{
+    RECT client;
+    GetClientRect(hwnd, &client);
+    LONG w = client.right - client.left;
+    LONG ItemHeight = 22, StatusHeight = 16, ComboWidth = 180;
+    HDWP wp = BeginDeferWindowPos(4);
+    wp = DeferWindowPos(wp, g_Slider, 0, client.left, client.top, w - ComboWidth, ItemHeight + 8, 0);
+    wp = DeferWindowPos(wp, g_ViewCombo, 0, client.right - ComboWidth, client.top, ComboWidth, 200, 0);
+    wp = DeferWindowPos(wp, g_TimeStatic, 0, client.left, client.top + ItemHeight + 8, w, StatusHeight, 0);
+    client.top += ItemHeight + 8 + StatusHeight;
+    wp = DeferWindowPos(wp, g_TimelineList, 0, client.left, client.top, w, client.bottom - client.top, 0);
+    EndDeferWindowPos(wp);
+    ListView_SetColumnWidth(g_TimelineList, (g_ShowRegions ? _countof(RegionColumns) : _countof(EventColumns)) - 1, LVSCW_AUTOSIZE_USEHEADER);
+}
+
+LRESULT CALLBACK TimelineWndProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
+{
+    switch (uMsg)
+    {
+    case WM_CREATE:
+    {
+        g_Slider = CreateWindowW(TRACKBAR_CLASS, L"", WS_CHILD | WS_VISIBLE | WS_TABSTOP | TBS_NOTICKS,
+            0, 0, 0, 0, hwnd, NULL, g_hInst, NULL);
+        g_ViewCombo = CreateWindowW(WC_COMBOBOX, L"", WS_CHILD | WS_VISIBLE | WS_TABSTOP | CBS_DROPDOWNLIST,
+            0, 0, 0, 0, hwnd, NULL, g_hInst, NULL);
+        g_TimeStatic = CreateWindowW(WC_STATIC, L"", WS_CHILD | WS_VISIBLE | SS_SUNKEN,
+            0, 0, 0, 0, hwnd, NULL, g_hInst, NULL);
+        g_TimelineList = CreateWindowW(WC_LISTVIEW, L"", WS_CHILD | LVS_REPORT | WS_VISIBLE | LVS_OWNERDATA | WS_TABSTOP | LVS_SHOWSELALWAYS,
+            0, 0, 0, 0, hwnd, NULL, g_hInst, NULL);
+
+        ListView_SetExtendedListViewStyle(g_TimelineList, ListView_GetExtendedListViewStyle(g_TimelineList) | LVS_EX_FULLROWSELECT | LVS_EX_DOUBLEBUFFER);
+
+        HWND Controls[] = { g_Slider, g_ViewCombo, g_TimeStatic, g_TimelineList };
+        for (HWND control : Controls)
+            SetWindowFont(control, getFont(), FALSE);
+
+        // Same order as Spans
+        ComboBox_AddString(g_ViewCombo, L"Regions");
+        ComboBox_AddString(g_ViewCombo, L"Events, 10 seconds");
+        ComboBox_AddString(g_ViewCombo, L"Events, 1 minute");
+        ComboBox_AddString(g_ViewCombo, L"Events, 10 minutes");
+        ComboBox_AddString(g_ViewCombo, L"Events, 1 hour");
+        ComboBox_AddString(g_ViewCombo, L"All events");
+        ComboBox_SetCurSel(g_ViewCombo, 2);
+
+        g_ShowRegions = false;
+        SetColumns(false);
+        HandleSize(hwnd);
+        UpdateSlider();
+        UpdateList();
+        SetTimer(hwnd, kRefreshTimerId, 1000, NULL);
+    }
+    return 0;
+
+    case WM_SIZE:
+        HandleSize(hwnd);
+        return 0;
+
+    case WM_TIMER:
+        if (wParam == kRefreshTimerId)
+        {
+            UpdateSlider();
+            // Only a slider at the end shows new events
+            if (SendMessageW(g_Slider, TBM_GETPOS, 0, 0) >= SendMessageW(g_Slider, TBM_GETRANGEMAX, 0, 0))
+                UpdateList();
+        }
+        return 0;
+
+    case WM_HSCROLL:
+        if ((HWND)lParam == g_Slider)
+        {
+            UpdateList();
+            return 0;
+        }
+        break;
+
+    case WM_COMMAND:
+        if ((HWND)lParam == g_ViewCombo && HIWORD(wParam) == CBN_SELCHANGE)
+        {
+            UpdateList();
+            return 0;
+        }
+        break;
+
+    case WM_NOTIFY:
+        if (((LPNMHDR)lParam)->hwndFrom == g_TimelineList && ((LPNMHDR)lParam)->code == LVN_GETDISPINFO)
+        {
+            NMLVDISPINFO* plvdi = (NMLVDISPINFO*)lParam;
+            size_t item = plvdi->item.iItem;
+            if (plvdi->item.mask & LVIF_TEXT)
+            {
+                if (g_ShowRegions && item < g_Regions.size())
+                    RegionText(g_Regions[item], plvdi->item.iSubItem, plvdi->item.pszText, plvdi->item.cchTextMax);
+                else if (!g_ShowRegions && item < g_Events.size())
+                    EventText(g_Events[item], plvdi->item.iSubItem, plvdi->item.pszText, plvdi->item.cchTextMax);
+            }
+            return TRUE;
+        }
+        break;
+
+    case WM_DESTROY:
+        KillTimer(hwnd, kRefreshTimerId);
+        g_Regions.clear();
+        g_Events.clear();
+        RemoveDialogWindow(hwnd);
+        g_TimelineWnd = NULL;
+        break;
+    }
+    return DefWindowProc(hwnd, uMsg, wParam, lParam);
+}
+
+void ShowTimeline(HWND Parent)
+{
+    if (g_TimelineWnd)
+    {
+        SetForegroundWindow(g_TimelineWnd);
+        return;
+    }
+
+    WNDCLASSEX wc = { sizeof(wc), 0 };
+    if (!GetClassInfoEx(g_hInst, TIMELINE_CLASS, &wc))
+    {
+        wc.lpfnWndProc = TimelineWndProc;
+        wc.hInstance = g_hInst;
+        wc.hCursor = LoadCursor((HINSTANCE)NULL, IDC_ARROW);
+        wc.hbrBackground = (HBRUSH)(COLOR_BTNFACE + 1);
+        wc.lpszClassName = TIMELINE_CLASS;
+        setIcons(wc);
+
+        if (!RegisterClassEx(&wc))
+            return;
+    }
+
+    g_TimelineWnd = CreateWindowEx(WS_EX_CONTROLPARENT, TIMELINE_CLASS, L"Timeline", WS_OVERLAPPEDWINDOW,
+        CW_USEDEFAULT, CW_USEDEFAULT, 800, 450, Parent, NULL, g_hInst, NULL);
+    AddDialogWindow(g_TimelineWnd);
+    ShowWindow(g_TimelineWnd, SW_SHOW);
+    UpdateWindow(g_TimelineWnd);
+}
+
@@ -0,0 +1,552 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     Value scanner, narrowing down the addresses that hold a value
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#include "MemView.h"
+#include "MemInfo.h"
+#include "ValueScan.h"
+#include "ByteDiff.h"
+#include "MemReader.h"
+#include "Parallel.h"
+#include <intrin.h>
+#include <algorithm>
+#include <thread>
+#include <cwchar>
+#include <cwctype>
+#include <cerrno>
+
+#if defined(_M_IX86) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+// Pages are handed out to the workers in blocks, so that the results can be joined in order
+const size_t kBlockPages = 256;
+
+struct ValueScan::Block
+{
+    std::vector<Page> Pages;
+    std::vector<DWORD> Bits;
+    std::vector<BYTE> Values;
+};
+
+static UINT CountBits(DWORD value)
+{
+    value = value - ((value >> 1) & 0x55555555);
+    value = (value & 0x33333333) + ((value >> 2) & 0x33333333);
+    return (((value + (value >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24;
+}
+
+static bool IsScannable(const MemSnapshot& Regions, size_t n)
+{
+    DWORD protect = Regions.protect(n);
+    return Regions.state(n) == MEM_COMMIT && Regions.isPrivate(n) &&
+        (protect & (PAGE_READWRITE | PAGE_EXECUTE_READWRITE)) != 0 &&
+        (protect & (PAGE_NOACCESS | PAGE_GUARD)) == 0;
+}
+
+template<typename T>
+static bool Matches(ScanCompare Compare, T Current, T Previous, T Value)
+{
+    switch (Compare)
+    {
+    case ScanCompare::Equals:       return Current == Value;
+    case ScanCompare::Unknown:      return true;
+    // Compare the bits, so that a NaN that stays the same is unchanged
+    case ScanCompare::Changed:      return memcmp(&Current, &Previous, sizeof(T)) != 0;
+    case ScanCompare::Unchanged:    return memcmp(&Current, &Previous, sizeof(T)) == 0;
+    case ScanCompare::Increased:    return Current > Previous;
+    case ScanCompare::Decreased:    return Current < Previous;
+    }
+    return false;
+}
+
+#if defined(_M_IX86) || defined(_M_X64)
+// The compares return one bit per lane, like movemask
+template<typename T> struct Lanes;
+
+template<> struct Lanes<INT32>
+{
+    enum { Count = 4 };
+    static __m128i load(const INT32* p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+    static __m128i set(INT32 v) { return _mm_set1_epi32(v); }
+    static int same(__m128i a, __m128i b) { return _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(a, b))); }
+    static int equal(__m128i a, __m128i b) { return same(a, b); }
+    static int greater(__m128i a, __m128i b) { return _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(a, b))); }
+};
+
+template<> struct Lanes<INT64>
+{
+    enum { Count = 2 };
+    static __m128i load(const INT64* p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+    static __m128i set(INT64 v) { return _mm_set_epi32((int)(v >> 32), (int)v, (int)(v >> 32), (int)v); }
+    static int same(__m128i a, __m128i b)
+    {
+        // Both halves have to be equal
+        __m128i eq = _mm_cmpeq_epi32(a, b);
+        eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+        return _mm_movemask_pd(_mm_castsi128_pd(eq));
+    }
+    static int equal(__m128i a, __m128i b) { return same(a, b); }
+    static int greater(__m128i a, __m128i b)
+    {
+        // SSE2 has no 64 bit compare
+        INT64 x[2], y[2];
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(x), a);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(y), b);
+        return (x[0] > y[0] ? 1 : 0) | (x[1] > y[1] ? 2 : 0);
+    }
+};
+
+template<> struct Lanes<float>
+{
+    enum { Count = 4 };
+    static __m128 load(const float* p) { return _mm_loadu_ps(p); }
+    static __m128 set(float v) { return _mm_set1_ps(v); }
+    static int same(__m128 a, __m128 b) { return Lanes<INT32>::same(_mm_castps_si128(a), _mm_castps_si128(b)); }
+    static int equal(__m128 a, __m128 b) { return _mm_movemask_ps(_mm_cmpeq_ps(a, b)); }
+    static int greater(__m128 a, __m128 b) { return _mm_movemask_ps(_mm_cmpgt_ps(a, b)); }
+};
+
+template<> struct Lanes<double>
+{
+    enum { Count = 2 };
+    static __m128d load(const double* p) { return _mm_loadu_pd(p); }
+    static __m128d set(double v) { return _mm_set1_pd(v); }
+    static int same(__m128d a, __m128d b) { return Lanes<INT64>::same(_mm_castpd_si128(a), _mm_castpd_si128(b)); }
+    static int equal(__m128d a, __m128d b) { return _mm_movemask_pd(_mm_cmpeq_pd(a, b)); }
+    static int greater(__m128d a, __m128d b) { return _mm_movemask_pd(_mm_cmpgt_pd(a, b)); }
+};
+#endif
+
+// Compare every slot of a page, Previous is laid out like the page
+template<typename T>
+static void CompareDense(ScanCompare Compare, const T* Current, const T* Previous, T Value, size_t Slots, DWORD* Bits)
+{
+    memset(Bits, 0, MaskWords(Slots) * sizeof(DWORD));
+    size_t n = 0;
+
+#if defined(_M_IX86) || defined(_M_X64)
+    typedef Lanes<T> L;
+    const int All = (1 << L::Count) - 1;
+    const auto value = L::set(Value);
+    for (; n + L::Count <= Slots; n += L::Count)
+    {
+        const auto current = L::load(Current + n);
+        int mask;
+        switch (Compare)
+        {
+        case ScanCompare::Equals:       mask = L::equal(current, value); break;
+        case ScanCompare::Unknown:      mask = All; break;
+        case ScanCompare::Changed:      mask = ~L::same(current, L::load(Previous + n)) & All; break;
+        case ScanCompare::Unchanged:    mask = L::same(current, L::load(Previous + n)); break;
+        case ScanCompare::Increased:    mask = L::greater(current, L::load(Previous + n)); break;
+        case ScanCompare::Decreased:    mask = L::greater(L::load(Previous + n), current); break;
+        default:                        mask = 0; break;
+        }
+        Bits[n / 32] |= (DWORD)mask << (n % 32);
+    }
+#endif
+
+    for (; n < Slots; ++n)
+    {
+        if (Matches(Compare, Current[n], Previous[n], Value))
+            Bits[n / 32] |= 1u << (n % 32);
+    }
+}
+
+// Compare only the slots set in OldBits, Previous holds their packed values
+template<typename T>
+static void CompareSparse(ScanCompare Compare, const T* Current, const DWORD* OldBits, const T* Previous, T Value, size_t Words, DWORD* Bits)
+{
+    for (size_t w = 0; w < Words; ++w)
+    {
+        DWORD word = OldBits[w], result = 0;
+        unsigned long index;
+        while (_BitScanForward(&index, word))
+        {
+            word &= word - 1;
+            if (Matches(Compare, Current[w * 32 + index], *Previous++, Value))
+                result |= 1u << index;
+        }
+        Bits[w] = result;
+    }
+}
+
+// Store the candidates of one page with their current values
+template<typename T>
+static void EmitPage(ValueScan::Block& Out, PBYTE Address, size_t Region, const T* Current, const DWORD* Bits, size_t Slots, size_t Words)
+{
+    UINT Count = 0;
+    for (size_t w = 0; w < Words; ++w)
+        Count += CountBits(Bits[w]);
+    if (!Count)
+        return;
+
+    ValueScan::Page page = { Address, Region, 0, Count, Out.Bits.size(), 0, Out.Values.size() };
+    Out.Pages.push_back(page);
+    Out.Bits.insert(Out.Bits.end(), Bits, Bits + Words);
+    Out.Values.resize(page.Values + Count * sizeof(T));
+    T* Values = reinterpret_cast<T*>(Out.Values.data() + page.Values);
+
+    if (Count == Slots)
+    {
+        memcpy(Values, Current, Slots * sizeof(T));
+        return;
+    }
+
+    for (size_t w = 0; w < Words; ++w)
+    {
+        DWORD word = Bits[w];
+        unsigned long index;
+        while (_BitScanForward(&index, word))
+        {
+            word &= word - 1;
+            *Values++ = Current[w * 32 + index];
+        }
+    }
+}
+
+// Negative values down to Min, or positive values up to Max are accepted
+static bool ParseInteger(const wchar_t* Text, INT64 Min, unsigned long long Max, INT64& Value)
+{
+    while (iswspace(*Text))
+        ++Text;
+    bool negative = *Text == '-';
+    if (negative)
+        ++Text;
+    int base = 10;
+    if (Text[0] == '0' && (Text[1] == 'x' || Text[1] == 'X'))
+    {
+        base = 16;
+        Text += 2;
+    }
+    if (!iswxdigit(*Text))
+        return false;
+
+    wchar_t* end;
+    errno = 0;
+    unsigned long long value = wcstoull(Text, &end, base);
+    while (iswspace(*end))
+        ++end;
+    if (*end || errno == ERANGE)
+        return false;
+
+    Value = (INT64)(negative ? 0ull - value : value);
+    return negative ? (value <= 0ull - (unsigned long long)Min) : (value <= Max);
+}
+
+bool ParseScanValue(const wchar_t* Text, ValueType Type, ScanValue& Value)
+{
+    INT64 value;
+    switch (Type)
+    {
+    case ValueType::Int32:
+        // Accept unsigned values as well, 0xffffffff is -1
+        if (!ParseInteger(Text, INT_MIN, UINT_MAX, value))
+            return false;
+        Value.Int32 = (INT32)value;
+        return true;
+    case ValueType::Int64:
+        if (!ParseInteger(Text, LLONG_MIN, ULLONG_MAX, value))
+            return false;
+        Value.Int64 = value;
+        return true;
+    case ValueType::Float:
+    case ValueType::Double:
+    {
+        wchar_t* end;
+        double d = wcstod(Text, &end);
+        while (iswspace(*end))
+            ++end;
+        if (end == Text || *end)
+            return false;
+        if (Type == ValueType::Float)
+            Value.Float = (float)d;
+        else
+            Value.Double = d;
+        return true;
+    }
+    }
+    return false;
+}
+
+void FormatScanValue(const BYTE* Data, ValueType Type, __out_ecount(cchDest) STRSAFE_LPWSTR pszDest, __in size_t cchDest)
+{
+    ScanValue value;
+    switch (Type)
+    {
+    case ValueType::Int32:
+        memcpy(&value.Int32, Data, sizeof(value.Int32));
+        StringCchPrintfW(pszDest, cchDest, L"%d", value.Int32);
+        break;
+    case ValueType::Int64:
+        memcpy(&value.Int64, Data, sizeof(value.Int64));
+        StringCchPrintfW(pszDest, cchDest, L"%I64d", value.Int64);
+        break;
+    case ValueType::Float:
+        memcpy(&value.Float, Data, sizeof(value.Float));
+        StringCchPrintfW(pszDest, cchDest, L"%g", value.Float);
+        break;
+    case ValueType::Double:
+        memcpy(&value.Double, Data, sizeof(value.Double));
+        StringCchPrintfW(pszDest, cchDest, L"%g", value.Double);
+        break;
+    }
+}
+
+ValueScan::ValueScan()
+    :mType(ValueType::Int32), mPageSize(PageSize()), mSlots(0), mWords(0), mCount(0)
+    , mCancel(false)
+{
+}
+
+size_t ValueScan::valueSize() const
+{
+    switch (mType)
+    {
+    case ValueType::Int32:  return sizeof(INT32);
+    case ValueType::Int64:  return sizeof(INT64);
+    case ValueType::Float:  return sizeof(float);
+    case ValueType::Double: return sizeof(double);
+    }
+    return 1;
+}
+
+void ValueScan::clear()
+{
+    // The candidates can take a lot of memory, release it
+    std::vector<Page>().swap(mPages);
+    std::vector<DWORD>().swap(mBits);
+    std::vector<std::vector<BYTE>>().swap(mValues);
+    mCount = 0;
+}
+
+template<typename T>
+void ValueScan::scanFirst(HANDLE hProcess, const MemSnapshot& Regions, ScanCompare Compare, T Value, std::vector<Block>& Blocks)
+{
+    struct Range
+    {
+        PBYTE Start;
+        SIZE_T Size;
+        size_t Region;
+    };
+
+    std::vector<Range> ranges;
+    const SIZE_T BlockSize = kBlockPages * mPageSize;
+    for (size_t n = 0; n < Regions.size(); ++n)
+    {
+        if (!IsScannable(Regions, n))
+            continue;
+        for (SIZE_T offset = 0; offset < Regions.regionSize(n); offset += BlockSize)
+        {
+            Range range = { Regions.start(n) + offset, std::min(BlockSize, Regions.regionSize(n) - offset), n };
+            ranges.push_back(range);
+        }
+    }
+
+    // The layout of the previous scan stays in place until this one succeeds
+    const size_t Slots = mPageSize / sizeof(T);
+    const size_t Words = MaskWords(Slots);
+
+    Blocks.resize(ranges.size());
+    ParallelFor(ranges.size(), [&](size_t index)
+    {
+        if (mCancel)
+            return;
+
+        const Range& range = ranges[index];
+        std::vector<BYTE> buffer(range.Size);
+        std::vector<DWORD> valid(MaskWords(range.Size));
+        std::vector<DWORD> bits(Words);
+
+        SIZE_T Read = 0;
+        if (ReadProcessMemory(hProcess, range.Start, buffer.data(), range.Size, &Read) && Read == range.Size)
+            SetMaskRange(valid.data(), 0, range.Size, true);
+        else
+            ReadMemoryPages(hProcess, range.Start, buffer.data(), range.Size, valid.data());
+
+        // Every slot is a candidate, the values are a copy of the range
+        if (Compare == ScanCompare::Unknown)
+            Blocks[index].Values.reserve(range.Size);
+
+        for (SIZE_T offset = 0; offset < range.Size; offset += mPageSize)
+        {
+            // A page is either read as a whole, or not at all
+            if (!TestMaskBit(valid.data(), offset))
+                continue;
+            const T* current = reinterpret_cast<const T*>(buffer.data() + offset);
+            CompareDense(Compare, current, current, Value, Slots, bits.data());
+            EmitPage(Blocks[index], range.Start + offset, range.Region, current, bits.data(), Slots, Words);
+        }
+        // The block is kept as it is after the scan
+        Blocks[index].Values.shrink_to_fit();
+    });
+}
+
+template<typename T>
+void ValueScan::scanNext(HANDLE hProcess, ScanCompare Compare, T Value, std::vector<Block>& Blocks)
+{
+    Blocks.resize((mPages.size() + kBlockPages - 1) / kBlockPages);
+    ParallelFor(Blocks.size(), [&](size_t index)
+    {
+        if (mCancel)
+            return;
+
+        size_t first = index * kBlockPages;
+        size_t last = std::min(first + kBlockPages, mPages.size());
+        std::vector<BYTE> buffer;
+        std::vector<DWORD> bits(mWords);
+
+        for (size_t n = first; n < last;)
+        {
+            // Read runs of adjacent pages at once
+            size_t end = n + 1;
+            while (end < last && mPages[end].Address == mPages[end - 1].Address + mPageSize)
+                ++end;
+
+            const PBYTE Start = mPages[n].Address;
+            SIZE_T Size = (end - n) * mPageSize;
+            buffer.resize(Size);
+            SIZE_T Read = 0;
+            bool all = ReadProcessMemory(hProcess, Start, buffer.data(), Size, &Read) && Read == Size;
+
+            for (; n < end; ++n)
+            {
+                const Page& page = mPages[n];
+                BYTE* data = buffer.data() + (page.Address - Start);
+                if (!all && (!ReadProcessMemory(hProcess, page.Address, data, mPageSize, &Read) || Read != mPageSize))
+                    continue;   // The page is gone, and so are its candidates
+
+                const T* current = reinterpret_cast<const T*>(data);
+                const T* previous = reinterpret_cast<const T*>(mValues[page.Segment].data() + page.Values);
+                if (page.Count == mSlots)
+                    CompareDense(Compare, current, previous, Value, mSlots, bits.data());
+                else
+                    CompareSparse(Compare, current, mBits.data() + page.Bits, previous, Value, mWords, bits.data());
+                EmitPage(Blocks[index], page.Address, page.Region, current, bits.data(), mSlots, mWords);
+            }
+        }
+        Blocks[index].Values.shrink_to_fit();
+    });
+}
+
+void ValueScan::take(std::vector<Block>& Blocks)
+{
+    size_t pages = 0, words = 0, segments = 0;
+    for (const Block& block : Blocks)
+    {
+        pages += block.Pages.size();
+        words += block.Bits.size();
+        segments += block.Pages.empty() ? 0 : 1;
+    }
+
+    clear();
+    mPages.reserve(pages);
+    mBits.reserve(words);
+    mValues.reserve(segments);
+    for (Block& block : Blocks)
+    {
+        if (block.Pages.empty())
+            continue;
+        for (Page page : block.Pages)
+        {
+            page.First = mCount;
+            page.Bits += mBits.size();
+            page.Segment = mValues.size();
+            mCount += page.Count;
+            mPages.push_back(page);
+        }
+        mBits.insert(mBits.end(), block.Bits.begin(), block.Bits.end());
+        std::vector<DWORD>().swap(block.Bits);
+        // Moved, so the values are never held twice
+        mValues.push_back(std::move(block.Values));
+    }
+}
+
+bool ValueScan::firstScan(HANDLE hProcess, MemSnapshot& Regions, ValueType Type, ScanCompare Compare, const ScanValue& Value)
+{
+    if (Compare != ScanCompare::Equals && Compare != ScanCompare::Unknown)
+        return false;
+
+    mCancel = false;
+
+    // Named from hProcess, the main window can switch to another process meanwhile
+    KnownRegions Known;
+    Known.init(hProcess);
+    MemSnapshot::read(hProcess, Regions, Known);
+
+    // Scan into Blocks, so that a cancelled scan keeps the previous candidates
+    std::vector<Block> Blocks;
+    switch (Type)
+    {
+    case ValueType::Int32:  scanFirst<INT32>(hProcess, Regions, Compare, Value.Int32, Blocks); break;
+    case ValueType::Int64:  scanFirst<INT64>(hProcess, Regions, Compare, Value.Int64, Blocks); break;
+    case ValueType::Float:  scanFirst<float>(hProcess, Regions, Compare, Value.Float, Blocks); break;
+    case ValueType::Double: scanFirst<double>(hProcess, Regions, Compare, Value.Double, Blocks); break;
+    }
+
+    if (mCancel)
+        return false;
+    mType = Type;
+    mSlots = mPageSize / valueSize();
+    mWords = MaskWords(mSlots);
+    take(Blocks);
+    return true;
+}
+
+bool ValueScan::nextScan(HANDLE hProcess, ScanCompare Compare, const ScanValue& Value)
+{
+    if (Compare == ScanCompare::Unknown)
+        return false;
+
+    mCancel = false;
+    std::vector<Block> Blocks;
+    switch (mType)
+    {
+    case ValueType::Int32:  scanNext<INT32>(hProcess, Compare, Value.Int32, Blocks); break;
+    case ValueType::Int64:  scanNext<INT64>(hProcess, Compare, Value.Int64, Blocks); break;
+    case ValueType::Float:  scanNext<float>(hProcess, Compare, Value.Float, Blocks); break;
+    case ValueType::Double: scanNext<double>(hProcess, Compare, Value.Double, Blocks); break;
+    }
+
+    if (mCancel)
+        return false;
+    take(Blocks);
+    return true;
+}
+
+bool ValueScan::candidate(size_t n, PBYTE& Address, const BYTE*& Value, size_t& Region) const
+{
+    if (n >= mCount)
+        return false;
+
+    auto it = std::upper_bound(mPages.begin(), mPages.end(), n, [](size_t n, const Page& page) { return n < page.First; });
+    const Page& page = *(it - 1);
+    size_t k = n - page.First;
+    const size_t size = valueSize();
+    Value = mValues[page.Segment].data() + page.Values + k * size;
+    Region = page.Region;
+
+    // Find the k'th set bit
+    const DWORD* Bits = mBits.data() + page.Bits;
+    for (size_t w = 0; w < mWords; ++w)
+    {
+        UINT count = CountBits(Bits[w]);
+        if (k >= count)
+        {
+            k -= count;
+            continue;
+        }
+        DWORD word = Bits[w];
+        while (k--)
+            word &= word - 1;
+        unsigned long index;
+        _BitScanForward(&index, word);
+        Address = page.Address + (w * 32 + index) * size;
+        return true;
+    }
+    return false;
+}
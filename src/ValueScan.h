@@ -0,0 +1,100 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     Value scanner, narrowing down the addresses that hold a value
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#pragma once
+
+#include <vector>
+#include <atomic>
+
+class MemSnapshot;
+
+enum class ValueType
+{
+    Int32,
+    Int64,
+    Float,
+    Double,
+};
+
+enum class ScanCompare
+{
+    Equals,
+    Unknown,    // First scan only, every value is a candidate
+    Changed,
+    Unchanged,
+    Increased,
+    Decreased,
+};
+
+union ScanValue
+{
+    INT32 Int32;
+    INT64 Int64;
+    float Float;
+    double Double;
+};
+
+bool ParseScanValue(const wchar_t* Text, ValueType Type, ScanValue& Value);
+void FormatScanValue(const BYTE* Data, ValueType Type, __out_ecount(cchDest) STRSAFE_LPWSTR pszDest, __in size_t cchDest);
+
+// Candidates are kept per page, as a bitmap with one bit per aligned slot,
+// followed by the values of the candidates at the last scan, packed.
+// A page where every slot is a candidate is stored as a plain copy of the page,
+// pages without candidates are dropped.
+class ValueScan
+{
+public:
+    ValueScan();
+
+    // List the regions of hProcess into Regions, and scan all committed, writable private ones.
+    // Only Equals and Unknown are valid for the first scan.
+    bool firstScan(HANDLE hProcess, MemSnapshot& Regions, ValueType Type, ScanCompare Compare, const ScanValue& Value);
+    // Compare the current memory with the values of the last scan, and keep the matching candidates.
+    bool nextScan(HANDLE hProcess, ScanCompare Compare, const ScanValue& Value);
+
+    // Stop a running scan, the candidates of the previous scan are kept
+    void cancel() { mCancel = true; }
+    void clear();
+
+    ValueType type() const { return mType; }
+    size_t valueSize() const;
+    size_t count() const { return mCount; }
+    bool empty() const { return mCount == 0; }
+
+    // Look up candidate n, with the value it had at the last scan
+    bool candidate(size_t n, PBYTE& Address, const BYTE*& Value, size_t& Region) const;
+
+    struct Page
+    {
+        PBYTE Address;
+        size_t Region;      // Index in the snapshot of the first scan
+        size_t First;       // Number of candidates in all previous pages
+        UINT Count;
+        size_t Bits;        // Offset in mBits
+        size_t Segment;     // Index in mValues
+        size_t Values;      // Offset in that segment
+    };
+
+    struct Block;
+
+private:
+    template<typename T> void scanFirst(HANDLE hProcess, const MemSnapshot& Regions, ScanCompare Compare, T Value, std::vector<Block>& Blocks);
+    template<typename T> void scanNext(HANDLE hProcess, ScanCompare Compare, T Value, std::vector<Block>& Blocks);
+    void take(std::vector<Block>& Blocks);
+
+    ValueType mType;
+    SIZE_T mPageSize;
+    size_t mSlots;      // Slots per page
+    size_t mWords;      // Bitmap words per page
+    size_t mCount;
+
+    std::vector<Page> mPages;
+    std::vector<DWORD> mBits;
+    // The values of every block of the scan as the worker left them, these are not copied into one buffer
+    std::vector<std::vector<BYTE>> mValues;
+    std::atomic<bool> mCancel;
+};
@@ -0,0 +1,394 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     The value scanner window
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#include "MemView.h"
+#include <Commctrl.h>
+#include <thread>
+#include <algorithm>
+#include "MemInfo.h"
+#include "ValueScan.h"
+
+#define VALUESCAN_CLASS TEXT("MemValueScanClass")
+const UINT WM_SCAN_DONE = WM_APP + 1;
+const UINT_PTR kRefreshTimerId = 0x5ca9;
+// The list only shows this many candidates, narrow them down first
+const size_t kMaxShown = 100000;
+
+static HWND g_ScanWnd;
+static HWND g_ValueEdit;
+static HWND g_TypeCombo;
+static HWND g_CompareCombo;
+static HWND g_FirstButton;
+static HWND g_NextButton;
+static HWND g_CandidateList;
+static HWND g_ScanStatic;
+
+static ValueScan g_Scan;
+static std::thread g_ScanThread;
+static bool g_Scanning;
+static MemSnapshot g_ScanRegions;
+static HANDLE g_ScanProcess;
+static std::wstring g_ScanProcessName;
+// A first scan runs against these, they replace the above only when it completes
+static MemSnapshot g_NewRegions;
+static HANDLE g_NewProcess;
+static std::wstring g_NewProcessName;
+static bool g_ScanDone;
+
+static wchar_t* Columns[] =
+{
+    L"Address",
+    L"Value",
+    L"Current",
+    L"Mapped",
+};
+
+static int Sizes[] = {
+#ifdef _WIN64
+    136,
+#else
+    76,
+#endif
+    120,
+    120,
+    300,
+};
+
+static void UpdateStatus(LPCWSTR Message = NULL)
+{
+    WCHAR buf[100];
+    if (Message)
+        StringCchCopyW(buf, _countof(buf), Message);
+    else if (g_Scanning)
+        StringCchCopyW(buf, _countof(buf), L"Scanning...");
+    else if (g_Scan.count() > kMaxShown)
+        StringCchPrintfW(buf, _countof(buf), L"%Iu candidates, showing the first %Iu", g_Scan.count(), kMaxShown);
+    else
+        StringCchPrintfW(buf, _countof(buf), L"%Iu candidates", g_Scan.count());
+    Static_SetText(g_ScanStatic, buf);
+
+    Button_SetText(g_FirstButton, g_Scanning ? L"Cancel" : L"First scan");
+    EnableWindow(g_NextButton, !g_Scanning && !g_Scan.empty());
+    EnableWindow(g_TypeCombo, !g_Scanning);
+}
+
+static void WaitForScan()
+{
+    if (g_ScanThread.joinable())
+    {
+        g_Scan.cancel();
+        g_ScanThread.join();
+    }
+
+    if (g_NewProcess)
+    {
+        if (g_ScanDone)
+        {
+            if (g_ScanProcess)
+                CloseHandle(g_ScanProcess);
+            g_ScanProcess = g_NewProcess;
+            g_ScanProcessName.swap(g_NewProcessName);
+            g_ScanRegions.swap(g_NewRegions);
+        }
+        else
+        {
+            CloseHandle(g_NewProcess);
+        }
+        g_NewProcess = NULL;
+        g_NewProcessName.clear();
+        g_NewRegions.clear();
+    }
+}
+
+static void StartScan(bool First)
+{
+    if (g_Scanning)
+    {
+        g_Scan.cancel();
+        return;
+    }
+
+    // A snapshot has no process to scan
+    if (First && (g_Snapshot || !g_ProcessHandle))
+    {
+        UpdateStatus(L"Scanning needs a running process");
+        return;
+    }
+
+    ScanCompare Compare = static_cast<ScanCompare>(ComboBox_GetCurSel(g_CompareCombo));
+    if (First && Compare != ScanCompare::Equals && Compare != ScanCompare::Unknown)
+    {
+        UpdateStatus(L"The first scan needs an exact or unknown value");
+        return;
+    }
+    if (!First && Compare == ScanCompare::Unknown)
+    {
+        UpdateStatus(L"An unknown value is only valid for the first scan");
+        return;
+    }
+
+    ValueType Type = First ? static_cast<ValueType>(ComboBox_GetCurSel(g_TypeCombo)) : g_Scan.type();
+    ScanValue Value = { 0 };
+    if (Compare == ScanCompare::Equals)
+    {
+        WCHAR Text[100];
+        Edit_GetText(g_ValueEdit, Text, _countof(Text));
+        if (!ParseScanValue(Text, Type, Value))
+        {
+            UpdateStatus(L"Invalid value");
+            return;
+        }
+    }
+
+    WaitForScan();
+    if (First)
+    {
+        // Keep our own handle, the main window can switch to another process between scans
+        if (!DuplicateHandle(GetCurrentProcess(), g_ProcessHandle, GetCurrentProcess(), &g_NewProcess, 0, FALSE, DUPLICATE_SAME_ACCESS))
+        {
+            g_NewProcess = NULL;
+            UpdateStatus(L"Scanning needs a running process");
+            return;
+        }
+        g_NewProcessName = g_ProcessName;
+    }
+
+    // The candidates are replaced by the scan, so the list cannot show them meanwhile
+    ListView_SetItemCountEx(g_CandidateList, 0, 0);
+    g_Scanning = true;
+    g_ScanDone = false;
+    UpdateStatus();
+
+    HWND Notify = g_ScanWnd;
+    g_ScanThread = std::thread([=]()
+    {
+        if (First)
+            g_ScanDone = g_Scan.firstScan(g_NewProcess, g_NewRegions, Type, Compare, Value);
+        else
+            g_ScanDone = g_Scan.nextScan(g_ScanProcess, Compare, Value);
+        PostMessageW(Notify, WM_SCAN_DONE, 0, 0);
+    });
+}
+
+static void HandleScanDone()
+{
+    WaitForScan();
+    g_Scanning = false;
+    ListView_SetItemCountEx(g_CandidateList, std::min(g_Scan.count(), kMaxShown), 0);
+    UpdateStatus();
+}
+
+static void HandleSize(HWND hwnd)
+{
+    RECT client;
+    GetClientRect(hwnd, &client);
+    LONG w = client.right - client.left;
+    LONG ItemHeight = 22, StatusHeight = 16;
+    LONG ButtonWidth = 80, ComboWidth = 100;
+    LONG x = client.right - 2 * ButtonWidth - 2 * ComboWidth;
+    HDWP wp = BeginDeferWindowPos(7);
+    wp = DeferWindowPos(wp, g_ValueEdit, 0, client.left, client.top, x - client.left, ItemHeight, 0);
+    wp = DeferWindowPos(wp, g_TypeCombo, 0, x, client.top, ComboWidth, 200, 0);
+    wp = DeferWindowPos(wp, g_CompareCombo, 0, x + ComboWidth, client.top, ComboWidth, 200, 0);
+    wp = DeferWindowPos(wp, g_FirstButton, 0, x + 2 * ComboWidth, client.top, ButtonWidth, ItemHeight, 0);
+    wp = DeferWindowPos(wp, g_NextButton, 0, x + 2 * ComboWidth + ButtonWidth, client.top, ButtonWidth, ItemHeight, 0);
+    wp = DeferWindowPos(wp, g_CandidateList, 0, client.left, client.top + ItemHeight, w, client.bottom - client.top - ItemHeight - StatusHeight, 0);
+    wp = DeferWindowPos(wp, g_ScanStatic, 0, client.left, client.bottom - StatusHeight, w, StatusHeight, 0);
+    EndDeferWindowPos(wp);
+    ListView_SetColumnWidth(g_CandidateList, _countof(Columns) - 1, LVSCW_AUTOSIZE_USEHEADER);
+}
+
+static LRESULT CandidatesWM_NOTIFY(HWND hWnd, WPARAM wParam, LPNMHDR lParam)
+{
+    switch (lParam->code)
+    {
+    case LVN_GETDISPINFO:
+    {
+        NMLVDISPINFO* plvdi = (NMLVDISPINFO*)lParam;
+        PBYTE Address;
+        const BYTE* Value;
+        size_t Region;
+        if ((plvdi->item.mask & LVIF_TEXT) && !g_Scanning && g_Scan.candidate(plvdi->item.iItem, Address, Value, Region))
+        {
+            switch (plvdi->item.iSubItem)
+            {
+            case 0:
+                StringCchPrintfW(plvdi->item.pszText, plvdi->item.cchTextMax, L"%p", Address);
+                break;
+            case 1:
+                FormatScanValue(Value, g_Scan.type(), plvdi->item.pszText, plvdi->item.cchTextMax);
+                break;
+            case 2:
+            {
+                BYTE Current[sizeof(ScanValue)];
+                SIZE_T Read = 0;
+                if (ReadProcessMemory(g_ScanProcess, Address, Current, g_Scan.valueSize(), &Read) && Read == g_Scan.valueSize())
+                    FormatScanValue(Current, g_Scan.type(), plvdi->item.pszText, plvdi->item.cchTextMax);
+                else
+                    StringCchCopyW(plvdi->item.pszText, plvdi->item.cchTextMax, L"??");
+                break;
+            }
+            case 3:
+                StringCchCopyW(plvdi->item.pszText, plvdi->item.cchTextMax, g_ScanRegions.mapped(Region).c_str());
+                break;
+            }
+            return TRUE;
+        }
+    }
+    break;
+    case NM_DBLCLK:
+    {
+        INT Num = ListView_GetNextItem(g_CandidateList, -1, LVNI_SELECTED);
+        PBYTE Address;
+        const BYTE* Value;
+        size_t Region;
+        if (Num >= 0 && !g_Scanning && g_Scan.candidate(Num, Address, Value, Region))
+            ShowMemory(hWnd, g_ScanRegions.at(Region), g_ScanProcess, g_ScanProcessName, Address - g_ScanRegions.start(Region));
+    }
+        return TRUE;
+    }
+    return DefWindowProc(hWnd, WM_NOTIFY, wParam, (LPARAM)lParam);
+}
+
+LRESULT CALLBACK ValueScanWndProc(HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
+{
+    switch (uMsg)
+    {
+    case WM_CREATE:
+    {
+        g_ValueEdit = CreateWindowExW(WS_EX_CLIENTEDGE, WC_EDIT, L"", WS_CHILD | WS_VISIBLE | WS_TABSTOP | ES_AUTOHSCROLL,
+            0, 0, 0, 0, hwnd, NULL, g_hInst, NULL);
+        g_TypeCombo = CreateWindowW(WC_COMBOBOX, L"", WS_CHILD | WS_VISIBLE | WS_TABSTOP | CBS_DROPDOWNLIST,
+            0, 0, 0, 0, hwnd, NULL, g_hInst, NULL);
+        g_CompareCombo = CreateWindowW(WC_COMBOBOX, L"", WS_CHILD | WS_VISIBLE | WS_TABSTOP | CBS_DROPDOWNLIST,
+            0, 0, 0, 0, hwnd, NULL, g_hInst, NULL);
+        g_FirstButton = CreateWindowW(WC_BUTTON, L"First scan", WS_CHILD | WS_VISIBLE | WS_TABSTOP,
+            0, 0, 0, 0, hwnd, NULL, g_hInst, NULL);
+        g_NextButton = CreateWindowW(WC_BUTTON, L"Next scan", WS_CHILD | WS_VISIBLE | WS_TABSTOP | BS_DEFPUSHBUTTON,
+            0, 0, 0, 0, hwnd, (HMENU)IDOK, g_hInst, NULL);
+        g_CandidateList = CreateWindowW(WC_LISTVIEW, L"", WS_CHILD | LVS_REPORT | WS_VISIBLE | LVS_OWNERDATA | WS_TABSTOP | LVS_SHOWSELALWAYS,
+            0, 0, 0, 0, hwnd, NULL, g_hInst, NULL);
+        g_ScanStatic = CreateWindowW(WC_STATIC, L"", WS_CHILD | WS_VISIBLE | SS_SUNKEN,
+            0, 0, 0, 0, hwnd, NULL, g_hInst, NULL);
+
+        ListView_SetExtendedListViewStyle(g_CandidateList, ListView_GetExtendedListViewStyle(g_CandidateList) | LVS_EX_FULLROWSELECT | LVS_EX_DOUBLEBUFFER);
+
+        HWND Controls[] = { g_ValueEdit, g_TypeCombo, g_CompareCombo, g_FirstButton, g_NextButton, g_CandidateList, g_ScanStatic };
+        for (HWND control : Controls)
+            SetWindowFont(control, getFont(), FALSE);
+
+        // Same order as ValueType and ScanCompare
+        ComboBox_AddString(g_TypeCombo, L"Int32");
+        ComboBox_AddString(g_TypeCombo, L"Int64");
+        ComboBox_AddString(g_TypeCombo, L"Float");
+        ComboBox_AddString(g_TypeCombo, L"Double");
+        ComboBox_SetCurSel(g_TypeCombo, 0);
+        ComboBox_AddString(g_CompareCombo, L"Exact value");
+        ComboBox_AddString(g_CompareCombo, L"Unknown value");
+        ComboBox_AddString(g_CompareCombo, L"Changed");
+        ComboBox_AddString(g_CompareCombo, L"Unchanged");
+        ComboBox_AddString(g_CompareCombo, L"Increased");
+        ComboBox_AddString(g_CompareCombo, L"Decreased");
+        ComboBox_SetCurSel(g_CompareCombo, 0);
+
+        LVCOLUMN lvc;
+        for (size_t n = 0; n < _countof(Columns); ++n)
+        {
+            lvc.mask = LVCF_FMT | LVCF_WIDTH | LVCF_TEXT | LVCF_SUBITEM;
+            lvc.iSubItem = (int)n;
+            lvc.cx = Sizes[n];
+            lvc.fmt = LVCFMT_LEFT;
+            lvc.pszText = Columns[n];
+            ListView_InsertColumn(g_CandidateList, n, &lvc);
+        }
+
+        HandleSize(hwnd);
+        UpdateStatus();
+        SetFocus(g_ValueEdit);
+        SetTimer(hwnd, kRefreshTimerId, 1000, NULL);
+    }
+    return 0;
+
+    case WM_SIZE:
+        HandleSize(hwnd);
+        return 0;
+
+    case WM_TIMER:
+        // Refresh the current values
+        if (wParam == kRefreshTimerId && !g_Scanning)
+            InvalidateRect(g_CandidateList, NULL, FALSE);
+        return 0;
+
+    case WM_COMMAND:
+        if ((HWND)lParam == g_FirstButton && HIWORD(wParam) == BN_CLICKED)
+        {
+            StartScan(true);
+            return 0;
+        }
+        if (LOWORD(wParam) == IDOK)
+        {
+            // Enter starts a first scan when there is nothing to narrow down yet
+            if (!g_Scanning)
+                StartScan(g_Scan.empty());
+            return 0;
+        }
+        break;
+
+    case WM_SCAN_DONE:
+        HandleScanDone();
+        return 0;
+
+    case WM_NOTIFY:
+        if (((LPNMHDR)lParam)->hwndFrom == g_CandidateList)
+            return CandidatesWM_NOTIFY(hwnd, wParam, (LPNMHDR)lParam);
+        break;
+
+    case WM_DESTROY:
+        KillTimer(hwnd, kRefreshTimerId);
+        WaitForScan();
+        g_Scanning = false;
+        g_Scan.clear();
+        g_ScanRegions.clear();
+        if (g_ScanProcess)
+            CloseHandle(g_ScanProcess);
+        g_ScanProcess = NULL;
+        RemoveDialogWindow(hwnd);
+        g_ScanWnd = NULL;
+        break;
+    }
+    return DefWindowProc(hwnd, uMsg, wParam, lParam);
+}
+
+void ShowValueScan(HWND Parent)
+{
+    if (g_ScanWnd)
+    {
+        SetForegroundWindow(g_ScanWnd);
+        SetFocus(g_ValueEdit);
+        return;
+    }
+
+    WNDCLASSEX wc = { sizeof(wc), 0 };
+    if (!GetClassInfoEx(g_hInst, VALUESCAN_CLASS, &wc))
+    {
+        wc.lpfnWndProc = ValueScanWndProc;
+        wc.hInstance = g_hInst;
+        wc.hCursor = LoadCursor((HINSTANCE)NULL, IDC_ARROW);
+        wc.hbrBackground = (HBRUSH)(COLOR_BTNFACE + 1);
+        wc.lpszClassName = VALUESCAN_CLASS;
+        setIcons(wc);
+
+        if (!RegisterClassEx(&wc))
+            return;
+    }
+
+    g_ScanWnd = CreateWindowEx(WS_EX_CONTROLPARENT, VALUESCAN_CLASS, L"Value scan", WS_OVERLAPPEDWINDOW,
+        CW_USEDEFAULT, CW_USEDEFAULT, 700, 400, Parent, NULL, g_hInst, NULL);
+    AddDialogWindow(g_ScanWnd);
+    ShowWindow(g_ScanWnd, SW_SHOW);
+    UpdateWindow(g_ScanWnd);
+}
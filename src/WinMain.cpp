@@ -9,6 +9,8 @@
 #include <Commctrl.h>
 #include "../res/resource.h"
 #include "version.h"
+#include <vector>
+#include <algorithm>
 
 // Common controls 6.0 are required for the SysLink control
 #pragma comment(linker,"\"/manifestdependency:type='win32' \
@@ -20,6 +22,7 @@ processorArchitecture='*' publicKeyToken='6595b64144ccf1df' language='*'\"")
 #pragma comment(lib, "Psapi.lib")
 
 HINSTANCE g_hInst;
+static std::vector<HWND> g_DialogWindows;
 
 
 static HFONT g_Font = NULL;
@@ -161,10 +164,41 @@ INT_PTR CALLBACK AboutProc(HWND hDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
     return FALSE;
 }
 
+void AddDialogWindow(HWND hwnd)
+{
+    g_DialogWindows.push_back(hwnd);
+}
+
+void RemoveDialogWindow(HWND hwnd)
+{
+    g_DialogWindows.erase(std::remove(g_DialogWindows.begin(), g_DialogWindows.end(), hwnd), g_DialogWindows.end());
+}
+
+static bool HandleDialogMessage(MSG* Msg)
+{
+    for (HWND hwnd : g_DialogWindows)
+    {
+        if (IsDialogMessageW(hwnd, Msg))
+            return true;
+    }
+    return false;
+}
+
 int __stdcall WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nCmdShow)
 {
     UNREFERENCED_PARAMETER(lpCmdLine);
 
+    // Any argument selects the command line mode
+    int argc = 0;
+    LPWSTR* argv = CommandLineToArgvW(GetCommandLineW(), &argc);
+    if (argv && argc > 1)
+    {
+        int Result = RunHeadless(argc - 1, argv + 1);
+        LocalFree(argv);
+        return Result;
+    }
+    LocalFree(argv);
+
     INITCOMMONCONTROLSEX icex;
     icex.dwICC = ICC_LISTVIEW_CLASSES | ICC_LINK_CLASS;
     InitCommonControlsEx(&icex);
@@ -185,6 +219,7 @@ int __stdcall WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdL
 
     HWND hwndMain = CreateWindowEx(WS_EX_CONTROLPARENT, L"MemListClass", L"MemView", WS_OVERLAPPEDWINDOW,
         CW_USEDEFAULT, CW_USEDEFAULT, CW_USEDEFAULT, CW_USEDEFAULT, NULL, NULL, hInstance, NULL);
+    AddDialogWindow(hwndMain);
     ShowWindow(hwndMain, nCmdShow);
     UpdateWindow(hwndMain);
 
@@ -197,7 +232,7 @@ int __stdcall WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdL
             DestroyWindow(hwndMain);
             ExitProcess(GetLastError());
         }
-        if (!IsDialogMessageW(hwndMain, &Msg))
+        if (!HandleDialogMessage(&Msg))
         {
             TranslateMessage(&Msg);
             DispatchMessageW(&Msg);
@@ -208,6 +243,39 @@ int __stdcall WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdL
         {
             DialogBoxParamW(hInstance, MAKEINTRESOURCEW(IDD_ABOUTBOX), hwndMain, AboutProc, 0L);
         }
+        // Searching and scanning need a running process, a snapshot is browsed without one
+        else if (Msg.message == WM_KEYDOWN && Msg.wParam == 'F' && GetKeyState(VK_CONTROL) < 0 && !g_Snapshot)
+        {
+            ShowSearch(hwndMain);
+        }
+        else if (Msg.message == WM_KEYDOWN && Msg.wParam == 'G' && GetKeyState(VK_CONTROL) < 0 && !g_Snapshot)
+        {
+            ShowValueScan(hwndMain);
+        }
+        else if (Msg.message == WM_KEYDOWN && Msg.wParam == 'S' && GetKeyState(VK_CONTROL) < 0)
+        {
+            SaveSnapshotDialog(hwndMain);
+        }
+        else if (Msg.message == WM_KEYDOWN && Msg.wParam == 'O' && GetKeyState(VK_CONTROL) < 0)
+        {
+            OpenSnapshotDialog(hwndMain);
+        }
+        else if (Msg.message == WM_KEYDOWN && Msg.wParam == 'D' && GetKeyState(VK_CONTROL) < 0)
+        {
+            DiffSnapshotsDialog(hwndMain);
+        }
+        else if (Msg.message == WM_KEYDOWN && Msg.wParam == 'T' && GetKeyState(VK_CONTROL) < 0)
+        {
+            ShowTimeline(hwndMain);
+        }
+        else if (Msg.message == WM_KEYDOWN && Msg.wParam == 'M' && GetKeyState(VK_CONTROL) < 0)
+        {
+            ShowMonitor(hwndMain);
+        }
+        else if (Msg.message == WM_KEYDOWN && Msg.wParam == 'L' && GetKeyState(VK_CONTROL) < 0)
+        {
+            FocusRegionFilter();
+        }
     }
     return (int)Msg.wParam;
 }
@@ -0,0 +1,96 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     A thread pool that balances its queues by stealing work
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#include "MemView.h"
+#include "WorkPool.h"
+#include <algorithm>
+
+WorkPool::WorkPool(size_t Threads)
+    :mNextQueue(0)
+    ,mQueued(0)
+    ,mStop(false)
+{
+    if (Threads == 0)
+        Threads = std::max(1u, std::thread::hardware_concurrency());
+
+    for (size_t n = 0; n < Threads; ++n)
+        mQueues.push_back(std::unique_ptr<Queue>(new Queue()));
+    for (size_t n = 0; n < Threads; ++n)
+        mThreads.push_back(std::thread(&WorkPool::worker, this, n));
+}
+
+WorkPool::~WorkPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mStop = true;
+    }
+    mWake.notify_all();
+    for (std::thread& thread : mThreads)
+        thread.join();
+}
+
+void WorkPool::submit(std::function<void()> Task)
+{
+    Queue& queue = *mQueues[mNextQueue++ % mQueues.size()];
+    {
+        std::lock_guard<std::mutex> lock(queue.Lock);
+        queue.Tasks.push_back(std::move(Task));
+    }
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        ++mQueued;
+    }
+    mWake.notify_one();
+}
+
+bool WorkPool::take(size_t Self, std::function<void()>& Task)
+{
+    {
+        Queue& own = *mQueues[Self];
+        std::lock_guard<std::mutex> lock(own.Lock);
+        if (!own.Tasks.empty())
+        {
+            Task = std::move(own.Tasks.back());
+            own.Tasks.pop_back();
+            return true;
+        }
+    }
+
+    for (size_t n = 1; n < mQueues.size(); ++n)
+    {
+        Queue& other = *mQueues[(Self + n) % mQueues.size()];
+        std::lock_guard<std::mutex> lock(other.Lock);
+        if (!other.Tasks.empty())
+        {
+            Task = std::move(other.Tasks.front());
+            other.Tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkPool::worker(size_t Self)
+{
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mLock);
+            mWake.wait(lock, [this]() { return mStop || mQueued > 0; });
+            if (mStop)
+                return;
+            --mQueued;
+        }
+
+        // A task was claimed, but it can sit in any of the queues
+        std::function<void()> Task;
+        while (!take(Self, Task))
+            std::this_thread::yield();
+        Task();
+    }
+}
@@ -0,0 +1,52 @@
+/*
+ * PROJECT:     MemView
+ * LICENSE:     MIT (https://spdx.org/licenses/MIT)
+ * PURPOSE:     A thread pool that balances its queues by stealing work
+ * COPYRIGHT:   Copyright 2023 Mark Jansen <mark.jansen@reactos.org>
+ */
+
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+
+// A fixed set of threads, each with a queue of its own that new tasks are spread over.
+// A thread runs the newest task of its own queue, and when that is empty it steals the
+// oldest task of another queue, so a long task only holds up the tasks behind it until
+// an idle thread takes them.
+class WorkPool
+{
+public:
+    // One thread per cpu when Threads is 0
+    explicit WorkPool(size_t Threads = 0);
+    // Waits for the running tasks, tasks that did not start yet are dropped
+    ~WorkPool();
+
+    void submit(std::function<void()> Task);
+    size_t threads() const { return mThreads.size(); }
+
+private:
+    struct Queue
+    {
+        std::mutex Lock;
+        std::deque<std::function<void()>> Tasks;
+    };
+
+    bool take(size_t Self, std::function<void()>& Task);
+    void worker(size_t Self);
+
+    std::vector<std::unique_ptr<Queue>> mQueues;
+    std::vector<std::thread> mThreads;
+    std::atomic<size_t> mNextQueue;
+
+    std::mutex mLock;
+    std::condition_variable mWake;
+    size_t mQueued;     // Tasks that no thread has claimed yet
+    bool mStop;
+};